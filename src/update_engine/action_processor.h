@@ -68,6 +68,7 @@ enum ActionExitCode {
   kActionCodeNewPCRPolicyVerificationError = 42,
   kActionCodeNewPCRPolicyHTTPError = 43,
   kActionCodeRollbackError = 44,
+  kActionCodeUnsupportedPayloadVersion = 45,
 
   // DownloadIncomplete isn't an error to report, it is analogous to EAGAIN
   // and for internal use to indicate that the processing must pause until
@@ -0,0 +1,108 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bandwidth_limiter.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+using std::chrono::duration;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+
+namespace chromeos_update_engine {
+
+namespace {
+int LocalHour() {
+  time_t now = time(NULL);
+  struct tm local_time;
+  if (!localtime_r(&now, &local_time))
+    return 0;
+  return local_time.tm_hour;
+}
+}  // namespace {}
+
+const double BandwidthLimiter::kBurstSeconds = 0.25;
+
+BandwidthLimiter::BandwidthLimiter()
+    : limit_(0),
+      full_speed_start_hour_(0),
+      full_speed_end_hour_(0),
+      tokens_(0) {}
+
+void BandwidthLimiter::set_full_speed_hours(int start_hour, int end_hour) {
+  CHECK(start_hour >= 0 && start_hour < 24) << start_hour;
+  CHECK(end_hour >= 0 && end_hour < 24) << end_hour;
+  full_speed_start_hour_ = start_hour;
+  full_speed_end_hour_ = end_hour;
+}
+
+uint64_t BandwidthLimiter::LimitAt(int hour) const {
+  bool full_speed;
+  if (full_speed_start_hour_ <= full_speed_end_hour_) {
+    full_speed = hour >= full_speed_start_hour_ && hour < full_speed_end_hour_;
+  } else {
+    full_speed = hour >= full_speed_start_hour_ || hour < full_speed_end_hour_;
+  }
+  return full_speed ? 0 : limit_;
+}
+
+uint64_t BandwidthLimiter::CurrentLimit() const {
+  return LimitAt(LocalHour());
+}
+
+microseconds BandwidthLimiter::Consume(size_t bytes) {
+  return Consume(bytes, steady_clock::now(), LocalHour());
+}
+
+microseconds BandwidthLimiter::Consume(size_t bytes,
+                                       steady_clock::time_point now,
+                                       int hour) {
+  const uint64_t limit = LimitAt(hour);
+  if (!limit) {
+    tokens_ = 0;
+    last_refill_ = now;
+    return microseconds(0);
+  }
+
+  // The first refill fills the bucket up, as the time since the epoch of
+  // last_refill_ is large.
+  const double elapsed = duration<double>(now - last_refill_).count();
+  tokens_ = min(limit * kBurstSeconds, tokens_ + elapsed * limit);
+  last_refill_ = now;
+  tokens_ -= bytes;
+  if (tokens_ >= 0)
+    return microseconds(0);
+  return microseconds(static_cast<int64_t>(-tokens_ * 1000000 / limit));
+}
+
+bool BandwidthLimiter::ParseRate(const string& str,
+                                 uint64_t* bytes_per_second) {
+  return utils::ParseSize(str, bytes_per_second);
+}
+
+bool BandwidthLimiter::ParseHours(const string& str, int* start_hour,
+                                  int* end_hour) {
+  int start, end;
+  char extra;
+  if (sscanf(str.c_str(), "%d-%d%c", &start, &end, &extra) != 2)
+    return false;
+  if (start < 0 || start >= 24 || end < 0 || end >= 24)
+    return false;
+  *start_hour = start;
+  *end_hour = end;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,75 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BANDWIDTH_LIMITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BANDWIDTH_LIMITER_H__
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+
+#include "macros.h"
+
+// The BandwidthLimiter class caps the combined download rate of the fetchers
+// sharing it with a token bucket. Tokens (bytes) flow into the bucket at the
+// configured rate and it holds at most kBurstSeconds worth of them. Fetchers
+// take tokens for every chunk they receive; once the bucket runs dry, a
+// fetcher pauses its transfer for as long as it takes to pay off the debt.
+//
+// The limit can be lifted during a range of local hours, so that updates
+// still download at full speed off-peak.
+
+namespace chromeos_update_engine {
+
+class BandwidthLimiter {
+ public:
+  // How much the rate may be exceeded in a burst, in seconds of data.
+  static const double kBurstSeconds;
+
+  BandwidthLimiter();
+
+  // The limit in bytes per second. Zero means unlimited.
+  void set_limit(uint64_t bytes_per_second) { limit_ = bytes_per_second; }
+  uint64_t limit() const { return limit_; }
+
+  // Lifts the limit from |start_hour| up to, but not including, |end_hour|
+  // (local time, 0-23). The range may wrap around midnight, e.g., 22 to 6.
+  // Equal hours lift it never.
+  void set_full_speed_hours(int start_hour, int end_hour);
+
+  // Returns the limit in effect during |hour| of the day, or right now.
+  uint64_t LimitAt(int hour) const;
+  uint64_t CurrentLimit() const;
+
+  // Takes |bytes| out of the bucket and returns how long the caller should
+  // wait before receiving more. The second form is for unit tests.
+  std::chrono::microseconds Consume(size_t bytes);
+  std::chrono::microseconds Consume(size_t bytes,
+                                    std::chrono::steady_clock::time_point now,
+                                    int hour);
+
+  // Parses a rate in bytes per second with an optional K, M, G or T
+  // (binary) suffix, e.g., "512K". Returns false if |str| isn't one.
+  static bool ParseRate(const std::string& str, uint64_t* bytes_per_second);
+
+  // Parses a range of hours such as "22-6". Returns false if |str| isn't one.
+  static bool ParseHours(const std::string& str, int* start_hour,
+                         int* end_hour);
+
+ private:
+  uint64_t limit_;
+  int full_speed_start_hour_;
+  int full_speed_end_hour_;
+
+  // Tokens in the bucket; negative while paying off a debt.
+  double tokens_;
+  std::chrono::steady_clock::time_point last_refill_;
+
+  DISALLOW_COPY_AND_ASSIGN(BandwidthLimiter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BANDWIDTH_LIMITER_H__
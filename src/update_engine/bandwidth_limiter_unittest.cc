@@ -0,0 +1,104 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/bandwidth_limiter.h"
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+namespace chromeos_update_engine {
+
+class BandwidthLimiterTest : public ::testing::Test { };
+
+TEST(BandwidthLimiterTest, UnlimitedTest) {
+  BandwidthLimiter limiter;
+  steady_clock::time_point now = steady_clock::now();
+  EXPECT_EQ(0, limiter.Consume(1 << 30, now, 12).count());
+  EXPECT_EQ(0, limiter.Consume(1 << 30, now, 12).count());
+}
+
+TEST(BandwidthLimiterTest, TokenBucketTest) {
+  BandwidthLimiter limiter;
+  limiter.set_limit(1000);
+  steady_clock::time_point now = steady_clock::now();
+
+  // The first bytes are covered by the burst allowance of 250 bytes.
+  EXPECT_EQ(0, limiter.Consume(200, now, 12).count());
+  // Going 250 bytes over takes a quarter of a second to pay off.
+  EXPECT_EQ(microseconds(250000), limiter.Consume(300, now, 12));
+  // Half a second later the debt is paid and 250 bytes are available again,
+  // but no more than that.
+  now += milliseconds(500);
+  EXPECT_EQ(0, limiter.Consume(250, now, 12).count());
+  EXPECT_EQ(microseconds(100000), limiter.Consume(100, now, 12));
+
+  // Lowering the limit makes the same debt take longer.
+  limiter.set_limit(100);
+  EXPECT_EQ(microseconds(2000000), limiter.Consume(100, now, 12));
+}
+
+TEST(BandwidthLimiterTest, FullSpeedHoursTest) {
+  BandwidthLimiter limiter;
+  limiter.set_limit(1000);
+  EXPECT_EQ(1000, limiter.LimitAt(3));
+
+  limiter.set_full_speed_hours(1, 5);
+  EXPECT_EQ(1000, limiter.LimitAt(0));
+  EXPECT_EQ(0, limiter.LimitAt(1));
+  EXPECT_EQ(0, limiter.LimitAt(4));
+  EXPECT_EQ(1000, limiter.LimitAt(5));
+
+  limiter.set_full_speed_hours(22, 6);
+  EXPECT_EQ(1000, limiter.LimitAt(21));
+  EXPECT_EQ(0, limiter.LimitAt(22));
+  EXPECT_EQ(0, limiter.LimitAt(0));
+  EXPECT_EQ(0, limiter.LimitAt(5));
+  EXPECT_EQ(1000, limiter.LimitAt(6));
+
+  steady_clock::time_point now = steady_clock::now();
+  EXPECT_EQ(0, limiter.Consume(1 << 20, now, 23).count());
+  EXPECT_LT(0, limiter.Consume(1 << 20, now, 12).count());
+}
+
+TEST(BandwidthLimiterTest, ParseRateTest) {
+  uint64_t rate = 0;
+  EXPECT_TRUE(BandwidthLimiter::ParseRate("0", &rate));
+  EXPECT_EQ(0, rate);
+  EXPECT_TRUE(BandwidthLimiter::ParseRate("1500", &rate));
+  EXPECT_EQ(1500, rate);
+  EXPECT_TRUE(BandwidthLimiter::ParseRate("512K", &rate));
+  EXPECT_EQ(512 * 1024, rate);
+  EXPECT_TRUE(BandwidthLimiter::ParseRate("10m", &rate));
+  EXPECT_EQ(10 * 1024 * 1024, rate);
+  EXPECT_TRUE(BandwidthLimiter::ParseRate("1G", &rate));
+  EXPECT_EQ(1024 * 1024 * 1024, rate);
+
+  EXPECT_FALSE(BandwidthLimiter::ParseRate("", &rate));
+  EXPECT_FALSE(BandwidthLimiter::ParseRate("-1", &rate));
+  EXPECT_FALSE(BandwidthLimiter::ParseRate("K", &rate));
+  EXPECT_FALSE(BandwidthLimiter::ParseRate("10MB", &rate));
+  EXPECT_FALSE(BandwidthLimiter::ParseRate("fast", &rate));
+}
+
+TEST(BandwidthLimiterTest, ParseHoursTest) {
+  int start = -1, end = -1;
+  EXPECT_TRUE(BandwidthLimiter::ParseHours("22-6", &start, &end));
+  EXPECT_EQ(22, start);
+  EXPECT_EQ(6, end);
+  EXPECT_TRUE(BandwidthLimiter::ParseHours("0-23", &start, &end));
+  EXPECT_EQ(0, start);
+  EXPECT_EQ(23, end);
+
+  EXPECT_FALSE(BandwidthLimiter::ParseHours("", &start, &end));
+  EXPECT_FALSE(BandwidthLimiter::ParseHours("22", &start, &end));
+  EXPECT_FALSE(BandwidthLimiter::ParseHours("22-24", &start, &end));
+  EXPECT_FALSE(BandwidthLimiter::ParseHours("2-6pm", &start, &end));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,160 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_owners.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "update_engine/extent_ranges.h"
+
+using std::max;
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+uint64_t IntervalEnd(const BlockOwners::Interval& interval) {
+  return interval.start_block + interval.num_blocks;
+}
+
+}  // namespace {}
+
+bool BlockOwners::AddReader(const Extent& extent,
+                            Vertex::Index vertex,
+                            uint64_t* conflict_block,
+                            Vertex::Index* conflict_vertex) {
+  return Add(&readers_, extent, vertex, conflict_block, conflict_vertex);
+}
+
+bool BlockOwners::AddWriter(const Extent& extent,
+                            Vertex::Index vertex,
+                            uint64_t* conflict_block,
+                            Vertex::Index* conflict_vertex) {
+  return Add(&writers_, extent, vertex, conflict_block, conflict_vertex);
+}
+
+bool BlockOwners::Add(IntervalMap* intervals,
+                      const Extent& extent,
+                      Vertex::Index vertex,
+                      uint64_t* conflict_block,
+                      Vertex::Index* conflict_vertex) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return true;
+  const uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+
+  // The first interval starting after |start|, and the one before it.
+  IntervalMap::iterator next = intervals->upper_bound(start);
+  IntervalMap::iterator prev = intervals->end();
+  if (next != intervals->begin()) {
+    prev = next;
+    --prev;
+  }
+
+  if (prev != intervals->end() && IntervalEnd(prev->second) > start) {
+    *conflict_block = start;
+    *conflict_vertex = prev->second.vertex;
+    return false;
+  }
+  if (next != intervals->end() && next->second.start_block < end) {
+    *conflict_block = next->second.start_block;
+    *conflict_vertex = next->second.vertex;
+    return false;
+  }
+
+  // Coalesce with adjacent intervals owned by the same vertex.
+  bool merged_prev = prev != intervals->end() &&
+      IntervalEnd(prev->second) == start && prev->second.vertex == vertex;
+  bool merge_next = next != intervals->end() &&
+      next->second.start_block == end && next->second.vertex == vertex;
+  if (merged_prev) {
+    prev->second.num_blocks += extent.num_blocks();
+  } else {
+    Interval interval = { start, extent.num_blocks(), vertex };
+    prev = intervals->insert(next, std::make_pair(start, interval));
+  }
+  if (merge_next) {
+    prev->second.num_blocks += next->second.num_blocks;
+    intervals->erase(next);
+  }
+  return true;
+}
+
+Vertex::Index BlockOwners::Find(const IntervalMap& intervals,
+                                uint64_t block) {
+  IntervalMap::const_iterator it = intervals.upper_bound(block);
+  if (it == intervals.begin())
+    return Vertex::kInvalidIndex;
+  --it;
+  if (IntervalEnd(it->second) <= block)
+    return Vertex::kInvalidIndex;
+  return it->second.vertex;
+}
+
+vector<BlockOwners::Overlap> BlockOwners::ReadWriteOverlaps() const {
+  vector<Overlap> overlaps;
+  // Sweep both sorted interval lists at once, always advancing whichever
+  // interval ends first.
+  IntervalMap::const_iterator r = readers_.begin();
+  IntervalMap::const_iterator w = writers_.begin();
+  while (r != readers_.end() && w != writers_.end()) {
+    uint64_t start = max(r->second.start_block, w->second.start_block);
+    uint64_t end = min(IntervalEnd(r->second), IntervalEnd(w->second));
+    if (start < end) {
+      Overlap overlap = { start, end - start, r->second.vertex,
+                          w->second.vertex };
+      overlaps.push_back(overlap);
+    }
+    if (IntervalEnd(r->second) < IntervalEnd(w->second))
+      ++r;
+    else
+      ++w;
+  }
+  return overlaps;
+}
+
+vector<Extent> BlockOwners::UnwrittenExtents() const {
+  vector<Extent> extents;
+  uint64_t next = 0;
+  for (const auto& start_interval_pair : writers_) {
+    const Interval& interval = start_interval_pair.second;
+    if (interval.start_block >= block_count_)
+      break;
+    if (interval.start_block > next)
+      extents.push_back(ExtentForRange(next, interval.start_block - next));
+    next = IntervalEnd(interval);
+  }
+  if (next < block_count_)
+    extents.push_back(ExtentForRange(next, block_count_ - next));
+  return extents;
+}
+
+void BlockOwners::ReadersInExtent(const Extent& extent,
+                                  vector<Interval>* out) const {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return;
+  const uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+  IntervalMap::const_iterator it = readers_.upper_bound(start);
+  if (it != readers_.begin()) {
+    --it;
+    if (IntervalEnd(it->second) <= start)
+      ++it;
+  }
+  for (; it != readers_.end() && it->second.start_block < end; ++it) {
+    Interval clipped = it->second;
+    clipped.start_block = max(clipped.start_block, start);
+    clipped.num_blocks = min(IntervalEnd(it->second), end) -
+        clipped.start_block;
+    out->push_back(clipped);
+  }
+}
+
+}  // namespace chromeos_update_engine
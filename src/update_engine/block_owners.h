@@ -0,0 +1,99 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_OWNERS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_OWNERS_H__
+
+#include <map>
+#include <vector>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/update_metadata.pb.h"
+
+// During install, each block on the install partition will be written
+// and some may be read (in all likelihood, many will be read). The reading
+// and writing will be performed by InstallOperations, each of which has a
+// corresponding vertex in a graph. A BlockOwners object tells which vertex
+// will read or write each block at install time.
+//
+// Ownership is stored as disjoint, sorted intervals of blocks rather than
+// one entry per block, so memory use and the cost of adding an operation
+// scale with the number of extents instead of the size of the partition.
+// Sparse hole extents are ignored.
+
+namespace chromeos_update_engine {
+
+class BlockOwners {
+ public:
+  // A run of blocks [start_block, start_block + num_blocks) owned by vertex.
+  struct Interval {
+    uint64_t start_block;
+    uint64_t num_blocks;
+    Vertex::Index vertex;
+  };
+  // Keyed by Interval::start_block.
+  typedef std::map<uint64_t, Interval> IntervalMap;
+
+  // A run of blocks read by |reader| and written by |writer|.
+  struct Overlap {
+    uint64_t start_block;
+    uint64_t num_blocks;
+    Vertex::Index reader;
+    Vertex::Index writer;
+  };
+
+  explicit BlockOwners(uint64_t block_count) : block_count_(block_count) {}
+
+  // Records |vertex| as the reader or writer of all blocks in |extent|.
+  // Each block may have at most one reader and one writer. If a block in
+  // |extent| is already owned, nothing is recorded, the first such block
+  // and its owner are stored in |conflict_block| and |conflict_vertex| and
+  // false is returned.
+  bool AddReader(const Extent& extent,
+                 Vertex::Index vertex,
+                 uint64_t* conflict_block,
+                 Vertex::Index* conflict_vertex);
+  bool AddWriter(const Extent& extent,
+                 Vertex::Index vertex,
+                 uint64_t* conflict_block,
+                 Vertex::Index* conflict_vertex);
+
+  // Returns the vertex that reads or writes |block|, or
+  // Vertex::kInvalidIndex if there is none.
+  Vertex::Index reader(uint64_t block) const { return Find(readers_, block); }
+  Vertex::Index writer(uint64_t block) const { return Find(writers_, block); }
+
+  // Returns, in block order, the ranges of blocks that have both a reader
+  // and a writer. This is a single merge-like sweep over both interval
+  // lists.
+  std::vector<Overlap> ReadWriteOverlaps() const;
+
+  // Returns, in block order, the extents of blocks below block_count()
+  // that have no writer.
+  std::vector<Extent> UnwrittenExtents() const;
+
+  // Appends to |out|, in block order, the parts of reader intervals that
+  // fall inside |extent|.
+  void ReadersInExtent(const Extent& extent, std::vector<Interval>* out) const;
+
+  uint64_t block_count() const { return block_count_; }
+  const IntervalMap& readers() const { return readers_; }
+  const IntervalMap& writers() const { return writers_; }
+
+ private:
+  static bool Add(IntervalMap* intervals,
+                  const Extent& extent,
+                  Vertex::Index vertex,
+                  uint64_t* conflict_block,
+                  Vertex::Index* conflict_vertex);
+  static Vertex::Index Find(const IntervalMap& intervals, uint64_t block);
+
+  uint64_t block_count_;
+  IntervalMap readers_;
+  IntervalMap writers_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_OWNERS_H__
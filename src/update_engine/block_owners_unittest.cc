@@ -0,0 +1,202 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/block_owners.h"
+#include "update_engine/delta_diff_generator.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BlockOwnersTest : public ::testing::Test {};
+
+namespace {
+const Vertex::Index kInvalidIndex = Vertex::kInvalidIndex;
+
+bool AddReader(BlockOwners* blocks, uint64_t start, uint64_t num,
+               Vertex::Index vertex) {
+  uint64_t conflict_block;
+  Vertex::Index conflict_vertex;
+  return blocks->AddReader(ExtentForRange(start, num), vertex,
+                           &conflict_block, &conflict_vertex);
+}
+
+bool AddWriter(BlockOwners* blocks, uint64_t start, uint64_t num,
+               Vertex::Index vertex) {
+  uint64_t conflict_block;
+  Vertex::Index conflict_vertex;
+  return blocks->AddWriter(ExtentForRange(start, num), vertex,
+                           &conflict_block, &conflict_vertex);
+}
+}  // namespace {}
+
+TEST(BlockOwnersTest, LookupTest) {
+  BlockOwners blocks(20);
+  EXPECT_TRUE(AddReader(&blocks, 2, 3, 7));
+  EXPECT_TRUE(AddWriter(&blocks, 4, 2, 8));
+  EXPECT_TRUE(AddWriter(&blocks, kSparseHole, 5, 9));
+
+  EXPECT_EQ(kInvalidIndex, blocks.reader(1));
+  EXPECT_EQ(7, blocks.reader(2));
+  EXPECT_EQ(7, blocks.reader(4));
+  EXPECT_EQ(kInvalidIndex, blocks.reader(5));
+  EXPECT_EQ(kInvalidIndex, blocks.writer(3));
+  EXPECT_EQ(8, blocks.writer(4));
+  EXPECT_EQ(8, blocks.writer(5));
+  EXPECT_EQ(kInvalidIndex, blocks.writer(6));
+}
+
+TEST(BlockOwnersTest, ConflictTest) {
+  BlockOwners blocks(20);
+  EXPECT_TRUE(AddWriter(&blocks, 5, 5, 1));
+
+  uint64_t conflict_block = 0;
+  Vertex::Index conflict_vertex = kInvalidIndex;
+  EXPECT_FALSE(blocks.AddWriter(ExtentForRange(2, 4), 2,
+                                &conflict_block, &conflict_vertex));
+  EXPECT_EQ(5, conflict_block);
+  EXPECT_EQ(1, conflict_vertex);
+  EXPECT_FALSE(blocks.AddWriter(ExtentForRange(9, 4), 2,
+                                &conflict_block, &conflict_vertex));
+  EXPECT_EQ(9, conflict_block);
+  EXPECT_EQ(1, conflict_vertex);
+
+  // Failed adds leave nothing behind, and readers are tracked separately.
+  EXPECT_EQ(kInvalidIndex, blocks.writer(2));
+  EXPECT_EQ(kInvalidIndex, blocks.writer(12));
+  EXPECT_TRUE(AddWriter(&blocks, 2, 3, 2));
+  EXPECT_TRUE(AddWriter(&blocks, 10, 3, 2));
+  EXPECT_TRUE(AddReader(&blocks, 0, 20, 3));
+}
+
+TEST(BlockOwnersTest, CoalesceTest) {
+  BlockOwners blocks(20);
+  EXPECT_TRUE(AddWriter(&blocks, 4, 2, 1));
+  EXPECT_TRUE(AddWriter(&blocks, 8, 2, 1));
+  EXPECT_TRUE(AddWriter(&blocks, 6, 2, 1));
+  EXPECT_TRUE(AddWriter(&blocks, 10, 1, 2));
+  ASSERT_EQ(2, blocks.writers().size());
+  EXPECT_EQ(4, blocks.writers().begin()->second.start_block);
+  EXPECT_EQ(6, blocks.writers().begin()->second.num_blocks);
+}
+
+TEST(BlockOwnersTest, UnwrittenExtentsTest) {
+  BlockOwners blocks(20);
+  EXPECT_TRUE(AddWriter(&blocks, 0, 2, 1));
+  EXPECT_TRUE(AddWriter(&blocks, 5, 2, 2));
+  EXPECT_TRUE(AddWriter(&blocks, 7, 3, 3));
+  EXPECT_TRUE(AddReader(&blocks, 1, 3, 4));
+  EXPECT_TRUE(AddReader(&blocks, 12, 10, 5));
+
+  vector<Extent> unwritten = blocks.UnwrittenExtents();
+  ASSERT_EQ(2, unwritten.size());
+  EXPECT_EQ(ExtentForRange(2, 3), unwritten[0]);
+  EXPECT_EQ(ExtentForRange(10, 10), unwritten[1]);
+
+  vector<BlockOwners::Interval> readers;
+  blocks.ReadersInExtent(unwritten[0], &readers);
+  blocks.ReadersInExtent(unwritten[1], &readers);
+  ASSERT_EQ(2, readers.size());
+  EXPECT_EQ(2, readers[0].start_block);
+  EXPECT_EQ(2, readers[0].num_blocks);
+  EXPECT_EQ(4, readers[0].vertex);
+  EXPECT_EQ(12, readers[1].start_block);
+  EXPECT_EQ(8, readers[1].num_blocks);
+  EXPECT_EQ(5, readers[1].vertex);
+
+  BlockOwners empty(4);
+  unwritten = empty.UnwrittenExtents();
+  ASSERT_EQ(1, unwritten.size());
+  EXPECT_EQ(ExtentForRange(0, 4), unwritten[0]);
+}
+
+// Checks the interval sweep against a brute-force per-block computation.
+TEST(BlockOwnersTest, ReadWriteOverlapsMatchesPerBlockTest) {
+  const uint64_t kBlockCount = 2000;
+  srand(11);
+  BlockOwners blocks(kBlockCount);
+  vector<Vertex::Index> readers(kBlockCount, kInvalidIndex);
+  vector<Vertex::Index> writers(kBlockCount, kInvalidIndex);
+  for (int i = 0; i < 400; i++) {
+    uint64_t start = rand() % kBlockCount;
+    uint64_t num = 1 + rand() % 20;
+    if (start + num > kBlockCount)
+      num = kBlockCount - start;
+    Vertex::Index vertex = rand() % 50;
+    bool read = rand() % 2;
+    vector<Vertex::Index>& owners = read ? readers : writers;
+    bool free = true;
+    for (uint64_t b = start; b < start + num; b++)
+      free = free && owners[b] == kInvalidIndex;
+    bool added = read ? AddReader(&blocks, start, num, vertex) :
+        AddWriter(&blocks, start, num, vertex);
+    ASSERT_EQ(free, added);
+    if (added) {
+      for (uint64_t b = start; b < start + num; b++)
+        owners[b] = vertex;
+    }
+  }
+
+  vector<Vertex::Index> overlap_readers(kBlockCount, kInvalidIndex);
+  vector<Vertex::Index> overlap_writers(kBlockCount, kInvalidIndex);
+  uint64_t last_end = 0;
+  for (const BlockOwners::Overlap& overlap : blocks.ReadWriteOverlaps()) {
+    EXPECT_LE(last_end, overlap.start_block);
+    last_end = overlap.start_block + overlap.num_blocks;
+    for (uint64_t b = overlap.start_block; b < last_end; b++) {
+      overlap_readers[b] = overlap.reader;
+      overlap_writers[b] = overlap.writer;
+    }
+  }
+  for (uint64_t b = 0; b < kBlockCount; b++) {
+    EXPECT_EQ(readers[b], blocks.reader(b)) << b;
+    EXPECT_EQ(writers[b], blocks.writer(b)) << b;
+    if (readers[b] == kInvalidIndex ||
+        writers[b] == kInvalidIndex) {
+      EXPECT_EQ(kInvalidIndex, overlap_readers[b]) << b;
+      continue;
+    }
+    EXPECT_EQ(readers[b], overlap_readers[b]) << b;
+    EXPECT_EQ(writers[b], overlap_writers[b]) << b;
+  }
+}
+
+// Not run by default. Run with --gtest_also_run_disabled_tests to time
+// building the block owners and edges for a 4 GiB image where every file
+// is moved by a few blocks.
+TEST(BlockOwnersTest, DISABLED_FourGigImageBenchmark) {
+  const uint64_t kBlockCount = (4ULL << 30) / 4096;
+  const uint64_t kFileBlocks = 16;
+  const uint64_t kFileCount = kBlockCount / kFileBlocks - 1;
+
+  auto start = std::chrono::steady_clock::now();
+  Graph graph(kFileCount);
+  BlockOwners blocks(kBlockCount);
+  for (Vertex::Index i = 0; i < kFileCount; i++) {
+    InstallOperation& op = graph[i].op;
+    op.set_type(InstallOperation_Type_MOVE);
+    *op.add_src_extents() = ExtentForRange(i * kFileBlocks, kFileBlocks);
+    *op.add_dst_extents() = ExtentForRange(i * kFileBlocks + 3, kFileBlocks);
+    EXPECT_TRUE(DeltaDiffGenerator::AddInstallOpToBlockOwners(op, graph, i,
+                                                              &blocks));
+  }
+  DeltaDiffGenerator::CreateEdges(&graph, blocks);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  EXPECT_EQ(1, graph[1].out_edges.size());
+  LOG(INFO) << "Block owners and edges for " << kBlockCount << " blocks, "
+            << kFileCount << " operations: " << utils::ToString(elapsed);
+}
+
+}  // namespace chromeos_update_engine
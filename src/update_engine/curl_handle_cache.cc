@@ -0,0 +1,98 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/curl_handle_cache.h"
+
+#include <glog/logging.h>
+
+namespace chromeos_update_engine {
+
+const size_t CurlHandleCache::kMaxIdleHandles = 4;
+
+CurlHandleCache* CurlHandleCache::cache_singleton_ = NULL;
+
+CurlHandleCache& CurlHandleCache::Get() {
+  if (!cache_singleton_)
+    cache_singleton_ = new CurlHandleCache;
+  return *cache_singleton_;
+}
+
+void CurlHandleCache::Shutdown() {
+  if (!cache_singleton_)
+    return;
+  if (cache_singleton_->handles_in_use_ == 0) {
+    delete cache_singleton_;
+    cache_singleton_ = NULL;
+    return;
+  }
+  // The last ReleaseEasyHandle() finishes the job.
+  cache_singleton_->shutting_down_ = true;
+  for (CURL* handle : cache_singleton_->idle_handles_)
+    curl_easy_cleanup(handle);
+  cache_singleton_->idle_handles_.clear();
+}
+
+CurlHandleCache::CurlHandleCache()
+    : share_(curl_share_init()),
+      handles_in_use_(0),
+      shutting_down_(false),
+      transfers_(0),
+      connections_opened_(0) {
+  CHECK(share_);
+  // update_engine runs all transfers from the glib main loop thread, so the
+  // share needs no lock callbacks. Only DNS is shared: a connection or TLS
+  // session opened by one fetcher and resumed by another would skip the
+  // CURLOPT_SSL_CTX_FUNCTION the CertificateChecker hooks into.
+  CHECK_EQ(curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS),
+           CURLSHE_OK);
+}
+
+CurlHandleCache::~CurlHandleCache() {
+  for (CURL* handle : idle_handles_)
+    curl_easy_cleanup(handle);
+  CHECK_EQ(curl_share_cleanup(share_), CURLSHE_OK);
+}
+
+CURL* CurlHandleCache::AcquireEasyHandle() {
+  CHECK(!shutting_down_);
+  handles_in_use_++;
+  if (!idle_handles_.empty()) {
+    CURL* handle = idle_handles_.back();
+    idle_handles_.pop_back();
+    // Resets the options only; the handle stays attached to the share.
+    curl_easy_reset(handle);
+    return handle;
+  }
+  CURL* handle = curl_easy_init();
+  CHECK(handle);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_SHARE, share_), CURLE_OK);
+  return handle;
+}
+
+void CurlHandleCache::ReleaseEasyHandle(CURL* handle) {
+  long num_connects = 0;
+  if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS,
+                        &num_connects) == CURLE_OK) {
+    connections_opened_ += num_connects;
+  }
+  transfers_++;
+  LOG(INFO) << "Transfer opened " << num_connects << " new connection(s), "
+            << connections_opened_ << " for " << transfers_
+            << " transfer(s) so far";
+
+  handles_in_use_--;
+  if (shutting_down_) {
+    curl_easy_cleanup(handle);
+    if (handles_in_use_ == 0) {
+      cache_singleton_ = NULL;
+      delete this;
+    }
+  } else if (idle_handles_.size() < kMaxIdleHandles) {
+    idle_handles_.push_back(handle);
+  } else {
+    curl_easy_cleanup(handle);
+  }
+}
+
+}  // namespace chromeos_update_engine
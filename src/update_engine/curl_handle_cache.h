@@ -0,0 +1,72 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CURL_HANDLE_CACHE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CURL_HANDLE_CACHE_H__
+
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "macros.h"
+
+// The CurlHandleCache class is a singleton holding the libcurl state that
+// outlives a single transfer. All easy handles it hands out are attached to
+// one CURLSH share handle, so the update check, the event pings and the
+// payload download of an update attempt (and every retry of them) reuse DNS
+// lookups. Finished easy handles are kept around for the next transfer rather
+// than being destroyed.
+//
+// It is deliberately not a connection pool. Connections are only reused
+// within one fetcher, through its multi handle, and TLS sessions are not
+// shared at all: a connection or session taken over from another fetcher
+// would skip that fetcher's certificate checker.
+
+namespace chromeos_update_engine {
+
+class CurlHandleCache {
+ public:
+  // Gets the one instance, creating it on first use.
+  static CurlHandleCache& Get();
+
+  // Frees the idle easy handles and, as soon as every handle handed out has
+  // been given back, the share handle and the instance itself.
+  static void Shutdown();
+
+  // Returns an easy handle with all options at their defaults, attached to
+  // the share handle. It must be given back through ReleaseEasyHandle().
+  CURL* AcquireEasyHandle();
+
+  // Takes back |handle| once it is no longer part of any multi handle, and
+  // accounts for the connections its last transfer had to open.
+  void ReleaseEasyHandle(CURL* handle);
+
+  // Number of transfers released so far and the number of new connections
+  // (i.e., TCP and, for HTTPS, TLS handshakes) they had to make.
+  int transfers() const { return transfers_; }
+  int connections_opened() const { return connections_opened_; }
+
+ private:
+  // At most this many finished easy handles are kept for reuse.
+  static const size_t kMaxIdleHandles;
+
+  CurlHandleCache();
+  ~CurlHandleCache();
+
+  // The global instance.
+  static CurlHandleCache* cache_singleton_;
+
+  CURLSH* share_;
+  std::vector<CURL*> idle_handles_;
+  int handles_in_use_;
+  bool shutting_down_;
+  int transfers_;
+  int connections_opened_;
+
+  DISALLOW_COPY_AND_ASSIGN(CurlHandleCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CURL_HANDLE_CACHE_H__
@@ -12,6 +12,7 @@
 
 #include "strings/string_printf.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/tarjan.h"
 #include "update_engine/utils.h"
 
@@ -42,9 +43,7 @@ void CycleBreaker::BreakCycles(const Graph& graph, set<Edge>* out_cut_edges) {
   skipped_ops_ = 0;
     
   for (Graph::size_type i = 0; i < subgraph_.size(); i++) {
-    InstallOperation_Type op_type = graph[i].op.type();
-    if (op_type == InstallOperation_Type_REPLACE ||
-        op_type == InstallOperation_Type_REPLACE_BZ) {
+    if (IsFullOperationType(graph[i].op.type())) {
       skipped_ops_++;
       continue;
     }
@@ -91,6 +91,16 @@ gboolean update_engine_service_get_status(UpdateEngineService* self,
   return TRUE;
 }
 
+gboolean update_engine_service_set_download_rate_limit(
+    UpdateEngineService* self,
+    guint64 bytes_per_second,
+    GError **error) {
+  *error = NULL;
+  self->system_state_->update_attempter()->SetDownloadRateLimit(
+      bytes_per_second);
+  return TRUE;
+}
+
 gboolean update_engine_service_emit_status_update(
     UpdateEngineService* self,
     gint64 last_checked_time,
@@ -60,6 +60,11 @@ gboolean update_engine_service_get_status(UpdateEngineService* self,
                                           int64_t* new_size,
                                           GError **error);
 
+gboolean update_engine_service_set_download_rate_limit(
+    UpdateEngineService* self,
+    guint64 bytes_per_second,
+    GError **error);
+
 gboolean update_engine_service_emit_status_update(
     UpdateEngineService* self,
     gint64 last_checked_time,
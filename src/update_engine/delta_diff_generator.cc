@@ -11,6 +11,8 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <chrono>
+#include <deque>
 #include <map>
 #include <memory>
 #include <set>
@@ -18,42 +20,46 @@
 #include <utility>
 #include <vector>
 
-#include <bzlib.h>
+#include <glib.h>
 #include <glog/logging.h>
 
 #include "files/scoped_file.h"
 #include "strings/string_printf.h"
-#include "update_engine/bzip.h"
 #include "update_engine/cycle_breaker.h"
 #include "update_engine/delta_metadata.h"
+#include "update_engine/ext2_files.h"
 #include "update_engine/ext2_metadata.h"
 #include "update_engine/extent_mapper.h"
 #include "update_engine/extent_ranges.h"
+#include "update_engine/file_block_index.h"
 #include "update_engine/file_writer.h"
 #include "update_engine/filesystem_iterator.h"
 #include "update_engine/full_update_generator.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/packed_extents.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/topological_sort.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
 
+using std::deque;
 using std::make_pair;
 using std::map;
 using std::max;
 using std::min;
 using std::pair;
 using std::set;
+using std::shared_ptr;
 using std::string;
 using std::vector;
 using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 typedef map<const InstallOperation*,
             const string*> OperationNameMap;
 
@@ -63,11 +69,22 @@ const string kNonexistentPath = "";
 
 const uint64_t kFullUpdateChunkSize = 1024 * 1024;  // bytes
 
+// Left over blocks are encoded in chunks of this many blocks, bounding the
+// size of each operation the client has to buffer.
+const uint64_t kUnwrittenChunkBlocks = kFullUpdateChunkSize / kBlockSize;
+
 static const char* kInstallOperationTypes[] = {
   "REPLACE",
   "REPLACE_BZ",
   "MOVE",
-  "BSDIFF"
+  "BSDIFF",
+  "REPLACE_ZSTD",
+  "REPLACE_XZ",
+  "ZERO",
+  "SOURCE_COPY",
+  "SOURCE_BSDIFF",
+  "ZSTD_DIFF",
+  "SOURCE_ZSTD_DIFF"
 };
 
 // Stores all Extents for a file into 'out'. Returns true on success.
@@ -79,18 +96,60 @@ bool GatherExtents(const string& path,
   return true;
 }
 
+// Writes |data|, the data of |operation| which encodes the file at |path|,
+// to data_fd, which has length *data_file_size. *data_file_size is updated
+// appropriately. Then adds |operation| to the graph, as |existing_vertex|
+// unless that's kInvalidIndex, and records its blocks in |blocks| if
+// |blocks| is non-NULL. Returns true on success.
+bool AddFileOperation(Graph* graph,
+                      Vertex::Index existing_vertex,
+                      BlockOwners* blocks,
+                      const string& path,
+                      const vector<char>& data,
+                      InstallOperation operation,
+                      int data_fd,
+                      off_t* data_file_size) {
+  // Write the data
+  if (!data.empty()) {
+    operation.set_data_offset(*data_file_size);
+    operation.set_data_length(data.size());
+  }
+
+  TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, &data[0], data.size()));
+  *data_file_size += data.size();
+
+  // Now, insert into graph and block owners
+  Vertex::Index vertex = existing_vertex;
+  if (vertex == Vertex::kInvalidIndex) {
+    graph->resize(graph->size() + 1);
+    vertex = graph->size() - 1;
+  }
+  (*graph)[vertex].op = operation;
+  CHECK((*graph)[vertex].op.has_type());
+  (*graph)[vertex].file_name = path;
+
+  if (blocks)
+    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlockOwners(
+        (*graph)[vertex].op,
+        *graph,
+        vertex,
+        blocks));
+  return true;
+}
+
 // For a given regular file which must exist at new_root + path, and
-// may exist at old_root + path, creates a new InstallOperation and
-// adds it to the graph. Also, populates the |blocks| array as
-// necessary, if |blocks| is non-NULL.  Also, writes the data
-// necessary to send the file down to the client into data_fd, which
-// has length *data_file_size. *data_file_size is updated
-// appropriately. If |existing_vertex| is no kInvalidIndex, use that
-// rather than allocating a new vertex. Returns true on success.
+// which is diffed against old_path unless that's kNonexistentPath,
+// creates a new InstallOperation and adds it to the graph. Also, records
+// the operation's blocks in |blocks| as necessary, if |blocks| is
+// non-NULL.  Also, writes the data necessary to send the file down to
+// the client into data_fd, which has length *data_file_size.
+// *data_file_size is updated appropriately. If |existing_vertex| is no
+// kInvalidIndex, use that rather than allocating a new vertex. Returns
+// true on success.
 bool DeltaReadFile(Graph* graph,
                    Vertex::Index existing_vertex,
-                   vector<Block>* blocks,
-                   const string& old_root,
+                   BlockOwners* blocks,
+                   const string& old_path,
                    const string& new_root,
                    const string& path,  // within new_root
                    int data_fd,
@@ -98,9 +157,6 @@ bool DeltaReadFile(Graph* graph,
   vector<char> data;
   InstallOperation operation;
 
-  string old_path = (old_root == kNonexistentPath) ? kNonexistentPath :
-      old_root + path;
-
   // If bsdiff breaks again, blacklist the problem file by using:
   //   bsdiff_allowed = (path != "/foo/bar")
   //
@@ -115,91 +171,138 @@ bool DeltaReadFile(Graph* graph,
                                                            bsdiff_allowed,
                                                            &data,
                                                            &operation,
-                                                           true));
-
-  // Write the data
-  if (operation.type() != InstallOperation_Type_MOVE) {
-    operation.set_data_offset(*data_file_size);
-    operation.set_data_length(data.size());
-  }
-
-  TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, &data[0], data.size()));
-  *data_file_size += data.size();
+                                                           true,
+                                                           kBlockSize));
+  return AddFileOperation(graph, existing_vertex, blocks, path, data,
+                          operation, data_fd, data_file_size);
+}
 
-  // Now, insert into graph and blocks vector
-  Vertex::Index vertex = existing_vertex;
-  if (vertex == Vertex::kInvalidIndex) {
-    graph->resize(graph->size() + 1);
-    vertex = graph->size() - 1;
-  }
-  (*graph)[vertex].op = operation;
-  CHECK((*graph)[vertex].op.has_type());
-  (*graph)[vertex].file_name = path;
+// Like DeltaReadFile with no old file, but for a file read straight from
+// the image |new_image|: the file is read back from the blocks that
+// |existing_vertex| writes.
+bool DeltaReadImageFile(Graph* graph,
+                        Vertex::Index existing_vertex,
+                        const string& new_image,
+                        int data_fd,
+                        off_t* data_file_size) {
+  const Vertex& vertex = (*graph)[existing_vertex];
+  Ext2File file;
+  file.path = vertex.file_name;
+  file.inode = 0;
+  file.size = vertex.op.dst_length();
+  file.extents.assign(vertex.op.dst_extents().begin(),
+                      vertex.op.dst_extents().end());
+
+  int new_fd = open(new_image.c_str(), O_RDONLY, 000);
+  TEST_AND_RETURN_FALSE_ERRNO(new_fd >= 0);
+  files::ScopedFD new_fd_closer(new_fd);
+  vector<char> new_data;
+  TEST_AND_RETURN_FALSE(Ext2Files::ReadFile(new_fd, file, &new_data));
 
-  if (blocks)
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
-        (*graph)[vertex].op,
-        *graph,
-        vertex,
-        blocks));
-  return true;
+  vector<char> data;
+  InstallOperation_Type type;
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::DiffData(vector<char>(),
+                                                     new_data,
+                                                     true,
+                                                     &data,
+                                                     &type));
+  InstallOperation operation;
+  operation.set_type(type);
+  *operation.mutable_dst_extents() = vertex.op.dst_extents();
+  operation.set_dst_length(new_data.size());
+  return AddFileOperation(graph, existing_vertex, NULL, file.path, data,
+                          operation, data_fd, data_file_size);
 }
 
-// For each regular file within new_root, creates a node in the graph,
-// determines the best way to compress it (REPLACE, REPLACE_BZ, COPY, BSDIFF),
-// and writes any necessary data to the end of data_fd.
-bool DeltaReadFiles(Graph* graph,
-                    vector<Block>* blocks,
-                    const string& old_root,
-                    const string& new_root,
-                    int data_fd,
-                    off_t* data_file_size) {
-  set<ino_t> visited_inodes;
-  set<ino_t> visited_src_inodes;
-  for (FilesystemIterator fs_iter(new_root,
-                                  set<string>{"/lost+found"});
-       !fs_iter.IsEnd(); fs_iter.Increment()) {
-    // We never diff symlinks (here, we check that dst file is not a symlink).
-    if (!S_ISREG(fs_iter.GetStat().st_mode))
-      continue;
-
-    // Make sure we visit each inode only once.
-    if (visited_inodes.count(fs_iter.GetStat().st_ino))
+// Like DeltaReadFiles, but reads the regular files straight from the
+// ext2 images |old_image| and |new_image| rather than through mount points.
+bool DeltaReadImageFiles(Graph* graph,
+                         BlockOwners* blocks,
+                         const string& old_image,
+                         const string& new_image,
+                         int data_fd,
+                         off_t* data_file_size) {
+  vector<Ext2File> old_files, new_files;
+  TEST_AND_RETURN_FALSE(Ext2Files::ListRegularFiles(old_image, &old_files));
+  TEST_AND_RETURN_FALSE(Ext2Files::ListRegularFiles(new_image, &new_files));
+  LOG(INFO) << "Found " << old_files.size() << " old and "
+            << new_files.size() << " new files";
+
+  int old_fd = open(old_image.c_str(), O_RDONLY, 000);
+  TEST_AND_RETURN_FALSE_ERRNO(old_fd >= 0);
+  files::ScopedFD old_fd_closer(old_fd);
+  int new_fd = open(new_image.c_str(), O_RDONLY, 000);
+  TEST_AND_RETURN_FALSE_ERRNO(new_fd >= 0);
+  files::ScopedFD new_fd_closer(new_fd);
+
+  // As in DeltaReadFiles, old files that are gone from the new image are
+  // indexed to find the one to diff against a new file with no old one.
+  set<string> new_paths;
+  for (const Ext2File& file : new_files)
+    new_paths.insert(file.path);
+  map<string, const Ext2File*> old_files_by_path;
+  FileBlockIndex removed_files;
+  vector<char> old_data;
+  for (const Ext2File& file : old_files) {
+    old_files_by_path[file.path] = &file;
+    if (new_paths.count(file.path))
       continue;
-    visited_inodes.insert(fs_iter.GetStat().st_ino);
-    if (fs_iter.GetStat().st_size == 0)
-      continue;
-
-    LOG(INFO) << "Encoding file " << fs_iter.GetPartialPath();
+    TEST_AND_RETURN_FALSE(Ext2Files::ReadFile(old_fd, file, &old_data));
+    removed_files.Add(file.path, file.inode, old_data);
+  }
+  LOG(INFO) << "Indexed " << removed_files.size() << " removed files";
 
-    // We can't visit each dst image inode more than once, as that would
-    // duplicate work. Here, we avoid visiting each source image inode
-    // more than once. Technically, we could have multiple operations
-    // that read the same blocks from the source image for diffing, but
-    // we choose not to to avoid complexity. Eventually we will move away
-    // from using a graph/cycle detection/etc to generate diffs, and at that
-    // time, it will be easy (non-complex) to have many operations read
-    // from the same source blocks. At that time, this code can die. -adlr
-    bool should_diff_from_source = false;
-    string src_path = old_root + fs_iter.GetPartialPath();
-    struct stat src_stbuf;
-    // We never diff symlinks (here, we check that src file is not a symlink).
-    if (0 == lstat(src_path.c_str(), &src_stbuf) &&
-        S_ISREG(src_stbuf.st_mode)) {
-      should_diff_from_source = !visited_src_inodes.count(src_stbuf.st_ino);
-      visited_src_inodes.insert(src_stbuf.st_ino);
+  set<ino_t> visited_src_inodes;
+  vector<char> new_data;
+  for (const Ext2File& new_file : new_files) {
+    LOG(INFO) << "Encoding file " << new_file.path;
+    TEST_AND_RETURN_FALSE(Ext2Files::ReadFile(new_fd, new_file, &new_data));
+
+    // Each old inode is only diffed against once, see DeltaReadFiles.
+    const Ext2File* old_file = NULL;
+    string similar_path;
+    auto it = old_files_by_path.find(new_file.path);
+    if (it != old_files_by_path.end()) {
+      if (visited_src_inodes.insert(it->second->inode).second)
+        old_file = it->second;
+    } else if (removed_files.FindMostSimilar(new_data,
+                                             visited_src_inodes,
+                                             &similar_path)) {
+      LOG(INFO) << "Diffing against " << similar_path << " instead";
+      old_file = old_files_by_path[similar_path];
+      visited_src_inodes.insert(old_file->inode);
     }
-
-    TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
-                                        Vertex::kInvalidIndex,
-                                        blocks,
-                                        (should_diff_from_source ?
-                                         old_root :
-                                         kNonexistentPath),
-                                        new_root,
-                                        fs_iter.GetPartialPath(),
-                                        data_fd,
-                                        data_file_size));
+    old_data.clear();
+    if (old_file)
+      TEST_AND_RETURN_FALSE(Ext2Files::ReadFile(old_fd, *old_file, &old_data));
+
+    vector<char> data;
+    InstallOperation_Type type;
+    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::DiffData(old_data,
+                                                       new_data,
+                                                       true,
+                                                       &data,
+                                                       &type));
+    InstallOperation operation;
+    operation.set_type(type);
+    if (type == InstallOperation_Type_MOVE ||
+        type == InstallOperation_Type_BSDIFF ||
+        type == InstallOperation_Type_ZSTD_DIFF) {
+      DeltaDiffGenerator::StoreExtents(old_file->extents,
+                                       operation.mutable_src_extents());
+      operation.set_src_length(old_data.size());
+    }
+    DeltaDiffGenerator::StoreExtents(new_file.extents,
+                                     operation.mutable_dst_extents());
+    operation.set_dst_length(new_data.size());
+    TEST_AND_RETURN_FALSE(AddFileOperation(graph,
+                                           Vertex::kInvalidIndex,
+                                           blocks,
+                                           new_file.path,
+                                           data,
+                                           operation,
+                                           data_fd,
+                                           data_file_size));
   }
   return true;
 }
@@ -223,120 +326,130 @@ class DummyExtentAllocator {
   uint64_t next_block_;
 };
 
-// Reads blocks from image_path that are not yet marked as being written
-// in the blocks array. These blocks that remain are non-file-data blocks.
-// In the future we might consider intelligent diffing between this data
-// and data in the previous image, but for now we just bzip2 compress it
-// and include it in the update.
-// Creates a new node in the graph to write these blocks and writes the
-// appropriate blob to blobs_fd. Reads and updates blobs_length;
-bool ReadUnwrittenBlocks(const vector<Block>& blocks,
-                         int blobs_fd,
-                         off_t* blobs_length,
-                         const string& image_path,
-                         Vertex* vertex) {
-  vertex->file_name = "<fs-non-file-data>";
-
-  InstallOperation* out_op = &vertex->op;
-  int image_fd = open(image_path.c_str(), O_RDONLY, 000);
-  TEST_AND_RETURN_FALSE_ERRNO(image_fd >= 0);
-  files::ScopedFD image_fd_closer(image_fd);
-
-  string temp_file_path;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/CrAU_temp_data.XXXXXX",
-                                            &temp_file_path,
-                                            NULL));
+// Reads the blocks in |extents| from |fd| into |data|, in order.
+bool ReadExtentsData(int fd, const vector<Extent>& extents,
+                     vector<char>* data) {
+  data->resize(graph_utils::BlocksInExtents(extents) * kBlockSize);
+  size_t offset = 0;
+  for (const Extent& extent : extents) {
+    const size_t length = extent.num_blocks() * kBlockSize;
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                          &(*data)[offset],
+                                          length,
+                                          extent.start_block() * kBlockSize,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(length));
+    offset += length;
+  }
+  return true;
+}
 
-  FILE* file = fopen(temp_file_path.c_str(), "w");
-  TEST_AND_RETURN_FALSE(file);
-  int err = BZ_OK;
+// Encodes one chunk of the blocks left over after all files and
+// metadata have been processed, on its own thread. The processor needs
+// to be started through Start() then waited on through Wait().
+class UnwrittenChunkProcessor {
+ public:
+  // Encodes the blocks in |extents| of |new_fd|. If |old_fd| is not -1,
+  // the same blocks of |old_fd| are used as the diff source.
+  UnwrittenChunkProcessor(int old_fd, int new_fd,
+                          const vector<Extent>& extents)
+      : thread_(NULL),
+        old_fd_(old_fd),
+        new_fd_(new_fd),
+        extents_(extents) {}
+  ~UnwrittenChunkProcessor() { Wait(); }
+
+  const vector<Extent>& extents() const { return extents_; }
+  const InstallOperation& op() const { return op_; }
+  const vector<char>& data() const { return data_; }
+
+  // Starts the processor. Returns true on success, false on failure.
+  bool Start();
+
+  // Waits for the processor to complete. Returns true on success, false on
+  // failure.
+  bool Wait();
 
-  BZFILE* bz_file = BZ2_bzWriteOpen(&err,
-                                    file,
-                                    9,  // max compression
-                                    0,  // verbosity
-                                    0);  // default work factor
-  TEST_AND_RETURN_FALSE(err == BZ_OK);
+ private:
+  // Reads the chunk and fills in |op_| and |data_| with its smallest
+  // encoding. Returns true on success, false otherwise.
+  bool ReadAndEncode();
+  static gpointer ReadAndEncodeThread(gpointer data);
+
+  GThread* thread_;
+  int old_fd_;
+  int new_fd_;
+  vector<Extent> extents_;
+  InstallOperation op_;
+  vector<char> data_;
+
+  DISALLOW_COPY_AND_ASSIGN(UnwrittenChunkProcessor);
+};
 
-  vector<Extent> extents;
-  vector<Block>::size_type block_count = 0;
+bool UnwrittenChunkProcessor::Start() {
+  thread_ = g_thread_try_new("unwritten_proc", ReadAndEncodeThread, this,
+                             NULL);
+  TEST_AND_RETURN_FALSE(thread_ != NULL);
+  return true;
+}
 
-  LOG(INFO) << "Appending left over blocks to extents";
-  for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-    if (blocks[i].writer != Vertex::kInvalidIndex)
-      continue;
-    if (blocks[i].reader != Vertex::kInvalidIndex) {
-      graph_utils::AddReadBeforeDep(vertex, blocks[i].reader, i);
-    }
-    graph_utils::AppendBlockToExtents(&extents, i);
-    block_count++;
+bool UnwrittenChunkProcessor::Wait() {
+  if (!thread_) {
+    return false;
   }
+  gpointer result = g_thread_join(thread_);
+  thread_ = NULL;
+  TEST_AND_RETURN_FALSE(result == this);
+  return true;
+}
 
-  // Code will handle 'buf' at any size that's a multiple of kBlockSize,
-  // so we arbitrarily set it to 1024 * kBlockSize.
-  vector<char> buf(1024 * kBlockSize);
+gpointer UnwrittenChunkProcessor::ReadAndEncodeThread(gpointer data) {
+  return reinterpret_cast<UnwrittenChunkProcessor*>(data)->ReadAndEncode() ?
+      data : NULL;
+}
 
-  LOG(INFO) << "Reading left over blocks";
-  vector<Block>::size_type blocks_copied_count = 0;
+bool UnwrittenChunkProcessor::ReadAndEncode() {
+  vector<char> new_data;
+  TEST_AND_RETURN_FALSE(ReadExtentsData(new_fd_, extents_, &new_data));
 
-  // For each extent in extents, write the data into BZ2_bzWrite which
-  // sends it to an output file.
-  // We use the temporary buffer 'buf' to hold the data, which may be
-  // smaller than the extent, so in that case we have to loop to get
-  // the extent's data (that's the inner while loop).
-  for (const Extent& extent : extents) {
-    vector<Block>::size_type blocks_read = 0;
-    float printed_progress = -1;
-    while (blocks_read < extent.num_blocks()) {
-      const int copy_block_cnt =
-          min(buf.size() / kBlockSize,
-              static_cast<vector<char>::size_type>(
-                  extent.num_blocks() - blocks_read));
-      ssize_t rc = pread(image_fd,
-                         &buf[0],
-                         copy_block_cnt * kBlockSize,
-                         (extent.start_block() + blocks_read) * kBlockSize);
-      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
-      TEST_AND_RETURN_FALSE(static_cast<size_t>(rc) ==
-                            copy_block_cnt * kBlockSize);
-      BZ2_bzWrite(&err, bz_file, &buf[0], copy_block_cnt * kBlockSize);
-      TEST_AND_RETURN_FALSE(err == BZ_OK);
-      blocks_read += copy_block_cnt;
-      blocks_copied_count += copy_block_cnt;
-      float current_progress =
-          static_cast<float>(blocks_copied_count) / block_count;
-      if (printed_progress + 0.1 < current_progress ||
-          blocks_copied_count == block_count) {
-        LOG(INFO) << "progress: " << current_progress;
-        printed_progress = current_progress;
+  InstallOperation_Type type;
+  TEST_AND_RETURN_FALSE(CompressReplaceData(new_data, &data_, &type));
+  op_.set_type(type);
+
+  if (old_fd_ >= 0) {
+    vector<char> old_data;
+    TEST_AND_RETURN_FALSE(ReadExtentsData(old_fd_, extents_, &old_data));
+    if (old_data == new_data) {
+      op_.set_type(InstallOperation_Type_MOVE);
+      data_.clear();
+    } else {
+      vector<char> bsdiff_delta;
+      TEST_AND_RETURN_FALSE(DeltaDiffGenerator::BsdiffData(old_data,
+                                                           new_data,
+                                                           &bsdiff_delta));
+      CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
+      if (IsCheaperOperation(InstallOperation_Type_BSDIFF, bsdiff_delta.size(),
+                             op_.type(), data_.size(), new_data.size())) {
+        op_.set_type(InstallOperation_Type_BSDIFF);
+        data_.swap(bsdiff_delta);
       }
+      type = op_.type();
+      TEST_AND_RETURN_FALSE(ChooseZstdDiff(old_data, new_data, &data_, &type));
+      op_.set_type(type);
+    }
+    // The blocks were not claimed by anything else, so the source is the
+    // same blocks of the old filesystem.
+    if (op_.type() == InstallOperation_Type_MOVE ||
+        op_.type() == InstallOperation_Type_BSDIFF ||
+        op_.type() == InstallOperation_Type_ZSTD_DIFF) {
+      DeltaDiffGenerator::StoreExtents(extents_, op_.mutable_src_extents());
+      op_.set_src_length(old_data.size());
     }
   }
-  BZ2_bzWriteClose(&err, bz_file, 0, NULL, NULL);
-  TEST_AND_RETURN_FALSE(err == BZ_OK);
-  bz_file = NULL;
-  TEST_AND_RETURN_FALSE_ERRNO(0 == fclose(file));
-  file = NULL;
-
-  vector<char> compressed_data;
-  LOG(INFO) << "Reading compressed data off disk";
-  TEST_AND_RETURN_FALSE(utils::ReadFile(temp_file_path, &compressed_data));
-  TEST_AND_RETURN_FALSE(unlink(temp_file_path.c_str()) == 0);
-
-  // Add node to graph to write these blocks
-  out_op->set_type(InstallOperation_Type_REPLACE_BZ);
-  out_op->set_data_offset(*blobs_length);
-  out_op->set_data_length(compressed_data.size());
-  LOG(INFO) << "fs non-data blocks compressed take up "
-            << compressed_data.size();
-  *blobs_length += compressed_data.size();
-  out_op->set_dst_length(kBlockSize * block_count);
-  DeltaDiffGenerator::StoreExtents(extents, out_op->mutable_dst_extents());
-
-  TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd,
-                                        &compressed_data[0],
-                                        compressed_data.size()));
-  LOG(INFO) << "done with extra blocks";
+
+  DeltaDiffGenerator::StoreExtents(extents_, op_.mutable_dst_extents());
+  op_.set_dst_length(new_data.size());
   return true;
 }
 
@@ -405,6 +518,7 @@ bool AddProcedureToManifest(
 // in the noop_operations list for compatibility with old versions that did
 // not support the new procedures.
 void ProceduresToNoops(DeltaArchiveManifest* manifest) {
+  const uint64_t block_size = manifest->block_size();
   for (const InstallProcedure& proc : manifest->procedures()) {
     for (const InstallOperation& op : proc.operations()) {
       // No need to include operations without data (e.g. MOVE)
@@ -421,7 +535,7 @@ void ProceduresToNoops(DeltaArchiveManifest* manifest) {
       // Tell the dummy op to write this data to a big sparse hole
       Extent* extent = noop->add_dst_extents();
       extent->set_start_block(kSparseHole);
-      extent->set_num_blocks((op.data_length() + kBlockSize - 1) / kBlockSize);
+      extent->set_num_blocks((op.data_length() + block_size - 1) / block_size);
     }
   }
 }
@@ -434,9 +548,11 @@ void CheckGraph(const Graph& graph) {
 
 // Delta compresses a file |new_path| with knowledge of the old file
 // |old_path|. If |old_file| is an empty string generate a full update.
+// The extents are counted in |block_size| blocks.
 bool DeltaCompressFile(
     const string& old_path,
     const string& new_path,
+    uint32_t block_size,
     vector<InstallOperation>* ops,
     int blobs_fd,
     off_t* blobs_length) {
@@ -456,10 +572,11 @@ bool DeltaCompressFile(
                                          true, // bsdiff_allowed
                                          &data,
                                          op,
-                                         false));
+                                         false,
+                                         block_size));
 
   // Write the data
-  if (op->type() != InstallOperation_Type_MOVE) {
+  if (!data.empty()) {
     op->set_data_offset(*blobs_length);
     op->set_data_length(data.size());
   }
@@ -472,17 +589,60 @@ bool DeltaCompressFile(
   return true;
 }
 
+// Returns how long it takes to parse |serialized_manifest|.
+std::chrono::microseconds ManifestParseTime(const string& serialized_manifest) {
+  const auto start = std::chrono::steady_clock::now();
+  DeltaArchiveManifest manifest;
+  CHECK(manifest.ParseFromString(serialized_manifest));
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+}
+
+// Reports how much smaller and faster to parse packed extents make
+// |manifest|, if it has them.
+void ReportPackedExtentsSavings(const DeltaArchiveManifest& manifest) {
+  DeltaArchiveManifest unpacked = manifest;
+  bool packed = false;
+  for (InstallOperation& op : *unpacked.mutable_partition_operations()) {
+    packed = packed || packed_extents::IsPacked(op);
+    CHECK(!packed_extents::IsPacked(op) || packed_extents::Unpack(&op));
+  }
+  for (InstallProcedure& proc : *unpacked.mutable_procedures()) {
+    for (InstallOperation& op : *proc.mutable_operations()) {
+      packed = packed || packed_extents::IsPacked(op);
+      CHECK(!packed_extents::IsPacked(op) || packed_extents::Unpack(&op));
+    }
+  }
+  if (!packed)
+    return;
+
+  const string packed_manifest = manifest.SerializeAsString();
+  const string unpacked_manifest = unpacked.SerializeAsString();
+  fprintf(stderr,
+          "Packed extents: manifest of %zu bytes instead of %zu (%.2f%%), "
+          "parsed in %s instead of %s\n",
+          packed_manifest.size(), unpacked_manifest.size(),
+          packed_manifest.size() * 100.0 / unpacked_manifest.size(),
+          utils::ToString(ManifestParseTime(packed_manifest)).c_str(),
+          utils::ToString(ManifestParseTime(unpacked_manifest)).c_str());
+}
+
 struct DeltaObject {
-  DeltaObject(const string& in_name, const int in_type, const off_t in_size)
+  DeltaObject(const string& in_name,
+              const int in_type,
+              const off_t in_size,
+              const double in_seconds)
       : name(in_name),
         type(in_type),
-        size(in_size) {}
+        size(in_size),
+        seconds(in_seconds) {}
   bool operator <(const DeltaObject& object) const {
     return (size != object.size) ? (size < object.size) : (name < object.name);
   }
   string name;
   int type;
   off_t size;
+  double seconds;  // predicted time to download and apply
 };
 
 void ReportPayloadUsage(const DeltaArchiveManifest& manifest,
@@ -490,6 +650,7 @@ void ReportPayloadUsage(const DeltaArchiveManifest& manifest,
                         const OperationNameMap& op_name_map) {
   vector<DeltaObject> objects;
   off_t total_size = 0;
+  double total_seconds = 0;
 
   // Rootfs install operations.
   for (int i = 0; i < manifest.partition_operations_size(); ++i) {
@@ -497,8 +658,12 @@ void ReportPayloadUsage(const DeltaArchiveManifest& manifest,
         manifest.partition_operations(i);
     objects.push_back(DeltaObject(*op_name_map.find(&op)->second,
                                   op.type(),
-                                  op.data_length()));
+                                  op.data_length(),
+                                  EstimateApplySeconds(op.type(),
+                                                       op.data_length(),
+                                                       op.dst_length())));
     total_size += op.data_length();
+    total_seconds += objects.back().seconds;
   }
 
   // Dummy install operations for compatibility with older clients.
@@ -507,62 +672,146 @@ void ReportPayloadUsage(const DeltaArchiveManifest& manifest,
         manifest.noop_operations(i);
     objects.push_back(DeltaObject(StringPrintf("<noop-operation-%d>", i),
                                   op.type(),
-                                  op.data_length()));
+                                  op.data_length(),
+                                  EstimateApplySeconds(op.type(),
+                                                       op.data_length(),
+                                                       0)));
     total_size += op.data_length();
+    total_seconds += objects.back().seconds;
   }
 
-  objects.push_back(DeltaObject("<manifest-metadata>",
-                                -1,
-                                manifest_metadata_size));
+  // The metadata is only downloaded.
+  objects.push_back(DeltaObject(
+      "<manifest-metadata>",
+      -1,
+      manifest_metadata_size,
+      EstimateApplySeconds(InstallOperation_Type_REPLACE,
+                           manifest_metadata_size,
+                           0)));
   total_size += manifest_metadata_size;
+  total_seconds += objects.back().seconds;
 
   std::sort(objects.begin(), objects.end());
 
-  static const char kFormatString[] = "%6.2f%% %10jd %-10s %s\n";
+  static const char kFormatString[] = "%6.2f%% %10jd %9.3fs %-10s %s\n";
   for (const DeltaObject& object : objects) {
     fprintf(stderr, kFormatString,
             object.size * 100.0 / total_size,
             static_cast<intmax_t>(object.size),
+            object.seconds,
             object.type >= 0 ? kInstallOperationTypes[object.type] : "-",
             object.name.c_str());
   }
   fprintf(stderr, kFormatString,
-          100.0, static_cast<intmax_t>(total_size), "", "<total>");
+          100.0, static_cast<intmax_t>(total_size), total_seconds, "",
+          "<total>");
+  fprintf(stderr, "Predicted apply times assume %.1f Mbit/s downloads\n",
+          (TargetDownloadRate() ? TargetDownloadRate() :
+           kNominalDownloadRate) * 8 / 1e6);
+  ReportPackedExtentsSavings(manifest);
 }
 
 }  // namespace {}
 
+bool DeltaDiffGenerator::DeltaReadFiles(Graph* graph,
+                                        BlockOwners* blocks,
+                                        const string& old_root,
+                                        const string& new_root,
+                                        int data_fd,
+                                        off_t* data_file_size) {
+  // Old files that are gone from new_root may have been renamed, so they're
+  // indexed to find the one to diff against a new file with no old one.
+  vector<string> removed_paths;
+  for (FilesystemIterator fs_iter(old_root,
+                                  set<string>{"/lost+found"});
+       !fs_iter.IsEnd(); fs_iter.Increment()) {
+    if (!S_ISREG(fs_iter.GetStat().st_mode) ||
+        fs_iter.GetStat().st_size == 0)
+      continue;
+    struct stat new_stbuf;
+    string new_path = new_root + fs_iter.GetPartialPath();
+    if (0 == lstat(new_path.c_str(), &new_stbuf) &&
+        S_ISREG(new_stbuf.st_mode))
+      continue;
+    removed_paths.push_back(fs_iter.GetFullPath());
+  }
+  FileBlockIndex removed_files;
+  TEST_AND_RETURN_FALSE(removed_files.Build(removed_paths));
+  LOG(INFO) << "Indexed " << removed_files.size() << " removed files";
+
+  set<ino_t> visited_inodes;
+  set<ino_t> visited_src_inodes;
+  for (FilesystemIterator fs_iter(new_root,
+                                  set<string>{"/lost+found"});
+       !fs_iter.IsEnd(); fs_iter.Increment()) {
+    // We never diff symlinks (here, we check that dst file is not a symlink).
+    if (!S_ISREG(fs_iter.GetStat().st_mode))
+      continue;
+
+    // Make sure we visit each inode only once.
+    if (visited_inodes.count(fs_iter.GetStat().st_ino))
+      continue;
+    visited_inodes.insert(fs_iter.GetStat().st_ino);
+    if (fs_iter.GetStat().st_size == 0)
+      continue;
+
+    LOG(INFO) << "Encoding file " << fs_iter.GetPartialPath();
+
+    // We can't visit each dst image inode more than once, as that would
+    // duplicate work. Here, we avoid visiting each source image inode
+    // more than once. Technically, we could have multiple operations
+    // that read the same blocks from the source image for diffing, but
+    // we choose not to to avoid complexity. Eventually we will move away
+    // from using a graph/cycle detection/etc to generate diffs, and at that
+    // time, it will be easy (non-complex) to have many operations read
+    // from the same source blocks. At that time, this code can die. -adlr
+    bool should_diff_from_source = false;
+    string src_path = old_root + fs_iter.GetPartialPath();
+    struct stat src_stbuf;
+    // We never diff symlinks (here, we check that src file is not a symlink).
+    if (0 == lstat(src_path.c_str(), &src_stbuf) &&
+        S_ISREG(src_stbuf.st_mode)) {
+      should_diff_from_source = !visited_src_inodes.count(src_stbuf.st_ino);
+      visited_src_inodes.insert(src_stbuf.st_ino);
+    } else if (removed_files.FindMostSimilar(fs_iter.GetFullPath(),
+                                             visited_src_inodes,
+                                             &src_path) &&
+               0 == lstat(src_path.c_str(), &src_stbuf)) {
+      LOG(INFO) << "Diffing against " << src_path << " instead";
+      should_diff_from_source = true;
+      visited_src_inodes.insert(src_stbuf.st_ino);
+    }
+
+    TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
+                                        Vertex::kInvalidIndex,
+                                        blocks,
+                                        (should_diff_from_source ?
+                                         src_path :
+                                         kNonexistentPath),
+                                        new_root,
+                                        fs_iter.GetPartialPath(),
+                                        data_fd,
+                                        data_file_size));
+  }
+  return true;
+}
+
 bool DeltaDiffGenerator::ReadFileToDiff(
     const string& old_filename,
     const string& new_filename,
     bool bsdiff_allowed,
     vector<char>* out_data,
     InstallOperation* out_op,
-    bool gather_extents) {
+    bool gather_extents,
+    uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(!gather_extents || block_size == kBlockSize);
+
   // Read new data in
   vector<char> new_data;
   TEST_AND_RETURN_FALSE(utils::ReadFile(new_filename, &new_data));
 
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
-  vector<char> new_data_bz;
-  TEST_AND_RETURN_FALSE(BzipCompress(new_data, &new_data_bz));
-  CHECK(!new_data_bz.empty());
-
-  vector<char> data;  // Data blob that will be written to delta file.
-
-  InstallOperation operation;
-  size_t current_best_size = 0;
-  if (new_data.size() <= new_data_bz.size()) {
-    operation.set_type(InstallOperation_Type_REPLACE);
-    current_best_size = new_data.size();
-    data = new_data;
-  } else {
-    operation.set_type(InstallOperation_Type_REPLACE_BZ);
-    current_best_size = new_data_bz.size();
-    data = new_data_bz;
-  }
-
   // Do we have an original file to consider?
   struct stat old_stbuf;
   bool original = !old_filename.empty();
@@ -572,35 +821,21 @@ bool DeltaDiffGenerator::ReadFileToDiff(
     original = false;
   }
 
-  if (original) {
-    // Read old data
-    vector<char> old_data;
+  vector<char> old_data;
+  if (original)
     TEST_AND_RETURN_FALSE(utils::ReadFile(old_filename, &old_data));
-    if (old_data == new_data) {
-      // No change in data.
-      operation.set_type(InstallOperation_Type_MOVE);
-      current_best_size = 0;
-      data.clear();
-    } else if (bsdiff_allowed) {
-      // If the source file is considered bsdiff safe (no bsdiff bugs
-      // triggered), see if BSDIFF encoding is smaller.
-      vector<char> bsdiff_delta;
-      TEST_AND_RETURN_FALSE(
-          BsdiffFiles(old_filename, new_filename, &bsdiff_delta));
-      CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
-      if (bsdiff_delta.size() < current_best_size) {
-        operation.set_type(InstallOperation_Type_BSDIFF);
-        current_best_size = bsdiff_delta.size();
-        data = bsdiff_delta;
-      }
-    }
-  }
 
-  // Set parameters of the operations
-  CHECK_EQ(data.size(), current_best_size);
+  vector<char> data;  // Data blob that will be written to delta file.
+  InstallOperation operation;
+  InstallOperation_Type type;
+  TEST_AND_RETURN_FALSE(
+      DiffData(old_data, new_data, bsdiff_allowed, &data, &type));
+  operation.set_type(type);
 
+  // Set parameters of the operations
   if (operation.type() == InstallOperation_Type_MOVE ||
-      operation.type() == InstallOperation_Type_BSDIFF) {
+      operation.type() == InstallOperation_Type_BSDIFF ||
+      operation.type() == InstallOperation_Type_ZSTD_DIFF) {
     if (gather_extents) {
       TEST_AND_RETURN_FALSE(
           GatherExtents(old_filename, operation.mutable_src_extents()));
@@ -608,7 +843,7 @@ bool DeltaDiffGenerator::ReadFileToDiff(
       Extent* src_extent = operation.add_src_extents();
       src_extent->set_start_block(0);
       src_extent->set_num_blocks(
-          (old_stbuf.st_size + kBlockSize - 1) / kBlockSize);
+          (old_stbuf.st_size + block_size - 1) / block_size);
     }
     operation.set_src_length(old_stbuf.st_size);
   }
@@ -619,7 +854,8 @@ bool DeltaDiffGenerator::ReadFileToDiff(
   } else {
     Extent* dst_extent = operation.add_dst_extents();
     dst_extent->set_start_block(0);
-    dst_extent->set_num_blocks((new_data.size() + kBlockSize - 1) / kBlockSize);
+    dst_extent->set_num_blocks((new_data.size() + block_size - 1) /
+                               block_size);
   }
   operation.set_dst_length(new_data.size());
 
@@ -629,6 +865,136 @@ bool DeltaDiffGenerator::ReadFileToDiff(
   return true;
 }
 
+bool DeltaDiffGenerator::DiffData(const vector<char>& old_data,
+                                  const vector<char>& new_data,
+                                  bool bsdiff_allowed,
+                                  vector<char>* out_data,
+                                  InstallOperation_Type* out_type) {
+  vector<char> data;  // Data blob that will be written to delta file.
+  InstallOperation_Type type;
+  TEST_AND_RETURN_FALSE(CompressReplaceData(new_data, &data, &type));
+
+  if (old_data == new_data) {
+    // No change in data.
+    type = InstallOperation_Type_MOVE;
+    data.clear();
+  } else if (!old_data.empty()) {
+    if (bsdiff_allowed) {
+      // If the source file is considered bsdiff safe (no bsdiff bugs
+      // triggered), see if BSDIFF encoding is smaller, or quicker to apply.
+      vector<char> bsdiff_delta;
+      TEST_AND_RETURN_FALSE(BsdiffData(old_data, new_data, &bsdiff_delta));
+      CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
+      if (IsCheaperOperation(InstallOperation_Type_BSDIFF, bsdiff_delta.size(),
+                             type, data.size(), new_data.size())) {
+        type = InstallOperation_Type_BSDIFF;
+        data.swap(bsdiff_delta);
+      }
+    }
+    // zstd doesn't share bsdiff's bugs, so it may diff any file.
+    TEST_AND_RETURN_FALSE(ChooseZstdDiff(old_data, new_data, &data, &type));
+  }
+
+  out_data->swap(data);
+  *out_type = type;
+  return true;
+}
+
+bool DeltaDiffGenerator::ReadUnwrittenBlocks(const BlockOwners& blocks,
+                                             int blobs_fd,
+                                             off_t* blobs_length,
+                                             const string& old_image,
+                                             const string& new_image,
+                                             uint64_t chunk_blocks,
+                                             Graph* graph) {
+  int new_fd = open(new_image.c_str(), O_RDONLY, 000);
+  TEST_AND_RETURN_FALSE_ERRNO(new_fd >= 0);
+  files::ScopedFD new_fd_closer(new_fd);
+
+  int old_fd = -1;
+  uint64_t old_block_count = 0;
+  if (!old_image.empty()) {
+    old_fd = open(old_image.c_str(), O_RDONLY, 000);
+    TEST_AND_RETURN_FALSE_ERRNO(old_fd >= 0);
+    old_block_count = utils::FileSize(old_image) / kBlockSize;
+  }
+  files::ScopedFD old_fd_closer(old_fd);
+
+  vector<vector<Extent>> chunks =
+      graph_utils::SplitExtents(blocks.UnwrittenExtents(), chunk_blocks);
+  LOG(INFO) << "Encoding left over blocks in " << chunks.size() << " chunks";
+
+  size_t max_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
+  deque<shared_ptr<UnwrittenChunkProcessor> > threads;
+  vector<vector<Extent>>::size_type next_chunk = 0;
+  uint64_t chunks_done = 0;
+  int last_progress_update = INT_MIN;
+  while (next_chunk < chunks.size() || !threads.empty()) {
+    // Keep up to |max_threads| chunks in flight.
+    while (threads.size() < max_threads && next_chunk < chunks.size()) {
+      const vector<Extent>& extents = chunks[next_chunk++];
+      // Only diff against the old image if it has all of the chunk's blocks.
+      bool diffable = true;
+      for (const Extent& extent : extents) {
+        diffable = diffable &&
+            extent.start_block() + extent.num_blocks() <= old_block_count;
+      }
+      shared_ptr<UnwrittenChunkProcessor> processor(
+          new UnwrittenChunkProcessor(diffable ? old_fd : -1, new_fd,
+                                      extents));
+      threads.push_back(processor);
+      TEST_AND_RETURN_FALSE(processor->Start());
+    }
+
+    // Operations are added in chunk order so the output is deterministic.
+    shared_ptr<UnwrittenChunkProcessor> processor = threads.front();
+    threads.pop_front();
+    TEST_AND_RETURN_FALSE(processor->Wait());
+
+    chunks_done++;
+    int progress = static_cast<int>(chunks_done * 100.0 / chunks.size());
+    if (last_progress_update < progress &&
+        (last_progress_update + 10 <= progress || progress == 100)) {
+      LOG(INFO) << progress << "% of left over blocks encoded (output size: "
+                << *blobs_length << ")";
+      last_progress_update = progress;
+    }
+
+    // Blocks that didn't change are already in place, so don't add an
+    // operation that would only constrain the order of the others.
+    if (IsNoopOperation(processor->op()))
+      continue;
+
+    graph->resize(graph->size() + 1);
+    Vertex* out_vertex = &graph->back();
+    out_vertex->file_name =
+        StringPrintf("<fs-non-file-data-%" PRIu64 ">", chunks_done - 1);
+    out_vertex->op = processor->op();
+    const vector<char>& data = processor->data();
+    if (!data.empty()) {
+      out_vertex->op.set_data_offset(*blobs_length);
+      out_vertex->op.set_data_length(data.size());
+      TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd, &data[0], data.size()));
+      *blobs_length += data.size();
+    }
+
+    // Anything that reads these blocks must do so before they are written.
+    for (const Extent& extent : processor->extents()) {
+      vector<BlockOwners::Interval> readers;
+      blocks.ReadersInExtent(extent, &readers);
+      for (const BlockOwners::Interval& reader : readers) {
+        graph_utils::AddReadBeforeDepExtents(
+            out_vertex,
+            reader.vertex,
+            vector<Extent>(1, ExtentForRange(reader.start_block,
+                                             reader.num_blocks)));
+      }
+    }
+  }
+  LOG(INFO) << "done with extra blocks";
+  return true;
+}
+
 bool DeltaDiffGenerator::InitializeInfo(const string& path, InstallInfo* info) {
   off_t size = 0;
   TEST_AND_RETURN_FALSE(utils::GetDeviceSize(path, &size));
@@ -677,14 +1043,98 @@ vector<uint64_t> ExpandExtents(const T& extents) {
   return ret;
 }
 
-// Takes a vector of blocks and returns an equivalent vector of Extent
-// objects.
-vector<Extent> CompressExtents(const vector<uint64_t>& blocks) {
-  vector<Extent> new_extents;
-  for (uint64_t block : blocks) {
-    graph_utils::AppendBlockToExtents(&new_extents, block);
+// A run of |num_blocks| blocks starting at |from_block| that should be
+// renamed to the run starting at |to_block|. If |to_block| is kSparseHole,
+// every block in the run is renamed to kSparseHole.
+struct BlockMapping {
+  uint64_t from_block;
+  uint64_t num_blocks;
+  uint64_t to_block;
+
+  uint64_t from_end() const { return from_block + num_blocks; }
+  bool operator<(const BlockMapping& that) const {
+    return from_block < that.from_block;
+  }
+};
+
+// Pairs up the blocks of |remove_extents| with those of |replace_extents|
+// and returns the resulting mappings sorted by |from_block|. Sparse holes
+// in |remove_extents| name no real block, so they produce no mapping.
+vector<BlockMapping> BuildBlockMappings(const vector<Extent>& remove_extents,
+                                        const vector<Extent>& replace_extents) {
+  CHECK_EQ(graph_utils::BlocksInExtents(remove_extents),
+           graph_utils::BlocksInExtents(replace_extents));
+  vector<BlockMapping> mappings;
+  vector<Extent>::const_iterator replace_it = replace_extents.begin();
+  uint64_t replace_used = 0;
+  for (const Extent& remove : remove_extents) {
+    uint64_t remove_used = 0;
+    while (remove_used < remove.num_blocks()) {
+      while (replace_used == replace_it->num_blocks()) {
+        ++replace_it;
+        replace_used = 0;
+      }
+      uint64_t count = min(remove.num_blocks() - remove_used,
+                           replace_it->num_blocks() - replace_used);
+      if (remove.start_block() != kSparseHole) {
+        BlockMapping mapping;
+        mapping.from_block = remove.start_block() + remove_used;
+        mapping.num_blocks = count;
+        mapping.to_block = replace_it->start_block() == kSparseHole ?
+            kSparseHole : replace_it->start_block() + replace_used;
+        mappings.push_back(mapping);
+      }
+      remove_used += count;
+      replace_used += count;
+    }
+  }
+  std::sort(mappings.begin(), mappings.end());
+  for (vector<BlockMapping>::size_type i = 1; i < mappings.size(); i++) {
+    CHECK_LE(mappings[i - 1].from_end(), mappings[i].from_block)
+        << "Block " << mappings[i].from_block << " removed twice";
+  }
+  return mappings;
+}
+
+// Appends |extents| to |out| with every block renamed according to
+// |mappings|. Blocks not covered by a mapping are kept as-is, and the
+// output is merged exactly as AppendBlockToExtents would merge it.
+template<typename T>
+void RemapExtents(const T& extents,
+                  const vector<BlockMapping>& mappings,
+                  vector<Extent>* out) {
+  for (size_t i = 0, e = static_cast<size_t>(extents.size()); i != e; ++i) {
+    const Extent extent = graph_utils::GetElement(extents, i);
+    if (extent.start_block() == kSparseHole) {
+      graph_utils::AppendExtentToExtents(out, extent);
+      continue;
+    }
+    uint64_t block = extent.start_block();
+    const uint64_t end = extent.start_block() + extent.num_blocks();
+    // First mapping that ends after |block|.
+    vector<BlockMapping>::const_iterator it = std::upper_bound(
+        mappings.begin(), mappings.end(), block,
+        [](uint64_t value, const BlockMapping& mapping) {
+          return value < mapping.from_end();
+        });
+    while (block < end) {
+      uint64_t run_end;
+      uint64_t to_block;
+      if (it != mappings.end() && it->from_block <= block) {
+        run_end = min(end, it->from_end());
+        to_block = it->to_block == kSparseHole ?
+            kSparseHole : it->to_block + (block - it->from_block);
+        if (run_end == it->from_end())
+          ++it;
+      } else {
+        run_end = it == mappings.end() ? end : min(end, it->from_block);
+        to_block = block;
+      }
+      graph_utils::AppendExtentToExtents(
+          out, ExtentForRange(to_block, run_end - block));
+      block = run_end;
+    }
   }
-  return new_extents;
 }
 
 }  // namespace {}
@@ -693,32 +1143,17 @@ void DeltaDiffGenerator::SubstituteBlocks(
     Vertex* vertex,
     const vector<Extent>& remove_extents,
     const vector<Extent>& replace_extents) {
-  // First, expand out the blocks that op reads from
-  vector<uint64_t> read_blocks = ExpandExtents(vertex->op.src_extents());
-  {
-    // Expand remove_extents and replace_extents
-    vector<uint64_t> remove_extents_expanded =
-        ExpandExtents(remove_extents);
-    vector<uint64_t> replace_extents_expanded =
-        ExpandExtents(replace_extents);
-    CHECK_EQ(remove_extents_expanded.size(), replace_extents_expanded.size());
-    map<uint64_t, uint64_t> conversion;
-    for (vector<uint64_t>::size_type i = 0;
-         i < replace_extents_expanded.size(); i++) {
-      conversion[remove_extents_expanded[i]] = replace_extents_expanded[i];
-    }
-    utils::ApplyMap(&read_blocks, conversion);
-    for (auto& edge_prop_pair : vertex->out_edges) {
-      vector<uint64_t> write_before_deps_expanded =
-          ExpandExtents(edge_prop_pair.second.write_extents);
-      utils::ApplyMap(&write_before_deps_expanded, conversion);
-      edge_prop_pair.second.write_extents =
-          CompressExtents(write_before_deps_expanded);
-    }
+  const vector<BlockMapping> mappings =
+      BuildBlockMappings(remove_extents, replace_extents);
+  vector<Extent> new_extents;
+  RemapExtents(vertex->op.src_extents(), mappings, &new_extents);
+  for (auto& edge_prop_pair : vertex->out_edges) {
+    vector<Extent> write_extents;
+    RemapExtents(edge_prop_pair.second.write_extents, mappings,
+                 &write_extents);
+    edge_prop_pair.second.write_extents.swap(write_extents);
   }
-  // Convert read_blocks back to extents
   vertex->op.clear_src_extents();
-  vector<Extent> new_extents = CompressExtents(read_blocks);
   DeltaDiffGenerator::StoreExtents(new_extents,
                                    vertex->op.mutable_src_extents());
 }
@@ -803,26 +1238,25 @@ void DeltaDiffGenerator::StoreExtents(
 // readers of the same block. This is because for an edge A->B, B
 // must complete before A executes.
 void DeltaDiffGenerator::CreateEdges(Graph* graph,
-                                     const vector<Block>& blocks) {
-  for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-    // Blocks with both a reader and writer get an edge
-    if (blocks[i].reader == Vertex::kInvalidIndex ||
-        blocks[i].writer == Vertex::kInvalidIndex)
-      continue;
+                                     const BlockOwners& blocks) {
+  // Only ranges with both a reader and writer get an edge
+  for (const BlockOwners::Overlap& overlap : blocks.ReadWriteOverlaps()) {
+    const Vertex::Index reader = overlap.reader;
+    const Vertex::Index writer = overlap.writer;
     // Don't have a node depend on itself
-    if (blocks[i].reader == blocks[i].writer)
+    if (reader == writer)
       continue;
     // See if there's already an edge we can add onto
     Vertex::EdgeMap::iterator edge_it =
-        (*graph)[blocks[i].writer].out_edges.find(blocks[i].reader);
-    if (edge_it == (*graph)[blocks[i].writer].out_edges.end()) {
+        (*graph)[writer].out_edges.find(reader);
+    if (edge_it == (*graph)[writer].out_edges.end()) {
       // No existing edge. Create one
-      (*graph)[blocks[i].writer].out_edges.insert(
-          make_pair(blocks[i].reader, EdgeProperties()));
-      edge_it = (*graph)[blocks[i].writer].out_edges.find(blocks[i].reader);
-      CHECK(edge_it != (*graph)[blocks[i].writer].out_edges.end());
+      edge_it = (*graph)[writer].out_edges.insert(
+          make_pair(reader, EdgeProperties())).first;
     }
-    graph_utils::AppendBlockToExtents(&edge_it->second.extents, i);
+    graph_utils::AppendExtentToExtents(
+        &edge_it->second.extents,
+        ExtentForRange(overlap.start_block, overlap.num_blocks));
   }
 }
 
@@ -872,10 +1306,7 @@ void DeltaDiffGenerator::MoveFullOpsToBack(Graph* graph,
   ret.reserve(op_indexes->size());
   for (vector<Vertex::Index>::size_type i = 0, e = op_indexes->size(); i != e;
        ++i) {
-    InstallOperation_Type type =
-        (*graph)[(*op_indexes)[i]].op.type();
-    if (type == InstallOperation_Type_REPLACE ||
-        type == InstallOperation_Type_REPLACE_BZ) {
+    if (IsFullOperationType((*graph)[(*op_indexes)[i]].op.type())) {
       full_ops.push_back((*op_indexes)[i]);
     } else {
       ret.push_back((*op_indexes)[i]);
@@ -1227,21 +1658,28 @@ bool DeltaDiffGenerator::ConvertCutToFullOp(Graph* graph,
   // Drop all incoming edges, keep all outgoing edges
 
   // Keep all outgoing edges
-  if ((*graph)[cut.old_dst].op.type() !=
-      InstallOperation_Type_REPLACE_BZ &&
-      (*graph)[cut.old_dst].op.type() !=
-      InstallOperation_Type_REPLACE) {
+  if (!IsFullOperationType((*graph)[cut.old_dst].op.type())) {
     Vertex::EdgeMap out_edges = (*graph)[cut.old_dst].out_edges;
     graph_utils::DropWriteBeforeDeps(&out_edges);
 
-    TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
-                                        cut.old_dst,
-                                        NULL,
-                                        kNonexistentPath,
-                                        new_root,
-                                        (*graph)[cut.old_dst].file_name,
-                                        data_fd,
-                                        data_file_size));
+    struct stat new_root_stbuf;
+    TEST_AND_RETURN_FALSE_ERRNO(stat(new_root.c_str(), &new_root_stbuf) == 0);
+    if (S_ISDIR(new_root_stbuf.st_mode)) {
+      TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
+                                          cut.old_dst,
+                                          NULL,
+                                          kNonexistentPath,
+                                          new_root,
+                                          (*graph)[cut.old_dst].file_name,
+                                          data_fd,
+                                          data_file_size));
+    } else {
+      TEST_AND_RETURN_FALSE(DeltaReadImageFile(graph,
+                                               cut.old_dst,
+                                               new_root,
+                                               data_fd,
+                                               data_file_size));
+    }
 
     (*graph)[cut.old_dst].out_edges = out_edges;
 
@@ -1308,6 +1746,44 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph* graph,
   return true;
 }
 
+void DeltaDiffGenerator::ConvertToSourceOperations(
+    Graph* graph,
+    uint64_t block_count,
+    vector<Vertex::Index>* final_order) {
+  ExtentRanges unwritten;
+  unwritten.AddExtent(ExtentForRange(0, block_count));
+  for (Vertex& vertex : *graph) {
+    if (vertex.op.type() == InstallOperation_Type_MOVE)
+      vertex.op.set_type(InstallOperation_Type_SOURCE_COPY);
+    else if (vertex.op.type() == InstallOperation_Type_BSDIFF)
+      vertex.op.set_type(InstallOperation_Type_SOURCE_BSDIFF);
+    else if (vertex.op.type() == InstallOperation_Type_ZSTD_DIFF)
+      vertex.op.set_type(InstallOperation_Type_SOURCE_ZSTD_DIFF);
+    for (const Extent& extent : vertex.op.dst_extents()) {
+      if (extent.start_block() != kSparseHole)
+        unwritten.SubtractExtent(extent);
+    }
+  }
+
+  vector<vector<Extent>> chunks = graph_utils::SplitExtents(
+      unwritten.GetExtentsForBlockCount(unwritten.blocks()),
+      kUnwrittenChunkBlocks);
+  LOG(INFO) << "Copying " << unwritten.blocks() << " unchanged blocks in "
+            << chunks.size() << " operations";
+  for (uint64_t i = 0; i < chunks.size(); i++) {
+    graph->resize(graph->size() + 1);
+    Vertex* vertex = &graph->back();
+    vertex->file_name = StringPrintf("<unchanged-%" PRIu64 ">", i);
+    vertex->op.set_type(InstallOperation_Type_SOURCE_COPY);
+    StoreExtents(chunks[i], vertex->op.mutable_src_extents());
+    StoreExtents(chunks[i], vertex->op.mutable_dst_extents());
+  }
+
+  final_order->clear();
+  for (Vertex::Index i = 0; i < graph->size(); i++)
+    final_order->push_back(i);
+}
+
 bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     const string& old_root,
     const string& old_image,
@@ -1316,14 +1792,32 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     const string& old_kernel,
     const string& new_kernel,
     const string& pcr_policy,
+    bool source_operations,
+    bool pack_extents,
+    uint32_t block_size,
     const string& output_path,
     const string& private_key_path,
     uint64_t* metadata_size) {
+  if (!DeltaMetadata::IsValidBlockSize(block_size) ||
+      kFullUpdateChunkSize % block_size != 0) {
+    LOG(ERROR) << "Invalid block size " << block_size;
+    return false;
+  }
+  // Deltas work on filesystem blocks, only full updates can use larger ones.
+  if (!old_image.empty() && block_size != kBlockSize) {
+    LOG(ERROR) << "Deltas must use a block size of " << kBlockSize;
+    return false;
+  }
+  if (!old_image.empty() && old_root.empty() != new_root.empty()) {
+    LOG(ERROR) << "Either both or neither of the images must be mounted";
+    return false;
+  }
+
   off_t new_image_size = 0, old_image_size = 0;
   TEST_AND_RETURN_FALSE(utils::GetDeviceSize(new_image, &new_image_size));
-  if (new_image_size % kBlockSize != 0) {
+  if (new_image_size % block_size != 0) {
     LOG(ERROR) << "Size of " << new_image << " (" << new_image_size
-      << ") is not a multiple of " << kBlockSize;
+      << ") is not a multiple of " << block_size;
     return false;
   }
 
@@ -1349,13 +1843,8 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     TEST_AND_RETURN_FALSE(utils::FileSize(pcr_policy) > 0);
   }
 
-  vector<Block> blocks(new_image_size / kBlockSize);
-  LOG(INFO) << "Invalid block index: " << Vertex::kInvalidIndex;
-  LOG(INFO) << "Block count: " << blocks.size();
-  for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-    CHECK(blocks[i].reader == Vertex::kInvalidIndex);
-    CHECK(blocks[i].writer == Vertex::kInvalidIndex);
-  }
+  BlockOwners blocks(new_image_size / kBlockSize);
+  LOG(INFO) << "Block count: " << blocks.block_count();
   Graph graph;
   CheckGraph(graph);
 
@@ -1379,12 +1868,21 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     if (!old_image.empty()) {
       // Delta update
 
-      TEST_AND_RETURN_FALSE(DeltaReadFiles(&graph,
-                                           &blocks,
-                                           old_root,
-                                           new_root,
-                                           fd,
-                                           &data_file_size));
+      if (new_root.empty()) {
+        TEST_AND_RETURN_FALSE(DeltaReadImageFiles(&graph,
+                                                  &blocks,
+                                                  old_image,
+                                                  new_image,
+                                                  fd,
+                                                  &data_file_size));
+      } else {
+        TEST_AND_RETURN_FALSE(DeltaReadFiles(&graph,
+                                             &blocks,
+                                             old_root,
+                                             new_root,
+                                             fd,
+                                             &data_file_size));
+      }
       LOG(INFO) << "done reading normal files";
       CheckGraph(graph);
 
@@ -1398,16 +1896,18 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
       LOG(INFO) << "Done metadata processing";
       CheckGraph(graph);
 
-      graph.resize(graph.size() + 1);
       TEST_AND_RETURN_FALSE(ReadUnwrittenBlocks(blocks,
                                                 fd,
                                                 &data_file_size,
+                                                old_image,
                                                 new_image,
-                                                &graph.back()));
+                                                kUnwrittenChunkBlocks,
+                                                &graph));
 
       if (!new_kernel.empty()) {
         TEST_AND_RETURN_FALSE(DeltaCompressFile(old_kernel,
                                                 new_kernel,
+                                                block_size,
                                                 &kernel_ops,
                                                 fd,
                                                 &data_file_size));
@@ -1416,6 +1916,7 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
       if (!pcr_policy.empty()) {
         TEST_AND_RETURN_FALSE(DeltaCompressFile("",
                                                 pcr_policy,
+                                                block_size,
                                                 &pcr_policy_ops,
                                                 fd,
                                                 &data_file_size));
@@ -1423,18 +1924,24 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
 
       CheckGraph(graph);
 
-      LOG(INFO) << "Creating edges...";
-      CreateEdges(&graph, blocks);
-      LOG(INFO) << "Done creating edges";
-      CheckGraph(graph);
-
-      TEST_AND_RETURN_FALSE(ConvertGraphToDag(&graph,
-                                              new_root,
-                                              fd,
-                                              &data_file_size,
-                                              &final_order));
+      if (source_operations) {
+        ConvertToSourceOperations(&graph, blocks.block_count(), &final_order);
+      } else {
+        LOG(INFO) << "Creating edges...";
+        CreateEdges(&graph, blocks);
+        LOG(INFO) << "Done creating edges";
+        CheckGraph(graph);
+
+        TEST_AND_RETURN_FALSE(ConvertGraphToDag(&graph,
+                                                (new_root.empty() ?
+                                                 new_image :
+                                                 new_root),
+                                                fd,
+                                                &data_file_size,
+                                                &final_order));
+      }
     } else {
-      FullUpdateGenerator generator(fd, kFullUpdateChunkSize, kBlockSize);
+      FullUpdateGenerator generator(fd, kFullUpdateChunkSize, block_size);
 
       TEST_AND_RETURN_FALSE(generator.Partition(new_image,
                                                 new_image_size,
@@ -1460,7 +1967,7 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
                               &manifest,
                               &op_name_map);
   CheckGraph(graph);
-  manifest.set_block_size(kBlockSize);
+  manifest.set_block_size(block_size);
 
   if (!new_kernel.empty()) {
     TEST_AND_RETURN_FALSE(AddProcedureToManifest(old_kernel,
@@ -1515,12 +2022,25 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
 
   // Signatures appear at the end of the blobs. Note the offset in the
   // manifest
+  uint64_t data_size = next_blob_offset;
   if (!private_key_path.empty()) {
     uint64_t signature_blob_length = 0;
     TEST_AND_RETURN_FALSE(
         PayloadSigner::SignatureBlobLength(vector<string>(1, private_key_path),
                                            &signature_blob_length));
     AddSignatureOp(next_blob_offset, signature_blob_length, manifest);
+    data_size += signature_blob_length;
+  }
+  const uint64_t version = DeltaMetadata::VersionForDataSize(data_size);
+  LOG(INFO) << "Payload version: " << version;
+
+  if (pack_extents) {
+    for (InstallOperation& op : *manifest.mutable_partition_operations())
+      packed_extents::Pack(&op);
+    for (InstallProcedure& proc : *manifest.mutable_procedures()) {
+      for (InstallOperation& op : *proc.mutable_operations())
+        packed_extents::Pack(&op);
+    }
   }
 
   TEST_AND_RETURN_FALSE(InitializePartitionInfos(old_image,
@@ -1543,7 +2063,7 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
   TEST_AND_RETURN_FALSE(writer.Write(kDeltaMagic, strlen(kDeltaMagic)));
 
   // Write version number
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, kDeltaVersion));
+  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, version));
 
   // Write protobuf length
   TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer,
@@ -1618,18 +2138,52 @@ bool DeltaDiffGenerator::BsdiffFiles(const string& old_file,
   return true;
 }
 
-// The |blocks| vector contains a reader and writer for each block on the
-// filesystem that's being in-place updated. We populate the reader/writer
-// fields of |blocks| by calling this function.
-// For each block in |operation| that is read or written, find that block
-// in |blocks| and set the reader/writer field to the vertex passed.
+bool DeltaDiffGenerator::BsdiffData(const vector<char>& old_data,
+                                    const vector<char>& new_data,
+                                    vector<char>* out) {
+  const string kTempFileTemplate("/tmp/CrAU_temp_data.XXXXXX");
+
+  // Write the buffers to temporary files
+  int old_fd;
+  string temp_old_file_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile(kTempFileTemplate, &temp_old_file_path, &old_fd));
+  TEST_AND_RETURN_FALSE(old_fd >= 0);
+  ScopedPathUnlinker temp_old_file_path_unlinker(temp_old_file_path);
+  files::ScopedFD old_fd_closer(old_fd);
+  TEST_AND_RETURN_FALSE(utils::WriteAll(old_fd,
+                                        &old_data[0],
+                                        old_data.size()));
+
+  int new_fd;
+  string temp_new_file_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile(kTempFileTemplate, &temp_new_file_path, &new_fd));
+  TEST_AND_RETURN_FALSE(new_fd >= 0);
+  ScopedPathUnlinker temp_new_file_path_unlinker(temp_new_file_path);
+  files::ScopedFD new_fd_closer(new_fd);
+  TEST_AND_RETURN_FALSE(utils::WriteAll(new_fd,
+                                        &new_data[0],
+                                        new_data.size()));
+
+  // Perform bsdiff on these files
+  TEST_AND_RETURN_FALSE(BsdiffFiles(temp_old_file_path,
+                                    temp_new_file_path,
+                                    out));
+  return true;
+}
+
+// |blocks| records a reader and writer for each block on the filesystem
+// that's being in-place updated. We populate it by calling this function.
+// Every extent in |operation| that is read or written is recorded in
+// |blocks| as read or written by the vertex passed.
 // |graph| is not strictly necessary, but useful for printing out
 // error messages.
-bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
+bool DeltaDiffGenerator::AddInstallOpToBlockOwners(
     const InstallOperation& operation,
     const Graph& graph,
     Vertex::Index vertex,
-    vector<Block>* blocks) {
+    BlockOwners* blocks) {
   // See if this is already present.
   TEST_AND_RETURN_FALSE(operation.dst_extents_size() > 0);
 
@@ -1641,26 +2195,21 @@ bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
     const char* past_participle = (field == READER) ? "read" : "written";
     const google::protobuf::RepeatedPtrField<Extent>& extents =
         (field == READER) ? operation.src_extents() : operation.dst_extents();
-    Vertex::Index Block::*access_type =
-        (field == READER) ? &Block::reader : &Block::writer;
+    bool (BlockOwners::*add_owner)(const Extent&, Vertex::Index,
+                                   uint64_t*, Vertex::Index*) =
+        (field == READER) ? &BlockOwners::AddReader : &BlockOwners::AddWriter;
 
     for (int i = 0; i < extents_size; i++) {
       const Extent& extent = extents.Get(i);
-      if (extent.start_block() == kSparseHole) {
-        // Hole in sparse file. skip
-        continue;
-      }
-      for (uint64_t block = extent.start_block();
-           block < (extent.start_block() + extent.num_blocks()); block++) {
-        if ((*blocks)[block].*access_type != Vertex::kInvalidIndex) {
-          LOG(FATAL) << "Block " << block << " is already "
-                     << past_participle << " by "
-                     << (*blocks)[block].*access_type << "("
-                     << graph[(*blocks)[block].*access_type].file_name
-                     << ") and also " << vertex << "("
-                     << graph[vertex].file_name << ")";
-        }
-        (*blocks)[block].*access_type = vertex;
+      uint64_t block = 0;
+      Vertex::Index owner = Vertex::kInvalidIndex;
+      if (!(blocks->*add_owner)(extent, vertex, &block, &owner)) {
+        LOG(FATAL) << "Block " << block << " is already "
+                   << past_participle << " by "
+                   << owner << "("
+                   << graph[owner].file_name
+                   << ") and also " << vertex << "("
+                   << graph[vertex].file_name << ")";
       }
     }
   }
@@ -1684,8 +2233,9 @@ void DeltaDiffGenerator::AddSignatureOp(uint64_t signature_blob_offset,
   Extent* dummy_extent = dummy_op->add_dst_extents();
   // Tell the dummy op to write this data to a big sparse hole
   dummy_extent->set_start_block(kSparseHole);
-  dummy_extent->set_num_blocks((signature_blob_length + kBlockSize - 1) /
-                               kBlockSize);
+  dummy_extent->set_num_blocks(
+      (signature_blob_length + manifest.block_size() - 1) /
+      manifest.block_size());
 }
 
 const char* const kBsdiffPath = "bsdiff";
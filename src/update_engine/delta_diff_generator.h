@@ -9,15 +9,15 @@
 #include <vector>
 
 #include "macros.h"
+#include "update_engine/block_owners.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/update_metadata.pb.h"
 
 // There is one function in DeltaDiffGenerator of importance to users
-// of the class: GenerateDeltaUpdateFile(). Before calling it,
-// the old and new images must be mounted. Call GenerateDeltaUpdateFile()
-// with both the mount-points of the images in addition to the paths of
-// the images (both old and new). A delta from old to new will be
-// generated and stored in output_path.
+// of the class: GenerateDeltaUpdateFile(). Call it with the paths of the
+// images (both old and new), and either the mount-points of both images or
+// neither, in which case the files are read from the ext2 images directly.
+// A delta from old to new will be generated and stored in output_path.
 
 namespace chromeos_update_engine {
 
@@ -39,27 +39,21 @@ struct CutEdgeVertexes {
 
 class DeltaDiffGenerator {
  public:
-  // Represents a disk block on the install partition.
-  struct Block {
-    // During install, each block on the install partition will be written
-    // and some may be read (in all likelihood, many will be read).
-    // The reading and writing will be performed by InstallOperations,
-    // each of which has a corresponding vertex in a graph.
-    // A Block object tells which vertex will read or write this block
-    // at install time.
-    // Generally, there will be a vector of Block objects whose length
-    // is the number of blocks on the install partition.
-    Block() : reader(Vertex::kInvalidIndex), writer(Vertex::kInvalidIndex) {}
-    Vertex::Index reader;
-    Vertex::Index writer;
-  };
-
   // This is the only function that external users of the class should call.
   // old_image and new_image are paths to two image files. They should be
-  // mounted read-only at paths old_root and new_root respectively.
+  // mounted read-only at paths old_root and new_root respectively, or both
+  // roots left empty to read the files of the images without mounting them.
   // {old,new}_kernel are paths to the old and new kernel images.
   // private_key_path points to a private key used to sign the update.
   // Pass empty string to not sign the update.
+  // If source_operations is true, a delta reads the old partition with
+  // SOURCE_COPY and SOURCE_BSDIFF operations instead of updating a copy of
+  // it in place, which older clients don't support. If pack_extents is
+  // true, the extents of the operations are packed, see packed_extents.h,
+  // which older clients don't support either.
+  // block_size is the unit of the extents in the payload. Full updates may
+  // use any power of two that divides their 1 MiB chunks, deltas have to use
+  // the filesystem's 4096 bytes.
   // output_path is the filename where the delta update should be written.
   // Returns true on success. Also writes the size of the metadata into
   // |metadata_size|.
@@ -70,6 +64,9 @@ class DeltaDiffGenerator {
                                       const std::string& old_kernel,
                                       const std::string& new_kernel,
                                       const std::string& pcr_policy,
+                                      bool source_operations,
+                                      bool pack_extents,
+                                      uint32_t block_size,
                                       const std::string& output_path,
                                       const std::string& private_key_path,
                                       uint64_t* metadata_size);
@@ -81,7 +78,8 @@ class DeltaDiffGenerator {
   // and finding temp space to resolve broken edges.
   // The final order of the nodes is given in |final_order|
   // Some files may need to be reread from disk, thus |fd| and
-  // |data_file_size| are be passed.
+  // |data_file_size| are be passed. |new_root| is where the new image is
+  // mounted, or the new image itself if the files were read from it.
   // Returns true on success.
   static bool ConvertGraphToDag(Graph* graph,
                                 const std::string& new_root,
@@ -89,6 +87,30 @@ class DeltaDiffGenerator {
                                 off_t* data_file_size,
                                 std::vector<Vertex::Index>* final_order);
 
+  // Takes a graph of in-place operations for a partition of |block_count|
+  // blocks and makes them read the old partition instead: MOVE becomes
+  // SOURCE_COPY and BSDIFF becomes SOURCE_BSDIFF, and SOURCE_COPY operations
+  // are added for the blocks no operation writes, as those are unchanged.
+  // Nothing is overwritten before it's read, so there are no cycles to
+  // break and any order will do; it's given in |final_order|.
+  static void ConvertToSourceOperations(
+      Graph* graph,
+      uint64_t block_count,
+      std::vector<Vertex::Index>* final_order);
+
+  // For each regular file within new_root, creates a node in the graph,
+  // determines the best way to compress it (REPLACE, REPLACE_BZ, MOVE,
+  // BSDIFF) against the file at the same path in old_root, or else the
+  // removed old file most similar to it, and writes any necessary data to
+  // the end of data_fd. Records the blocks of the operations in |blocks| if
+  // it's non-NULL. Returns true on success.
+  static bool DeltaReadFiles(Graph* graph,
+                             BlockOwners* blocks,
+                             const std::string& old_root,
+                             const std::string& new_root,
+                             int data_fd,
+                             off_t* data_file_size);
+
   // Reads old_filename (if it exists) and a new_filename and determines
   // the smallest way to encode this file for the diff. It stores
   // necessary data in out_data and fills in out_op.
@@ -96,13 +118,28 @@ class DeltaDiffGenerator {
   // operation. If there is a change, or the old file doesn't exist,
   // the smallest of REPLACE, REPLACE_BZ, or BSDIFF wins.
   // new_filename must contain at least one byte.
+  // Without gather_extents, the extents of out_op cover the files from
+  // block 0, counted in block_size blocks; with it they're the files'
+  // filesystem blocks, so block_size must be the filesystem's.
   // Returns true on success.
   static bool ReadFileToDiff(const std::string& old_filename,
                              const std::string& new_filename,
                              bool bsdiff_allowed,
                              std::vector<char>* out_data,
                              InstallOperation* out_op,
-                             bool gather_extents);
+                             bool gather_extents,
+                             uint32_t block_size);
+
+  // Determines the smallest way to encode a file whose contents change
+  // from |old_data| to |new_data|, like ReadFileToDiff. An empty
+  // |old_data| means there's no old file. Stores the necessary data in
+  // |out_data| and the operation type in |out_type|. Returns true on
+  // success.
+  static bool DiffData(const std::vector<char>& old_data,
+                       const std::vector<char>& new_data,
+                       bool bsdiff_allowed,
+                       std::vector<char>* out_data,
+                       InstallOperation_Type* out_type);
 
   // Modifies blocks read by 'op' so that any blocks referred to by
   // 'remove_extents' are replaced with blocks from 'replace_extents'.
@@ -127,6 +164,25 @@ class DeltaDiffGenerator {
                        const std::set<Edge>& edges,
                        std::vector<CutEdgeVertexes>* out_cuts);
 
+  // Reads the blocks of |new_image| that are not yet written by any
+  // operation in |blocks| (non-file-data such as filesystem metadata when
+  // the ext2 structures changed) and adds operations to |graph| that
+  // write them. The blocks are split into chunks of at most
+  // |chunk_blocks| blocks which are encoded in parallel, each becoming
+  // its own operation so the client never buffers more than one chunk.
+  // A chunk that lies entirely within |old_image| is skipped if unchanged
+  // and otherwise the smallest of REPLACE, REPLACE_BZ or BSDIFF against
+  // the same blocks; other chunks are REPLACE or REPLACE_BZ. Pass an empty
+  // |old_image| to never diff. Data blobs are appended to |blobs_fd| and
+  // |blobs_length| is updated. Returns true on success.
+  static bool ReadUnwrittenBlocks(const BlockOwners& blocks,
+                                  int blobs_fd,
+                                  off_t* blobs_length,
+                                  const std::string& old_image,
+                                  const std::string& new_image,
+                                  uint64_t chunk_blocks,
+                                  Graph* graph);
+
   // Stores all Extents in 'extents' into 'out'.
   static void StoreExtents(const std::vector<Extent>& extents,
                            google::protobuf::RepeatedPtrField<Extent>* out);
@@ -134,7 +190,7 @@ class DeltaDiffGenerator {
   // Creates all the edges for the graph. Writers of a block point to
   // readers of the same block. This is because for an edge A->B, B
   // must complete before A executes.
-  static void CreateEdges(Graph* graph, const std::vector<Block>& blocks);
+  static void CreateEdges(Graph* graph, const BlockOwners& blocks);
 
   // Given a topologically sorted graph |op_indexes| and |graph|, alters
   // |op_indexes| to move all the full operations to the end of the vector.
@@ -178,7 +234,8 @@ class DeltaDiffGenerator {
   // For example, say we have A->B->A. It would first be cut to form:
   // A->B->N<-A, where N copies blocks to temp space. If there are no
   // temp blocks, this function can be called to convert it to the form:
-  // A->B. Now, A is a full operation.
+  // A->B. Now, A is a full operation. |new_root| is as in
+  // ConvertGraphToDag().
   static bool ConvertCutToFullOp(Graph* graph,
                                  const CutEdgeVertexes& cut,
                                  const std::string& new_root,
@@ -221,18 +278,23 @@ class DeltaDiffGenerator {
                           const std::string& new_file,
                           std::vector<char>* out);
 
-  // The |blocks| vector contains a reader and writer for each block on the
-  // filesystem that's being in-place updated. We populate the reader/writer
-  // fields of |blocks| by calling this function.
-  // For each block in |operation| that is read or written, find that block
-  // in |blocks| and set the reader/writer field to the vertex passed.
+  // Like BsdiffFiles, but diffs two in-memory buffers by writing them to
+  // temporary files first.
+  static bool BsdiffData(const std::vector<char>& old_data,
+                         const std::vector<char>& new_data,
+                         std::vector<char>* out);
+
+  // |blocks| records a reader and writer for each block on the
+  // filesystem that's being in-place updated. We populate it by calling
+  // this function: every extent in |operation| that is read or written is
+  // recorded in |blocks| as read or written by the vertex passed.
   // |graph| is not strictly necessary, but useful for printing out
   // error messages.
-  static bool AddInstallOpToBlocksVector(
+  static bool AddInstallOpToBlockOwners(
       const InstallOperation& operation,
       const Graph& graph,
       Vertex::Index vertex,
-      std::vector<DeltaDiffGenerator::Block>* blocks);
+      BlockOwners* blocks);
 
   // Adds to |manifest| a dummy operation that points to a signature blob
   // located at the specified offset/length.
@@ -7,6 +7,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
 #include <set>
 #include <sstream>
 #include <string>
@@ -17,18 +21,24 @@
 #include <gtest/gtest.h>
 
 #include "files/scoped_file.h"
+#include "update_engine/block_owners.h"
+#include "update_engine/bzip.h"
 #include "update_engine/cycle_breaker.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/delta_performer.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/topological_sort.h"
 #include "update_engine/utils.h"
+#include "update_engine/zstd.h"
 
 using std::make_pair;
+using std::map;
+using std::min;
 using std::set;
 using std::string;
 using std::stringstream;
@@ -36,7 +46,6 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 
 namespace {
 int64_t BlocksInExtents(
@@ -47,6 +56,20 @@ int64_t BlocksInExtents(
   }
   return ret;
 }
+
+void AddReader(BlockOwners* blocks, uint64_t block, Vertex::Index vertex) {
+  uint64_t conflict_block;
+  Vertex::Index conflict_vertex;
+  EXPECT_TRUE(blocks->AddReader(ExtentForRange(block, 1), vertex,
+                                &conflict_block, &conflict_vertex));
+}
+
+void AddWriter(BlockOwners* blocks, uint64_t block, Vertex::Index vertex) {
+  uint64_t conflict_block;
+  Vertex::Index conflict_vertex;
+  EXPECT_TRUE(blocks->AddWriter(ExtentForRange(block, 1), vertex,
+                                &conflict_block, &conflict_vertex));
+}
 }  // namespace {}
 
 class DeltaDiffGeneratorTest : public ::testing::Test {
@@ -73,7 +96,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootMoveSmallTest) {
                                                  true, // bsdiff_allowed
                                                  &data,
                                                  &op,
-                                                 true));
+                                                 true,
+                                                 4096));
   EXPECT_TRUE(data.empty());
 
   EXPECT_TRUE(op.has_type());
@@ -103,7 +127,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffSmallTest) {
                                                  true, // bsdiff_allowed
                                                  &data,
                                                  &op,
-                                                 true));
+                                                 true,
+                                                 4096));
   EXPECT_FALSE(data.empty());
 
   EXPECT_TRUE(op.has_type());
@@ -134,7 +159,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNotAllowedTest) {
                                                  false, // bsdiff_allowed
                                                  &data,
                                                  &op,
-                                                 true));
+                                                 true,
+                                                 4096));
   EXPECT_FALSE(data.empty());
 
   // The point of this test is that we don't use BSDIFF the way the above
@@ -158,7 +184,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNotAllowedMoveTest) {
                                                  false, // bsdiff_allowed
                                                  &data,
                                                  &op,
-                                                 true));
+                                                 true,
+                                                 4096));
   EXPECT_TRUE(data.empty());
 
   // The point of this test is that we can still use a MOVE for a file
@@ -183,7 +210,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootReplaceSmallTest) {
                                                    true, // bsdiff_allowed
                                                    &data,
                                                    &op,
-                                                   true));
+                                                   true,
+                                                   4096));
     EXPECT_FALSE(data.empty());
 
     EXPECT_TRUE(op.has_type());
@@ -215,7 +243,8 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNoGatherExtentsSmallTest) {
                                                  true, // bsdiff_allowed
                                                  &data,
                                                  &op,
-                                                 false));
+                                                 false,
+                                                 4096));
   EXPECT_FALSE(data.empty());
 
   EXPECT_TRUE(op.has_type());
@@ -232,6 +261,159 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootBsdiffNoGatherExtentsSmallTest) {
   EXPECT_EQ(sizeof(kRandomString), op.dst_length());
 }
 
+TEST_F(DeltaDiffGeneratorTest, ZstdDiffNoGatherExtentsTest) {
+  // A few changed bytes in data that doesn't compress.
+  vector<char> old_data(4 * 4096 + 100);
+  for (size_t i = 0; i < old_data.size(); i++)
+    old_data[i] = kRandomString[(i * 7 + i / sizeof(kRandomString)) %
+                                sizeof(kRandomString)];
+  vector<char> new_data = old_data;
+  new_data[5000] ^= 1;
+  new_data.insert(new_data.begin() + 9000, 'x');
+  EXPECT_TRUE(WriteFileVector(old_path(), old_data));
+  EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+  vector<char> data;
+  InstallOperation op;
+
+  // Older clients don't understand ZSTD_DIFF.
+  EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                                                 new_path(),
+                                                 false, // bsdiff_allowed
+                                                 &data,
+                                                 &op,
+                                                 false,
+                                                 4096));
+  EXPECT_NE(InstallOperation_Type_ZSTD_DIFF, op.type());
+
+  SetUseZstdDiffOperations(true);
+  EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                                                 new_path(),
+                                                 false, // bsdiff_allowed
+                                                 &data,
+                                                 &op,
+                                                 false,
+                                                 4096));
+  SetUseZstdDiffOperations(false);
+  EXPECT_EQ(InstallOperation_Type_ZSTD_DIFF, op.type());
+  EXPECT_LT(data.size(), 200);
+  EXPECT_EQ(1, op.src_extents_size());
+  EXPECT_EQ(0, op.src_extents().Get(0).start_block());
+  EXPECT_EQ(5, op.src_extents().Get(0).num_blocks());
+  EXPECT_EQ(old_data.size(), op.src_length());
+  EXPECT_EQ(1, op.dst_extents_size());
+  EXPECT_EQ(new_data.size(), op.dst_length());
+
+  vector<char> patched;
+  EXPECT_TRUE(ZstdPatch(old_data, data, &patched));
+  EXPECT_TRUE(patched == new_data);
+
+  // The extents are counted in the payload's blocks.
+  op.Clear();
+  SetUseZstdDiffOperations(true);
+  EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                                                 new_path(),
+                                                 false, // bsdiff_allowed
+                                                 &data,
+                                                 &op,
+                                                 false,
+                                                 1024));
+  SetUseZstdDiffOperations(false);
+  ASSERT_EQ(1, op.src_extents_size());
+  EXPECT_EQ(17, op.src_extents().Get(0).num_blocks());
+  ASSERT_EQ(1, op.dst_extents_size());
+  EXPECT_EQ(17, op.dst_extents().Get(0).num_blocks());
+}
+
+TEST_F(DeltaDiffGeneratorTest, RunAsRootDeltaReadRenamedFilesTest) {
+  string old_root, new_root;
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenamedFilesTestOld.XXXXXX",
+                                       &old_root));
+  ScopedDirRemover old_root_remover(old_root);
+  ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenamedFilesTestNew.XXXXXX",
+                                       &new_root));
+  ScopedDirRemover new_root_remover(new_root);
+
+  // One library is renamed as is, the other with a few bytes changed.
+  vector<char> same(3 * 4096);
+  FillWithData(&same);
+  vector<char> old_changed(4 * 4096);
+  FillWithData(&old_changed);
+  for (size_t i = 0; i < old_changed.size(); i++)
+    old_changed[i] ^= 0x55;
+  vector<char> new_changed = old_changed;
+  new_changed[100] ^= 1;
+  new_changed[5000] ^= 1;
+  EXPECT_TRUE(WriteFileVector(old_root + "/libsame.so.1", same));
+  ScopedPathUnlinker old_same_unlinker(old_root + "/libsame.so.1");
+  EXPECT_TRUE(WriteFileVector(old_root + "/libchanged.so.1", old_changed));
+  ScopedPathUnlinker old_changed_unlinker(old_root + "/libchanged.so.1");
+  EXPECT_TRUE(WriteFileVector(new_root + "/libsame.so.2", same));
+  ScopedPathUnlinker new_same_unlinker(new_root + "/libsame.so.2");
+  EXPECT_TRUE(WriteFileVector(new_root + "/libchanged.so.2", new_changed));
+  ScopedPathUnlinker new_changed_unlinker(new_root + "/libchanged.so.2");
+
+  string data_path;
+  int fd;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/RenamedFilesTestData.XXXXXX",
+                                  &data_path,
+                                  &fd));
+  ScopedPathUnlinker data_path_unlinker(data_path);
+  files::ScopedFD fd_closer(fd);
+  off_t data_file_size = 0;
+  Graph graph;
+  EXPECT_TRUE(DeltaDiffGenerator::DeltaReadFiles(&graph,
+                                                 NULL,
+                                                 old_root,
+                                                 new_root,
+                                                 fd,
+                                                 &data_file_size));
+
+  // Each is diffed against its old path, which the source size tells.
+  ASSERT_EQ(2, graph.size());
+  for (const Vertex& vertex : graph) {
+    if (vertex.file_name == "/libsame.so.2") {
+      EXPECT_EQ(InstallOperation_Type_MOVE, vertex.op.type());
+      EXPECT_EQ(same.size(), vertex.op.src_length());
+      EXPECT_EQ(3, BlocksInExtents(vertex.op.src_extents()));
+    } else {
+      EXPECT_EQ("/libchanged.so.2", vertex.file_name);
+      EXPECT_EQ(InstallOperation_Type_BSDIFF, vertex.op.type());
+      EXPECT_EQ(old_changed.size(), vertex.op.src_length());
+      EXPECT_EQ(4, BlocksInExtents(vertex.op.src_extents()));
+    }
+  }
+}
+
+TEST_F(DeltaDiffGeneratorTest, DiffDataTest) {
+  vector<char> old_data(4 * 4096);
+  for (size_t i = 0; i < old_data.size(); i++)
+    old_data[i] = kRandomString[(i * 7 + i / sizeof(kRandomString)) %
+                                sizeof(kRandomString)];
+  vector<char> new_data = old_data;
+  vector<char> data;
+  InstallOperation_Type type;
+
+  EXPECT_TRUE(DeltaDiffGenerator::DiffData(old_data, new_data, false, &data,
+                                           &type));
+  EXPECT_EQ(InstallOperation_Type_MOVE, type);
+  EXPECT_TRUE(data.empty());
+
+  // With no old data, the new data is sent in full.
+  new_data[5000] ^= 1;
+  EXPECT_TRUE(DeltaDiffGenerator::DiffData(vector<char>(), new_data, false,
+                                           &data, &type));
+  EXPECT_TRUE(IsReplaceType(type));
+
+  SetUseZstdDiffOperations(true);
+  EXPECT_TRUE(DeltaDiffGenerator::DiffData(old_data, new_data, false, &data,
+                                           &type));
+  SetUseZstdDiffOperations(false);
+  EXPECT_EQ(InstallOperation_Type_ZSTD_DIFF, type);
+  vector<char> patched;
+  EXPECT_TRUE(ZstdPatch(old_data, data, &patched));
+  EXPECT_TRUE(patched == new_data);
+}
+
 namespace {
 void AppendExtent(vector<Extent>* vect, uint64_t start, uint64_t length) {
   vect->resize(vect->size() + 1);
@@ -280,9 +462,148 @@ TEST_F(DeltaDiffGeneratorTest, SubstituteBlocksTest) {
   EXPECT_EQ(2, op.src_extents(6).num_blocks());
 }
 
+namespace {
+// Per-block reference for SubstituteBlocks: renames every block of
+// |extents| found in |conversion| and merges the result.
+vector<Extent> SubstituteBlocksReference(
+    const vector<Extent>& extents,
+    const map<uint64_t, uint64_t>& conversion) {
+  vector<Extent> ret;
+  for (const Extent& extent : extents) {
+    for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+      uint64_t block = extent.start_block() == kSparseHole ?
+          kSparseHole : extent.start_block() + i;
+      map<uint64_t, uint64_t>::const_iterator it = conversion.find(block);
+      graph_utils::AppendBlockToExtents(
+          &ret, it == conversion.end() ? block : it->second);
+    }
+  }
+  return ret;
+}
+
+// Returns random extents of up to |max_length| blocks below |block_count|,
+// with roughly one in |sparse_ratio| of them being sparse holes.
+vector<Extent> RandomExtents(int count, uint64_t block_count,
+                             uint64_t max_length, int sparse_ratio) {
+  vector<Extent> ret;
+  for (int i = 0; i < count; i++) {
+    uint64_t length = 1 + rand() % max_length;
+    uint64_t start = rand() % sparse_ratio == 0 ?
+        kSparseHole : rand() % (block_count - length);
+    ret.push_back(ExtentForRange(start, length));
+  }
+  return ret;
+}
+
+vector<Extent> ToVector(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  return vector<Extent>(extents.begin(), extents.end());
+}
+
+void ExpectExtentsEqual(const vector<Extent>& expected,
+                        const vector<Extent>& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (vector<Extent>::size_type i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].start_block(), actual[i].start_block()) << i;
+    EXPECT_EQ(expected[i].num_blocks(), actual[i].num_blocks()) << i;
+  }
+}
+}  // namespace {}
+
+TEST_F(DeltaDiffGeneratorTest, SubstituteBlocksRandomizedTest) {
+  const uint64_t kBlockCount = 1 << 16;
+  srand(29);
+  for (int round = 0; round < 20; round++) {
+    // Removed blocks must be distinct, so carve them out of a shuffled
+    // partition of the block space.
+    vector<Extent> partition;
+    for (uint64_t block = 0; block < kBlockCount;) {
+      uint64_t length = min<uint64_t>(1 + rand() % 64, kBlockCount - block);
+      partition.push_back(ExtentForRange(block, length));
+      block += length;
+    }
+    std::random_shuffle(partition.begin(), partition.end());
+    vector<Extent> remove_extents(partition.begin(),
+                                  partition.begin() + partition.size() / 3);
+    uint64_t remove_count = graph_utils::BlocksInExtents(remove_extents);
+
+    // Replacements may overlap each other and include sparse holes.
+    vector<Extent> replace_extents;
+    while (graph_utils::BlocksInExtents(replace_extents) < remove_count) {
+      uint64_t missing =
+          remove_count - graph_utils::BlocksInExtents(replace_extents);
+      Extent extent = RandomExtents(1, kBlockCount * 2, 64, 20)[0];
+      extent.set_num_blocks(min(extent.num_blocks(), missing));
+      replace_extents.push_back(extent);
+    }
+
+    map<uint64_t, uint64_t> conversion;
+    {
+      vector<uint64_t> removed, replaced;
+      for (const Extent& extent : remove_extents) {
+        for (uint64_t i = 0; i < extent.num_blocks(); i++)
+          removed.push_back(extent.start_block() + i);
+      }
+      for (const Extent& extent : replace_extents) {
+        for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+          replaced.push_back(extent.start_block() == kSparseHole ?
+                             kSparseHole : extent.start_block() + i);
+        }
+      }
+      ASSERT_EQ(removed.size(), replaced.size());
+      for (vector<uint64_t>::size_type i = 0; i < removed.size(); i++)
+        conversion[removed[i]] = replaced[i];
+    }
+
+    Vertex vertex;
+    vector<Extent> src_extents = RandomExtents(2000, kBlockCount, 100, 10);
+    DeltaDiffGenerator::StoreExtents(src_extents,
+                                     vertex.op.mutable_src_extents());
+    vector<vector<Extent>> write_extents;
+    for (Vertex::Index i = 0; i < 5; i++) {
+      write_extents.push_back(RandomExtents(500, kBlockCount, 100, 10));
+      vertex.out_edges[i].write_extents = write_extents.back();
+    }
+
+    DeltaDiffGenerator::SubstituteBlocks(&vertex, remove_extents,
+                                         replace_extents);
+
+    ExpectExtentsEqual(SubstituteBlocksReference(src_extents, conversion),
+                       ToVector(vertex.op.src_extents()));
+    for (Vertex::Index i = 0; i < 5; i++) {
+      ExpectExtentsEqual(
+          SubstituteBlocksReference(write_extents[i], conversion),
+          vertex.out_edges[i].write_extents);
+    }
+  }
+}
+
+TEST_F(DeltaDiffGeneratorTest, DISABLED_SubstituteBlocksBenchmark) {
+  // A large fragmented file whose every other block gets moved to scratch.
+  const uint64_t kBlocks = 1 << 20;
+  vector<Extent> remove_extents, replace_extents;
+  Vertex vertex;
+  for (uint64_t block = 0; block < kBlocks; block += 2) {
+    *vertex.op.add_src_extents() = ExtentForRange(block, 1);
+    remove_extents.push_back(ExtentForRange(block, 1));
+  }
+  replace_extents.push_back(ExtentForRange(kTempBlockStart, kBlocks / 2));
+  vertex.out_edges[0].write_extents = remove_extents;
+
+  auto start = std::chrono::steady_clock::now();
+  DeltaDiffGenerator::SubstituteBlocks(&vertex, remove_extents,
+                                       replace_extents);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  ASSERT_EQ(1, vertex.op.src_extents_size());
+  EXPECT_EQ(kTempBlockStart, vertex.op.src_extents(0).start_block());
+  LOG(INFO) << "SubstituteBlocks over " << remove_extents.size()
+            << " extents: " << utils::ToString(elapsed);
+}
+
 TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
   Graph graph;
-  vector<Block> blocks(9);
+  BlockOwners blocks(9);
 
   // Create nodes in graph
   {
@@ -295,9 +616,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 7);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_src_extents());
-    blocks[3].reader = graph.size() - 1;
-    blocks[5].reader = graph.size() - 1;
-    blocks[7].reader = graph.size() - 1;
+    AddReader(&blocks, 3, graph.size() - 1);
+    AddReader(&blocks, 5, graph.size() - 1);
+    AddReader(&blocks, 7, graph.size() - 1);
 
     // Writes to blocks 1, 2, 4
     extents.clear();
@@ -306,9 +627,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 4);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[1].writer = graph.size() - 1;
-    blocks[2].writer = graph.size() - 1;
-    blocks[4].writer = graph.size() - 1;
+    AddWriter(&blocks, 1, graph.size() - 1);
+    AddWriter(&blocks, 2, graph.size() - 1);
+    AddWriter(&blocks, 4, graph.size() - 1);
   }
   {
     graph.resize(graph.size() + 1);
@@ -320,9 +641,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 4);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_src_extents());
-    blocks[1].reader = graph.size() - 1;
-    blocks[2].reader = graph.size() - 1;
-    blocks[4].reader = graph.size() - 1;
+    AddReader(&blocks, 1, graph.size() - 1);
+    AddReader(&blocks, 2, graph.size() - 1);
+    AddReader(&blocks, 4, graph.size() - 1);
 
     // Writes to blocks 3, 5, 6
     extents.clear();
@@ -331,9 +652,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
     graph_utils::AppendBlockToExtents(&extents, 6);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[3].writer = graph.size() - 1;
-    blocks[5].writer = graph.size() - 1;
-    blocks[6].writer = graph.size() - 1;
+    AddWriter(&blocks, 3, graph.size() - 1);
+    AddWriter(&blocks, 5, graph.size() - 1);
+    AddWriter(&blocks, 6, graph.size() - 1);
   }
 
   // Create edges
@@ -400,18 +721,116 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest) {
   EXPECT_TRUE(graph[1].out_edges.end() != graph[1].out_edges.find(2));
 }
 
+TEST_F(DeltaDiffGeneratorTest, ReadUnwrittenBlocksTest) {
+  const uint64_t kBlockSize = 4096;
+  // The old image is 8 blocks and the new one 10. Blocks 0-7 are unchanged
+  // and blocks 8-9 are new.
+  vector<char> old_data(8 * kBlockSize);
+  FillWithData(&old_data);
+  vector<char> new_data(old_data);
+  new_data.resize(10 * kBlockSize, 'x');
+  EXPECT_TRUE(utils::WriteFile(old_path().c_str(), &old_data[0],
+                               old_data.size()));
+  EXPECT_TRUE(utils::WriteFile(new_path().c_str(), &new_data[0],
+                               new_data.size()));
+
+  // A file operation writes blocks 2-3 and reads block 5.
+  Graph graph(1);
+  graph[0].op.set_type(InstallOperation_Type_MOVE);
+  *graph[0].op.add_src_extents() = ExtentForRange(5, 1);
+  *graph[0].op.add_dst_extents() = ExtentForRange(2, 2);
+  BlockOwners blocks(10);
+  EXPECT_TRUE(DeltaDiffGenerator::AddInstallOpToBlockOwners(graph[0].op,
+                                                            graph,
+                                                            0,
+                                                            &blocks));
+
+  string blobs_path;
+  int blobs_fd;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/ReadUnwrittenBlocksTest.XXXXXX",
+                                  &blobs_path,
+                                  &blobs_fd));
+  ScopedPathUnlinker blobs_unlinker(blobs_path);
+  files::ScopedFD blobs_fd_closer(blobs_fd);
+  off_t blobs_length = 0;
+
+  // Unwritten blocks 0-1 and 4-9 split into 4 block chunks. Without an
+  // old image, both chunks are sent in full.
+  EXPECT_TRUE(DeltaDiffGenerator::ReadUnwrittenBlocks(blocks,
+                                                      blobs_fd,
+                                                      &blobs_length,
+                                                      "",
+                                                      new_path(),
+                                                      4,
+                                                      &graph));
+  ASSERT_EQ(3, graph.size());
+  const InstallOperation& first_op = graph[1].op;
+  EXPECT_EQ(0, first_op.src_extents_size());
+  ASSERT_EQ(2, first_op.dst_extents_size());
+  EXPECT_EQ(0, first_op.dst_extents(0).start_block());
+  EXPECT_EQ(2, first_op.dst_extents(0).num_blocks());
+  EXPECT_EQ(4, first_op.dst_extents(1).start_block());
+  EXPECT_EQ(2, first_op.dst_extents(1).num_blocks());
+  EXPECT_EQ(0, first_op.data_offset());
+  // The file operation must read block 5 before it is overwritten.
+  ASSERT_EQ(1, graph[1].out_edges.size());
+  ASSERT_EQ(1, graph[1].out_edges[0].extents.size());
+  EXPECT_EQ(5, graph[1].out_edges[0].extents[0].start_block());
+  EXPECT_EQ(1, graph[1].out_edges[0].extents[0].num_blocks());
+  EXPECT_EQ(first_op.data_length(), graph[2].op.data_offset());
+  EXPECT_EQ(blobs_length,
+            first_op.data_length() + graph[2].op.data_length());
+
+  // With the old image, blocks 0-1 and 4-5 are unchanged and need no
+  // operation at all.
+  graph.resize(1);
+  off_t old_blobs_length = blobs_length;
+  EXPECT_TRUE(DeltaDiffGenerator::ReadUnwrittenBlocks(blocks,
+                                                      blobs_fd,
+                                                      &blobs_length,
+                                                      old_path(),
+                                                      new_path(),
+                                                      4,
+                                                      &graph));
+  ASSERT_EQ(2, graph.size());
+
+  // Blocks 6-9 are partly past the end of the old image, so they are
+  // still sent in full.
+  const InstallOperation& replace_op = graph[1].op;
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, replace_op.type());
+  EXPECT_EQ(0, replace_op.src_extents_size());
+  ASSERT_EQ(1, replace_op.dst_extents_size());
+  EXPECT_EQ(6, replace_op.dst_extents(0).start_block());
+  EXPECT_EQ(4, replace_op.dst_extents(0).num_blocks());
+  EXPECT_EQ(4 * kBlockSize, replace_op.dst_length());
+  EXPECT_EQ(old_blobs_length, replace_op.data_offset());
+  EXPECT_EQ(blobs_length - old_blobs_length, replace_op.data_length());
+  EXPECT_TRUE(graph[1].out_edges.empty());
+
+  vector<char> blobs;
+  EXPECT_TRUE(utils::ReadFile(blobs_path, &blobs));
+  vector<char> decompressed;
+  EXPECT_TRUE(BzipDecompress(
+      vector<char>(blobs.begin() + replace_op.data_offset(), blobs.end()),
+      &decompressed));
+  EXPECT_TRUE(decompressed == vector<char>(new_data.begin() + 6 * kBlockSize,
+                                           new_data.end()));
+}
+
 TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest) {
   string orig_blobs;
-  EXPECT_TRUE(
-      utils::MakeTempFile("ReorderBlobsTest.orig.XXXXXX", &orig_blobs, NULL));
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/ReorderBlobsTest.orig.XXXXXX",
+                                  &orig_blobs, NULL));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
 
   string orig_data = "abcd";
   EXPECT_TRUE(
       utils::WriteFile(orig_blobs.c_str(), orig_data.data(), orig_data.size()));
 
   string new_blobs;
-  EXPECT_TRUE(
-      utils::MakeTempFile("ReorderBlobsTest.new.XXXXXX", &new_blobs, NULL));
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/ReorderBlobsTest.new.XXXXXX",
+                                  &new_blobs, NULL));
+  ScopedPathUnlinker new_blobs_unlinker(new_blobs);
 
   DeltaArchiveManifest manifest;
   InstallOperation* op =
@@ -434,9 +853,42 @@ TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest) {
   EXPECT_EQ(3, manifest.partition_operations(0).data_length());
   EXPECT_EQ(3, manifest.partition_operations(1).data_offset());
   EXPECT_EQ(1, manifest.partition_operations(1).data_length());
+}
+
+TEST_F(DeltaDiffGeneratorTest, ReorderBlobsLargeOffsetTest) {
+  // The blobs are read from past 4 GiB in a sparse file.
+  const uint64_t kOffset = 5ULL * 1024 * 1024 * 1024;
+  string orig_blobs;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/ReorderBlobsTest.orig.XXXXXX",
+                                  &orig_blobs, NULL));
+  ScopedPathUnlinker orig_blobs_unlinker(orig_blobs);
+  int fd = open(orig_blobs.c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_TRUE(utils::PWriteAll(fd, "abcd", 4, kOffset));
+  close(fd);
+
+  string new_blobs;
+  ASSERT_TRUE(utils::MakeTempFile("/tmp/ReorderBlobsTest.new.XXXXXX",
+                                  &new_blobs, NULL));
+  ScopedPathUnlinker new_blobs_unlinker(new_blobs);
+
+  DeltaArchiveManifest manifest;
+  InstallOperation* op = manifest.add_partition_operations();
+  op->set_data_offset(kOffset + 1);
+  op->set_data_length(3);
+  op = manifest.add_partition_operations();
+  op->set_data_offset(kOffset);
+  op->set_data_length(1);
+
+  EXPECT_TRUE(DeltaDiffGenerator::ReorderDataBlobs(&manifest,
+                                                   orig_blobs,
+                                                   new_blobs));
 
-  unlink(orig_blobs.c_str());
-  unlink(new_blobs.c_str());
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs, &new_data));
+  EXPECT_EQ("bcda", new_data);
+  EXPECT_EQ(0, manifest.partition_operations(0).data_offset());
+  EXPECT_EQ(3, manifest.partition_operations(1).data_offset());
 }
 
 TEST_F(DeltaDiffGeneratorTest, MoveFullOpsToBackTest) {
@@ -463,6 +915,41 @@ TEST_F(DeltaDiffGeneratorTest, MoveFullOpsToBackTest) {
   EXPECT_EQ(graph[vect[3]].file_name, "C");
 }
 
+TEST_F(DeltaDiffGeneratorTest, ConvertToSourceOperationsTest) {
+  // Blocks 0 and 1 swap places, 3 and 4 are bsdiffed and 5 is replaced.
+  // Blocks 2 and 6-9 are unchanged.
+  Graph graph(3);
+  graph[0].op.set_type(InstallOperation_Type_MOVE);
+  *(graph[0].op.add_src_extents()) = ExtentForRange(0, 2);
+  *(graph[0].op.add_dst_extents()) = ExtentForRange(1, 1);
+  *(graph[0].op.add_dst_extents()) = ExtentForRange(0, 1);
+  graph[1].op.set_type(InstallOperation_Type_BSDIFF);
+  *(graph[1].op.add_src_extents()) = ExtentForRange(3, 2);
+  *(graph[1].op.add_dst_extents()) = ExtentForRange(3, 2);
+  graph[2].op.set_type(InstallOperation_Type_REPLACE_BZ);
+  *(graph[2].op.add_dst_extents()) = ExtentForRange(5, 1);
+
+  vector<Vertex::Index> final_order;
+  DeltaDiffGenerator::ConvertToSourceOperations(&graph, 10, &final_order);
+  ASSERT_EQ(4, graph.size());
+  EXPECT_EQ(InstallOperation_Type_SOURCE_COPY, graph[0].op.type());
+  EXPECT_EQ(InstallOperation_Type_SOURCE_BSDIFF, graph[1].op.type());
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, graph[2].op.type());
+  EXPECT_EQ(InstallOperation_Type_SOURCE_COPY, graph[3].op.type());
+  ASSERT_EQ(2, graph[3].op.dst_extents_size());
+  EXPECT_TRUE(ExtentForRange(2, 1) == graph[3].op.dst_extents(0));
+  EXPECT_TRUE(ExtentForRange(6, 4) == graph[3].op.dst_extents(1));
+  ASSERT_EQ(2, graph[3].op.src_extents_size());
+  EXPECT_TRUE(ExtentForRange(2, 1) == graph[3].op.src_extents(0));
+  EXPECT_TRUE(ExtentForRange(6, 4) == graph[3].op.src_extents(1));
+  // The unchanged blocks aren't a no-op when they're read from elsewhere.
+  EXPECT_FALSE(DeltaDiffGenerator::IsNoopOperation(graph[3].op));
+
+  ASSERT_EQ(4, final_order.size());
+  for (vector<Vertex::Index>::size_type i = 0; i < final_order.size(); i++)
+    EXPECT_EQ(i, final_order[i]);
+}
+
 namespace {
 
 #define OP_BSDIFF InstallOperation_Type_BSDIFF
@@ -709,7 +1196,7 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootNoSparseAsTempTest) {
 // crbug.com/238440.
 TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest) {
   Graph graph;
-  vector<Block> blocks(4);
+  BlockOwners blocks(4);
 
   // Create nodes in |graph|.
   {
@@ -734,7 +1221,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest) {
     graph_utils::AppendBlockToExtents(&extents, kSparseHole);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[0].writer = graph.size() - 1;
+    AddWriter(&blocks, 0, graph.size() - 1);
   }
   {
     graph.resize(graph.size() + 1);
@@ -757,7 +1244,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest) {
     graph_utils::AppendBlockToExtents(&extents, kSparseHole);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_src_extents());
-    blocks[2].reader = graph.size() - 1;
+    AddReader(&blocks, 2, graph.size() - 1);
 
     // Write to (1, sparse, 3).
     extents.clear();
@@ -766,8 +1253,8 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest) {
     graph_utils::AppendBlockToExtents(&extents, 3);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[1].writer = graph.size() - 1;
-    blocks[3].writer = graph.size() - 1;
+    AddWriter(&blocks, 1, graph.size() - 1);
+    AddWriter(&blocks, 3, graph.size() - 1);
   }
   {
     graph.resize(graph.size() + 1);
@@ -779,8 +1266,8 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest) {
     graph_utils::AppendBlockToExtents(&extents, 3);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_src_extents());
-    blocks[1].reader = graph.size() - 1;
-    blocks[3].reader = graph.size() - 1;
+    AddReader(&blocks, 1, graph.size() - 1);
+    AddReader(&blocks, 3, graph.size() - 1);
 
     // Write to (2, sparse, sparse).
     extents.clear();
@@ -789,7 +1276,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest) {
     graph_utils::AppendBlockToExtents(&extents, kSparseHole);
     DeltaDiffGenerator::StoreExtents(extents,
                                      graph.back().op.mutable_dst_extents());
-    blocks[2].writer = graph.size() - 1;
+    AddWriter(&blocks, 2, graph.size() - 1);
   }
 
   graph_utils::DumpGraph(graph);
@@ -7,6 +7,8 @@
 #include <endian.h>
 #include <string.h>
 
+#include <limits>
+
 #include <glog/logging.h>
 
 namespace chromeos_update_engine {
@@ -30,8 +32,17 @@ ActionExitCode DeltaMetadata::ParsePayload(
     return kActionCodeDownloadInvalidMetadataMagicString;
   }
 
-  // TODO(jaysri): Compare the version number and skip unknown manifest
-  // versions. We don't check the version at all today.
+  // Clients that predate version 2 don't check the version, which is why
+  // the generator only uses it for payloads that need it.
+  uint64_t version;
+  static_assert(sizeof(version) == kDeltaVersionSize, "version size mismatch");
+  memcpy(&version, &payload[kDeltaVersionOffset], kDeltaVersionSize);
+  version = be64toh(version);
+  if (version < kDeltaVersion32BitData || version > kDeltaVersion) {
+    LOG(ERROR) << "Unsupported payload version " << version
+               << ", expected at most " << kDeltaVersion;
+    return kActionCodeUnsupportedPayloadVersion;
+  }
 
   // Next, parse the manifest size.
   uint64_t manifest_size;
@@ -54,7 +65,22 @@ ActionExitCode DeltaMetadata::ParsePayload(
     LOG(ERROR) << "Unable to parse manifest in update file.";
     return kActionCodeDownloadManifestParseError;
   }
+  if (!IsValidBlockSize(manifest->block_size())) {
+    LOG(ERROR) << "Invalid block size " << manifest->block_size();
+    return kActionCodeDownloadManifestParseError;
+  }
   return kActionCodeSuccess;
 }
 
+uint64_t DeltaMetadata::VersionForDataSize(uint64_t data_size) {
+  return data_size > std::numeric_limits<uint32_t>::max() ?
+      kDeltaVersion : kDeltaVersion32BitData;
+}
+
+bool DeltaMetadata::IsValidBlockSize(uint64_t block_size) {
+  return block_size >= kDeltaMinBlockSize &&
+      block_size <= kDeltaMaxBlockSize &&
+      (block_size & (block_size - 1)) == 0;
+}
+
 };  // namespace chromeos_update_engine
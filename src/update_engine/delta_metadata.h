@@ -18,7 +18,15 @@ namespace chromeos_update_engine {
 // Update payload header field values and sizes.
 // See update_metadata.proto for details.
 extern const char kDeltaMagic[];
-const uint64_t kDeltaVersion = 1;
+// The newest payload version this code understands. Version 1 payloads have
+// less than 4 GiB of data, which older clients need.
+const uint64_t kDeltaVersion = 2;
+const uint64_t kDeltaVersion32BitData = 1;
+
+// The range of DeltaArchiveManifest.block_size, which must also be a power
+// of two.
+const uint32_t kDeltaMinBlockSize = 512;
+const uint32_t kDeltaMaxBlockSize = 1024 * 1024;
 
 const uint64_t kDeltaMagicSize = 4;
 const uint64_t kDeltaVersionSize = sizeof(uint64_t);
@@ -35,12 +43,23 @@ class DeltaMetadata {
   // metadata bytes (including the delta magic and metadata size fields), and
   // returns kActionCodeSuccess. Returns kActionCodeDownloadIncomplete if more
   // data is needed to parse the complete metadata. Returns
-  // kActionCodeDownloadManifestParseError if the metadata can't be parsed.
+  // kActionCodeUnsupportedPayloadVersion if the payload is newer than
+  // kDeltaVersion and kActionCodeDownloadManifestParseError if the metadata
+  // can't be parsed or has an invalid block size.
   static ActionExitCode ParsePayload(
       const std::vector<char>& payload,
       DeltaArchiveManifest* manifest,
       uint64_t* metadata_size);
 
+  // Returns the version to give a payload with |data_size| bytes of data
+  // blobs and signatures after the manifest: the oldest one that can
+  // address all of it, so that older clients can still apply it.
+  static uint64_t VersionForDataSize(uint64_t data_size);
+
+  // Returns true if |block_size| is a power of two between
+  // kDeltaMinBlockSize and kDeltaMaxBlockSize.
+  static bool IsValidBlockSize(uint64_t block_size);
+
  private:
   DISALLOW_IMPLICIT_CONSTRUCTORS(DeltaMetadata);
 };
@@ -0,0 +1,123 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <endian.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/delta_metadata.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint64_t kGiB = 1024ULL * 1024 * 1024;
+
+// Returns the metadata of a payload of |version| with |manifest|.
+vector<char> PayloadMetadata(uint64_t version,
+                             const DeltaArchiveManifest& manifest) {
+  string serialized_manifest;
+  EXPECT_TRUE(manifest.AppendToString(&serialized_manifest));
+  vector<char> payload(kDeltaMagic, kDeltaMagic + kDeltaMagicSize);
+  uint64_t version_be = htobe64(version);
+  uint64_t size_be = htobe64(serialized_manifest.size());
+  const char* version_bytes = reinterpret_cast<const char*>(&version_be);
+  const char* size_bytes = reinterpret_cast<const char*>(&size_be);
+  payload.insert(payload.end(), version_bytes,
+                 version_bytes + sizeof(version_be));
+  payload.insert(payload.end(), size_bytes, size_bytes + sizeof(size_be));
+  payload.insert(payload.end(), serialized_manifest.begin(),
+                 serialized_manifest.end());
+  return payload;
+}
+}  // namespace {}
+
+TEST(DeltaMetadataTest, VersionTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  DeltaArchiveManifest parsed;
+  uint64_t metadata_size = 0;
+
+  vector<char> payload = PayloadMetadata(kDeltaVersion32BitData, manifest);
+  EXPECT_EQ(kActionCodeSuccess,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+  EXPECT_EQ(payload.size(), metadata_size);
+
+  payload = PayloadMetadata(kDeltaVersion, manifest);
+  EXPECT_EQ(kActionCodeSuccess,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+
+  payload = PayloadMetadata(kDeltaVersion + 1, manifest);
+  EXPECT_EQ(kActionCodeUnsupportedPayloadVersion,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+  payload = PayloadMetadata(0, manifest);
+  EXPECT_EQ(kActionCodeUnsupportedPayloadVersion,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+}
+
+TEST(DeltaMetadataTest, LargeDataTest) {
+  // An operation whose data starts and ends past 4 GiB.
+  DeltaArchiveManifest manifest;
+  InstallOperation* op = manifest.add_partition_operations();
+  op->set_type(InstallOperation_Type_REPLACE);
+  op->set_data_offset(5 * kGiB);
+  op->set_data_length(4 * kGiB + 1);
+  manifest.set_signatures_offset(9 * kGiB + 1);
+  manifest.set_signatures_size(100);
+
+  vector<char> payload = PayloadMetadata(kDeltaVersion, manifest);
+  DeltaArchiveManifest parsed;
+  uint64_t metadata_size = 0;
+  ASSERT_EQ(kActionCodeSuccess,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+  ASSERT_EQ(1, parsed.partition_operations_size());
+  EXPECT_EQ(5 * kGiB, parsed.partition_operations(0).data_offset());
+  EXPECT_EQ(4 * kGiB + 1, parsed.partition_operations(0).data_length());
+  EXPECT_EQ(9 * kGiB + 1, parsed.signatures_offset());
+}
+
+TEST(DeltaMetadataTest, VersionForDataSizeTest) {
+  EXPECT_EQ(kDeltaVersion32BitData, DeltaMetadata::VersionForDataSize(0));
+  EXPECT_EQ(kDeltaVersion32BitData,
+            DeltaMetadata::VersionForDataSize(4 * kGiB - 1));
+  EXPECT_EQ(kDeltaVersion, DeltaMetadata::VersionForDataSize(4 * kGiB));
+  EXPECT_EQ(kDeltaVersion, DeltaMetadata::VersionForDataSize(9 * kGiB));
+}
+
+TEST(DeltaMetadataTest, BlockSizeTest) {
+  EXPECT_TRUE(DeltaMetadata::IsValidBlockSize(512));
+  EXPECT_TRUE(DeltaMetadata::IsValidBlockSize(4096));
+  EXPECT_TRUE(DeltaMetadata::IsValidBlockSize(64 * 1024));
+  EXPECT_TRUE(DeltaMetadata::IsValidBlockSize(1024 * 1024));
+  EXPECT_FALSE(DeltaMetadata::IsValidBlockSize(0));
+  EXPECT_FALSE(DeltaMetadata::IsValidBlockSize(256));
+  EXPECT_FALSE(DeltaMetadata::IsValidBlockSize(6144));
+  EXPECT_FALSE(DeltaMetadata::IsValidBlockSize(2 * 1024 * 1024));
+
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest parsed;
+  uint64_t metadata_size = 0;
+  manifest.set_block_size(64 * 1024);
+  vector<char> payload = PayloadMetadata(kDeltaVersion, manifest);
+  EXPECT_EQ(kActionCodeSuccess,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+  EXPECT_EQ(64 * 1024, parsed.block_size());
+
+  manifest.set_block_size(0);
+  payload = PayloadMetadata(kDeltaVersion, manifest);
+  EXPECT_EQ(kActionCodeDownloadManifestParseError,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+  manifest.set_block_size(3000);
+  payload = PayloadMetadata(kDeltaVersion, manifest);
+  EXPECT_EQ(kActionCodeDownloadManifestParseError,
+            DeltaMetadata::ParsePayload(payload, &parsed, &metadata_size));
+}
+
+}  // namespace chromeos_update_engine
@@ -22,10 +22,14 @@
 #include "update_engine/extent_writer.h"
 #include "update_engine/file_writer.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/packed_extents.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/payload_processor.h"
 #include "update_engine/prefs_interface.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/terminator.h"
+#include "update_engine/xz_extent_writer.h"
+#include "update_engine/zstd_extent_writer.h"
 
 using std::min;
 using std::string;
@@ -35,11 +39,20 @@ using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
+namespace {
+// How much of the source CopySource() copies per call.
+const uint64_t kCopySourceChunkSize = 1024 * 1024;
+}  // namespace {}
+
 // Returns true if |op| is idempotent -- i.e., if we can interrupt it and repeat
 // it safely. Returns false otherwise.
 bool DeltaPerformer::IsIdempotentOperation(
     const InstallOperation& op) {
-  if (op.src_extents_size() == 0) {
+  // Operations reading the source partition never write what they read.
+  if (op.src_extents_size() == 0 ||
+      op.type() == InstallOperation_Type_SOURCE_COPY ||
+      op.type() == InstallOperation_Type_SOURCE_BSDIFF ||
+      op.type() == InstallOperation_Type_SOURCE_ZSTD_DIFF) {
     return true;
   }
   // When in doubt, it's safe to declare an op non-idempotent. Note that we
@@ -64,6 +77,17 @@ int DeltaPerformer::Open() {
     PLOG(ERROR) << "Unable to open file " << path_;
     return -err;
   }
+  if (!source_path_.empty()) {
+    source_fd_ = open(source_path_.c_str(), O_RDONLY);
+    if (source_fd_ < 0) {
+      int err = errno;
+      PLOG(ERROR) << "Unable to open source " << source_path_;
+      close(fd_);
+      fd_ = -1;
+      return -err;
+    }
+  }
+  io_scheduler_.Start();
   return 0;
 }
 
@@ -81,6 +105,12 @@ int DeltaPerformer::Close() {
     PLOG(ERROR) << "Failed to close " << path_;
   }
   fd_ = -2;  // Set to invalid so that calls to Open() will fail.
+  if (source_fd_ >= 0) {
+    close(source_fd_);
+    source_fd_ = -1;
+  }
+  io_scheduler_.LogThroughput("Wrote " + path_);
+  io_scheduler_.Stop();
   return -err;
 }
 
@@ -89,6 +119,15 @@ ActionExitCode DeltaPerformer::PerformOperation(
     const vector<char>& data) {
   CHECK(fd_ >= 0);
 
+  if (packed_extents::IsPacked(operation)) {
+    InstallOperation unpacked = operation;
+    if (!packed_extents::Unpack(&unpacked)) {
+      LOG(ERROR) << "Unable to unpack the operation's extents";
+      return kActionCodeDownloadOperationExecutionError;
+    }
+    return PerformOperation(unpacked, data);
+  }
+
   ActionExitCode error = ValidateOperationHash(operation, data);
   if (error != kActionCodeSuccess) {
     LOG(ERROR) << "Operation hash check failed";
@@ -96,54 +135,75 @@ ActionExitCode DeltaPerformer::PerformOperation(
   }
 
   // Log every thousandth operation, and also the first and last ones
-  if (operation.type() == InstallOperation_Type_REPLACE ||
-      operation.type() == InstallOperation_Type_REPLACE_BZ) {
+  if (IsReplaceType(operation.type())) {
     if (!PerformReplaceOperation(operation, data)) {
       LOG(ERROR) << "Failed to perform replace operation";
       return kActionCodeDownloadOperationExecutionError;
     }
-  } else if (operation.type() == InstallOperation_Type_MOVE) {
+  } else if (operation.type() == InstallOperation_Type_MOVE ||
+             operation.type() == InstallOperation_Type_SOURCE_COPY) {
     if (!PerformMoveOperation(operation)) {
       LOG(ERROR) << "Failed to perform move operation";
       return kActionCodeDownloadOperationExecutionError;
     }
-  } else if (operation.type() == InstallOperation_Type_BSDIFF) {
+  } else if (operation.type() == InstallOperation_Type_BSDIFF ||
+             operation.type() == InstallOperation_Type_SOURCE_BSDIFF) {
     if (!PerformBsdiffOperation(operation, data)) {
       LOG(ERROR) << "Failed to perform bsdiff operation";
       return kActionCodeDownloadOperationExecutionError;
     }
+  } else if (operation.type() == InstallOperation_Type_ZSTD_DIFF ||
+             operation.type() == InstallOperation_Type_SOURCE_ZSTD_DIFF) {
+    if (!PerformZstdDiffOperation(operation, data)) {
+      LOG(ERROR) << "Failed to perform zstd diff operation";
+      return kActionCodeDownloadOperationExecutionError;
+    }
+  } else if (operation.type() == InstallOperation_Type_ZERO) {
+    if (!PerformZeroOperation(operation)) {
+      LOG(ERROR) << "Failed to perform zero operation";
+      return kActionCodeDownloadOperationExecutionError;
+    }
   } else {
     DCHECK(false);
   }
 
+  // The download is held back until the rate limit allows more, see
+  // TakeIoDelay().
+  uint64_t bytes_read = 0;
+  for (int i = 0; i < operation.src_extents_size(); i++)
+    bytes_read += operation.src_extents(i).num_blocks() * block_size_;
+  uint64_t bytes_written = 0;
+  for (int i = 0; i < operation.dst_extents_size(); i++)
+    bytes_written += operation.dst_extents(i).num_blocks() * block_size_;
+  io_delay_ = io_scheduler_.Transferred(fd_, bytes_read, bytes_written);
+
   return kActionCodeSuccess;
 }
 
 bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation,
     const vector<char>& data) {
-  CHECK(operation.type() == \
-        InstallOperation_Type_REPLACE || \
-        operation.type() == \
-        InstallOperation_Type_REPLACE_BZ);
+  CHECK(IsReplaceType(operation.type()));
 
   TEST_AND_RETURN_FALSE(data.size() >= operation.data_length());
 
   DirectExtentWriter direct_writer;
   ZeroPadExtentWriter zero_pad_writer(&direct_writer);
-  std::unique_ptr<BzipExtentWriter> bzip_writer;
+  std::unique_ptr<ExtentWriter> decompress_writer;
 
-  // Since bzip decompression is optional, we have a variable writer that will
+  // Since decompression is optional, we have a variable writer that will
   // point to one of the ExtentWriter objects above.
   ExtentWriter* writer = NULL;
   if (operation.type() == InstallOperation_Type_REPLACE) {
     writer = &zero_pad_writer;
-  } else if (operation.type() ==
-             InstallOperation_Type_REPLACE_BZ) {
-    bzip_writer.reset(new BzipExtentWriter(&zero_pad_writer));
-    writer = bzip_writer.get();
   } else {
-    DCHECK(false);
+    if (operation.type() == InstallOperation_Type_REPLACE_BZ)
+      decompress_writer.reset(new BzipExtentWriter(&zero_pad_writer));
+    else if (operation.type() == InstallOperation_Type_REPLACE_ZSTD)
+      decompress_writer.reset(new ZstdExtentWriter(&zero_pad_writer));
+    else
+      decompress_writer.reset(new XzExtentWriter(&zero_pad_writer));
+    writer = decompress_writer.get();
   }
 
   // Create a vector of extents to pass to the ExtentWriter.
@@ -159,10 +219,33 @@ bool DeltaPerformer::PerformReplaceOperation(
   return true;
 }
 
+bool DeltaPerformer::CopySource(uint64_t size, uint64_t* offset) {
+  TEST_AND_RETURN_FALSE(fd_ >= 0 && source_fd_ >= 0);
+  LOG_IF(INFO, *offset == 0) << "Copying " << size << " bytes of "
+                             << source_path_ << " to " << path_;
+  const size_t count = min(kCopySourceChunkSize, size - min(size, *offset));
+  if (count == 0)
+    return true;
+  vector<char> buf(count);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd_, buf.data(), count,
+                                        *offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+  TEST_AND_RETURN_FALSE(utils::PWriteAll(fd_, buf.data(), count, *offset));
+  io_delay_ = io_scheduler_.Transferred(fd_, count, count);
+  *offset += count;
+  return true;
+}
+
 bool DeltaPerformer::PerformMoveOperation(const InstallOperation& operation) {
   // Sanity check the operation definition.
   TEST_AND_RETURN_FALSE(operation.data_length() == 0);
 
+  // A MOVE reads the blocks it moves from the target itself.
+  const int src_fd = operation.type() == InstallOperation_Type_SOURCE_COPY ?
+      source_fd_ : fd_;
+  TEST_AND_RETURN_FALSE(src_fd >= 0);
+
   // Calculate buffer size. Note, this function doesn't do a sliding
   // window to copy in case the source and destination blocks overlap.
   // If we wanted to do a sliding window, we could program the server
@@ -185,7 +268,7 @@ bool DeltaPerformer::PerformMoveOperation(const InstallOperation& operation) {
   for (int i = 0; i < operation.src_extents_size(); i++) {
     ssize_t bytes_read_this_iteration = 0;
     const Extent& extent = operation.src_extents(i);
-    TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
+    TEST_AND_RETURN_FALSE(utils::PReadAll(src_fd,
                                           &buf[bytes_read],
                                           extent.num_blocks() * block_size_,
                                           extent.start_block() * block_size_,
@@ -219,6 +302,23 @@ bool DeltaPerformer::PerformMoveOperation(const InstallOperation& operation) {
   return true;
 }
 
+bool DeltaPerformer::PerformZeroOperation(const InstallOperation& operation) {
+  // Sanity check the operation definition.
+  TEST_AND_RETURN_FALSE(operation.data_length() == 0);
+  TEST_AND_RETURN_FALSE(operation.src_extents_size() == 0);
+
+  DCHECK(block_size_);
+  for (int i = 0; i < operation.dst_extents_size(); i++) {
+    const Extent& extent = operation.dst_extents(i);
+    if (extent.start_block() == kSparseHole)
+      continue;
+    TEST_AND_RETURN_FALSE(utils::ZeroRange(fd_,
+                                           extent.start_block() * block_size_,
+                                           extent.num_blocks() * block_size_));
+  }
+  return true;
+}
+
 bool DeltaPerformer::ExtentsToBsdiffPositionsString(
     const RepeatedPtrField<Extent>& extents,
     uint64_t block_size,
@@ -274,6 +374,10 @@ bool DeltaPerformer::PerformBsdiffOperation(
         utils::WriteAll(fd, &data[0], operation.data_length()));
   }
 
+  const int src_fd = operation.type() == InstallOperation_Type_SOURCE_BSDIFF ?
+      source_fd_ : fd_;
+  TEST_AND_RETURN_FALSE(src_fd >= 0);
+  const string& src_path = StringPrintf("/dev/fd/%d", src_fd);
   const string& path = StringPrintf("/dev/fd/%d", fd_);
 
   // If this is a non-idempotent operation, request a delayed exit and clear the
@@ -286,7 +390,7 @@ bool DeltaPerformer::PerformBsdiffOperation(
 
   vector<string> cmd;
   cmd.push_back(kBspatchPath);
-  cmd.push_back(path);
+  cmd.push_back(src_path);
   cmd.push_back(path);
   cmd.push_back(temp_filename);
   cmd.push_back(input_positions);
@@ -316,6 +420,55 @@ bool DeltaPerformer::PerformBsdiffOperation(
   return true;
 }
 
+bool DeltaPerformer::PerformZstdDiffOperation(
+    const InstallOperation& operation,
+    const vector<char>& data) {
+  TEST_AND_RETURN_FALSE(data.size() >= operation.data_length());
+
+  const int src_fd =
+      operation.type() == InstallOperation_Type_SOURCE_ZSTD_DIFF ?
+      source_fd_ : fd_;
+  TEST_AND_RETURN_FALSE(src_fd >= 0);
+
+  // The dictionary is read in full before anything is written, so the
+  // source and destination extents may overlap.
+  DCHECK(block_size_);
+  vector<char> prefix;
+  for (int i = 0; i < operation.src_extents_size(); i++) {
+    const Extent& extent = operation.src_extents(i);
+    const uint64_t length = extent.num_blocks() * block_size_;
+    const size_t offset = prefix.size();
+    prefix.resize(offset + length);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(src_fd,
+                                          &prefix[offset],
+                                          length,
+                                          extent.start_block() * block_size_,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(length));
+  }
+  TEST_AND_RETURN_FALSE(operation.src_length() <= prefix.size());
+  prefix.resize(operation.src_length());
+
+  // If this is a non-idempotent operation, request a delayed exit and clear the
+  // update state in case the operation gets interrupted. Do this as late as
+  // possible.
+  if (!IsIdempotentOperation(operation)) {
+    Terminator::set_exit_blocked(true);
+    PayloadProcessor::ResetUpdateProgress(prefs_, true);
+  }
+
+  DirectExtentWriter direct_writer;
+  ZeroPadExtentWriter zero_pad_writer(&direct_writer);
+  ZstdExtentWriter zstd_writer(&zero_pad_writer, &prefix);
+  vector<Extent> extents(operation.dst_extents().begin(),
+                         operation.dst_extents().end());
+  TEST_AND_RETURN_FALSE(zstd_writer.Init(fd_, extents, block_size_));
+  TEST_AND_RETURN_FALSE(zstd_writer.Write(&data[0], operation.data_length()));
+  TEST_AND_RETURN_FALSE(zstd_writer.End());
+  return true;
+}
+
 ActionExitCode DeltaPerformer::ValidateOperationHash(
     const InstallOperation& operation,
     const vector<char>& data) {
@@ -7,6 +7,7 @@
 
 #include <inttypes.h>
 
+#include <chrono>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -14,6 +15,7 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/action_processor.h"
+#include "update_engine/io_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -31,19 +33,35 @@ class DeltaPerformer {
       : prefs_(prefs),
         path_(install_path),
         fd_(-1),
+        source_fd_(-1),
         block_size_(0),
-        file_size_(-1) {}
+        file_size_(-1),
+        io_delay_(0) {}
 
   // Once Close()d, a DeltaPerformer can't be Open()ed again.
   int Open();
 
-  // Processes a single operation on the target partition.
+  // Processes a single operation on the target partition. Packed extents
+  // are unpacked first.
   ActionExitCode PerformOperation(const InstallOperation& operation,
                                   const std::vector<char>& data);
 
   // Wrapper around close. Returns 0 on success or -errno on error.
   int Close();
 
+  // Sets the partition that SOURCE_COPY and SOURCE_BSDIFF operations read
+  // from, and that CopySource() copies. Must be called before Open().
+  void SetSourcePath(const std::string& source_path) {
+    source_path_ = source_path;
+  }
+
+  // Copies the next part of the first |size| bytes of the source over the
+  // target, from |*offset| on, and advances |*offset| past it. In-place
+  // deltas expect the target to start out as a copy of the source; copying
+  // it in parts lets the caller get on with other things in between.
+  // Returns true on success.
+  bool CopySource(uint64_t size, uint64_t* offset);
+
   // Set block size specified by the manifest.
   void SetBlockSize(uint32_t size) {
     block_size_ = size;
@@ -54,6 +72,22 @@ class DeltaPerformer {
     file_size_ = size;
   }
 
+  // Set the I/O priority and rate limit, see IoScheduler. Must be called
+  // before Open().
+  void SetIoLimits(int priority, uint64_t rate_limit) {
+    io_scheduler_.set_priority(priority);
+    io_scheduler_.set_rate_limit(rate_limit);
+  }
+
+  // Returns how long the caller should hold off more I/O to stay under the
+  // rate limit, going by the I/O done so far, and resets it. The operations
+  // don't wait themselves, so as not to block the main loop.
+  std::chrono::microseconds TakeIoDelay() {
+    std::chrono::microseconds delay = io_delay_;
+    io_delay_ = std::chrono::microseconds(0);
+    return delay;
+  }
+
  private:
   friend class DeltaPerformerTest;
   FRIEND_TEST(DeltaPerformerTest, ExtentsToByteStringTest);
@@ -84,11 +118,16 @@ class DeltaPerformer {
                                        const std::vector<char>& data);
 
   // These perform a specific type of operation and return true on success.
+  // The move, bsdiff and zstd diff ones also perform SOURCE_COPY,
+  // SOURCE_BSDIFF and SOURCE_ZSTD_DIFF.
   bool PerformReplaceOperation(const InstallOperation& operation,
                                const std::vector<char>& data);
   bool PerformMoveOperation(const InstallOperation& operation);
+  bool PerformZeroOperation(const InstallOperation& operation);
   bool PerformBsdiffOperation(const InstallOperation& operation,
                               const std::vector<char>& data);
+  bool PerformZstdDiffOperation(const InstallOperation& operation,
+                                const std::vector<char>& data);
 
   // Update Engine preference store.
   PrefsInterface* prefs_;
@@ -99,12 +138,22 @@ class DeltaPerformer {
   // File descriptor of open device.
   int fd_;
 
+  // Path to and file descriptor of the partition the update is from, if set.
+  std::string source_path_;
+  int source_fd_;
+
   // The block size (parsed from the manifest).
   uint32_t block_size_;
 
   // The final file size defined by the manifest.
   off_t file_size_;
 
+  // Throttles the operations and keeps the dirty pages in check.
+  IoScheduler io_scheduler_;
+
+  // The wait the rate limit calls for after the last I/O, see TakeIoDelay().
+  std::chrono::microseconds io_delay_;
+
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
 
@@ -3,8 +3,12 @@
 // found in the LICENSE file.
 
 #include <inttypes.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest.h>
@@ -12,11 +16,18 @@
 #include "update_engine/delta_performer.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/packed_extents.h"
+#include "update_engine/prefs_mock.h"
+#include "update_engine/test_utils.h"
 #include "update_engine/update_metadata.pb.h"
+#include "update_engine/utils.h"
+#include "update_engine/zstd.h"
 
 namespace chromeos_update_engine {
 
 using std::string;
+using std::vector;
 
 TEST(DeltaPerformerTest, ExtentsToByteStringTest) {
   uint64_t test[] = {1, 1, 4, 2, kSparseHole, 1, 0, 1};
@@ -54,6 +65,241 @@ TEST(DeltaPerformerTest, IsIdempotentOperationTest) {
   EXPECT_TRUE(DeltaPerformer::IsIdempotentOperation(op));
   *(op.add_src_extents()) = ExtentForRange(19, 2);
   EXPECT_FALSE(DeltaPerformer::IsIdempotentOperation(op));
+  // The source partition is never written.
+  op.set_type(InstallOperation_Type_SOURCE_COPY);
+  EXPECT_TRUE(DeltaPerformer::IsIdempotentOperation(op));
+  op.set_type(InstallOperation_Type_SOURCE_BSDIFF);
+  EXPECT_TRUE(DeltaPerformer::IsIdempotentOperation(op));
+  op.set_type(InstallOperation_Type_SOURCE_ZSTD_DIFF);
+  EXPECT_TRUE(DeltaPerformer::IsIdempotentOperation(op));
+}
+
+// Applies operations to a target file, and reads from a source file, both
+// of which are set up by the tests.
+class DeltaPerformerFileTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerTarget.XXXXXX",
+                                    &path_, NULL));
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DeltaPerformerSource.XXXXXX",
+                                    &source_path_, NULL));
+  }
+  virtual void TearDown() {
+    unlink(path_.c_str());
+    unlink(source_path_.c_str());
+  }
+
+  void WriteTarget(const vector<char>& data) {
+    ASSERT_TRUE(WriteFileVector(path_, data));
+  }
+  void WriteSource(const vector<char>& data) {
+    ASSERT_TRUE(WriteFileVector(source_path_, data));
+  }
+
+  // Opens performer_ on the target with |block_size|, reading the source
+  // if |use_source| is set.
+  void OpenPerformer(uint32_t block_size, bool use_source,
+                     PrefsInterface* prefs) {
+    performer_.reset(new DeltaPerformer(prefs, path_));
+    if (use_source)
+      performer_->SetSourcePath(source_path_);
+    ASSERT_EQ(0, performer_->Open());
+    performer_->SetBlockSize(block_size);
+  }
+  void OpenPerformer(uint32_t block_size, bool use_source) {
+    OpenPerformer(block_size, use_source, NULL);
+  }
+
+  void ExpectTarget(const vector<char>& expected) {
+    vector<char> actual;
+    EXPECT_TRUE(utils::ReadFile(path_, &actual));
+    EXPECT_TRUE(expected == actual);
+  }
+
+  string path_;
+  string source_path_;
+  std::unique_ptr<DeltaPerformer> performer_;
+};
+
+TEST_F(DeltaPerformerFileTest, ZeroOperationTest) {
+  const uint32_t block_size = 4096;
+  ASSERT_NO_FATAL_FAILURE(WriteTarget(vector<char>(4 * block_size, 'x')));
+
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_ZERO);
+  *(op.add_dst_extents()) = ExtentForRange(1, 2);
+  *(op.add_dst_extents()) = ExtentForRange(kSparseHole, 1);
+  // Blocks past the end of the file make it longer.
+  *(op.add_dst_extents()) = ExtentForRange(5, 1);
+
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, false));
+  EXPECT_EQ(kActionCodeSuccess, performer_->PerformOperation(op,
+                                                             vector<char>()));
+  EXPECT_EQ(0, performer_->Close());
+
+  vector<char> expected(6 * block_size, 0);
+  std::fill(expected.begin(), expected.begin() + block_size, 'x');
+  std::fill(expected.begin() + 3 * block_size,
+            expected.begin() + 4 * block_size, 'x');
+  ExpectTarget(expected);
+}
+
+TEST_F(DeltaPerformerFileTest, PackedExtentsTest) {
+  const uint32_t block_size = 4096;
+  ASSERT_NO_FATAL_FAILURE(WriteTarget(vector<char>(4 * block_size, 'x')));
+
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_REPLACE);
+  *(op.add_dst_extents()) = ExtentForRange(2, 1);
+  *(op.add_dst_extents()) = ExtentForRange(0, 1);
+  packed_extents::Pack(&op);
+  vector<char> data(2 * block_size);
+  FillWithData(&data);
+  op.set_data_length(data.size());
+  vector<char> hash;
+  ASSERT_TRUE(OmahaHashCalculator::RawHashOfData(data, &hash));
+  op.set_data_sha256_hash(hash.data(), hash.size());
+
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, false));
+  EXPECT_EQ(kActionCodeSuccess, performer_->PerformOperation(op, data));
+
+  // Both kinds of extents at once are rejected.
+  *(op.add_dst_extents()) = ExtentForRange(3, 1);
+  EXPECT_EQ(kActionCodeDownloadOperationExecutionError,
+            performer_->PerformOperation(op, data));
+  EXPECT_EQ(0, performer_->Close());
+
+  vector<char> expected(4 * block_size, 'x');
+  std::copy(data.begin(), data.begin() + block_size,
+            expected.begin() + 2 * block_size);
+  std::copy(data.begin() + block_size, data.end(), expected.begin());
+  ExpectTarget(expected);
+}
+
+TEST_F(DeltaPerformerFileTest, LargeBlockSizeTest) {
+  const uint32_t block_size = 64 * 1024;
+  ASSERT_NO_FATAL_FAILURE(WriteTarget(vector<char>(4 * block_size, 'x')));
+
+  // Data that ends partway into its last block is zero padded to the end
+  // of it.
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_REPLACE);
+  *(op.add_dst_extents()) = ExtentForRange(1, 2);
+  vector<char> data(block_size + block_size / 2);
+  FillWithData(&data);
+  op.set_data_length(data.size());
+  vector<char> hash;
+  ASSERT_TRUE(OmahaHashCalculator::RawHashOfData(data, &hash));
+  op.set_data_sha256_hash(hash.data(), hash.size());
+
+  InstallOperation move;
+  move.set_type(InstallOperation_Type_MOVE);
+  *(move.add_src_extents()) = ExtentForRange(1, 1);
+  *(move.add_dst_extents()) = ExtentForRange(3, 1);
+
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, false));
+  EXPECT_EQ(kActionCodeSuccess, performer_->PerformOperation(op, data));
+  EXPECT_EQ(kActionCodeSuccess,
+            performer_->PerformOperation(move, vector<char>()));
+  EXPECT_EQ(0, performer_->Close());
+
+  vector<char> expected(4 * block_size, 'x');
+  std::copy(data.begin(), data.end(), expected.begin() + block_size);
+  std::fill(expected.begin() + block_size + data.size(),
+            expected.begin() + 3 * block_size, 0);
+  std::copy(data.begin(), data.begin() + block_size,
+            expected.begin() + 3 * block_size);
+  ExpectTarget(expected);
+}
+
+TEST_F(DeltaPerformerFileTest, SourceCopyTest) {
+  const uint32_t block_size = 4096;
+  vector<char> source(4 * block_size);
+  FillWithData(&source);
+  ASSERT_NO_FATAL_FAILURE(WriteSource(source));
+  ASSERT_NO_FATAL_FAILURE(WriteTarget(vector<char>(4 * block_size, 'x')));
+
+  // Swaps the first two blocks, which in place would need temp space.
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_SOURCE_COPY);
+  *(op.add_src_extents()) = ExtentForRange(0, 2);
+  *(op.add_dst_extents()) = ExtentForRange(1, 1);
+  *(op.add_dst_extents()) = ExtentForRange(0, 1);
+
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, true));
+  EXPECT_EQ(kActionCodeSuccess, performer_->PerformOperation(op,
+                                                             vector<char>()));
+  EXPECT_EQ(0, performer_->Close());
+
+  vector<char> expected(4 * block_size, 'x');
+  std::copy(source.begin(), source.begin() + block_size,
+            expected.begin() + block_size);
+  std::copy(source.begin() + block_size, source.begin() + 2 * block_size,
+            expected.begin());
+  ExpectTarget(expected);
+
+  // In-place payloads start out from a copy of the source partition.
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, true));
+  uint64_t offset = 0;
+  while (offset < source.size())
+    ASSERT_TRUE(performer_->CopySource(source.size(), &offset));
+  EXPECT_EQ(source.size(), offset);
+  EXPECT_EQ(0, performer_->Close());
+  ExpectTarget(source);
+}
+
+TEST_F(DeltaPerformerFileTest, ZstdDiffTest) {
+  const uint32_t block_size = 4096;
+  vector<char> source(4 * block_size);
+  FillWithData(&source);
+  ASSERT_NO_FATAL_FAILURE(WriteSource(source));
+  ASSERT_NO_FATAL_FAILURE(WriteTarget(source));
+
+  // The first three blocks, but for their last bytes, with a few bytes
+  // changed and written a block further on, partway into the last one.
+  const uint64_t src_length = 3 * block_size - 10;
+  vector<char> old_data(source.begin(), source.begin() + src_length);
+  vector<char> new_data(old_data.begin(), old_data.end() - 100);
+  new_data[10] ^= 1;
+  new_data[5000] ^= 1;
+  vector<char> diff;
+  ASSERT_TRUE(ZstdDiff(old_data, new_data, &diff));
+  vector<char> hash;
+  ASSERT_TRUE(OmahaHashCalculator::RawHashOfData(diff, &hash));
+
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_ZSTD_DIFF);
+  op.set_data_length(diff.size());
+  op.set_data_sha256_hash(hash.data(), hash.size());
+  *(op.add_src_extents()) = ExtentForRange(0, 3);
+  op.set_src_length(src_length);
+  *(op.add_dst_extents()) = ExtentForRange(1, 3);
+  op.set_dst_length(new_data.size());
+
+  vector<char> expected = source;
+  std::copy(new_data.begin(), new_data.end(), expected.begin() + block_size);
+  std::fill(expected.begin() + block_size + new_data.size(), expected.end(),
+            0);
+
+  // In place, the source blocks are overwritten as the data is decoded.
+  testing::NiceMock<PrefsMock> prefs;
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, false, &prefs));
+  EXPECT_EQ(kActionCodeSuccess, performer_->PerformOperation(op, diff));
+  EXPECT_EQ(0, performer_->Close());
+  ExpectTarget(expected);
+
+  op.set_type(InstallOperation_Type_SOURCE_ZSTD_DIFF);
+  ASSERT_NO_FATAL_FAILURE(WriteTarget(source));
+  ASSERT_NO_FATAL_FAILURE(OpenPerformer(block_size, true));
+  EXPECT_EQ(kActionCodeSuccess, performer_->PerformOperation(op, diff));
+  ExpectTarget(expected);
+
+  // A diff of other data doesn't apply.
+  std::reverse(source.begin(), source.begin() + src_length);
+  ASSERT_NO_FATAL_FAILURE(WriteSource(source));
+  EXPECT_EQ(kActionCodeDownloadOperationExecutionError,
+            performer_->PerformOperation(op, diff));
+  EXPECT_EQ(0, performer_->Close());
 }
 
 }  // namespace chromeos_update_engine
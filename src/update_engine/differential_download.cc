@@ -0,0 +1,225 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/differential_download.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/packed_extents.h"
+#include "update_engine/payload_compression.h"
+#include "update_engine/utils.h"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+int OpenForReading(const string& path) {
+  if (path.empty())
+    return -1;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  PLOG_IF(WARNING, fd < 0) << "Unable to open " << path;
+  return fd;
+}
+
+bool HashMatches(const vector<char>& data, const string& expected_hash) {
+  vector<char> hash;
+  return OmahaHashCalculator::RawHashOfData(data, &hash) &&
+      string(hash.begin(), hash.end()) == expected_hash;
+}
+}  // namespace {}
+
+DifferentialDownload::DifferentialDownload(const string& target_path,
+                                           const string& running_path)
+    : target_path_(target_path),
+      running_path_(running_path),
+      target_fd_(-1),
+      running_fd_(-1),
+      block_size_(0),
+      manifest_(NULL),
+      first_operation_(0),
+      next_operation_(0),
+      total_bytes_(0),
+      reused_operations_(0),
+      reused_bytes_(0) {}
+
+DifferentialDownload::~DifferentialDownload() {
+  if (target_fd_ >= 0)
+    close(target_fd_);
+  if (running_fd_ >= 0)
+    close(running_fd_);
+}
+
+bool DifferentialDownload::CanUse(const DeltaArchiveManifest& manifest) {
+  if (manifest.has_old_partition_info())
+    return false;  // A delta already only has what changed.
+  for (const InstallOperation& op : manifest.partition_operations()) {
+    if (!IsFullOperationType(op.type()))
+      return false;
+    if (op.has_dst_sha256_hash())
+      return true;
+  }
+  return false;
+}
+
+bool DifferentialDownload::Plan(const DeltaArchiveManifest& manifest,
+                                size_t first_operation) {
+  TEST_AND_RETURN_FALSE(BeginPlan(manifest, first_operation));
+  while (!PlanStep(manifest.partition_operations_size())) {}
+  return true;
+}
+
+bool DifferentialDownload::BeginPlan(const DeltaArchiveManifest& manifest,
+                                     size_t first_operation) {
+  manifest_ = &manifest;
+  block_size_ = manifest.block_size();
+  sources_.assign(manifest.partition_operations_size(), kSourceDownload);
+  reused_ranges_.clear();
+  reused_operations_ = 0;
+  reused_bytes_ = 0;
+  first_operation_ = first_operation;
+  next_operation_ = first_operation;
+  checked_types_.clear();
+  unreproducible_types_.clear();
+  total_bytes_ = 0;
+  if (target_fd_ < 0)
+    target_fd_ = OpenForReading(target_path_);
+  if (running_fd_ < 0)
+    running_fd_ = OpenForReading(running_path_);
+  if (target_fd_ < 0 && running_fd_ < 0) {
+    manifest_ = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool DifferentialDownload::PlanStep(size_t max_operations) {
+  CHECK(manifest_);
+  vector<char> blocks;
+  for (size_t end = std::min(sources_.size(), next_operation_ + max_operations);
+       next_operation_ < end; next_operation_++) {
+    const size_t i = next_operation_;
+    const InstallOperation& op = manifest_->partition_operations(i);
+    total_bytes_ += op.data_length();
+    if (!op.has_dst_sha256_hash() || !op.has_data_sha256_hash() ||
+        op.data_length() == 0 || !IsReplaceType(op.type()) ||
+        unreproducible_types_.count(op.type())) {
+      continue;
+    }
+    if (ReadMatchingBlocks(target_fd_, op, &blocks))
+      sources_[i] = kSourceTarget;
+    else if (ReadMatchingBlocks(running_fd_, op, &blocks))
+      sources_[i] = kSourceRunning;
+    else
+      continue;
+
+    if (op.type() != InstallOperation_Type_REPLACE &&
+        checked_types_.insert(op.type()).second) {
+      vector<char> data;
+      if (!RebuildData(op, i, &data)) {
+        LOG(WARNING) << "Compressing the local blocks doesn't reproduce the "
+                     << "payload data, downloading all data of type "
+                     << op.type();
+        unreproducible_types_.insert(op.type());
+        sources_[i] = kSourceDownload;
+        continue;
+      }
+    }
+    reused_ranges_.push_back(std::make_pair(op.data_offset(),
+                                            op.data_length()));
+    reused_operations_++;
+    reused_bytes_ += op.data_length();
+  }
+  if (next_operation_ < sources_.size())
+    return false;
+
+  manifest_ = NULL;
+  std::sort(reused_ranges_.begin(), reused_ranges_.end());
+  LOG(INFO) << "Found the results of " << reused_operations_ << " of "
+            << sources_.size() - first_operation_ << " operations locally, "
+            << "skipping " << reused_bytes_ << " of " << total_bytes_
+            << " bytes of partition data";
+  return true;
+}
+
+void DifferentialDownload::GetDownloadRanges(
+    uint64_t begin, uint64_t end, vector<pair<uint64_t, uint64_t> >* ranges)
+    const {
+  uint64_t offset = begin;
+  for (const pair<uint64_t, uint64_t>& reused : reused_ranges_) {
+    if (reused.first + reused.second <= offset)
+      continue;
+    if (reused.first >= end)
+      break;
+    if (reused.first > offset)
+      ranges->push_back(std::make_pair(offset, reused.first - offset));
+    offset = reused.first + reused.second;
+  }
+  if (offset < end)
+    ranges->push_back(std::make_pair(offset, end - offset));
+}
+
+bool DifferentialDownload::RebuildData(const InstallOperation& op,
+                                       size_t operation,
+                                       vector<char>* data) const {
+  const Source op_source = source(operation);
+  TEST_AND_RETURN_FALSE(op_source != kSourceDownload);
+  vector<char> blocks;
+  TEST_AND_RETURN_FALSE(ReadMatchingBlocks(
+      op_source == kSourceTarget ? target_fd_ : running_fd_, op, &blocks));
+
+  // The data was written up to dst_length, and zero padded after that.
+  const size_t length = op.has_dst_length() ? op.dst_length() :
+      op.type() == InstallOperation_Type_REPLACE ? op.data_length() :
+      blocks.size();
+  TEST_AND_RETURN_FALSE(length <= blocks.size());
+  blocks.resize(length);
+  TEST_AND_RETURN_FALSE(CompressForType(op.type(), blocks, data));
+  TEST_AND_RETURN_FALSE(data->size() == op.data_length());
+  TEST_AND_RETURN_FALSE(HashMatches(*data, op.data_sha256_hash()));
+  return true;
+}
+
+bool DifferentialDownload::ReadMatchingBlocks(int fd,
+                                              const InstallOperation& op,
+                                              vector<char>* blocks) const {
+  if (fd < 0)
+    return false;
+  if (packed_extents::IsPacked(op)) {
+    InstallOperation unpacked = op;
+    return packed_extents::Unpack(&unpacked) &&
+        ReadMatchingBlocks(fd, unpacked, blocks);
+  }
+  uint64_t num_blocks = 0;
+  for (const Extent& extent : op.dst_extents()) {
+    if (extent.start_block() == kSparseHole)
+      return false;
+    num_blocks += extent.num_blocks();
+  }
+  blocks->resize(num_blocks * block_size_);
+  char* out = blocks->data();
+  for (const Extent& extent : op.dst_extents()) {
+    const size_t length = extent.num_blocks() * block_size_;
+    ssize_t bytes_read = 0;
+    // Blocks past the end of a smaller partition don't match.
+    if (!utils::PReadAll(fd, out, length, extent.start_block() * block_size_,
+                         &bytes_read) ||
+        bytes_read != static_cast<ssize_t>(length)) {
+      return false;
+    }
+    out += length;
+  }
+  return HashMatches(*blocks, op.dst_sha256_hash());
+}
+
+}  // namespace chromeos_update_engine
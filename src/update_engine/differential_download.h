@@ -0,0 +1,116 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DIFFERENTIAL_DOWNLOAD_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_DIFFERENTIAL_DOWNLOAD_H__
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A full update replaces every block of the partition, but when versions
+// were skipped most of its chunks are usually still identical to what's
+// already on the disk. This class finds, zsync-style, the partition
+// operations of a full payload whose result is already on the target
+// partition or on the running one, going by their dst_sha256_hash, so that
+// only the data of the others needs to be downloaded.
+//
+// The payload hash and signature cover all of the data, so the data of an
+// operation that isn't downloaded is rebuilt from the local blocks instead,
+// compressing it again for the compressed REPLACE types, and checked against
+// its data_sha256_hash before it's used.
+
+namespace chromeos_update_engine {
+
+class DifferentialDownload {
+ public:
+  // Where the data of an operation comes from.
+  enum Source {
+    kSourceDownload,  // the payload
+    kSourceTarget,  // the target partition, which already has it in place
+    kSourceRunning,  // the same blocks of the running partition
+  };
+
+  // Either path may be empty, in which case it isn't looked at.
+  DifferentialDownload(const std::string& target_path,
+                       const std::string& running_path);
+  ~DifferentialDownload();
+
+  // Returns true if |manifest| is a full update with destination hashes.
+  static bool CanUse(const DeltaArchiveManifest& manifest);
+
+  // Looks for the results of the partition operations of |manifest| from
+  // |first_operation| on in the local blocks. Returns false if there are
+  // no local blocks to look at.
+  bool Plan(const DeltaArchiveManifest& manifest, size_t first_operation);
+
+  // Plan() in steps, so that reading the local blocks doesn't hold up the
+  // caller for long: BeginPlan() returns false if there are no local blocks
+  // to look at, then each PlanStep() looks at up to |max_operations| more
+  // operations and returns true once all are done. |manifest| must outlive
+  // the plan.
+  bool BeginPlan(const DeltaArchiveManifest& manifest,
+                 size_t first_operation);
+  bool PlanStep(size_t max_operations);
+  bool planning() const { return manifest_ != NULL; }
+
+  Source source(size_t operation) const {
+    return operation < sources_.size() ? sources_[operation] :
+        kSourceDownload;
+  }
+
+  // The number of operations and bytes of data that aren't downloaded.
+  size_t reused_operations() const { return reused_operations_; }
+  uint64_t reused_bytes() const { return reused_bytes_; }
+
+  // Appends the (offset, length) ranges of the data blobs in [begin, end)
+  // that have to be downloaded to |ranges|.
+  void GetDownloadRanges(
+      uint64_t begin, uint64_t end,
+      std::vector<std::pair<uint64_t, uint64_t> >* ranges) const;
+
+  // Rebuilds the data of the partition operation |operation|, |op|, from
+  // its source into |data|. Returns false if the local blocks no longer
+  // match or the data comes out different.
+  bool RebuildData(const InstallOperation& op, size_t operation,
+                   std::vector<char>* data) const;
+
+ private:
+  // Reads the dst_extents of |op| from |fd| into |blocks| and returns
+  // whether they match its dst_sha256_hash.
+  bool ReadMatchingBlocks(int fd, const InstallOperation& op,
+                          std::vector<char>* blocks) const;
+
+  std::string target_path_;
+  std::string running_path_;
+  int target_fd_;
+  int running_fd_;
+  uint32_t block_size_;
+
+  // The state of the plan in progress.
+  const DeltaArchiveManifest* manifest_;
+  size_t first_operation_;
+  size_t next_operation_;
+  std::set<InstallOperation_Type> checked_types_;
+  std::set<InstallOperation_Type> unreproducible_types_;
+  uint64_t total_bytes_;
+
+  // The source of each partition operation, and the data blobs of the
+  // ones that aren't downloaded, sorted by offset.
+  std::vector<Source> sources_;
+  std::vector<std::pair<uint64_t, uint64_t> > reused_ranges_;
+  size_t reused_operations_;
+  uint64_t reused_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(DifferentialDownload);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_DIFFERENTIAL_DOWNLOAD_H__
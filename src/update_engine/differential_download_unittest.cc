@@ -0,0 +1,261 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/bzip.h"
+#include "update_engine/differential_download.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/packed_extents.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+const size_t kChunkSize = 2 * kBlockSize;
+const size_t kNumChunks = 4;
+// The data of the last chunk, which is zero padded on the partition.
+const size_t kLastChunkLength = 5000;
+const uint64_t kSignaturesSize = 100;
+
+string RawHash(const vector<char>& data) {
+  vector<char> hash;
+  EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(data, &hash));
+  return string(hash.begin(), hash.end());
+}
+}  // namespace {}
+
+class DifferentialDownloadTest : public ::testing::Test {
+ protected:
+  // Sets up a full payload for a partition of kNumChunks chunks, of
+  // alternating REPLACE and REPLACE_BZ operations. The target partition has
+  // the first chunk already, the running one the second and the last.
+  virtual void SetUp() {
+    new_partition_.resize(kNumChunks * kChunkSize);
+    FillWithData(&new_partition_);
+    std::fill(new_partition_.begin() + (kNumChunks - 1) * kChunkSize +
+              kLastChunkLength, new_partition_.end(), 0);
+
+    manifest_.set_block_size(kBlockSize);
+    uint64_t data_offset = 0;
+    for (size_t i = 0; i < kNumChunks; i++) {
+      vector<char> chunk(new_partition_.begin() + i * kChunkSize,
+                         new_partition_.begin() + (i + 1) * kChunkSize);
+      const size_t length = i == kNumChunks - 1 ? kLastChunkLength :
+          kChunkSize;
+      vector<char> data(chunk.begin(), chunk.begin() + length);
+      InstallOperation* op = manifest_.add_partition_operations();
+      if (i % 2) {
+        op->set_type(InstallOperation_Type_REPLACE_BZ);
+        vector<char> compressed;
+        ASSERT_TRUE(BzipCompress(data, &compressed));
+        data.swap(compressed);
+      } else {
+        op->set_type(InstallOperation_Type_REPLACE);
+      }
+      Extent* extent = op->add_dst_extents();
+      extent->set_start_block(i * kChunkSize / kBlockSize);
+      extent->set_num_blocks(kChunkSize / kBlockSize);
+      op->set_dst_length(length);
+      op->set_dst_sha256_hash(RawHash(chunk));
+      op->set_data_offset(data_offset);
+      op->set_data_length(data.size());
+      op->set_data_sha256_hash(RawHash(data));
+      data_offset += data.size();
+      data_.push_back(data);
+    }
+    data_size_ = data_offset + kSignaturesSize;
+
+    vector<char> target(new_partition_.size());
+    std::copy(new_partition_.begin(), new_partition_.begin() + kChunkSize,
+              target.begin());
+    vector<char> running(new_partition_.size(), 'x');
+    std::copy(new_partition_.begin() + kChunkSize,
+              new_partition_.begin() + 2 * kChunkSize,
+              running.begin() + kChunkSize);
+    std::copy(new_partition_.begin() + 3 * kChunkSize, new_partition_.end(),
+              running.begin() + 3 * kChunkSize);
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DifferentialDownloadTarget.XXXXXX",
+                                    &target_path_, NULL));
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/DifferentialDownloadRunning.XXXXXX",
+                                    &running_path_, NULL));
+    ASSERT_TRUE(WriteFileVector(target_path_, target));
+    ASSERT_TRUE(WriteFileVector(running_path_, running));
+  }
+
+  virtual void TearDown() {
+    unlink(target_path_.c_str());
+    unlink(running_path_.c_str());
+  }
+
+  vector<char> new_partition_;
+  DeltaArchiveManifest manifest_;
+  vector<vector<char> > data_;
+  uint64_t data_size_;
+  string target_path_;
+  string running_path_;
+};
+
+TEST_F(DifferentialDownloadTest, CanUseTest) {
+  EXPECT_TRUE(DifferentialDownload::CanUse(manifest_));
+
+  DeltaArchiveManifest delta = manifest_;
+  delta.mutable_old_partition_info()->set_size(new_partition_.size());
+  EXPECT_FALSE(DifferentialDownload::CanUse(delta));
+
+  DeltaArchiveManifest no_hashes = manifest_;
+  for (int i = 0; i < no_hashes.partition_operations_size(); i++)
+    no_hashes.mutable_partition_operations(i)->clear_dst_sha256_hash();
+  EXPECT_FALSE(DifferentialDownload::CanUse(no_hashes));
+
+  DeltaArchiveManifest move = manifest_;
+  move.mutable_partition_operations(0)->set_type(InstallOperation_Type_MOVE);
+  EXPECT_FALSE(DifferentialDownload::CanUse(move));
+}
+
+TEST_F(DifferentialDownloadTest, PlanTest) {
+  DifferentialDownload differential(target_path_, running_path_);
+  ASSERT_TRUE(differential.Plan(manifest_, 0));
+  EXPECT_EQ(DifferentialDownload::kSourceTarget, differential.source(0));
+  EXPECT_EQ(DifferentialDownload::kSourceRunning, differential.source(1));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(2));
+  EXPECT_EQ(DifferentialDownload::kSourceRunning, differential.source(3));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(4));
+  EXPECT_EQ(3, differential.reused_operations());
+  EXPECT_EQ(data_[0].size() + data_[1].size() + data_[3].size(),
+            differential.reused_bytes());
+
+  // The data of the third operation and the signatures are left.
+  vector<pair<uint64_t, uint64_t> > ranges;
+  differential.GetDownloadRanges(0, data_size_, &ranges);
+  ASSERT_EQ(2, ranges.size());
+  EXPECT_EQ(manifest_.partition_operations(2).data_offset(), ranges[0].first);
+  EXPECT_EQ(data_[2].size(), ranges[0].second);
+  EXPECT_EQ(data_size_ - kSignaturesSize, ranges[1].first);
+  EXPECT_EQ(kSignaturesSize, ranges[1].second);
+
+  // Resuming from within the third operation's data.
+  ranges.clear();
+  const uint64_t resume_offset =
+      manifest_.partition_operations(2).data_offset() + 10;
+  differential.GetDownloadRanges(resume_offset, data_size_, &ranges);
+  ASSERT_EQ(2, ranges.size());
+  EXPECT_EQ(resume_offset, ranges[0].first);
+  EXPECT_EQ(data_[2].size() - 10, ranges[0].second);
+
+  for (size_t i = 0; i < kNumChunks; i++) {
+    if (i == 2)
+      continue;
+    vector<char> data;
+    EXPECT_TRUE(differential.RebuildData(manifest_.partition_operations(i), i,
+                                         &data)) << "i = " << i;
+    EXPECT_TRUE(data == data_[i]) << "i = " << i;
+  }
+  vector<char> data;
+  EXPECT_FALSE(differential.RebuildData(manifest_.partition_operations(2), 2,
+                                        &data));
+}
+
+TEST_F(DifferentialDownloadTest, PlanStepTest) {
+  DifferentialDownload differential(target_path_, running_path_);
+  ASSERT_TRUE(differential.BeginPlan(manifest_, 0));
+  EXPECT_TRUE(differential.planning());
+  size_t steps = 0;
+  while (!differential.PlanStep(2))
+    steps++;
+  EXPECT_EQ(kNumChunks / 2 - 1, steps);
+  EXPECT_FALSE(differential.planning());
+  EXPECT_EQ(DifferentialDownload::kSourceTarget, differential.source(0));
+  EXPECT_EQ(DifferentialDownload::kSourceRunning, differential.source(3));
+  EXPECT_EQ(3, differential.reused_operations());
+  vector<pair<uint64_t, uint64_t> > ranges;
+  differential.GetDownloadRanges(0, data_size_, &ranges);
+  EXPECT_EQ(2, ranges.size());
+}
+
+TEST_F(DifferentialDownloadTest, PackedExtentsTest) {
+  for (int i = 0; i < manifest_.partition_operations_size(); i++)
+    packed_extents::Pack(manifest_.mutable_partition_operations(i));
+  DifferentialDownload differential(target_path_, running_path_);
+  ASSERT_TRUE(differential.Plan(manifest_, 0));
+  EXPECT_EQ(DifferentialDownload::kSourceTarget, differential.source(0));
+  EXPECT_EQ(DifferentialDownload::kSourceRunning, differential.source(1));
+  EXPECT_EQ(3, differential.reused_operations());
+  vector<char> data;
+  EXPECT_TRUE(differential.RebuildData(manifest_.partition_operations(1), 1,
+                                       &data));
+  EXPECT_TRUE(data == data_[1]);
+}
+
+TEST_F(DifferentialDownloadTest, FirstOperationTest) {
+  DifferentialDownload differential(target_path_, running_path_);
+  ASSERT_TRUE(differential.Plan(manifest_, 2));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(0));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(1));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(2));
+  EXPECT_EQ(DifferentialDownload::kSourceRunning, differential.source(3));
+  EXPECT_EQ(1, differential.reused_operations());
+}
+
+TEST_F(DifferentialDownloadTest, NoPartitionsTest) {
+  DifferentialDownload differential("/dev/null/missing", "");
+  EXPECT_FALSE(differential.Plan(manifest_, 0));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(0));
+
+  // Nothing matches the blocks of an empty partition.
+  DifferentialDownload empty("/dev/null", "");
+  ASSERT_TRUE(empty.Plan(manifest_, 0));
+  EXPECT_EQ(0, empty.reused_operations());
+  vector<pair<uint64_t, uint64_t> > ranges;
+  empty.GetDownloadRanges(0, data_size_, &ranges);
+  ASSERT_EQ(1, ranges.size());
+  EXPECT_EQ(0, ranges[0].first);
+  EXPECT_EQ(data_size_, ranges[0].second);
+}
+
+TEST_F(DifferentialDownloadTest, ChangedBlocksTest) {
+  DifferentialDownload differential(target_path_, running_path_);
+  ASSERT_TRUE(differential.Plan(manifest_, 0));
+  ASSERT_EQ(DifferentialDownload::kSourceRunning, differential.source(1));
+
+  // The blocks are checked again when the data is rebuilt.
+  vector<char> garbage(kBlockSize, 'y');
+  int fd = open(running_path_.c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_TRUE(utils::PWriteAll(fd, garbage.data(), garbage.size(),
+                               kChunkSize));
+  close(fd);
+  vector<char> data;
+  EXPECT_FALSE(differential.RebuildData(manifest_.partition_operations(1), 1,
+                                        &data));
+}
+
+TEST_F(DifferentialDownloadTest, DataMismatchTest) {
+  // If compressing the local blocks doesn't give the payload's data, e.g.
+  // with another version of bzip2, the compressed data is all downloaded.
+  manifest_.mutable_partition_operations(1)->set_data_sha256_hash(
+      RawHash(vector<char>(1, 'z')));
+  DifferentialDownload differential(target_path_, running_path_);
+  ASSERT_TRUE(differential.Plan(manifest_, 0));
+  EXPECT_EQ(DifferentialDownload::kSourceTarget, differential.source(0));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(1));
+  EXPECT_EQ(DifferentialDownload::kSourceDownload, differential.source(3));
+  EXPECT_EQ(1, differential.reused_operations());
+}
+
+}  // namespace chromeos_update_engine
@@ -5,10 +5,14 @@
 #include "update_engine/download_action.h"
 #include <errno.h>
 #include <algorithm>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <glib.h>
 #include "update_engine/action_pipe.h"
+#include "update_engine/file_http_fetcher.h"
+#include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/payload_cache.h"
 #include "update_engine/subprocess.h"
 
 using std::min;
@@ -24,9 +28,21 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       writer_(NULL),
       code_(kActionCodeSuccess),
       delegate_(NULL),
-      bytes_downloaded_(0) {}
+      bytes_downloaded_(0),
+      payload_cache_(NULL),
+      restarting_(false),
+      transfer_stopped_(false),
+      restart_source_id_(0),
+      resume_source_id_(0),
+      paused_(false),
+      transfer_complete_(false),
+      transfer_successful_(false) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  if (restart_source_id_)
+    g_source_remove(restart_source_id_);
+  CancelResume();
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
@@ -35,6 +51,16 @@ void DownloadAction::PerformAction() {
   CHECK(HasInputObject());
   install_plan_ = GetInputObject();
   bytes_downloaded_ = 0;
+  restarting_ = false;
+  transfer_stopped_ = false;
+  paused_ = false;
+  transfer_complete_ = false;
+
+  // Leaving out part of the payload takes several ranges.
+  if (install_plan_.differential_download &&
+      !dynamic_cast<MultiRangeHttpFetcher*>(http_fetcher_.get())) {
+    install_plan_.differential_download = false;
+  }
 
   install_plan_.Dump();
 
@@ -50,6 +76,11 @@ void DownloadAction::PerformAction() {
     processor_->ActionComplete(this, kActionCodeInstallDeviceOpenError);
     return;
   }
+  if (payload_cache_ &&
+      !FileHttpFetcher::IsFileUrl(install_plan_.download_url, NULL)) {
+    payload_cache_->BeginWrite(install_plan_.payload_hash,
+                               install_plan_.payload_size);
+  }
   if (delegate_) {
     delegate_->SetDownloadStatus(true);  // Set to active.
   }
@@ -57,10 +88,21 @@ void DownloadAction::PerformAction() {
 }
 
 void DownloadAction::TerminateProcessing() {
+  restarting_ = false;
+  transfer_stopped_ = false;
+  if (restart_source_id_) {
+    g_source_remove(restart_source_id_);
+    restart_source_id_ = 0;
+  }
+  CancelResume();
+  paused_ = false;
+  transfer_complete_ = false;
   if (writer_) {
     LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
     writer_ = NULL;
   }
+  if (payload_cache_)
+    payload_cache_->EndWrite(false);
   if (delegate_) {
     delegate_->SetDownloadStatus(false);  // Set to inactive.
   }
@@ -71,12 +113,19 @@ void DownloadAction::TerminateProcessing() {
 
 void DownloadAction::SeekToOffset(off_t offset) {
   bytes_downloaded_ = offset;
+  if (payload_cache_)
+    payload_cache_->Seek(offset);
 }
 
 void DownloadAction::ReceivedBytes(HttpFetcher *fetcher,
                                    const char* bytes,
                                    int length) {
+  // The rest of this range isn't needed any more.
+  if (restarting_)
+    return;
   bytes_downloaded_ += length;
+  if (payload_cache_)
+    payload_cache_->Write(bytes, length);
   if (delegate_)
     delegate_->BytesReceived(length,
                              bytes_downloaded_,
@@ -90,9 +139,143 @@ void DownloadAction::ReceivedBytes(HttpFetcher *fetcher,
     TerminateProcessing();
     return;
   }
+  if (RestartIfNeeded())
+    return;
+  HoldBackTransfer();
+}
+
+bool DownloadAction::RestartIfNeeded() {
+  if (!payload_processor_.get() ||
+      !payload_processor_->GetNewDownloadRanges(&restart_ranges_)) {
+    return false;
+  }
+  LOG(INFO) << "Restarting the transfer with " << restart_ranges_.size()
+            << " ranges left to download";
+  CancelResume();
+  if (restarting_) {
+    // Already ended to wait for the payload processor; the new ranges
+    // replace the ones it would have carried on with.
+    if (transfer_stopped_)
+      ScheduleRestart();
+    return true;
+  }
+  restarting_ = true;
+  if (transfer_complete_) {
+    transfer_complete_ = false;
+    transfer_stopped_ = true;
+    ScheduleRestart();
+    return true;
+  }
+  if (paused_) {
+    // Whatever this lets through is dropped, as restarting_ is set.
+    paused_ = false;
+    http_fetcher_->Unpause();
+  }
+  http_fetcher_->TerminateTransfer();
+  return true;
+}
+
+void DownloadAction::ScheduleRestart() {
+  if (!restart_source_id_) {
+    restart_source_id_ = g_idle_add(&DownloadAction::StaticRestartCallback,
+                                    this);
+  }
+}
+
+void DownloadAction::HoldBackTransfer() {
+  if (!payload_processor_.get() || resume_source_id_)
+    return;
+  std::chrono::microseconds delay = payload_processor_->TakeIoDelay();
+  const bool pending_work = payload_processor_->HasPendingWork();
+  if (delay.count() <= 0 && !pending_work)
+    return;
+  // Waiting or working here would block the main loop, so stop the data
+  // from coming in and carry on from a callback instead. Note that the
+  // callback is set up first, as ending the transfer may report it ended
+  // right away.
+  if (delay.count() > 0) {
+    resume_source_id_ = g_timeout_add(
+        std::max(static_cast<guint>(delay.count() / 1000), 1U),
+        &DownloadAction::StaticResumeCallback,
+        this);
+  } else {
+    resume_source_id_ = g_idle_add(&DownloadAction::StaticResumeCallback,
+                                   this);
+  }
+  if (transfer_complete_ || restarting_)
+    return;
+  MultiRangeHttpFetcher* fetcher =
+      dynamic_cast<MultiRangeHttpFetcher*>(http_fetcher_.get());
+  if (pending_work && fetcher) {
+    fetcher->GetRemainingRanges(&restart_ranges_);
+    LOG(INFO) << "Ending the transfer until the pending work is done, with "
+              << restart_ranges_.size() << " ranges left to download";
+    restarting_ = true;
+    if (paused_) {
+      paused_ = false;
+      http_fetcher_->Unpause();
+    }
+    http_fetcher_->TerminateTransfer();
+  } else if (!paused_) {
+    http_fetcher_->Pause();
+    paused_ = true;
+  }
+}
+
+gboolean DownloadAction::ResumeCallback() {
+  resume_source_id_ = 0;
+  if (payload_processor_->HasPendingWork() &&
+      !payload_processor_->ContinueWork(&code_)) {
+    LOG(ERROR) << "Error " << code_ << " while processing the received payload"
+               << " -- Terminating processing";
+    transfer_complete_ = false;
+    TerminateProcessing();
+    return FALSE;
+  }
+  if (RestartIfNeeded())
+    return FALSE;
+  HoldBackTransfer();
+  if (resume_source_id_)
+    return FALSE;  // Not done yet.
+  paused_ = false;
+  if (restarting_) {
+    // Otherwise the restart happens once the transfer has ended.
+    if (transfer_stopped_)
+      ScheduleRestart();
+  } else if (transfer_complete_) {
+    transfer_complete_ = false;
+    FinishTransfer(transfer_successful_);
+  } else {
+    http_fetcher_->Unpause();
+  }
+  return FALSE;  // Don't have glib auto call this callback again
+}
+
+void DownloadAction::CancelResume() {
+  if (resume_source_id_) {
+    g_source_remove(resume_source_id_);
+    resume_source_id_ = 0;
+  }
 }
 
 void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful) {
+  if (restarting_) {
+    // Ended while letting the last of the old ranges through.
+    TransferTerminated(fetcher);
+    return;
+  }
+  if (resume_source_id_) {
+    // The payload processor hasn't caught up with the data yet.
+    transfer_complete_ = true;
+    transfer_successful_ = successful;
+    return;
+  }
+  FinishTransfer(successful);
+}
+
+void DownloadAction::FinishTransfer(bool successful) {
+  CancelResume();
+  paused_ = false;
   if (writer_) {
     LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
     writer_ = NULL;
@@ -109,6 +292,17 @@ void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful) {
                  << " failed due to payload verification error.";
     }
   }
+  if (payload_cache_) {
+    // A complete payload is checked against its hash before it's cached,
+    // which the payload processor has done already if it succeeded.
+    payload_cache_->EndWrite(code == kActionCodeSuccess &&
+                             payload_processor_.get());
+    if (code != kActionCodeSuccess &&
+        FileHttpFetcher::IsFileUrl(install_plan_.download_url, NULL)) {
+      // Don't keep replaying a cached payload that doesn't work.
+      payload_cache_->Remove(install_plan_.payload_hash);
+    }
+  }
 
   // Write the plan to the output pipe if we're successful.
   if (code == kActionCodeSuccess && HasOutputPipe())
@@ -117,9 +311,39 @@ void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful) {
 }
 
 void DownloadAction::TransferTerminated(HttpFetcher *fetcher) {
+  paused_ = false;
+  if (restarting_) {
+    // Not from within the fetcher's callback, and not before the payload
+    // processor is done with the work held back for.
+    transfer_stopped_ = true;
+    if (!resume_source_id_)
+      ScheduleRestart();
+    return;
+  }
+  CancelResume();
   if (code_ != kActionCodeSuccess) {
     processor_->ActionComplete(this, code_);
   }
 }
 
+gboolean DownloadAction::RestartCallback() {
+  restart_source_id_ = 0;
+  restarting_ = false;
+  transfer_stopped_ = false;
+  MultiRangeHttpFetcher* fetcher =
+      dynamic_cast<MultiRangeHttpFetcher*>(http_fetcher_.get());
+  CHECK(fetcher);
+  fetcher->ClearRanges();
+  for (const std::pair<uint64_t, uint64_t>& range : restart_ranges_) {
+    if (range.second)
+      fetcher->AddRange(range.first, range.second);
+    else
+      fetcher->AddRange(range.first);
+  }
+  restart_ranges_.clear();
+  // With nothing left to download, this completes straight away.
+  fetcher->BeginTransfer(install_plan_.download_url);
+  return FALSE;
+}
+
 };  // namespace {}
@@ -11,8 +11,11 @@
 
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <curl/curl.h>
+#include <glib.h>
 #include <google/protobuf/stubs/common.h>
 
 #include "update_engine/action.h"
@@ -44,6 +47,7 @@ class DownloadActionDelegate {
 
 class DownloadAction;
 class NoneType;
+class PayloadCache;
 class PrefsInterface;
 
 template<>
@@ -92,7 +96,50 @@ class DownloadAction : public Action<DownloadAction>,
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Replaces the HttpFetcher, taking ownership of the new one. Must not be
+  // called while the action is running.
+  void set_http_fetcher(HttpFetcher* http_fetcher) {
+    http_fetcher_.reset(http_fetcher);
+    http_fetcher_->set_delegate(this);
+  }
+
+  // Keeps a copy of the downloaded payload in |payload_cache|, which isn't
+  // owned. Payloads read from a file:// URL are already on the disk and
+  // aren't copied.
+  void set_payload_cache(PayloadCache* payload_cache) {
+    payload_cache_ = payload_cache;
+  }
+
  private:
+  // Restarts the transfer with restart_ranges_, e.g., the ranges the
+  // payload processor still needs once it has found part of the payload data
+  // on the disk.
+  gboolean RestartCallback();
+  static gboolean StaticRestartCallback(gpointer data) {
+    return reinterpret_cast<DownloadAction*>(data)->RestartCallback();
+  }
+  void ScheduleRestart();
+
+  // Restarts the transfer if the payload processor has new download ranges,
+  // returning true if it does.
+  bool RestartIfNeeded();
+
+  // Holds back the transfer while the payload processor has work pending,
+  // which ResumeCallback() does from the main loop, or for as long as its
+  // I/O rate limit calls for. The pending work may take a while, e.g.,
+  // copying the old partition, so rather than keep the connections paused
+  // through it, the transfer is ended and restarted from where it stopped
+  // once the work is done.
+  void HoldBackTransfer();
+  gboolean ResumeCallback();
+  static gboolean StaticResumeCallback(gpointer data) {
+    return reinterpret_cast<DownloadAction*>(data)->ResumeCallback();
+  }
+  void CancelResume();
+
+  // Closes the writer, verifies the payload and completes the action.
+  void FinishTransfer(bool successful);
+
   // The InstallPlan passed in
   InstallPlan install_plan_;
 
@@ -116,6 +163,27 @@ class DownloadAction : public Action<DownloadAction>,
   DownloadActionDelegate* delegate_;
   uint64_t bytes_downloaded_;
 
+  // Where the payload is copied to, or NULL.
+  PayloadCache* payload_cache_;
+
+  // True while the transfer stops to restart with restart_ranges_, where a
+  // length of zero means up to the end. transfer_stopped_ is set once it
+  // has, and the restart waits for any work held back for.
+  bool restarting_;
+  bool transfer_stopped_;
+  std::vector<std::pair<uint64_t, uint64_t> > restart_ranges_;
+  guint restart_source_id_;
+
+  // If non-zero, the glib timeout or idle source that resumes the transfer
+  // held back by HoldBackTransfer(), which paused it if paused_ is set.
+  guint resume_source_id_;
+  bool paused_;
+
+  // Set when the transfer completed while held back, which is then finished
+  // once the payload processor has caught up.
+  bool transfer_complete_;
+  bool transfer_successful_;
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
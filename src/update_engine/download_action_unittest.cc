@@ -9,10 +9,12 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "files/scoped_temp_dir.h"
 #include "update_engine/action_pipe.h"
 #include "update_engine/download_action.h"
 #include "update_engine/mock_http_fetcher.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/payload_cache.h"
 #include "update_engine/prefs_mock.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
@@ -408,4 +410,50 @@ TEST(DownloadActionTest, BadOutFileTest) {
   g_main_loop_unref(loop);
 }
 
+TEST(DownloadActionTest, PayloadCacheTest) {
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+
+  files::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  PayloadCache payload_cache;
+  payload_cache.set_dir(cache_dir.path().value());
+
+  vector<char> data(kMockHttpFetcherChunkSize * 3 + 7);
+  FillWithData(&data);
+  const string hash = OmahaHashCalculator::OmahaHashOfData(data);
+  DirectFileWriter writer("/dev/null");
+  InstallPlan install_plan(false, "", data.size(), hash, "/dev/null");
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  PrefsMock prefs;
+  DownloadAction download_action(&prefs,
+                                 new MockHttpFetcher(data.data(),
+                                                     data.size()));
+  download_action.SetTestFileWriter(&writer);
+  download_action.set_payload_cache(&payload_cache);
+  BondActions(&feeder_action, &download_action);
+
+  ActionProcessor processor;
+  PassObjectOutTestProcessorDelegate delegate;
+  delegate.loop_ = loop;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+
+  g_timeout_add(0, &PassObjectOutTestStarter, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  // Without a payload processor to have checked it, the cached payload is
+  // hashed again first.
+  EXPECT_TRUE(payload_cache.checking());
+  while (payload_cache.checking())
+    g_main_context_iteration(NULL, TRUE);
+  string path;
+  ASSERT_TRUE(payload_cache.Lookup(hash, data.size(), &path));
+  vector<char> cached;
+  EXPECT_TRUE(utils::ReadFile(path, &cached));
+  EXPECT_TRUE(data == cached);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,179 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/ext2_files.h"
+
+#include <string.h>
+
+#include <set>
+
+#include <et/com_err.h>
+#include <ext2fs/ext2_io.h>
+#include <ext2fs/ext2fs.h>
+#include <glog/logging.h>
+
+#include "update_engine/ext2_utils.h"
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/utils.h"
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+
+struct DirEntry {
+  string name;
+  ext2_ino_t inode;
+};
+
+// Collects the entries of a directory other than "." and "..".
+int ProcessDirEntry(ext2_ino_t dir,
+                    int entry,
+                    struct ext2_dir_entry* dirent,
+                    int offset,
+                    int blocksize,
+                    char* buf,
+                    void* priv) {
+  vector<DirEntry>* entries = static_cast<vector<DirEntry>*>(priv);
+  // The upper byte holds the file type on filesystems that record it.
+  const int name_len = dirent->name_len & 0xff;
+  if (dirent->inode == 0 ||
+      (name_len == 1 && dirent->name[0] == '.') ||
+      (name_len == 2 && dirent->name[0] == '.' && dirent->name[1] == '.')) {
+    return 0;
+  }
+  entries->push_back(DirEntry{string(dirent->name, name_len), dirent->inode});
+  return 0;
+}
+
+// The blocks of a file found so far.
+struct FileBlocks {
+  uint64_t file_blocks;  // blocks up to the end of the file
+  uint64_t num_blocks;  // blocks in |extents|
+  vector<Extent> extents;
+};
+
+// Appends a data block of a file to its extents, filling any gap since
+// the previous one with a hole.
+int ProcessDataBlock(ext2_filsys fs,
+                     blk_t* blocknr,
+                     e2_blkcnt_t blockcnt,
+                     blk_t ref_blk,
+                     int ref_offset,
+                     void* priv) {
+  FileBlocks* blocks = static_cast<FileBlocks*>(priv);
+  // Blocks preallocated past the end of the file aren't part of it.
+  if (blockcnt < 0 ||
+      static_cast<uint64_t>(blockcnt) < blocks->num_blocks ||
+      static_cast<uint64_t>(blockcnt) >= blocks->file_blocks) {
+    return 0;
+  }
+  graph_utils::AppendExtentToExtents(
+      &blocks->extents,
+      ExtentForRange(kSparseHole, blockcnt - blocks->num_blocks));
+  graph_utils::AppendBlockToExtents(&blocks->extents, *blocknr);
+  blocks->num_blocks = blockcnt + 1;
+  return 0;
+}
+
+// Lists the files under the directory |dir_inode| at |dir_path| into
+// |files|, skipping the inodes in |seen_inodes| and adding the others.
+bool ListDirectory(ext2_filsys fs,
+                   ext2_ino_t dir_inode,
+                   const string& dir_path,
+                   set<ext2_ino_t>* seen_inodes,
+                   vector<Ext2File>* files) {
+  vector<DirEntry> entries;
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_dir_iterate2(
+      fs, dir_inode, 0, NULL, ProcessDirEntry, &entries));
+
+  for (const DirEntry& entry : entries) {
+    const string path = dir_path + "/" + entry.name;
+    if (path == "/lost+found" || !seen_inodes->insert(entry.inode).second)
+      continue;
+    struct ext2_inode inode;
+    TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode(fs, entry.inode, &inode));
+    if (LINUX_S_ISDIR(inode.i_mode)) {
+      TEST_AND_RETURN_FALSE(
+          ListDirectory(fs, entry.inode, path, seen_inodes, files));
+      continue;
+    }
+    // We never diff symlinks or special files.
+    if (!LINUX_S_ISREG(inode.i_mode) || EXT2_I_SIZE(&inode) == 0)
+      continue;
+    if (inode.i_flags & EXT4_INLINE_DATA_FL) {
+      LOG(INFO) << "Skipping " << path << ", its data is in its inode";
+      continue;
+    }
+
+    Ext2File file;
+    file.path = path;
+    file.inode = entry.inode;
+    file.size = EXT2_I_SIZE(&inode);
+    FileBlocks blocks;
+    blocks.file_blocks = (file.size + kBlockSize - 1) / kBlockSize;
+    blocks.num_blocks = 0;
+    TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_block_iterate2(
+        fs, entry.inode, BLOCK_FLAG_DATA_ONLY, NULL, ProcessDataBlock,
+        &blocks));
+    graph_utils::AppendExtentToExtents(
+        &blocks.extents,
+        ExtentForRange(kSparseHole, blocks.file_blocks - blocks.num_blocks));
+    file.extents.swap(blocks.extents);
+    files->push_back(file);
+  }
+  return true;
+}
+}  // namespace {}
+
+bool Ext2Files::ListRegularFiles(const string& image,
+                                 vector<Ext2File>* files) {
+  ext2_filsys fs;
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_open(image.c_str(), 0, 0, 0,
+                                            unix_io_manager, &fs));
+  ScopedExt2fsCloser fs_closer(fs);
+  if (fs->blocksize != kBlockSize) {
+    LOG(ERROR) << image << " has " << fs->blocksize << " byte blocks, "
+               << "not " << kBlockSize;
+    return false;
+  }
+
+  files->clear();
+  set<ext2_ino_t> seen_inodes;
+  seen_inodes.insert(EXT2_ROOT_INO);
+  TEST_AND_RETURN_FALSE(
+      ListDirectory(fs, EXT2_ROOT_INO, "", &seen_inodes, files));
+  return true;
+}
+
+bool Ext2Files::ReadFile(int fd, const Ext2File& file, vector<char>* data) {
+  data->resize(graph_utils::BlocksInExtents(file.extents) * kBlockSize);
+  size_t offset = 0;
+  for (const Extent& extent : file.extents) {
+    const size_t length = extent.num_blocks() * kBlockSize;
+    if (extent.start_block() == kSparseHole) {
+      memset(&(*data)[offset], 0, length);
+    } else {
+      ssize_t bytes_read = -1;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                            &(*data)[offset],
+                                            length,
+                                            extent.start_block() * kBlockSize,
+                                            &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(length));
+    }
+    offset += length;
+  }
+  TEST_AND_RETURN_FALSE(file.size <= data->size());
+  data->resize(file.size);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,52 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_FILES_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_FILES_H__
+
+#include <string>
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+// Reading the files of an image through a loop mount needs root. This
+// reads the directory tree and block maps of an ext2/3/4 image directly
+// with libext2fs instead, so that the file data can be read from the image
+// itself by anyone who can read the image.
+
+namespace chromeos_update_engine {
+
+struct Ext2File {
+  std::string path;  // starting with "/"
+  uint32_t inode;
+  uint64_t size;
+
+  // The blocks of the image holding the file's data, in order. Holes are
+  // kSparseHole extents, up to the end of the file's last block.
+  std::vector<Extent> extents;
+};
+
+class Ext2Files {
+ public:
+  // Lists the non-empty regular files of the image at |image| into |files|.
+  // A file with several hard links is listed once, at the first path found.
+  // /lost+found and files whose data is stored in their inode are skipped.
+  // Returns false if the image isn't an ext2/3/4 filesystem with 4096 byte
+  // blocks or can't be read.
+  static bool ListRegularFiles(const std::string& image,
+                               std::vector<Ext2File>* files);
+
+  // Reads the data of |file| from |fd|, an open descriptor of its image,
+  // into |data|. Holes read as zeros. Returns true on success.
+  static bool ReadFile(int fd, const Ext2File& file, std::vector<char>* data);
+
+ private:
+  // This should never be constructed.
+  DISALLOW_IMPLICIT_CONSTRUCTORS(Ext2Files);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_FILES_H__
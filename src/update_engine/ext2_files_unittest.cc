@@ -0,0 +1,128 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "files/scoped_file.h"
+#include "strings/string_printf.h"
+#include "update_engine/ext2_files.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::string;
+using std::vector;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+class Ext2FilesTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/Ext2FilesTest.XXXXXX",
+                                         &dir_));
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/Ext2FilesTest_img.XXXXXX",
+                                    &image_,
+                                    NULL));
+  }
+  virtual void TearDown() {
+    EXPECT_TRUE(utils::RecursiveUnlinkDir(dir_));
+    EXPECT_EQ(0, unlink(image_.c_str()));
+  }
+
+  // Makes |image_| an image of filesystem |type| holding the contents of
+  // |dir_|, which doesn't need root, unlike mounting it.
+  void CreateImage(const char* type) {
+    EXPECT_EQ(0, System(StringPrintf("mkfs.%s -q -b 4096 -F -d %s %s 8M",
+                                     type, dir_.c_str(), image_.c_str())));
+  }
+
+  string dir_;
+  string image_;
+};
+
+TEST_F(Ext2FilesTest, ListRegularFilesTest) {
+  vector<char> big(3 * 4096 + 100);
+  FillWithData(&big);
+  EXPECT_TRUE(WriteFileVector(dir_ + "/big", big));
+  EXPECT_TRUE(WriteFileString(dir_ + "/empty", ""));
+  EXPECT_EQ(0, mkdir((dir_ + "/some_dir").c_str(), 0755));
+  EXPECT_TRUE(WriteFileString(dir_ + "/some_dir/test", "T\n"));
+  EXPECT_EQ(0, link((dir_ + "/some_dir/test").c_str(),
+                    (dir_ + "/testlink").c_str()));
+  EXPECT_EQ(0, symlink("/some/target", (dir_ + "/sym").c_str()));
+  // A file with a hole in the middle.
+  vector<char> sparse(5 * 4096, 0);
+  sparse[0] = 'a';
+  sparse.back() = 'z';
+  EXPECT_TRUE(WriteFileVector(dir_ + "/sparse", sparse));
+  CreateImage("ext2");
+
+  vector<Ext2File> files;
+  EXPECT_TRUE(Ext2Files::ListRegularFiles(image_, &files));
+  map<string, Ext2File> files_by_path;
+  for (const Ext2File& file : files)
+    files_by_path[file.path] = file;
+  // The hard link is only listed once, and the empty file and symlink not
+  // at all.
+  EXPECT_EQ(3, files.size());
+  EXPECT_EQ(1, files_by_path.count("/big"));
+  EXPECT_EQ(1, files_by_path.count("/sparse"));
+  EXPECT_EQ(1, files_by_path.count("/some_dir/test") +
+               files_by_path.count("/testlink"));
+
+  int fd = open(image_.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  files::ScopedFD fd_closer(fd);
+  vector<char> data;
+  const Ext2File& big_file = files_by_path["/big"];
+  EXPECT_EQ(big.size(), big_file.size);
+  EXPECT_EQ(4, graph_utils::BlocksInExtents(big_file.extents));
+  EXPECT_TRUE(Ext2Files::ReadFile(fd, big_file, &data));
+  EXPECT_TRUE(data == big);
+
+  const Ext2File& sparse_file = files_by_path["/sparse"];
+  EXPECT_EQ(5, graph_utils::BlocksInExtents(sparse_file.extents));
+  bool has_hole = false;
+  for (const Extent& extent : sparse_file.extents)
+    has_hole = has_hole || extent.start_block() == kSparseHole;
+  EXPECT_TRUE(has_hole);
+  EXPECT_TRUE(Ext2Files::ReadFile(fd, sparse_file, &data));
+  EXPECT_TRUE(data == sparse);
+}
+
+TEST_F(Ext2FilesTest, Ext4Test) {
+  // Files on ext4 are mapped by extents rather than block lists.
+  vector<char> big(300 * 4096);
+  FillWithData(&big);
+  EXPECT_TRUE(WriteFileVector(dir_ + "/big", big));
+  CreateImage("ext4");
+
+  vector<Ext2File> files;
+  EXPECT_TRUE(Ext2Files::ListRegularFiles(image_, &files));
+  ASSERT_EQ(1, files.size());
+  EXPECT_EQ("/big", files[0].path);
+  int fd = open(image_.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  files::ScopedFD fd_closer(fd);
+  vector<char> data;
+  EXPECT_TRUE(Ext2Files::ReadFile(fd, files[0], &data));
+  EXPECT_TRUE(data == big);
+}
+
+TEST_F(Ext2FilesTest, NotAnImageTest) {
+  vector<Ext2File> files;
+  EXPECT_TRUE(WriteFileString(image_, "not an image"));
+  EXPECT_FALSE(Ext2Files::ListRegularFiles(image_, &files));
+}
+
+}  // namespace chromeos_update_engine
@@ -10,13 +10,13 @@
 #include <ext2fs/ext2_io.h>
 #include <ext2fs/ext2fs.h>
 
-#include "files/scoped_file.h"
 #include "strings/string_printf.h"
-#include "update_engine/bzip.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/ext2_metadata.h"
+#include "update_engine/ext2_utils.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/utils.h"
 
 using std::min;
@@ -29,19 +29,6 @@ namespace chromeos_update_engine {
 namespace {
 const size_t kBlockSize = 4096;
 
-typedef DeltaDiffGenerator::Block Block;
-
-// Utility class to close a file system
-class ScopedExt2fsCloser {
- public:
-  explicit ScopedExt2fsCloser(ext2_filsys filsys) : filsys_(filsys) {}
-  ~ScopedExt2fsCloser() { ext2fs_close(filsys_); }
-
- private:
-  ext2_filsys filsys_;
-  DISALLOW_COPY_AND_ASSIGN(ScopedExt2fsCloser);
-};
-
 // Read data from the specified extents.
 bool ReadExtentsData(const ext2_filsys fs,
                      const vector<Extent>& extents,
@@ -56,9 +43,9 @@ bool ReadExtentsData(const ext2_filsys fs,
 
   // Read in the data blocks
   const size_t kMaxReadBlocks = 256;
-  vector<Block>::size_type blocks_copied_count = 0;
+  size_t blocks_copied_count = 0;
   for (const Extent& extent : extents) {
-    vector<Block>::size_type blocks_read = 0;
+    size_t blocks_read = 0;
     while (blocks_read < extent.num_blocks()) {
       const int copy_block_cnt =
           min(kMaxReadBlocks,
@@ -77,47 +64,9 @@ bool ReadExtentsData(const ext2_filsys fs,
   return true;
 }
 
-// Compute the bsdiff between two metadata blobs.
-bool ComputeMetadataBsdiff(const vector<char>& old_metadata,
-                           const vector<char>& new_metadata,
-                           vector<char>* bsdiff_delta) {
-  const string kTempFileTemplate("/tmp/CrAU_temp_data.XXXXXX");
-
-  // Write the metadata buffers to temporary files
-  int old_fd;
-  string temp_old_file_path;
-  TEST_AND_RETURN_FALSE(
-      utils::MakeTempFile(kTempFileTemplate, &temp_old_file_path, &old_fd));
-  TEST_AND_RETURN_FALSE(old_fd >= 0);
-  ScopedPathUnlinker temp_old_file_path_unlinker(temp_old_file_path);
-  files::ScopedFD old_fd_closer(old_fd);
-  TEST_AND_RETURN_FALSE(utils::WriteAll(old_fd,
-                                        &old_metadata[0],
-                                        old_metadata.size()));
-
-  int new_fd;
-  string temp_new_file_path;
-  TEST_AND_RETURN_FALSE(
-      utils::MakeTempFile(kTempFileTemplate, &temp_new_file_path, &new_fd));
-  TEST_AND_RETURN_FALSE(new_fd >= 0);
-  ScopedPathUnlinker temp_new_file_path_unlinker(temp_new_file_path);
-  files::ScopedFD new_fd_closer(new_fd);
-  TEST_AND_RETURN_FALSE(utils::WriteAll(new_fd,
-                                        &new_metadata[0],
-                                        new_metadata.size()));
-
-  // Perform bsdiff on these files
-  TEST_AND_RETURN_FALSE(
-      DeltaDiffGenerator::BsdiffFiles(temp_old_file_path,
-                                      temp_new_file_path,
-                                      bsdiff_delta));
-
-  return true;
-}
-
-// Add the specified metadata extents to the graph and blocks vector.
+// Add the specified metadata extents to the graph and block owners.
 bool AddMetadataExtents(Graph* graph,
-                        vector<Block>* blocks,
+                        BlockOwners* blocks,
                         const ext2_filsys fs_old,
                         const ext2_filsys fs_new,
                         const string& metadata_name,
@@ -136,20 +85,10 @@ bool AddMetadataExtents(Graph* graph,
     TEST_AND_RETURN_FALSE(ReadExtentsData(fs_new, extents, &new_data));
 
     // Determine the best way to compress this.
-    vector<char> new_data_bz;
-    TEST_AND_RETURN_FALSE(BzipCompress(new_data, &new_data_bz));
-    CHECK(!new_data_bz.empty());
-
-    size_t current_best_size = 0;
-    if (new_data.size() <= new_data_bz.size()) {
-      op.set_type(InstallOperation_Type_REPLACE);
-      current_best_size = new_data.size();
-      data = new_data;
-    } else {
-      op.set_type(InstallOperation_Type_REPLACE_BZ);
-      current_best_size = new_data_bz.size();
-      data = new_data_bz;
-    }
+    InstallOperation_Type type;
+    TEST_AND_RETURN_FALSE(CompressReplaceData(new_data, &data, &type));
+    op.set_type(type);
+    size_t current_best_size = data.size();
 
     if (old_data == new_data) {
       // No change in data.
@@ -159,16 +98,24 @@ bool AddMetadataExtents(Graph* graph,
     } else {
       // Try bsdiff of old to new data
       vector<char> bsdiff_delta;
-      TEST_AND_RETURN_FALSE(ComputeMetadataBsdiff(old_data,
-                                                  new_data,
-                                                  &bsdiff_delta));
+      TEST_AND_RETURN_FALSE(DeltaDiffGenerator::BsdiffData(old_data,
+                                                           new_data,
+                                                           &bsdiff_delta));
       CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
 
-      if (bsdiff_delta.size() < current_best_size) {
+      if (IsCheaperOperation(InstallOperation_Type_BSDIFF,
+                             bsdiff_delta.size(),
+                             op.type(),
+                             current_best_size,
+                             new_data.size())) {
         op.set_type(InstallOperation_Type_BSDIFF);
         current_best_size = bsdiff_delta.size();
         data = bsdiff_delta;
       }
+      type = op.type();
+      TEST_AND_RETURN_FALSE(ChooseZstdDiff(old_data, new_data, &data, &type));
+      op.set_type(type);
+      current_best_size = data.size();
     }
 
     CHECK_EQ(data.size(), current_best_size);
@@ -176,7 +123,8 @@ bool AddMetadataExtents(Graph* graph,
     // Set the source and dest extents to be the same since the filesystem
     // structures are identical
     if (op.type() == InstallOperation_Type_MOVE ||
-        op.type() == InstallOperation_Type_BSDIFF) {
+        op.type() == InstallOperation_Type_BSDIFF ||
+        op.type() == InstallOperation_Type_ZSTD_DIFF) {
       DeltaDiffGenerator::StoreExtents(extents, op.mutable_src_extents());
       op.set_src_length(old_data.size());
     }
@@ -186,7 +134,7 @@ bool AddMetadataExtents(Graph* graph,
   }
 
   // Write data to output file
-  if (op.type() != InstallOperation_Type_MOVE) {
+  if (!data.empty()) {
     op.set_data_offset(*data_file_size);
     op.set_data_length(data.size());
   }
@@ -194,14 +142,14 @@ bool AddMetadataExtents(Graph* graph,
   TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, &data[0], data.size()));
   *data_file_size += data.size();
 
-  // Now, insert into graph and blocks vector
+  // Now, insert into graph and block owners
   graph->resize(graph->size() + 1);
   Vertex::Index vertex = graph->size() - 1;
   (*graph)[vertex].op = op;
   CHECK((*graph)[vertex].op.has_type());
   (*graph)[vertex].file_name = metadata_name;
 
-  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+  TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlockOwners(
       (*graph)[vertex].op,
       *graph,
       vertex,
@@ -212,7 +160,7 @@ bool AddMetadataExtents(Graph* graph,
 
 // Reads the file system metadata extents.
 bool ReadFilesystemMetadata(Graph* graph,
-                            vector<Block>* blocks,
+                            BlockOwners* blocks,
                             const ext2_filsys fs_old,
                             const ext2_filsys fs_new,
                             int data_fd,
@@ -299,7 +247,7 @@ int ProcessInodeMetadataBlocks(ext2_filsys fs,
 
 // Read inode metadata blocks.
 bool ReadInodeMetadata(Graph* graph,
-                       vector<Block>* blocks,
+                       BlockOwners* blocks,
                        const ext2_filsys fs_old,
                        const ext2_filsys fs_new,
                        int data_fd,
@@ -417,7 +365,7 @@ bool ReadInodeMetadata(Graph* graph,
     }
 
     // We have identical inode metadata blocks, we can now add them to
-    // our graph and blocks vector
+    // our graph and block owners
     string metadata_name = StringPrintf("<fs-inode-%d-metadata>", ino);
     TEST_AND_RETURN_FALSE(AddMetadataExtents(graph,
                                              blocks,
@@ -445,7 +393,7 @@ bool ReadInodeMetadata(Graph* graph,
 // metadata extents to blocks.
 // Returns true on success.
 bool Ext2Metadata::DeltaReadMetadata(Graph* graph,
-                                     vector<Block>* blocks,
+                                     BlockOwners* blocks,
                                      const string& old_image,
                                      const string& new_image,
                                      int data_fd,
@@ -5,6 +5,7 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_METADATA_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_METADATA_H__
 
+#include "update_engine/block_owners.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/graph_types.h"
 
@@ -21,7 +22,7 @@ class Ext2Metadata {
   // metadata extents to blocks.
   // Returns true on success.
   static bool DeltaReadMetadata(Graph* graph,
-                                std::vector<DeltaDiffGenerator::Block>* blocks,
+                                BlockOwners* blocks,
                                 const std::string& old_image,
                                 const std::string& new_image,
                                 int data_fd,
@@ -26,7 +26,6 @@ using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 
 class Ext2MetadataTest : public ::testing::Test {
 };
@@ -42,7 +41,7 @@ TEST_F(Ext2MetadataTest, RunAsRootReadMetadataDissimilarFileSystems) {
   CreateEmptyExtImageAtPath(b_img, 11534336, 4096);
 
   Graph graph;
-  vector<Block> blocks;
+  BlockOwners blocks(0);
   EXPECT_TRUE(Ext2Metadata::DeltaReadMetadata(&graph,
                                               &blocks,
                                               a_img,
@@ -55,7 +54,7 @@ TEST_F(Ext2MetadataTest, RunAsRootReadMetadataDissimilarFileSystems) {
   CreateEmptyExtImageAtPath(b_img, 10485759, 8192);
 
   graph.clear();
-  blocks.clear();
+  blocks = BlockOwners(0);
   EXPECT_TRUE(Ext2Metadata::DeltaReadMetadata(&graph,
                                               &blocks,
                                               a_img,
@@ -93,7 +92,7 @@ TEST_F(Ext2MetadataTest, RunAsRootReadMetadata) {
   files::ScopedFD fd_closer(fd);
 
   Graph graph;
-  vector<Block> blocks(image_size / block_size);
+  BlockOwners blocks(image_size / block_size);
   off_t data_file_size;
   EXPECT_TRUE(Ext2Metadata::DeltaReadMetadata(&graph,
                                               &blocks,
@@ -4,6 +4,7 @@
 
 #include "update_engine/extent_ranges.h"
 
+#include <algorithm>
 #include <set>
 #include <utility>
 #include <vector>
@@ -51,140 +52,238 @@ void ExtentRanges::SubtractBlock(uint64_t block) {
 
 namespace {
 
-Extent UnionOverlappingExtents(const Extent& first, const Extent& second) {
-  CHECK_NE(kSparseHole, first.start_block());
-  CHECK_NE(kSparseHole, second.start_block());
-  uint64_t start = min(first.start_block(), second.start_block());
-  uint64_t end = max(first.start_block() + first.num_blocks(),
-                     second.start_block() + second.num_blocks());
-  return ExtentForRange(start, end - start);
+typedef ExtentRanges::Range Range;
+typedef ExtentRanges::RangeVector RangeVector;
+
+bool RangeStartLess(const Range& a, const Range& b) {
+  return a.start < b.start;
 }
 
-}  // namespace {}
+// Returns true if |range| ends before |start|, i.e. doesn't touch it.
+bool RangeEndsBefore(const Range& range, uint64_t start) {
+  return range.end() < start;
+}
 
-void ExtentRanges::AddExtent(Extent extent) {
-  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+// Returns true if |range| ends at or before |start|, i.e. doesn't overlap it.
+bool RangeEndsAtOrBefore(const Range& range, uint64_t start) {
+  return range.end() <= start;
+}
+
+// Appends |range| to |out|, coalescing it with the last element if they
+// overlap or touch. |range| must not start before the last element.
+void AppendRange(const Range& range, RangeVector* out) {
+  if (!out->empty() && out->back().end() >= range.start) {
+    Range& last = out->back();
+    if (range.end() > last.end())
+      last.count = range.end() - last.start;
     return;
+  }
+  out->push_back(range);
+}
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e; ++it) {
-    if (ExtentsOverlapOrTouch(*it, extent)) {
-      end_del = it;
-      ++end_del;
-      del_blocks += it->num_blocks();
-      if (begin_del == extent_set_.end())
-        begin_del = it;
-
-      extent = UnionOverlappingExtents(extent, *it);
-    }
+// Appends the non-empty, non-sparse extents in |extents| to |out|.
+template<typename T>
+void AppendExtentsAsRanges(const T& extents, RangeVector* out) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+      continue;
+    Range range = { extent.start_block(), extent.num_blocks() };
+    out->push_back(range);
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(extent);
-  blocks_ -= del_blocks;
-  blocks_ += extent.num_blocks();
 }
 
-namespace {
-// Returns base - subtractee (set subtraction).
-ExtentRanges::ExtentSet SubtractOverlappingExtents(const Extent& base,
-                                                   const Extent& subtractee) {
-  ExtentRanges::ExtentSet ret;
-  if (subtractee.start_block() > base.start_block()) {
-    ret.insert(ExtentForRange(base.start_block(),
-                              subtractee.start_block() - base.start_block()));
+// Sorts |ranges| and coalesces overlapping or touching elements.
+void Normalize(RangeVector* ranges) {
+  if (!std::is_sorted(ranges->begin(), ranges->end(), RangeStartLess))
+    std::sort(ranges->begin(), ranges->end(), RangeStartLess);
+  RangeVector out;
+  out.reserve(ranges->size());
+  for (const Range& range : *ranges)
+    AppendRange(range, &out);
+  ranges->swap(out);
+}
+
+// The following take normalized inputs and produce a normalized |out|.
+
+void UnionRangeVectors(const RangeVector& a,
+                       const RangeVector& b,
+                       RangeVector* out) {
+  out->reserve(a.size() + b.size());
+  RangeVector::const_iterator a_it = a.begin(), b_it = b.begin();
+  while (a_it != a.end() || b_it != b.end()) {
+    if (b_it == b.end() || (a_it != a.end() && a_it->start < b_it->start))
+      AppendRange(*a_it++, out);
+    else
+      AppendRange(*b_it++, out);
   }
-  uint64_t base_end = base.start_block() + base.num_blocks();
-  uint64_t subtractee_end = subtractee.start_block() + subtractee.num_blocks();
-  if (base_end > subtractee_end) {
-    ret.insert(ExtentForRange(subtractee_end, base_end - subtractee_end));
+}
+
+void SubtractRangeVectors(const RangeVector& a,
+                          const RangeVector& b,
+                          RangeVector* out) {
+  out->reserve(a.size() + b.size());
+  RangeVector::const_iterator b_it = b.begin();
+  for (Range range : a) {
+    // Skip subtrahends entirely before this range.
+    while (b_it != b.end() && b_it->end() <= range.start)
+      ++b_it;
+    // Carve out every subtrahend overlapping this range. The last one may
+    // also overlap the next range, so it's not consumed.
+    RangeVector::const_iterator cut = b_it;
+    while (range.count > 0 && cut != b.end() && cut->start < range.end()) {
+      if (cut->start > range.start) {
+        Range head = { range.start, cut->start - range.start };
+        out->push_back(head);
+      }
+      if (cut->end() >= range.end()) {
+        range.count = 0;
+      } else {
+        range.count = range.end() - cut->end();
+        range.start = cut->end();
+        ++cut;
+      }
+    }
+    if (range.count > 0)
+      out->push_back(range);
+  }
+}
+
+void IntersectRangeVectors(const RangeVector& a,
+                           const RangeVector& b,
+                           RangeVector* out) {
+  RangeVector::const_iterator a_it = a.begin(), b_it = b.begin();
+  while (a_it != a.end() && b_it != b.end()) {
+    uint64_t start = max(a_it->start, b_it->start);
+    uint64_t end = min(a_it->end(), b_it->end());
+    if (start < end) {
+      Range range = { start, end - start };
+      out->push_back(range);
+    }
+    if (a_it->end() < b_it->end())
+      ++a_it;
+    else
+      ++b_it;
   }
-  return ret;
 }
+
 }  // namespace {}
 
-void ExtentRanges::SubtractExtent(const Extent& extent) {
+void ExtentRanges::Assign(RangeVector* ranges) {
+  ranges_.swap(*ranges);
+  blocks_ = 0;
+  for (const Range& range : ranges_)
+    blocks_ += range.count;
+}
+
+void ExtentRanges::AddExtent(Extent extent) {
   if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
     return;
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
+  Range range = { extent.start_block(), extent.num_blocks() };
+  // The first range that overlaps or touches |range|, and one past the last.
+  RangeVector::iterator begin_del = std::lower_bound(
+      ranges_.begin(), ranges_.end(), range.start, RangeEndsBefore);
+  RangeVector::iterator end_del = begin_del;
   uint64_t del_blocks = 0;
-  ExtentSet new_extents;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e; ++it) {
-    if (!ExtentsOverlap(*it, extent))
-      continue;
-
-    if (begin_del == extent_set_.end())
-      begin_del = it;
-    end_del = it;
-    ++end_del;
+  for (; end_del != ranges_.end() && end_del->start <= range.end();
+       ++end_del) {
+    uint64_t start = min(range.start, end_del->start);
+    range.count = max(range.end(), end_del->end()) - start;
+    range.start = start;
+    del_blocks += end_del->count;
+  }
+  begin_del = ranges_.erase(begin_del, end_del);
+  ranges_.insert(begin_del, range);
+  blocks_ -= del_blocks;
+  blocks_ += range.count;
+}
 
-    del_blocks += it->num_blocks();
+void ExtentRanges::SubtractExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return;
 
-    ExtentSet subtraction = SubtractOverlappingExtents(*it, extent);
-    for (ExtentSet::iterator jt = subtraction.begin(), je = subtraction.end();
-         jt != je; ++jt) {
-      new_extents.insert(*jt);
-      del_blocks -= jt->num_blocks();
+  Range cut = { extent.start_block(), extent.num_blocks() };
+  // The first range that overlaps |cut|, and one past the last.
+  RangeVector::iterator begin_del = std::lower_bound(
+      ranges_.begin(), ranges_.end(), cut.start, RangeEndsAtOrBefore);
+  RangeVector::iterator end_del = begin_del;
+  RangeVector remainder;
+  for (; end_del != ranges_.end() && end_del->start < cut.end(); ++end_del) {
+    blocks_ -= end_del->count;
+    if (end_del->start < cut.start) {
+      Range head = { end_del->start, cut.start - end_del->start };
+      remainder.push_back(head);
+    }
+    if (end_del->end() > cut.end()) {
+      Range tail = { cut.end(), end_del->end() - cut.end() };
+      remainder.push_back(tail);
     }
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(new_extents.begin(), new_extents.end());
-  blocks_ -= del_blocks;
+  for (const Range& range : remainder)
+    blocks_ += range.count;
+  begin_del = ranges_.erase(begin_del, end_del);
+  ranges_.insert(begin_del, remainder.begin(), remainder.end());
 }
 
 void ExtentRanges::AddRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-           e = ranges.extent_set_.end(); it != e; ++it) {
-    AddExtent(*it);
-  }
+  RangeVector result;
+  UnionRangeVectors(ranges_, ranges.ranges_, &result);
+  Assign(&result);
 }
 
 void ExtentRanges::SubtractRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-           e = ranges.extent_set_.end(); it != e; ++it) {
-    SubtractExtent(*it);
-  }
+  RangeVector result;
+  SubtractRangeVectors(ranges_, ranges.ranges_, &result);
+  Assign(&result);
+}
+
+void ExtentRanges::IntersectRanges(const ExtentRanges& ranges) {
+  RangeVector result;
+  IntersectRangeVectors(ranges_, ranges.ranges_, &result);
+  Assign(&result);
 }
 
 void ExtentRanges::AddExtents(const vector<Extent>& extents) {
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e; ++it) {
-    AddExtent(*it);
-  }
+  ExtentRanges other;
+  AppendExtentsAsRanges(extents, &other.ranges_);
+  Normalize(&other.ranges_);
+  AddRanges(other);
 }
 
 void ExtentRanges::SubtractExtents(const vector<Extent>& extents) {
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e; ++it) {
-    SubtractExtent(*it);
-  }
+  ExtentRanges other;
+  AppendExtentsAsRanges(extents, &other.ranges_);
+  Normalize(&other.ranges_);
+  SubtractRanges(other);
 }
 
 void ExtentRanges::AddRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent> &exts) {
-  for (int i = 0, e = exts.size(); i != e; ++i) {
-    AddExtent(exts.Get(i));
-  }
+  ExtentRanges other;
+  AppendExtentsAsRanges(exts, &other.ranges_);
+  Normalize(&other.ranges_);
+  AddRanges(other);
 }
 
 void ExtentRanges::SubtractRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent> &exts) {
-  for (int i = 0, e = exts.size(); i != e; ++i) {
-    SubtractExtent(exts.Get(i));
-  }
+  ExtentRanges other;
+  AppendExtentsAsRanges(exts, &other.ranges_);
+  Normalize(&other.ranges_);
+  SubtractRanges(other);
+}
+
+ExtentRanges::ExtentSet ExtentRanges::extent_set() const {
+  ExtentSet ret;
+  for (const Range& range : ranges_)
+    ret.insert(ret.end(), ExtentForRange(range.start, range.count));
+  return ret;
 }
 
 void ExtentRanges::Dump() const {
   LOG(INFO) << "ExtentRanges Dump. blocks: " << blocks_;
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-           e = extent_set_.end();
-       it != e; ++it) {
-    LOG(INFO) << "{" << it->start_block() << ", " << it->num_blocks() << "}";
+  for (const Range& range : ranges_) {
+    LOG(INFO) << "{" << range.start << ", " << range.count << "}";
   }
 }
 
@@ -202,11 +301,9 @@ std::vector<Extent> ExtentRanges::GetExtentsForBlockCount(
     return out;
   uint64_t out_blocks = 0;
   CHECK(count <= blocks_);
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-           e = extent_set_.end();
-       it != e; ++it) {
+  for (const Range& range : ranges_) {
     const uint64_t blocks_needed = count - out_blocks;
-    const Extent& extent = *it;
+    const Extent extent = ExtentForRange(range.start, range.count);
     out.push_back(extent);
     out_blocks += extent.num_blocks();
     if (extent.num_blocks() < blocks_needed)
@@ -19,6 +19,10 @@
 // ignores sparse hole extents mostly to avoid confusion between extending a
 // sparse hole range vs. set addition but also to ensure that the delta
 // generator doesn't use sparse holes as scratch space.
+//
+// Internally the blocks are kept as a sorted vector of disjoint,
+// non-touching {start, count} pairs. Adding or subtracting a whole collection
+// sorts it once and merges it in a single pass.
 
 namespace chromeos_update_engine {
 
@@ -32,6 +36,13 @@ Extent ExtentForRange(uint64_t start_block, uint64_t num_blocks);
 
 class ExtentRanges {
  public:
+  // The blocks [start, start + count).
+  struct Range {
+    uint64_t start;
+    uint64_t count;
+    uint64_t end() const { return start + count; }
+  };
+  typedef std::vector<Range> RangeVector;
   typedef std::set<Extent, ExtentLess> ExtentSet;
 
   ExtentRanges() : blocks_(0) {}
@@ -47,6 +58,8 @@ class ExtentRanges {
       const ::google::protobuf::RepeatedPtrField<Extent> &exts);
   void AddRanges(const ExtentRanges& ranges);
   void SubtractRanges(const ExtentRanges& ranges);
+  // Keeps only the blocks that are also in |ranges| (set intersection).
+  void IntersectRanges(const ExtentRanges& ranges);
 
   static bool ExtentsOverlapOrTouch(const Extent& a, const Extent& b);
   static bool ExtentsOverlap(const Extent& a, const Extent& b);
@@ -55,16 +68,23 @@ class ExtentRanges {
   void Dump() const;
 
   uint64_t blocks() const { return blocks_; }
-  const ExtentSet& extent_set() const { return extent_set_; }
+  const RangeVector& ranges() const { return ranges_; }
+
+  // Returns a copy of the contents as a set of Extent messages.
+  ExtentSet extent_set() const;
 
   // Returns an ordered vector of extents for |count| blocks,
-  // using extents in extent_set_. The returned extents are not
-  // removed from extent_set_. |count| must be less than or equal to
+  // using extents in ranges_. The returned extents are not
+  // removed from ranges_. |count| must be less than or equal to
   // the number of blocks in this extent set.
   std::vector<Extent> GetExtentsForBlockCount(uint64_t count) const;
 
  private:
-  ExtentSet extent_set_;
+  // Replaces the contents with |ranges|, which must be sorted and
+  // normalized, and recomputes blocks_.
+  void Assign(RangeVector* ranges);
+
+  RangeVector ranges_;
   uint64_t blocks_;
 };
 
@@ -2,13 +2,19 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <chrono>
+#include <cstdlib>
+#include <set>
 #include <vector>
 
+#include <glog/logging.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/extent_ranges.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
 
+using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -105,6 +111,59 @@ void ExpectFalseRangesOverlap(uint64_t a_start, uint64_t a_num,
                                                            a_num)));
 }
 
+// Returns |count| random extents with blocks below |max_block|.
+vector<Extent> RandomExtents(size_t count, uint64_t max_block,
+                             uint64_t max_length) {
+  vector<Extent> extents;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t start = rand() % max_block;
+    extents.push_back(ExtentForRange(start, rand() % (max_length + 1)));
+  }
+  return extents;
+}
+
+void AddBlocks(const vector<Extent>& extents, set<uint64_t>* blocks) {
+  for (const Extent& extent : extents) {
+    for (uint64_t i = 0; i < extent.num_blocks(); i++)
+      blocks->insert(extent.start_block() + i);
+  }
+}
+
+void SubtractBlocks(const vector<Extent>& extents, set<uint64_t>* blocks) {
+  for (const Extent& extent : extents) {
+    for (uint64_t i = 0; i < extent.num_blocks(); i++)
+      blocks->erase(extent.start_block() + i);
+  }
+}
+
+// Checks that |ranges| holds exactly |blocks| in normalized form.
+void ExpectRangesHoldBlocks(const ExtentRanges& ranges,
+                            const set<uint64_t>& blocks) {
+  EXPECT_EQ(blocks.size(), ranges.blocks());
+  set<uint64_t> actual;
+  const ExtentRanges::Range* previous = NULL;
+  for (const ExtentRanges::Range& range : ranges.ranges()) {
+    EXPECT_GT(range.count, 0);
+    if (previous) {
+      EXPECT_LT(previous->end(), range.start);
+    }
+    previous = &range;
+    for (uint64_t i = 0; i < range.count; i++)
+      actual.insert(range.start + i);
+  }
+  EXPECT_TRUE(actual == blocks);
+}
+
+// Runs |func| and logs how long it took.
+template<typename F>
+void TimeIt(const char* name, F func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  LOG(INFO) << name << ": " << utils::ToString(elapsed);
+}
+
 }  // namespace {}
 
 TEST(ExtentRangesTest, ExtentsOverlapTest) {
@@ -220,6 +279,57 @@ TEST(ExtentRangesTest, MultipleRanges) {
     uint64_t expected[] = {3, 2};
     EXPECT_RANGE_EQ(ranges_b, expected);
   }
+  ranges_a.AddExtent(ExtentForRange(4, 10));
+  ranges_a.IntersectRanges(ranges_b);
+  {
+    uint64_t expected[] = {4, 1};
+    EXPECT_RANGE_EQ(ranges_a, expected);
+  }
+}
+
+TEST(ExtentRangesTest, RandomizedBulkOperationsTest) {
+  srand(3);
+  for (int round = 0; round < 20; round++) {
+    ExtentRanges ranges;
+    set<uint64_t> blocks;
+    for (int step = 0; step < 20; step++) {
+      vector<Extent> extents = RandomExtents(1 + rand() % 30, 2000, 40);
+      switch (rand() % 5) {
+        case 0:
+          ranges.AddExtents(extents);
+          AddBlocks(extents, &blocks);
+          break;
+        case 1:
+          ranges.SubtractExtents(extents);
+          SubtractBlocks(extents, &blocks);
+          break;
+        case 2:
+          for (const Extent& extent : extents)
+            ranges.AddExtent(extent);
+          AddBlocks(extents, &blocks);
+          break;
+        case 3:
+          for (const Extent& extent : extents)
+            ranges.SubtractExtent(extent);
+          SubtractBlocks(extents, &blocks);
+          break;
+        case 4: {
+          ExtentRanges other;
+          other.AddExtents(extents);
+          ranges.IntersectRanges(other);
+          set<uint64_t> other_blocks, intersection;
+          AddBlocks(extents, &other_blocks);
+          for (uint64_t block : blocks) {
+            if (other_blocks.count(block))
+              intersection.insert(block);
+          }
+          blocks.swap(intersection);
+          break;
+        }
+      }
+      ExpectRangesHoldBlocks(ranges, blocks);
+    }
+  }
 }
 
 TEST(ExtentRangesTest, GetExtentsForBlockCountTest) {
@@ -253,4 +363,61 @@ TEST(ExtentRangesTest, GetExtentsForBlockCountTest) {
   }
 }
 
+// Not run by default. Run with --gtest_also_run_disabled_tests to time the
+// common ExtentRanges operations on large, fragmented inputs.
+TEST(ExtentRangesTest, DISABLED_Benchmark) {
+  const size_t kExtentCount = 200000;
+  const uint64_t kMaxBlock = 1 << 24;
+  srand(5);
+  vector<Extent> a = RandomExtents(kExtentCount, kMaxBlock, 64);
+  vector<Extent> b = RandomExtents(kExtentCount, kMaxBlock, 64);
+  ::google::protobuf::RepeatedPtrField<Extent> b_field;
+  for (const Extent& extent : b)
+    *b_field.Add() = extent;
+
+  ExtentRanges ranges_a, ranges_b;
+  TimeIt("AddExtent x50K", [&] {
+    for (size_t i = 0; i < 50000; i++)
+      ranges_a.AddExtent(a[i]);
+  });
+  ranges_a.AddExtents(a);
+  TimeIt("AddRepeatedExtents 200K", [&] {
+    ranges_b.AddRepeatedExtents(b_field);
+  });
+  TimeIt("AddRanges", [&] {
+    ExtentRanges copy = ranges_a;
+    copy.AddRanges(ranges_b);
+  });
+  TimeIt("SubtractRanges", [&] {
+    ExtentRanges copy = ranges_a;
+    copy.SubtractRanges(ranges_b);
+  });
+  TimeIt("IntersectRanges", [&] {
+    ExtentRanges copy = ranges_a;
+    copy.IntersectRanges(ranges_b);
+  });
+  TimeIt("SubtractExtent x10K", [&] {
+    ExtentRanges copy = ranges_a;
+    for (size_t i = 0; i < 10000; i++)
+      copy.SubtractExtent(b[i]);
+  });
+  TimeIt("GetExtentsForBlockCount", [&] {
+    EXPECT_FALSE(
+        ranges_a.GetExtentsForBlockCount(ranges_a.blocks() / 2).empty());
+  });
+  // The client side pattern in DeltaPerformer::IsIdempotentOperation.
+  TimeIt("IsIdempotentOperation pattern x10K", [&] {
+    for (size_t i = 0; i + 8 <= 80000; i += 8) {
+      ExtentRanges src;
+      ::google::protobuf::RepeatedPtrField<Extent> src_field, dst_field;
+      for (size_t j = 0; j < 4; j++) {
+        *src_field.Add() = a[i + j];
+        *dst_field.Add() = a[i + 4 + j];
+      }
+      src.AddRepeatedExtents(src_field);
+      src.SubtractRepeatedExtents(dst_field);
+    }
+  });
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,254 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/file_block_index.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+
+#include <glib.h>
+#include <glog/logging.h>
+
+#include "files/scoped_file.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;  // bytes
+const size_t kReadBlocks = 256;  // blocks read at a time
+
+// Returns the hash of the |length| bytes at |data| zero padded to a whole
+// block, or 0 if they're all zeros.
+uint64_t HashBlock(const char* data, size_t length) {
+  char block[kBlockSize];
+  memcpy(block, data, length);
+  memset(block + length, 0, kBlockSize - length);
+  static const char kZeros[kBlockSize] = {};
+  if (memcmp(block, kZeros, kBlockSize) == 0)
+    return 0;
+  vector<char> hash;
+  CHECK(OmahaHashCalculator::RawHashOfBytes(block, kBlockSize, &hash));
+  uint64_t value;
+  memcpy(&value, hash.data(), sizeof(value));
+  return value;
+}
+
+// Hashes the files at |paths| from |first| on, skipping |step| files each
+// time, on its own thread. The hasher needs to be started through Start()
+// then waited on through Wait().
+class FileHasher {
+ public:
+  FileHasher(const vector<string>* paths, size_t first, size_t step)
+      : thread_(NULL),
+        paths_(paths),
+        first_(first),
+        step_(step),
+        hashes_((paths->size() - first + step - 1) / step),
+        stats_(hashes_.size()) {}
+  ~FileHasher() { Wait(); }
+
+  // The block hashes and stat of the file at |(*paths)[i]|, which must be
+  // one this hasher was given.
+  const vector<uint64_t>& hashes(size_t i) const {
+    return hashes_[(i - first_) / step_];
+  }
+  const struct stat& stat(size_t i) const {
+    return stats_[(i - first_) / step_];
+  }
+
+  // Starts the hasher. Returns true on success, false on failure.
+  bool Start();
+
+  // Waits for the hasher to complete. Returns true if all of its files were
+  // hashed, false otherwise.
+  bool Wait();
+
+ private:
+  bool HashFiles();
+  static gpointer HashFilesThread(gpointer data);
+
+  GThread* thread_;
+  const vector<string>* paths_;
+  size_t first_;
+  size_t step_;
+  vector<vector<uint64_t> > hashes_;
+  vector<struct stat> stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileHasher);
+};
+
+bool FileHasher::Start() {
+  thread_ = g_thread_try_new("file_hasher", HashFilesThread, this, NULL);
+  TEST_AND_RETURN_FALSE(thread_ != NULL);
+  return true;
+}
+
+bool FileHasher::Wait() {
+  if (!thread_) {
+    return false;
+  }
+  gpointer result = g_thread_join(thread_);
+  thread_ = NULL;
+  TEST_AND_RETURN_FALSE(result == this);
+  return true;
+}
+
+gpointer FileHasher::HashFilesThread(gpointer data) {
+  return reinterpret_cast<FileHasher*>(data)->HashFiles() ? data : NULL;
+}
+
+bool FileHasher::HashFiles() {
+  for (size_t i = first_, j = 0; i < paths_->size(); i += step_, j++) {
+    const string& path = (*paths_)[i];
+    TEST_AND_RETURN_FALSE_ERRNO(lstat(path.c_str(), &stats_[j]) == 0);
+    TEST_AND_RETURN_FALSE(FileBlockIndex::HashBlocks(path, &hashes_[j]));
+  }
+  return true;
+}
+}  // namespace {}
+
+bool FileBlockIndex::Build(const vector<string>& paths) {
+  const size_t num_hashers = std::max(
+      std::min(static_cast<size_t>(sysconf(_SC_NPROCESSORS_ONLN)),
+               paths.size()),
+      static_cast<size_t>(1));
+  vector<std::unique_ptr<FileHasher> > hashers;
+  for (size_t i = 0; i < num_hashers; i++) {
+    hashers.emplace_back(new FileHasher(&paths, i, num_hashers));
+    TEST_AND_RETURN_FALSE(hashers.back()->Start());
+  }
+  bool success = true;
+  for (const std::unique_ptr<FileHasher>& hasher : hashers)
+    success = hasher->Wait() && success;
+  TEST_AND_RETURN_FALSE(success);
+
+  for (size_t i = 0; i < paths.size(); i++) {
+    const FileHasher& hasher = *hashers[i % num_hashers];
+    AddHashes(paths[i], hasher.stat(i).st_ino, hasher.stat(i).st_size,
+              hasher.hashes(i));
+  }
+  return true;
+}
+
+void FileBlockIndex::Add(const string& path,
+                         ino_t inode,
+                         const vector<char>& data) {
+  vector<uint64_t> hashes;
+  HashData(data, &hashes);
+  AddHashes(path, inode, data.size(), hashes);
+}
+
+void FileBlockIndex::AddHashes(const string& path,
+                               ino_t inode,
+                               off_t size,
+                               vector<uint64_t> hashes) {
+  const uint32_t index = files_.size();
+  files_.push_back(File{path, inode, size});
+  std::sort(hashes.begin(), hashes.end());
+  hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+  for (uint64_t hash : hashes) {
+    if (hash != 0)
+      blocks_[hash].push_back(index);
+  }
+}
+
+bool FileBlockIndex::FindMostSimilar(const string& path,
+                                     const set<ino_t>& excluded_inodes,
+                                     string* similar_path) const {
+  vector<uint64_t> hashes;
+  TEST_AND_RETURN_FALSE(HashBlocks(path, &hashes));
+  return FindMostSimilarHashes(hashes, utils::FileSize(path), excluded_inodes,
+                               similar_path);
+}
+
+bool FileBlockIndex::FindMostSimilar(const vector<char>& data,
+                                     const set<ino_t>& excluded_inodes,
+                                     string* similar_path) const {
+  vector<uint64_t> hashes;
+  HashData(data, &hashes);
+  return FindMostSimilarHashes(hashes, data.size(), excluded_inodes,
+                               similar_path);
+}
+
+bool FileBlockIndex::FindMostSimilarHashes(const vector<uint64_t>& hashes,
+                                           off_t size,
+                                           const set<ino_t>& excluded_inodes,
+                                           string* similar_path) const {
+  map<uint32_t, uint64_t> matching_blocks;
+  for (uint64_t hash : hashes) {
+    if (hash == 0)
+      continue;
+    auto it = blocks_.find(hash);
+    if (it == blocks_.end())
+      continue;
+    for (uint32_t index : it->second) {
+      if (!excluded_inodes.count(files_[index].inode))
+        matching_blocks[index]++;
+    }
+  }
+
+  const File* best = NULL;
+  uint64_t best_blocks = 0;
+  for (const auto& match : matching_blocks) {
+    const File& file = files_[match.first];
+    if (match.second > best_blocks ||
+        (match.second == best_blocks &&
+         llabs(file.size - size) < llabs(best->size - size))) {
+      best = &file;
+      best_blocks = match.second;
+    }
+  }
+  if (!best)
+    return false;
+  *similar_path = best->path;
+  return true;
+}
+
+bool FileBlockIndex::HashBlocks(const string& path,
+                                vector<uint64_t>* hashes) {
+  hashes->clear();
+  int fd = open(path.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  files::ScopedFD fd_closer(fd);
+
+  vector<char> buf(kReadBlocks * kBlockSize);
+  for (off_t offset = 0;; offset += buf.size()) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, buf.data(), buf.size(), offset,
+                                          &bytes_read));
+    for (ssize_t block = 0; block < bytes_read;
+         block += static_cast<ssize_t>(kBlockSize)) {
+      hashes->push_back(HashBlock(&buf[block], std::min(
+          kBlockSize, static_cast<size_t>(bytes_read - block))));
+    }
+    if (bytes_read < static_cast<ssize_t>(buf.size()))
+      break;
+  }
+  return true;
+}
+
+void FileBlockIndex::HashData(const vector<char>& data,
+                              vector<uint64_t>* hashes) {
+  hashes->clear();
+  for (size_t block = 0; block < data.size(); block += kBlockSize) {
+    hashes->push_back(HashBlock(&data[block],
+                                std::min(kBlockSize, data.size() - block)));
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,95 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_BLOCK_INDEX_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_BLOCK_INDEX_H__
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "macros.h"
+
+// When a file is renamed or moved between releases, such as a library
+// whose name carries its version, there's no old file at its new path to
+// diff it against. A FileBlockIndex hashes every block of a set of old
+// files so that the one sharing the most blocks with a new file can be
+// found and diffed against instead. A file that didn't change at all then
+// becomes a MOVE, like one that kept its path.
+//
+// Files are stored in whole filesystem blocks, so only blocks at the same
+// offset modulo the block size are compared; those are all a MOVE could
+// reuse, and the diff picks up whatever moved by other amounts. All-zero
+// blocks are left out, as they'd make every sparse file look alike.
+
+namespace chromeos_update_engine {
+
+class FileBlockIndex {
+ public:
+  FileBlockIndex() {}
+
+  // Hashes the blocks of the files at |paths|, spread over as many threads
+  // as there are processors. Returns false if any of them can't be read.
+  bool Build(const std::vector<std::string>& paths);
+
+  // The number of files indexed.
+  size_t size() const { return files_.size(); }
+
+  // Adds a file named |path| with |inode| and contents |data|, for files
+  // that aren't read through the filesystem.
+  void Add(const std::string& path, ino_t inode, const std::vector<char>& data);
+
+  // Sets |similar_path| to the indexed file sharing the most blocks with
+  // the file at |path|, skipping those whose inode is in |excluded_inodes|.
+  // Ties go to the file closest in size. Returns false if no file shares
+  // any block or |path| can't be read.
+  bool FindMostSimilar(const std::string& path,
+                       const std::set<ino_t>& excluded_inodes,
+                       std::string* similar_path) const;
+
+  // Like above, for a file with contents |data|.
+  bool FindMostSimilar(const std::vector<char>& data,
+                       const std::set<ino_t>& excluded_inodes,
+                       std::string* similar_path) const;
+
+  // Hashes each block of the file at |path|, the last one zero padded, into
+  // |hashes|. Blocks of all zeros hash to 0.
+  static bool HashBlocks(const std::string& path,
+                         std::vector<uint64_t>* hashes);
+
+  // Like above, for the contents of a file.
+  static void HashData(const std::vector<char>& data,
+                       std::vector<uint64_t>* hashes);
+
+ private:
+  struct File {
+    std::string path;
+    ino_t inode;
+    off_t size;
+  };
+
+  void AddHashes(const std::string& path,
+                 ino_t inode,
+                 off_t size,
+                 std::vector<uint64_t> hashes);
+  bool FindMostSimilarHashes(const std::vector<uint64_t>& hashes,
+                             off_t size,
+                             const std::set<ino_t>& excluded_inodes,
+                             std::string* similar_path) const;
+
+  std::vector<File> files_;
+
+  // The indexes into |files_| of the files with each block hash.
+  std::unordered_map<uint64_t, std::vector<uint32_t> > blocks_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileBlockIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_BLOCK_INDEX_H__
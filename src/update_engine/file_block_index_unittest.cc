@@ -0,0 +1,163 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/file_block_index.h"
+#include "update_engine/test_utils.h"
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+
+// Returns |num_blocks| blocks of data unlike any other blocks in the test.
+vector<char> UniqueBlocks(size_t num_blocks) {
+  static uint32_t state = 1;
+  vector<char> data(num_blocks * kBlockSize);
+  for (char& c : data) {
+    state = state * 1103515245 + 12345;
+    c = state >> 24;
+  }
+  return data;
+}
+
+vector<char> Concat(const vector<char>& a, const vector<char>& b) {
+  vector<char> result = a;
+  result.insert(result.end(), b.begin(), b.end());
+  return result;
+}
+
+ino_t Inode(const string& path) {
+  struct stat stbuf;
+  EXPECT_EQ(0, lstat(path.c_str(), &stbuf));
+  return stbuf.st_ino;
+}
+}  // namespace {}
+
+class FileBlockIndexTest : public ::testing::Test { };
+
+TEST(FileBlockIndexTest, HashBlocksTest) {
+  ScopedTempFile file;
+  vector<char> data = Concat(UniqueBlocks(1), vector<char>(kBlockSize, 0));
+  data.push_back('a');
+  ASSERT_TRUE(WriteFileVector(file.GetPath(), data));
+
+  vector<uint64_t> hashes;
+  EXPECT_TRUE(FileBlockIndex::HashBlocks(file.GetPath(), &hashes));
+  ASSERT_EQ(3, hashes.size());
+  EXPECT_NE(0, hashes[0]);
+  EXPECT_EQ(0, hashes[1]);
+  EXPECT_NE(0, hashes[2]);
+
+  // The last block is hashed as if it were zero padded.
+  ScopedTempFile padded;
+  data.resize(3 * kBlockSize, 0);
+  ASSERT_TRUE(WriteFileVector(padded.GetPath(), data));
+  vector<uint64_t> padded_hashes;
+  EXPECT_TRUE(FileBlockIndex::HashBlocks(padded.GetPath(), &padded_hashes));
+  EXPECT_TRUE(hashes == padded_hashes);
+
+  EXPECT_FALSE(FileBlockIndex::HashBlocks("/nonexistent/path", &hashes));
+}
+
+TEST(FileBlockIndexTest, FindMostSimilarTest) {
+  const vector<char> shared = UniqueBlocks(3);
+  ScopedTempFile little, lot, unrelated, other_lot, new_file;
+  ASSERT_TRUE(WriteFileVector(
+      little.GetPath(),
+      Concat(vector<char>(shared.begin(), shared.begin() + kBlockSize),
+             UniqueBlocks(1))));
+  ASSERT_TRUE(WriteFileVector(lot.GetPath(),
+                              Concat(shared, UniqueBlocks(4))));
+  ASSERT_TRUE(WriteFileVector(other_lot.GetPath(),
+                              Concat(shared, UniqueBlocks(1))));
+  ASSERT_TRUE(WriteFileVector(unrelated.GetPath(), UniqueBlocks(8)));
+  ASSERT_TRUE(WriteFileVector(new_file.GetPath(),
+                              Concat(UniqueBlocks(1), shared)));
+
+  FileBlockIndex index;
+  vector<string> paths;
+  paths.push_back(little.GetPath());
+  paths.push_back(lot.GetPath());
+  paths.push_back(other_lot.GetPath());
+  paths.push_back(unrelated.GetPath());
+  EXPECT_TRUE(index.Build(paths));
+  EXPECT_EQ(4, index.size());
+
+  // Blocks match wherever they are in the files, and a tie goes to the
+  // file closest in size.
+  string similar;
+  set<ino_t> excluded;
+  EXPECT_TRUE(index.FindMostSimilar(new_file.GetPath(), excluded, &similar));
+  EXPECT_EQ(other_lot.GetPath(), similar);
+
+  excluded.insert(Inode(other_lot.GetPath()));
+  EXPECT_TRUE(index.FindMostSimilar(new_file.GetPath(), excluded, &similar));
+  EXPECT_EQ(lot.GetPath(), similar);
+
+  excluded.insert(Inode(lot.GetPath()));
+  EXPECT_TRUE(index.FindMostSimilar(new_file.GetPath(), excluded, &similar));
+  EXPECT_EQ(little.GetPath(), similar);
+
+  excluded.insert(Inode(little.GetPath()));
+  EXPECT_FALSE(index.FindMostSimilar(new_file.GetPath(), excluded, &similar));
+}
+
+TEST(FileBlockIndexTest, AddDataTest) {
+  const vector<char> shared = UniqueBlocks(2);
+  FileBlockIndex index;
+  index.Add("/old", 1, Concat(shared, UniqueBlocks(1)));
+  index.Add("/unrelated", 2, UniqueBlocks(3));
+  EXPECT_EQ(2, index.size());
+
+  // Files read some other way hash the same as those read from a path.
+  ScopedTempFile file;
+  const vector<char> new_data = Concat(shared, vector<char>(100, 'a'));
+  ASSERT_TRUE(WriteFileVector(file.GetPath(), new_data));
+  vector<uint64_t> path_hashes, data_hashes;
+  EXPECT_TRUE(FileBlockIndex::HashBlocks(file.GetPath(), &path_hashes));
+  FileBlockIndex::HashData(new_data, &data_hashes);
+  EXPECT_TRUE(path_hashes == data_hashes);
+
+  string similar;
+  EXPECT_TRUE(index.FindMostSimilar(new_data, set<ino_t>(), &similar));
+  EXPECT_EQ("/old", similar);
+  EXPECT_FALSE(index.FindMostSimilar(new_data, set<ino_t>{1}, &similar));
+}
+
+TEST(FileBlockIndexTest, ZeroBlocksTest) {
+  ScopedTempFile sparse, new_file;
+  ASSERT_TRUE(WriteFileVector(
+      sparse.GetPath(),
+      Concat(vector<char>(4 * kBlockSize, 0), UniqueBlocks(1))));
+  ASSERT_TRUE(WriteFileVector(
+      new_file.GetPath(),
+      Concat(vector<char>(4 * kBlockSize, 0), UniqueBlocks(1))));
+
+  FileBlockIndex index;
+  EXPECT_TRUE(index.Build(vector<string>(1, sparse.GetPath())));
+  string similar;
+  EXPECT_FALSE(index.FindMostSimilar(new_file.GetPath(), set<ino_t>(),
+                                     &similar));
+}
+
+TEST(FileBlockIndexTest, BuildFailureTest) {
+  FileBlockIndex index;
+  EXPECT_TRUE(index.Build(vector<string>()));
+  EXPECT_EQ(0, index.size());
+  EXPECT_FALSE(index.Build(vector<string>(1, "/nonexistent/path")));
+}
+
+}  // namespace chromeos_update_engine
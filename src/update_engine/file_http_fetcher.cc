@@ -0,0 +1,216 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/file_http_fetcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kFileUrlPrefix[] = "file://";
+}  // namespace {}
+
+const size_t FileHttpFetcher::kReadSize = 1024 * 1024;
+
+FileHttpFetcher::FileHttpFetcher()
+    : offset_(0),
+      length_(0),
+      fd_(-1),
+      read_offset_(0),
+      bytes_left_(0),
+      bytes_downloaded_(0),
+      source_id_(0),
+      transfer_in_progress_(false),
+      paused_(false),
+      in_write_callback_(false),
+      terminate_requested_(false) {}
+
+FileHttpFetcher::~FileHttpFetcher() {
+  LOG_IF(ERROR, transfer_in_progress_)
+      << "Destroying the fetcher while a transfer is in progress.";
+  CleanUp();
+}
+
+bool FileHttpFetcher::IsFileUrl(const string& url, string* path) {
+  if (!utils::StringHasPrefix(url, kFileUrlPrefix))
+    return false;
+  if (path)
+    *path = url.substr(strlen(kFileUrlPrefix));
+  return true;
+}
+
+void FileHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_in_progress_);
+  url_ = url;
+  http_response_code_ = kHttpResponseUndefined;
+  terminate_requested_ = false;
+  bytes_downloaded_ = offset_;
+  read_offset_ = offset_;
+  bytes_left_ = 0;
+  transfer_in_progress_ = true;
+
+  // Failures are reported from the main loop too, as the delegate doesn't
+  // expect to hear back from within BeginTransfer.
+  string path;
+  if (!IsFileUrl(url, &path) || path.empty() || path[0] != '/') {
+    LOG(ERROR) << "Not an absolute file:// URL: " << url;
+    http_response_code_ = kHttpResponseBadRequest;
+    ScheduleRead();
+    return;
+  }
+
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    http_response_code_ = errno == ENOENT ? kHttpResponseNotFound :
+        kHttpResponseForbidden;
+    PLOG(ERROR) << "Unable to open " << path;
+    ScheduleRead();
+    return;
+  }
+
+  struct stat stbuf;
+  if (fstat(fd_, &stbuf) != 0 || !S_ISREG(stbuf.st_mode)) {
+    LOG(ERROR) << path << " is not a regular file";
+    close(fd_);
+    fd_ = -1;
+    http_response_code_ = kHttpResponseForbidden;
+    ScheduleRead();
+    return;
+  }
+
+  // Same as a server would do, a range starting past the end of the file
+  // can't be satisfied while one running past it is cut short.
+  if (offset_ > 0 && offset_ >= stbuf.st_size) {
+    LOG(ERROR) << "Offset " << offset_ << " is past the end of " << path
+               << " (" << stbuf.st_size << " bytes)";
+    close(fd_);
+    fd_ = -1;
+    http_response_code_ = kHttpResponseReqRangeNotSat;
+    ScheduleRead();
+    return;
+  }
+  bytes_left_ = stbuf.st_size - offset_;
+  if (length_)
+    bytes_left_ = min(bytes_left_, static_cast<uint64_t>(length_));
+  http_response_code_ = (offset_ > 0 || length_) ?
+      kHttpResponsePartialContent : kHttpResponseOk;
+
+  posix_fadvise(fd_, read_offset_, bytes_left_, POSIX_FADV_SEQUENTIAL);
+  LOG(INFO) << "Reading " << bytes_left_ << " bytes at offset " << offset_
+            << " from " << path;
+  ScheduleRead();
+}
+
+void FileHttpFetcher::ScheduleRead() {
+  if (source_id_ || paused_ || !transfer_in_progress_)
+    return;
+  source_id_ = g_idle_add(&FileHttpFetcher::StaticReadCallback, this);
+}
+
+gboolean FileHttpFetcher::ReadCallback() {
+  source_id_ = 0;
+  CHECK(transfer_in_progress_);
+
+  if (fd_ < 0 || bytes_left_ == 0) {
+    bool successful = fd_ >= 0;
+    CleanUp();
+    if (delegate_) {
+      // Note that after the callback returns this object may be destroyed.
+      delegate_->TransferComplete(this, successful);
+    }
+    return FALSE;
+  }
+
+  buffer_.resize(min(static_cast<uint64_t>(kReadSize), bytes_left_));
+  ssize_t rc;
+  do {
+    rc = pread(fd_, buffer_.data(), buffer_.size(), read_offset_);
+  } while (rc < 0 && errno == EINTR);
+  if (rc <= 0) {
+    // Either an I/O error or the file got truncated underneath us.
+    PLOG_IF(ERROR, rc < 0) << "Unable to read " << url_;
+    LOG_IF(ERROR, rc == 0) << url_ << " ended " << bytes_left_
+                           << " bytes short";
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, false);
+    return FALSE;
+  }
+  read_offset_ += rc;
+  bytes_left_ -= rc;
+  bytes_downloaded_ += rc;
+
+  if (delegate_) {
+    in_write_callback_ = true;
+    delegate_->ReceivedBytes(this, buffer_.data(), rc);
+    in_write_callback_ = false;
+  }
+  if (terminate_requested_) {
+    ForceTransferTermination();
+    return FALSE;
+  }
+  // Completion is reported on the next iteration, so the delegate sees the
+  // same sequence of events as with a network transfer.
+  ScheduleRead();
+  return FALSE;  // Don't have glib auto call this callback again
+}
+
+void FileHttpFetcher::ForceTransferTermination() {
+  CleanUp();
+  if (delegate_) {
+    // Note that after the callback returns this object may be destroyed.
+    delegate_->TransferTerminated(this);
+  }
+}
+
+void FileHttpFetcher::TerminateTransfer() {
+  if (in_write_callback_) {
+    terminate_requested_ = true;
+  } else {
+    ForceTransferTermination();
+  }
+}
+
+void FileHttpFetcher::Pause() {
+  paused_ = true;
+  if (source_id_) {
+    g_source_remove(source_id_);
+    source_id_ = 0;
+  }
+}
+
+void FileHttpFetcher::Unpause() {
+  paused_ = false;
+  // From within ReceivedBytes, the read gets scheduled once it returns.
+  if (!in_write_callback_)
+    ScheduleRead();
+}
+
+void FileHttpFetcher::CleanUp() {
+  if (source_id_) {
+    g_source_remove(source_id_);
+    source_id_ = 0;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  paused_ = false;
+  transfer_in_progress_ = false;
+}
+
+}  // namespace chromeos_update_engine
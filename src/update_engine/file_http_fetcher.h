@@ -0,0 +1,112 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HTTP_FETCHER_H__
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "macros.h"
+#include "update_engine/http_fetcher.h"
+
+// This is a concrete implementation of HttpFetcher that reads file:// URLs
+// from the local file system, for payloads staged on a local disk or a
+// shared volume. The file is read in large blocks from the glib main loop,
+// one block per iteration, so the rest of the daemon keeps running.
+//
+// To the delegate it looks like an HTTP transfer: the offset and length
+// select a byte range, which is reported as a 206 response (200 for the
+// whole file), a missing file as 404 and a range past its end as 416.
+
+namespace chromeos_update_engine {
+
+class FileHttpFetcher : public HttpFetcher {
+ public:
+  // Bytes read from the file and handed to the delegate at a time.
+  static const size_t kReadSize;
+
+  FileHttpFetcher();
+
+  // Cleans up all internal state. Does not notify delegate
+  virtual ~FileHttpFetcher();
+
+  virtual void SetOffset(off_t offset) { offset_ = offset; }
+
+  virtual void SetLength(size_t length) { length_ = length; }
+  virtual void UnsetLength() { SetLength(0); }
+
+  // Begins the transfer, which must not have already been started.
+  virtual void BeginTransfer(const std::string& url);
+
+  // Stops reading. TransferTerminated is sent to the delegate right away,
+  // or once its current callback has returned if called from one.
+  virtual void TerminateTransfer();
+
+  virtual void Pause();
+  virtual void Unpause();
+
+  virtual size_t GetBytesDownloaded() {
+    return static_cast<size_t>(bytes_downloaded_);
+  }
+
+  // Returns true if |url| is a file:// URL, and its path in |path| if that
+  // isn't NULL.
+  static bool IsFileUrl(const std::string& url, std::string* path);
+
+ private:
+  // Reads and delivers the next block, or completes the transfer once
+  // there's nothing left to read or the file couldn't be opened. The static
+  // version is a shim for glib, which has a C API.
+  gboolean ReadCallback();
+  static gboolean StaticReadCallback(gpointer data) {
+    return reinterpret_cast<FileHttpFetcher*>(data)->ReadCallback();
+  }
+
+  // Schedules ReadCallback() unless it already is.
+  void ScheduleRead();
+
+  // Closes the file and removes the glib sources.
+  void CleanUp();
+
+  // Cleans up and tells the delegate the transfer was terminated. After
+  // this returns, this object may have been destroyed.
+  void ForceTransferTermination();
+
+  off_t offset_;
+  size_t length_;  // zero means up to the end of the file
+
+  // The file being read, or -1 if it couldn't be opened.
+  int fd_;
+
+  // Where the next read starts and the bytes left to read. When the length
+  // is unknown, |bytes_left_| is the rest of the file.
+  off_t read_offset_;
+  uint64_t bytes_left_;
+
+  // Bytes handed to the delegate, counting from the beginning of the file
+  // like LibcurlHttpFetcher does.
+  off_t bytes_downloaded_;
+
+  // The glib source of the pending ReadCallback(), or 0.
+  guint source_id_;
+
+  bool transfer_in_progress_;
+  bool paused_;
+
+  // We can't clean everything up while we're in a delegate callback, so
+  // if we get a terminate request, queue it until we can handle it.
+  bool in_write_callback_;
+  bool terminate_requested_;
+
+  std::vector<char> buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HTTP_FETCHER_H__
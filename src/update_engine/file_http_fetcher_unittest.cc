@@ -0,0 +1,206 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/file_http_fetcher.h"
+#include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+class FileFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  explicit FileFetcherTestDelegate(GMainLoop* loop)
+      : loop_(loop),
+        completed_(false),
+        successful_(false),
+        terminated_(false),
+        callbacks_(0),
+        terminate_after_(0) {}
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    data_.append(bytes, length);
+    callbacks_++;
+    if (terminate_after_ && data_.size() >= terminate_after_)
+      fetcher->TerminateTransfer();
+  }
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    completed_ = true;
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    terminated_ = true;
+    g_main_loop_quit(loop_);
+  }
+
+  GMainLoop* loop_;
+  string data_;
+  bool completed_;
+  bool successful_;
+  bool terminated_;
+  int callbacks_;
+  size_t terminate_after_;
+};
+
+gboolean UnpausingTimeoutCallback(gpointer data) {
+  reinterpret_cast<HttpFetcher*>(data)->Unpause();
+  return FALSE;
+}
+}  // namespace {}
+
+class FileHttpFetcherTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    loop_ = g_main_loop_new(g_main_context_default(), FALSE);
+    // A few blocks and a bit, so that reads and callbacks don't line up.
+    content_.resize(FileHttpFetcher::kReadSize * 2 + 123);
+    for (size_t i = 0; i < content_.size(); i++)
+      content_[i] = 'a' + i % 26;
+    ASSERT_TRUE(utils::WriteFile(file_.GetPath().c_str(), content_.data(),
+                                 content_.size()));
+    url_ = "file://" + file_.GetPath();
+  }
+  virtual void TearDown() {
+    g_main_loop_unref(loop_);
+  }
+
+  GMainLoop* loop_;
+  ScopedTempFile file_;
+  string content_;
+  string url_;
+};
+
+TEST_F(FileHttpFetcherTest, IsFileUrlTest) {
+  string path;
+  EXPECT_TRUE(FileHttpFetcher::IsFileUrl("file:///var/lib/update.gz", &path));
+  EXPECT_EQ("/var/lib/update.gz", path);
+  EXPECT_TRUE(FileHttpFetcher::IsFileUrl("file:///x", NULL));
+  EXPECT_FALSE(FileHttpFetcher::IsFileUrl("http://example.com/x", &path));
+  EXPECT_FALSE(FileHttpFetcher::IsFileUrl("/var/lib/update.gz", &path));
+}
+
+TEST_F(FileHttpFetcherTest, SimpleTest) {
+  FileFetcherTestDelegate delegate(loop_);
+  FileHttpFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.BeginTransfer(url_);
+  // Nothing is delivered before the main loop runs.
+  EXPECT_EQ(0, delegate.callbacks_);
+  g_main_loop_run(loop_);
+
+  EXPECT_TRUE(delegate.completed_);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(kHttpResponseOk, fetcher.http_response_code());
+  EXPECT_EQ(content_, delegate.data_);
+  EXPECT_EQ(3, delegate.callbacks_);
+  EXPECT_EQ(content_.size(), fetcher.GetBytesDownloaded());
+}
+
+TEST_F(FileHttpFetcherTest, RangeTest) {
+  FileFetcherTestDelegate delegate(loop_);
+  FileHttpFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.SetOffset(1000);
+  fetcher.SetLength(FileHttpFetcher::kReadSize);
+  fetcher.BeginTransfer(url_);
+  g_main_loop_run(loop_);
+
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(kHttpResponsePartialContent, fetcher.http_response_code());
+  EXPECT_EQ(content_.substr(1000, FileHttpFetcher::kReadSize),
+            delegate.data_);
+
+  // A length going past the end is cut short.
+  FileFetcherTestDelegate tail_delegate(loop_);
+  fetcher.set_delegate(&tail_delegate);
+  fetcher.SetOffset(content_.size() - 10);
+  fetcher.SetLength(100);
+  fetcher.BeginTransfer(url_);
+  g_main_loop_run(loop_);
+  EXPECT_TRUE(tail_delegate.successful_);
+  EXPECT_EQ(content_.substr(content_.size() - 10), tail_delegate.data_);
+}
+
+TEST_F(FileHttpFetcherTest, MultiRangeTest) {
+  // This is how a resumed update reads the payload: the manifest, then the
+  // rest from where it left off.
+  FileFetcherTestDelegate delegate(loop_);
+  MultiRangeHttpFetcher fetcher(new FileHttpFetcher());
+  fetcher.set_delegate(&delegate);
+  fetcher.ClearRanges();
+  fetcher.AddRange(0, 100);
+  fetcher.AddRange(FileHttpFetcher::kReadSize + 5);
+  fetcher.BeginTransfer(url_);
+  g_main_loop_run(loop_);
+
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(content_.substr(0, 100) +
+            content_.substr(FileHttpFetcher::kReadSize + 5),
+            delegate.data_);
+}
+
+TEST_F(FileHttpFetcherTest, MissingFileTest) {
+  FileFetcherTestDelegate delegate(loop_);
+  FileHttpFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.BeginTransfer(url_ + ".missing");
+  g_main_loop_run(loop_);
+
+  EXPECT_TRUE(delegate.completed_);
+  EXPECT_FALSE(delegate.successful_);
+  EXPECT_EQ(kHttpResponseNotFound, fetcher.http_response_code());
+  EXPECT_EQ(0, delegate.callbacks_);
+}
+
+TEST_F(FileHttpFetcherTest, OffsetPastEndTest) {
+  FileFetcherTestDelegate delegate(loop_);
+  FileHttpFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.SetOffset(content_.size());
+  fetcher.BeginTransfer(url_);
+  g_main_loop_run(loop_);
+
+  EXPECT_FALSE(delegate.successful_);
+  EXPECT_EQ(kHttpResponseReqRangeNotSat, fetcher.http_response_code());
+}
+
+TEST_F(FileHttpFetcherTest, TerminateTest) {
+  FileFetcherTestDelegate delegate(loop_);
+  delegate.terminate_after_ = 1;
+  FileHttpFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.BeginTransfer(url_);
+  g_main_loop_run(loop_);
+
+  EXPECT_TRUE(delegate.terminated_);
+  EXPECT_FALSE(delegate.completed_);
+  EXPECT_EQ(1, delegate.callbacks_);
+}
+
+TEST_F(FileHttpFetcherTest, PauseTest) {
+  FileFetcherTestDelegate delegate(loop_);
+  FileHttpFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.BeginTransfer(url_);
+  fetcher.Pause();
+  g_timeout_add(50, UnpausingTimeoutCallback, &fetcher);
+  g_main_loop_run(loop_);
+
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(content_, delegate.data_);
+}
+
+}  // namespace chromeos_update_engine
@@ -38,11 +38,13 @@ const off_t kCopyFileBufferSize = 128 * 1024;
 
 FilesystemCopierAction::FilesystemCopierAction(bool verify_hash)
     : verify_hash_(verify_hash),
+      hash_only_(false),
       src_stream_(NULL),
       dst_stream_(NULL),
       read_done_(false),
       failed_(false),
       cancelled_(false),
+      throttle_timeout_id_(0),
       filesystem_size_(std::numeric_limits<int64_t>::max()) {
   // A lot of code works on the implicit assumption that processing is done on
   // exactly 2 ping-pong buffers.
@@ -83,7 +85,7 @@ void FilesystemCopierAction::PerformAction() {
     return;
   }
 
-  if (!verify_hash_) {
+  if (!verify_hash_ && !hash_only_) {
     int dst_fd = open(install_plan_.partition_path.c_str(),
                       O_WRONLY | O_TRUNC | O_CREAT,
                     0644);
@@ -100,6 +102,10 @@ void FilesystemCopierAction::PerformAction() {
   DetermineFilesystemSize(src_fd);
   src_stream_ = g_unix_input_stream_new(src_fd, TRUE);
 
+  io_scheduler_.set_priority(install_plan_.io_priority);
+  io_scheduler_.set_rate_limit(install_plan_.io_rate_limit);
+  io_scheduler_.Start();
+
   for (int i = 0; i < 2; i++) {
     buffer_[i].resize(kCopyFileBufferSize);
     canceller_[i] = g_cancellable_new();
@@ -124,6 +130,16 @@ bool FilesystemCopierAction::IsCleanupPending() const {
 }
 
 void FilesystemCopierAction::Cleanup(ActionExitCode code) {
+  if (throttle_timeout_id_) {
+    g_source_remove(throttle_timeout_id_);
+    throttle_timeout_id_ = 0;
+  }
+  io_scheduler_.LogThroughput(
+      verify_hash_ ? "Verified " + install_plan_.partition_path :
+      !dst_stream_ ? "Hashed " + install_plan_.old_partition_path :
+      "Copied " + install_plan_.old_partition_path + " to " +
+      install_plan_.partition_path);
+  io_scheduler_.Stop();
   for (int i = 0; i < 2; i++) {
     g_object_unref(canceller_[i]);
     canceller_[i] = NULL;
@@ -163,7 +179,8 @@ void FilesystemCopierAction::AsyncReadReadyCallback(GObject *source_object,
     buffer_state_[index] = kBufferStateFull;
     filesystem_size_ -= bytes_read;
   }
-  SpawnAsyncActions();
+  SpawnAsyncActionsAfter(io_scheduler_.Transferred(
+      -1, bytes_read > 0 ? bytes_read : 0, 0));
 
   if (bytes_read > 0) {
     // If read_done_ is set, SpawnAsyncActions may finalize the hash so the hash
@@ -173,7 +190,7 @@ void FilesystemCopierAction::AsyncReadReadyCallback(GObject *source_object,
       LOG(ERROR) << "Unable to update the hash.";
       failed_ = true;
     }
-    if (verify_hash_) {
+    if (!dst_stream_) {
       buffer_state_[index] = kBufferStateEmpty;
     }
   }
@@ -211,7 +228,10 @@ void FilesystemCopierAction::AsyncWriteReadyCallback(GObject *source_object,
     failed_ = true;
   }
 
-  SpawnAsyncActions();
+  SpawnAsyncActionsAfter(io_scheduler_.Transferred(
+      g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(dst_stream_)),
+      0,
+      bytes_written > 0 ? bytes_written : 0));
 }
 
 void FilesystemCopierAction::StaticAsyncWriteReadyCallback(
@@ -222,6 +242,29 @@ void FilesystemCopierAction::StaticAsyncWriteReadyCallback(
       AsyncWriteReadyCallback(source_object, res);
 }
 
+void FilesystemCopierAction::SpawnAsyncActionsAfter(
+    std::chrono::microseconds delay) {
+  if (throttle_timeout_id_)
+    return;  // The pending timeout spawns them.
+  if (delay.count() <= 0 || failed_ || cancelled_) {
+    SpawnAsyncActions();
+    return;
+  }
+  throttle_timeout_id_ = g_timeout_add(
+      std::max(static_cast<guint>(delay.count() / 1000), 1U),
+      &FilesystemCopierAction::StaticThrottleTimeoutCallback,
+      this);
+}
+
+gboolean FilesystemCopierAction::StaticThrottleTimeoutCallback(
+    gpointer data) {
+  FilesystemCopierAction* action =
+      reinterpret_cast<FilesystemCopierAction*>(data);
+  action->throttle_timeout_id_ = 0;
+  action->SpawnAsyncActions();
+  return FALSE;  // Don't have glib auto call this callback again
+}
+
 void FilesystemCopierAction::SpawnAsyncActions() {
   bool reading = false;
   bool writing = false;
@@ -253,7 +296,7 @@ void FilesystemCopierAction::SpawnAsyncActions() {
           this);
       reading = true;
       buffer_state_[i] = kBufferStateReading;
-    } else if (!writing && !verify_hash_ &&
+    } else if (!writing && dst_stream_ &&
                buffer_state_[i] == kBufferStateFull) {
       g_output_stream_write_async(
           dst_stream_,
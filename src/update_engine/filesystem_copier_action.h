@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <chrono>
 #include <string>
 #include <vector>
 
@@ -17,6 +18,7 @@
 
 #include "update_engine/action.h"
 #include "update_engine/install_plan.h"
+#include "update_engine/io_scheduler.h"
 #include "update_engine/omaha_hash_calculator.h"
 
 // This action will only do real work if it's a delta update. It will
@@ -46,6 +48,10 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   void PerformAction();
   void TerminateProcessing();
 
+  // If set, the old partition is only hashed, not copied to the target. The
+  // payload copies what it needs itself, see PayloadProcessor.
+  void set_hash_only(bool hash_only) { hash_only_ = hash_only; }
+
   // Used for testing. Return true if Cleanup() has not yet been called due
   // to a callback upon the completion or cancellation of the copier action.
   // A test should wait until IsCleanupPending() returns false before
@@ -61,8 +67,8 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   FRIEND_TEST(FilesystemCopierActionTest, DetermineFilesystemSizeTest);
 
   // Ping-pong buffers generally cycle through the following states:
-  // Empty->Reading->Full->Writing->Empty. In hash verification mode the state
-  // is never set to Writing.
+  // Empty->Reading->Full->Writing->Empty. When nothing is written the state is
+  // never set to Writing.
   enum BufferState {
     kBufferStateEmpty,
     kBufferStateReading,
@@ -85,6 +91,11 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   // actions asynchronously.
   void SpawnAsyncActions();
 
+  // Calls SpawnAsyncActions() after |delay|, to stay under the I/O rate
+  // limit, or right away if there is no delay.
+  void SpawnAsyncActionsAfter(std::chrono::microseconds delay);
+  static gboolean StaticThrottleTimeoutCallback(gpointer data);
+
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
   // true if TerminateProcessing() was called.
@@ -100,6 +111,9 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   // expected value.
   const bool verify_hash_;
 
+  // Whether the old partition is only hashed, see set_hash_only().
+  bool hash_only_;
+
   // If non-NULL, these are GUnixInputStream objects for the opened
   // source/destination partitions.
   GInputStream* src_stream_;
@@ -128,6 +142,13 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   // Calculates the hash of the copied data.
   OmahaHashCalculator hasher_;
 
+  // Schedules the reads and writes.
+  IoScheduler io_scheduler_;
+
+  // If non-zero, the glib timeout that resumes the copy once the I/O rate
+  // limit allows it.
+  guint throttle_timeout_id_;
+
   // Copies and hashes this many bytes from the head of the input stream. This
   // field is initialized when the action is started and decremented as more
   // bytes get copied.
@@ -11,7 +11,8 @@
 
 #include "files/scoped_file.h"
 #include "strings/string_printf.h"
-#include "update_engine/bzip.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/utils.h"
 
 using std::deque;
@@ -31,17 +32,22 @@ namespace {
 // processor needs to be started through Start() then waited on through Wait().
 class ChunkProcessor {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
-  ChunkProcessor(int fd, off_t offset, size_t size)
+  // Read a chunk of |size| bytes from |fd| starting at offset |offset|, to
+  // be written to |dst_size| bytes of blocks.
+  ChunkProcessor(int fd, off_t offset, size_t size, size_t dst_size)
       : thread_(NULL),
         fd_(fd),
         offset_(offset),
-        buffer_in_(size) {}
+        dst_size_(dst_size),
+        buffer_in_(size),
+        type_(InstallOperation_Type_REPLACE) {}
   ~ChunkProcessor() { Wait(); }
 
   off_t offset() const { return offset_; }
   const vector<char>& buffer_in() const { return buffer_in_; }
-  const vector<char>& buffer_compressed() const { return buffer_compressed_; }
+  const vector<char>& data() const { return data_; }
+  InstallOperation_Type type() const { return type_; }
+  const vector<char>& dst_hash() const { return dst_hash_; }
 
   // Starts the processor. Returns true on success, false on failure.
   bool Start();
@@ -50,21 +56,21 @@ class ChunkProcessor {
   // failure.
   bool Wait();
 
-  bool ShouldCompress() const {
-    return buffer_compressed_.size() < buffer_in_.size();
-  }
-
  private:
-  // Reads the input data into |buffer_in_| and compresses it into
-  // |buffer_compressed_|. Returns true on success, false otherwise.
+  // Reads the input data into |buffer_in_|, stores it into |data_| as an
+  // operation of |type_| and hashes the chunk as written to the disk into
+  // |dst_hash_|. Returns true on success, false otherwise.
   bool ReadAndCompress();
   static gpointer ReadAndCompressThread(gpointer data);
 
   GThread* thread_;
   int fd_;
   off_t offset_;
+  size_t dst_size_;
   vector<char> buffer_in_;
-  vector<char> buffer_compressed_;
+  vector<char> data_;
+  InstallOperation_Type type_;
+  vector<char> dst_hash_;
 
   DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
 };
@@ -100,7 +106,16 @@ bool ChunkProcessor::ReadAndCompress() {
                                         offset_,
                                         &bytes_read));
   TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer_in_.size()));
-  TEST_AND_RETURN_FALSE(BzipCompress(buffer_in_, &buffer_compressed_));
+  TEST_AND_RETURN_FALSE(CompressReplaceData(buffer_in_, &data_, &type_));
+
+  // The chunk fills whole blocks on the disk, zero padded if it's short.
+  OmahaHashCalculator hasher;
+  TEST_AND_RETURN_FALSE(hasher.Update(buffer_in_.data(), buffer_in_.size()));
+  const vector<char> padding(dst_size_ - buffer_in_.size(), 0);
+  TEST_AND_RETURN_FALSE(padding.empty() ||
+                        hasher.Update(padding.data(), padding.size()));
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  dst_hash_ = hasher.raw_hash();
   return true;
 }
 
@@ -160,7 +175,8 @@ bool FullUpdateGenerator::Add(const string& path, off_t size,
     // Check and start new chunk processors if possible.
     while (threads.size() < max_threads && bytes_left > 0) {
       shared_ptr<ChunkProcessor> processor(
-          new ChunkProcessor(in_fd, offset, min(bytes_left, chunk_size_)));
+          new ChunkProcessor(in_fd, offset, min(bytes_left, chunk_size_),
+                             chunk_size_));
       threads.push_back(processor);
       TEST_AND_RETURN_FALSE(processor->Start());
       bytes_left -= chunk_size_;
@@ -176,19 +192,21 @@ bool FullUpdateGenerator::Add(const string& path, off_t size,
     ops->resize(ops->size() + 1);
     InstallOperation& op = ops->back();
 
-    const bool compress = processor->ShouldCompress();
-    const vector<char>& use_buf =
-        compress ? processor->buffer_compressed() : processor->buffer_in();
-    op.set_type(compress ?
-                InstallOperation_Type_REPLACE_BZ :
-                InstallOperation_Type_REPLACE);
-    op.set_data_offset(data_file_size_);
-    TEST_AND_RETURN_FALSE(utils::WriteAll(fd_, &use_buf[0], use_buf.size()));
-    data_file_size_ += use_buf.size();
-    op.set_data_length(use_buf.size());
+    const vector<char>& use_buf = processor->data();
+    op.set_type(processor->type());
+    if (!use_buf.empty()) {
+      op.set_data_offset(data_file_size_);
+      TEST_AND_RETURN_FALSE(utils::WriteAll(fd_, &use_buf[0],
+                                            use_buf.size()));
+      data_file_size_ += use_buf.size();
+      op.set_data_length(use_buf.size());
+    }
     Extent* dst_extent = op.add_dst_extents();
     dst_extent->set_start_block(processor->offset() / block_size_);
     dst_extent->set_num_blocks(chunk_size_ / block_size_);
+    op.set_dst_length(processor->buffer_in().size());
+    const vector<char>& dst_hash = processor->dst_hash();
+    op.set_dst_sha256_hash(dst_hash.data(), dst_hash.size());
 
     int progress = static_cast<int>(
         (processor->offset() + processor->buffer_in().size()) * 100.0 / size);
@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -9,6 +10,8 @@
 
 #include "files/scoped_file.h"
 #include "update_engine/full_update_generator.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/test_utils.h"
 
 using std::string;
@@ -85,6 +88,12 @@ TEST(FullUpdateGeneratorTest, RunTest) {
     }
     EXPECT_EQ(out_offset, graph[i].op.data_offset());
     out_offset += graph[i].op.data_length();
+    EXPECT_EQ(kChunkSize, graph[i].op.dst_length());
+    vector<char> dst_hash;
+    EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(
+        &new_root[i * kChunkSize], kChunkSize, &dst_hash));
+    EXPECT_EQ(string(dst_hash.begin(), dst_hash.end()),
+              graph[i].op.dst_sha256_hash());
   }
   for (size_t i = 0; i < kernel_ops.size(); ++i) {
     EXPECT_EQ(1, kernel_ops[i].dst_extents_size());
@@ -104,4 +113,86 @@ TEST(FullUpdateGeneratorTest, RunTest) {
   EXPECT_EQ(out_offset, utils::FileSize(out_blobs_path));
 }
 
+TEST(FullUpdateGeneratorTest, ZeroChunksTest) {
+  const off_t kChunkSize = 128 * 1024;
+  vector<char> new_kern(4 * kChunkSize);
+  FillWithData(&new_kern);
+  std::fill(new_kern.begin() + kChunkSize, new_kern.begin() + 3 * kChunkSize,
+            0);
+
+  string new_kern_path;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_K.XXXXXX",
+                                  &new_kern_path,
+                                  NULL));
+  ScopedPathUnlinker new_kern_path_unlinker(new_kern_path);
+  EXPECT_TRUE(WriteFileVector(new_kern_path, new_kern));
+
+  string out_blobs_path;
+  int out_blobs_fd;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_D.XXXXXX",
+                                  &out_blobs_path,
+                                  &out_blobs_fd));
+  ScopedPathUnlinker out_blobs_path_unlinker(out_blobs_path);
+  files::ScopedFD out_blobs_fd_closer(out_blobs_fd);
+
+  SetUseZeroOperations(true);
+  vector<InstallOperation> kernel_ops;
+  FullUpdateGenerator generator(out_blobs_fd, kChunkSize, kBlockSize);
+  EXPECT_TRUE(generator.Add(new_kern_path, &kernel_ops));
+  SetUseZeroOperations(false);
+
+  ASSERT_EQ(4, kernel_ops.size());
+  EXPECT_NE(InstallOperation_Type_ZERO, kernel_ops[0].type());
+  EXPECT_NE(InstallOperation_Type_ZERO, kernel_ops[3].type());
+  for (size_t i = 1; i < 3; ++i) {
+    EXPECT_EQ(InstallOperation_Type_ZERO, kernel_ops[i].type());
+    EXPECT_FALSE(kernel_ops[i].has_data_offset());
+    EXPECT_EQ(0, kernel_ops[i].data_length());
+    EXPECT_EQ(kChunkSize / kBlockSize,
+              kernel_ops[i].dst_extents(0).num_blocks());
+  }
+  // The zero chunks take no space in the payload.
+  EXPECT_EQ(kernel_ops[0].data_length(), kernel_ops[3].data_offset());
+  EXPECT_EQ(kernel_ops[0].data_length() + kernel_ops[3].data_length(),
+            generator.Size());
+}
+
+TEST(FullUpdateGeneratorTest, LargeBlockSizeTest) {
+  const off_t kChunkSize = 128 * 1024;
+  const off_t kLargeBlockSize = 64 * 1024;
+  vector<char> new_kern(2 * kChunkSize + kLargeBlockSize / 2);
+  FillWithData(&new_kern);
+
+  string new_kern_path;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_K.XXXXXX",
+                                  &new_kern_path,
+                                  NULL));
+  ScopedPathUnlinker new_kern_path_unlinker(new_kern_path);
+  EXPECT_TRUE(WriteFileVector(new_kern_path, new_kern));
+
+  string out_blobs_path;
+  int out_blobs_fd;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_D.XXXXXX",
+                                  &out_blobs_path,
+                                  &out_blobs_fd));
+  ScopedPathUnlinker out_blobs_path_unlinker(out_blobs_path);
+  files::ScopedFD out_blobs_fd_closer(out_blobs_fd);
+
+  vector<InstallOperation> kernel_ops;
+  FullUpdateGenerator generator(out_blobs_fd, kChunkSize, kLargeBlockSize);
+  EXPECT_TRUE(generator.Add(new_kern_path, &kernel_ops));
+
+  // The extents are counted in the larger blocks.
+  ASSERT_EQ(3, kernel_ops.size());
+  for (size_t i = 0; i < kernel_ops.size(); ++i) {
+    ASSERT_EQ(1, kernel_ops[i].dst_extents_size());
+    EXPECT_EQ(i * kChunkSize / kLargeBlockSize,
+              kernel_ops[i].dst_extents(0).start_block());
+    EXPECT_EQ(kChunkSize / kLargeBlockSize,
+              kernel_ops[i].dst_extents(0).num_blocks());
+  }
+  EXPECT_EQ(kChunkSize, kernel_ops[1].dst_length());
+  EXPECT_EQ(kLargeBlockSize / 2, kernel_ops[2].dst_length());
+}
+
 }  // namespace chromeos_update_engine
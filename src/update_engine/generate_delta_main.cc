@@ -22,6 +22,7 @@
 #include "strings/string_number_conversions.h"
 #include "strings/string_split.h"
 #include "update_engine/delta_diff_generator.h"
+#include "update_engine/payload_compression.h"
 #include "update_engine/payload_processor.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/prefs.h"
@@ -31,9 +32,11 @@
 #include "update_engine/utils.h"
 
 DEFINE_string(old_dir, "",
-              "Directory where the old partition is loop mounted read-only");
+              "Directory where the old partition is loop mounted read-only, "
+              "or empty to read its files from --old_image directly");
 DEFINE_string(new_dir, "",
-              "Directory where the new partition is loop mounted read-only");
+              "Directory where the new partition is loop mounted read-only, "
+              "or empty to read its files from --new_image directly");
 DEFINE_string(old_image, "", "Path to the old partition");
 DEFINE_string(new_image, "", "Path to the new partition");
 DEFINE_string(old_kernel, "", "Path to the old kernel image");
@@ -57,6 +60,43 @@ DEFINE_string(signature_size, "",
               "You may pass in multiple sizes by colon separating them. E.g. "
               "2048:2048:4096 will assume 3 signatures, the first two with "
               "2048 size and the last 4096.");
+DEFINE_string(compression, "bzip2",
+              "Comma separated compressors the data of REPLACE operations "
+              "may use: bzip2, xz and zstd. Whichever is expected to get the "
+              "client done soonest is used. Clients that predate xz and zstd "
+              "support must only be sent bzip2.");
+DEFINE_bool(zero_operations, false,
+            "Send blocks that are all zeros as ZERO operations, without any "
+            "data. Clients that predate ZERO support must not be sent them.");
+DEFINE_bool(zstd_diff_operations, false,
+            "Also diff changed data with zstd, using the old data as a "
+            "dictionary, and send it as ZSTD_DIFF operations whenever that "
+            "beats bsdiff on size or on the estimated time to apply. Clients "
+            "that predate ZSTD_DIFF support must not be sent them.");
+DEFINE_double(target_download_mbps, 0,
+              "Download rate in Mbit/s at which to minimize the total time "
+              "to download and apply the update, weighing the bytes of each "
+              "operation against its estimated cost on the client. 0 picks "
+              "the smallest diff, as before.");
+DEFINE_string(apply_cost_table, "",
+              "File of the decode rates and fixed costs of operation types "
+              "measured on the clients, one \"TYPE bytes_per_second "
+              "microseconds\" line per type, to estimate apply times with "
+              "rather than the nominal ones.");
+DEFINE_bool(source_operations, false,
+            "Have a delta read the old partition with SOURCE_COPY and "
+            "SOURCE_BSDIFF operations rather than update a copy of it in "
+            "place. Clients that predate them must not be sent them.");
+DEFINE_bool(packed_extents, false,
+            "Encode the extents of the operations compactly, for a smaller "
+            "manifest that is faster to parse. Clients that predate packed "
+            "extents must not be sent them.");
+DEFINE_int32(block_size, 4096,
+             "Size in bytes of the blocks the extents of the operations are "
+             "counted in. Full updates may use larger powers of two, up to "
+             "1 MiB, for fewer and shorter extents; deltas use 4096. "
+             "Clients that predate other block sizes must only be sent "
+             "4096.");
 DEFINE_string(signature_file, "",
               "Raw signature file to sign payload with. To pass multiple "
               "signatures, use a single argument with a colon between paths, "
@@ -245,13 +285,28 @@ int Main(int argc, char** argv) {
   }
   CHECK(!FLAGS_new_image.empty());
   CHECK(!FLAGS_out_file.empty());
+  vector<InstallOperation_Type> replace_types;
+  if (!ParseReplaceTypes(FLAGS_compression, &replace_types)) {
+    LOG(FATAL) << "Invalid --compression: " << FLAGS_compression;
+  }
+  SetReplaceTypes(replace_types);
+  SetUseZeroOperations(FLAGS_zero_operations);
+  SetUseZstdDiffOperations(FLAGS_zstd_diff_operations);
+  CHECK_GE(FLAGS_target_download_mbps, 0);
+  SetTargetDownloadRate(FLAGS_target_download_mbps * 1000 * 1000 / 8);
+  if (!FLAGS_apply_cost_table.empty() &&
+      !LoadApplyCostTable(FLAGS_apply_cost_table)) {
+    LOG(FATAL) << "Invalid --apply_cost_table: " << FLAGS_apply_cost_table;
+  }
   if (FLAGS_old_image.empty()) {
     LOG(INFO) << "Generating full update";
   } else {
     LOG(INFO) << "Generating delta update";
-    CHECK(!FLAGS_old_dir.empty());
-    CHECK(!FLAGS_new_dir.empty());
-    if ((!IsDir(FLAGS_old_dir.c_str())) || (!IsDir(FLAGS_new_dir.c_str()))) {
+    CHECK_EQ(FLAGS_old_dir.empty(), FLAGS_new_dir.empty());
+    if (FLAGS_old_dir.empty()) {
+      LOG(INFO) << "Reading the files from the images without mounting them";
+    } else if ((!IsDir(FLAGS_old_dir.c_str())) ||
+               (!IsDir(FLAGS_new_dir.c_str()))) {
       LOG(FATAL) << "old_dir or new_dir not directory";
     }
   }
@@ -263,6 +318,9 @@ int Main(int argc, char** argv) {
                                                    FLAGS_old_kernel,
                                                    FLAGS_new_kernel,
                                                    FLAGS_pcr_policy,
+                                                   FLAGS_source_operations,
+                                                   FLAGS_packed_extents,
+                                                   FLAGS_block_size,
                                                    FLAGS_out_file,
                                                    FLAGS_private_key,
                                                    &metadata_size)) {
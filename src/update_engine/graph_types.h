@@ -40,7 +40,7 @@ struct EdgeProperties {
 };
 
 struct Vertex {
-  Vertex() : valid(true), index(-1), lowlink(-1) {}
+  Vertex() : valid(true) {}
   bool valid;
   
   typedef std::map<std::vector<Vertex>::size_type, EdgeProperties> EdgeMap;
@@ -53,10 +53,6 @@ struct Vertex {
   typedef std::set<std::vector<Vertex>::size_type> SubgraphEdgeMap;
   SubgraphEdgeMap subgraph_edges;
 
-  // For Tarjan's algorithm:
-  std::vector<Vertex>::size_type index;
-  std::vector<Vertex>::size_type lowlink;
-
   // Other Vertex properties:
   InstallOperation op;
   std::string file_name;
@@ -4,13 +4,17 @@
 
 #include "update_engine/graph_utils.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <glog/logging.h>
 
+#include "update_engine/extent_ranges.h"
+
 using std::make_pair;
+using std::min;
 using std::pair;
 using std::string;
 using std::vector;
@@ -49,6 +53,45 @@ void AppendBlockToExtents(vector<Extent>* extents, uint64_t block) {
   extents->push_back(new_extent);
 }
 
+void AppendExtentToExtents(vector<Extent>* extents, const Extent& extent) {
+  if (extent.num_blocks() == 0)
+    return;
+  if (!extents->empty()) {
+    Extent& last = extents->back();
+    uint64_t next_block = last.start_block() == kSparseHole ?
+        kSparseHole : last.start_block() + last.num_blocks();
+    if (next_block == extent.start_block()) {
+      last.set_num_blocks(last.num_blocks() + extent.num_blocks());
+      return;
+    }
+  }
+  extents->push_back(extent);
+}
+
+vector<vector<Extent>> SplitExtents(const vector<Extent>& extents,
+                                    uint64_t max_blocks) {
+  CHECK_GT(max_blocks, 0);
+  vector<vector<Extent>> ret;
+  uint64_t blocks_in_last = max_blocks;
+  for (const Extent& extent : extents) {
+    uint64_t offset = 0;
+    while (offset < extent.num_blocks()) {
+      if (blocks_in_last == max_blocks) {
+        ret.resize(ret.size() + 1);
+        blocks_in_last = 0;
+      }
+      uint64_t count = min(extent.num_blocks() - offset,
+                           max_blocks - blocks_in_last);
+      uint64_t start = extent.start_block() == kSparseHole ?
+          kSparseHole : extent.start_block() + offset;
+      AppendExtentToExtents(&ret.back(), ExtentForRange(start, count));
+      offset += count;
+      blocks_in_last += count;
+    }
+  }
+  return ret;
+}
+
 void AddReadBeforeDep(Vertex* src,
                       Vertex::Index dst,
                       uint64_t block) {
@@ -66,16 +109,18 @@ void AddReadBeforeDep(Vertex* src,
 void AddReadBeforeDepExtents(Vertex* src,
                              Vertex::Index dst,
                              const vector<Extent>& extents) {
-  // TODO(adlr): Be more efficient than adding each block individually.
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e; ++it) {
-    const Extent& extent = *it;
-    for (uint64_t block = extent.start_block(),
-             block_end = extent.start_block() + extent.num_blocks();
-         block != block_end; ++block) {
-      AddReadBeforeDep(src, dst, block);
-    }
+  if (BlocksInExtents(extents) == 0)
+    return;
+  Vertex::EdgeMap::iterator edge_it = src->out_edges.find(dst);
+  if (edge_it == src->out_edges.end()) {
+    // Must create new edge
+    pair<Vertex::EdgeMap::iterator, bool> result =
+        src->out_edges.insert(make_pair(dst, EdgeProperties()));
+    CHECK(result.second);
+    edge_it = result.first;
   }
+  for (const Extent& extent : extents)
+    AppendExtentToExtents(&edge_it->second.extents, extent);
 }
 
 void DropWriteBeforeDeps(Vertex::EdgeMap* edge_map) {
@@ -149,6 +194,27 @@ void DumpGraph(const Graph& graph) {
       case InstallOperation_Type_REPLACE_BZ:
         type_str = "REPLACE_BZ";
         break;
+      case InstallOperation_Type_REPLACE_ZSTD:
+        type_str = "REPLACE_ZSTD";
+        break;
+      case InstallOperation_Type_REPLACE_XZ:
+        type_str = "REPLACE_XZ";
+        break;
+      case InstallOperation_Type_ZERO:
+        type_str = "ZERO";
+        break;
+      case InstallOperation_Type_SOURCE_COPY:
+        type_str = "SOURCE_COPY";
+        break;
+      case InstallOperation_Type_SOURCE_BSDIFF:
+        type_str = "SOURCE_BSDIFF";
+        break;
+      case InstallOperation_Type_ZSTD_DIFF:
+        type_str = "ZSTD_DIFF";
+        break;
+      case InstallOperation_Type_SOURCE_ZSTD_DIFF:
+        type_str = "SOURCE_ZSTD_DIFF";
+        break;
     }
     LOG(INFO) << i 
               << (graph[i].valid ? "" : "-INV")
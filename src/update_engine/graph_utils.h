@@ -38,6 +38,15 @@ void DropIncomingEdgesTo(Graph* graph, Vertex::Index index);
 // into an arbitrary place in the extents.
 void AppendBlockToExtents(std::vector<Extent>* extents, uint64_t block);
 
+// Like AppendBlockToExtents, but for a whole extent. |extent| is merged
+// into the last extent of |extents| if it directly follows it.
+void AppendExtentToExtents(std::vector<Extent>* extents, const Extent& extent);
+
+// Splits |extents| in order into consecutive groups of at most
+// |max_blocks| blocks each, cutting an extent in two where needed.
+std::vector<std::vector<Extent>> SplitExtents(
+    const std::vector<Extent>& extents, uint64_t max_blocks);
+
 // Get/SetElement are intentionally overloaded so that templated functions
 // can accept either type of collection of Extents.
 Extent GetElement(const std::vector<Extent>& collection, size_t index);
@@ -84,6 +84,35 @@ TEST(GraphUtilsTest, BlocksInExtentsTest) {
   }
 }
 
+TEST(GraphUtilsTest, SplitExtentsTest) {
+  vector<Extent> extents;
+  extents.push_back(ExtentForRange(10, 3));
+  extents.push_back(ExtentForRange(20, 6));
+  extents.push_back(ExtentForRange(kSparseHole, 2));
+  extents.push_back(ExtentForRange(30, 1));
+
+  vector<vector<Extent>> chunks = graph_utils::SplitExtents(extents, 4);
+  ASSERT_EQ(3, chunks.size());
+  ASSERT_EQ(2, chunks[0].size());
+  EXPECT_EQ(10, chunks[0][0].start_block());
+  EXPECT_EQ(3, chunks[0][0].num_blocks());
+  EXPECT_EQ(20, chunks[0][1].start_block());
+  EXPECT_EQ(1, chunks[0][1].num_blocks());
+  ASSERT_EQ(1, chunks[1].size());
+  EXPECT_EQ(21, chunks[1][0].start_block());
+  EXPECT_EQ(4, chunks[1][0].num_blocks());
+  ASSERT_EQ(3, chunks[2].size());
+  EXPECT_EQ(25, chunks[2][0].start_block());
+  EXPECT_EQ(1, chunks[2][0].num_blocks());
+  EXPECT_EQ(kSparseHole, chunks[2][1].start_block());
+  EXPECT_EQ(2, chunks[2][1].num_blocks());
+  EXPECT_EQ(30, chunks[2][2].start_block());
+  EXPECT_EQ(1, chunks[2][2].num_blocks());
+
+  EXPECT_TRUE(graph_utils::SplitExtents(vector<Extent>(), 4).empty());
+  EXPECT_EQ(1, graph_utils::SplitExtents(extents, 100).size());
+}
+
 TEST(GraphUtilsTest, DepsTest) {
   Graph graph(3);
 
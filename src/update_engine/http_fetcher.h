@@ -73,9 +73,7 @@ class HttpFetcher {
   // Unpause() returns
   virtual void Unpause() = 0;
 
-  // These two function are overloaded in LibcurlHttp fetcher to speed
-  // testing.
-  virtual void set_idle_seconds(int seconds) {}
+  // This function is overloaded in LibcurlHttp fetcher to speed testing.
   virtual void set_retry_seconds(int seconds) {}
 
   // Get the total number of bytes downloaded by fetcher.
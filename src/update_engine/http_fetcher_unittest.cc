@@ -16,12 +16,20 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "files/scoped_temp_dir.h"
 #include "strings/string_printf.h"
+#include "update_engine/bandwidth_limiter.h"
+#include "update_engine/curl_handle_cache.h"
 #include "update_engine/http_common.h"
 #include "update_engine/http_fetcher_unittest.h"
 #include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/mirror_http_fetcher.h"
+#include "update_engine/mirror_prober.h"
 #include "update_engine/mock_http_fetcher.h"
 #include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/p2p_server.h"
+#include "update_engine/parallel_range_http_fetcher.h"
+#include "update_engine/prefs.h"
 #include "update_engine/utils.h"
 
 using std::make_pair;
@@ -42,6 +50,7 @@ const int kMediumLength        = 1000;
 const int kFlakyTruncateLength = 29000;
 const int kFlakySleepEvery     = 3;
 const int kFlakySleepSecs      = 10;
+const int kParallelFetchers    = 4;
 
 }  // namespace
 
@@ -49,8 +58,9 @@ namespace chromeos_update_engine {
 
 static const char *kUnusedUrl = "unused://unused";
 
-static inline string LocalServerUrlForPath(const string& path) {
-  return StringPrintf("http://127.0.0.1:%d%s", kServerPort, path.c_str());
+static inline string LocalServerUrlForPath(const string& path,
+                                           int port = kServerPort) {
+  return StringPrintf("http://127.0.0.1:%d%s", port, path.c_str());
 }
 
 //
@@ -78,8 +88,10 @@ class NullHttpServer : public HttpServer {
 
 class PythonHttpServer : public HttpServer {
  public:
-  PythonHttpServer() {
-    char *argv[2] = {strdup("./test_http_server"), NULL};
+  explicit PythonHttpServer(int port = kServerPort) : port_(port) {
+    char *argv[3] = {strdup("./test_http_server"),
+                     strdup(StringPrintf("%d", port).c_str()),
+                     NULL};
     GError *err;
     started_ = false;
     validate_quit_ = true;
@@ -109,7 +121,7 @@ class PythonHttpServer : public HttpServer {
       LOG(INFO) << "running wget to start";
       // rc should be 0 if we're able to successfully talk to the server.
       rc = system((string("wget --output-document=/dev/null ") +
-                   LocalServerUrlForPath("/test")).c_str());
+                   LocalServerUrlForPath("/test", port_)).c_str());
       LOG(INFO) << "done running wget to start, rc = " << rc;
     }
 
@@ -123,6 +135,7 @@ class PythonHttpServer : public HttpServer {
     }
 
     free(argv[0]);
+    free(argv[1]);
     LOG(INFO) << "gdb attach now!";
   }
 
@@ -139,7 +152,7 @@ class PythonHttpServer : public HttpServer {
     // request that the server exit itself
     LOG(INFO) << "running wget to exit";
     int rc = system((string("wget -t 1 --output-document=/dev/null ") +
-                     LocalServerUrlForPath("/quitquitquit")).c_str());
+                     LocalServerUrlForPath("/quitquitquit", port_)).c_str());
     LOG(INFO) << "done running wget to exit";
     if (validate_quit_) {
       EXPECT_EQ(0, rc);
@@ -153,6 +166,7 @@ class PythonHttpServer : public HttpServer {
 
   GPid pid_;
   bool validate_quit_;
+  int port_;
 };
 
 //
@@ -208,7 +222,6 @@ class LibcurlHttpFetcherTest : public AnyHttpFetcherTest {
   virtual HttpFetcher* NewLargeFetcher() {
     LibcurlHttpFetcher *ret = new LibcurlHttpFetcher();
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     ret->SetBuildType(false);
     return ret;
@@ -253,7 +266,6 @@ class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
     ret->ClearRanges();
     ret->AddRange(0);
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     ret->SetBuildType(false);
     return ret;
@@ -268,6 +280,34 @@ class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
   virtual bool IsMulti() const { return true; }
 };
 
+class ParallelRangeHttpFetcherTest : public MultiRangeHttpFetcherTest {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewLargeFetcher;
+  virtual HttpFetcher* NewLargeFetcher() {
+    vector<HttpFetcher*> base_fetchers;
+    for (int i = 0; i < kParallelFetchers; i++)
+      base_fetchers.push_back(new LibcurlHttpFetcher());
+    ParallelRangeHttpFetcher* parallel_fetcher =
+        new ParallelRangeHttpFetcher(base_fetchers);
+    // Small enough for the ranges of the multi-range tests to be split.
+    parallel_fetcher->set_segment_size(10);
+    MultiRangeHttpFetcher *ret = new MultiRangeHttpFetcher(parallel_fetcher);
+    ret->ClearRanges();
+    ret->AddRange(0);
+    // Speed up test execution.
+    ret->set_retry_seconds(1);
+    ret->SetBuildType(false);
+    return ret;
+  }
+
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewSmallFetcher;
+  virtual HttpFetcher* NewSmallFetcher() {
+    return NewLargeFetcher();
+  }
+};
+
 
 //
 // Infrastructure for type tests of HTTP fetcher.
@@ -291,7 +331,8 @@ class HttpFetcherTest : public ::testing::Test {
 // Test case types list.
 typedef ::testing::Types<LibcurlHttpFetcherTest,
                          MockHttpFetcherTest,
-                         MultiRangeHttpFetcherTest> HttpFetcherTestTypes;
+                         MultiRangeHttpFetcherTest,
+                         ParallelRangeHttpFetcherTest> HttpFetcherTestTypes;
 TYPED_TEST_CASE(HttpFetcherTest, HttpFetcherTestTypes);
 
 
@@ -961,6 +1002,64 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherInsufficientTest) {
   }
 }
 
+namespace {
+// Terminates the transfer on the first bytes, noting the ranges left.
+class RemainingRangesTestDelegate : public HttpFetcherDelegate {
+ public:
+  RemainingRangesTestDelegate(MultiRangeHttpFetcher* fetcher, GMainLoop* loop)
+      : fetcher_(fetcher), loop_(loop) {}
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    EXPECT_TRUE(data_.empty());
+    data_.append(bytes, length);
+    fetcher_->GetRemainingRanges(&ranges_);
+    fetcher_->TerminateTransfer();
+  }
+
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    ADD_FAILURE();
+    g_main_loop_quit(loop_);
+  }
+
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    g_main_loop_quit(loop_);
+  }
+
+  MultiRangeHttpFetcher* fetcher_;
+  GMainLoop* loop_;
+  string data_;
+  vector<pair<uint64_t, uint64_t> > ranges_;
+};
+}  // namespace {}
+
+// A transfer terminated part way through can be carried on from the ranges
+// left.
+TEST(MultiRangeHttpFetcherTest, RemainingRangesTest) {
+  const string payload(3 * kMockHttpFetcherChunkSize, 'x');
+  const size_t kFirstLength = kMockHttpFetcherChunkSize + 100;
+  const uint64_t kSecondOffset = 2 * kMockHttpFetcherChunkSize;
+  MultiRangeHttpFetcher fetcher(
+      new MockHttpFetcher(payload.data(), payload.size()));
+  fetcher.AddRange(0, kFirstLength);
+  fetcher.AddRange(kSecondOffset);
+
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  RemainingRangesTestDelegate delegate(&fetcher, loop);
+  fetcher.set_delegate(&delegate);
+  StartTransferArgs start_xfer_args = {&fetcher, "http://fake_url"};
+  g_timeout_add(0, StartTransfer, &start_xfer_args);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_EQ(kMockHttpFetcherChunkSize, delegate.data_.size());
+  ASSERT_EQ(2U, delegate.ranges_.size());
+  EXPECT_EQ(kMockHttpFetcherChunkSize, delegate.ranges_[0].first);
+  EXPECT_EQ(100U, delegate.ranges_[0].second);
+  EXPECT_EQ(kSecondOffset, delegate.ranges_[1].first);
+  EXPECT_EQ(0U, delegate.ranges_[1].second);
+}
+
 namespace {
 class BlockedTransferTestDelegate : public HttpFetcherDelegate {
  public:
@@ -1010,4 +1109,532 @@ TYPED_TEST(HttpFetcherTest, BlockedTransferTest) {
   }
 }
 
+// Consecutive transfers of a fetcher (e.g. retries of a download) should
+// reuse one connection to the server rather than reconnect each time. Other
+// fetchers, which may check certificates differently, open their own.
+TEST(CurlHandleCacheTest, ReusesConnectionWithinFetcher) {
+  const int kNumTransfers = 4;
+  std::unique_ptr<HttpServer> server(new PythonHttpServer);
+  ASSERT_TRUE(server->started_);
+
+  CurlHandleCache& cache = CurlHandleCache::Get();
+  const int transfers = cache.transfers();
+  const int connections_opened = cache.connections_opened();
+
+  for (int i = 0; i < 2; i++) {
+    GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+    {
+      HttpFetcherTestDelegate delegate;
+      delegate.loop_ = loop;
+      LibcurlHttpFetcher fetcher;
+      fetcher.SetBuildType(false);
+      fetcher.set_delegate(&delegate);
+
+      StartTransferArgs start_xfer_args = {
+        &fetcher,
+        LocalServerUrlForPath(StringPrintf("/keep-alive/download/%d",
+                                           kMediumLength)) };
+
+      for (int j = 0; j < kNumTransfers; j++) {
+        fetcher.SetOffset(0);
+        g_timeout_add(0, StartTransfer, &start_xfer_args);
+        g_main_loop_run(loop);
+      }
+      EXPECT_EQ(kNumTransfers, delegate.times_transfer_complete_called_);
+    }
+    g_main_loop_unref(loop);
+  }
+
+  EXPECT_EQ(transfers + 2 * kNumTransfers, cache.transfers());
+  EXPECT_EQ(connections_opened + 2, cache.connections_opened());
+}
+
+TEST(CurlHandleCacheTest, ShutdownTest) {
+  CurlHandleCache::Get().ReleaseEasyHandle(
+      CurlHandleCache::Get().AcquireEasyHandle());
+  CURL* handle = CurlHandleCache::Get().AcquireEasyHandle();
+  EXPECT_NE(0, CurlHandleCache::Get().transfers());
+
+  // The cache outlives Shutdown() until the handle in use comes back.
+  CurlHandleCache::Shutdown();
+  CurlHandleCache::Get().ReleaseEasyHandle(handle);
+  EXPECT_EQ(0, CurlHandleCache::Get().transfers());
+  CurlHandleCache::Shutdown();
+}
+
+namespace {
+class RangeFetchTestDelegate : public HttpFetcherDelegate {
+ public:
+  RangeFetchTestDelegate() : loop_(NULL), successful_(false) {}
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    data.append(bytes, length);
+  }
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    ADD_FAILURE();
+    g_main_loop_quit(loop_);
+  }
+
+  GMainLoop* loop_;
+  bool successful_;
+  string data;
+};
+
+ParallelRangeHttpFetcher* NewParallelFetcher(int num_fetchers,
+                                             BandwidthLimiter* limiter = NULL) {
+  vector<HttpFetcher*> base_fetchers;
+  for (int i = 0; i < num_fetchers; i++) {
+    LibcurlHttpFetcher* fetcher = new LibcurlHttpFetcher();
+    fetcher->set_retry_seconds(1);
+    fetcher->SetBuildType(false);
+    fetcher->set_bandwidth_limiter(limiter);
+    base_fetchers.push_back(fetcher);
+  }
+  return new ParallelRangeHttpFetcher(base_fetchers);
+}
+
+// Fetches |length| bytes at |offset| of |url| into |data| and returns how
+// long it took.
+std::chrono::microseconds FetchUrlRange(HttpFetcher* fetcher,
+                                        const string& url,
+                                        off_t offset,
+                                        size_t length,
+                                        string* data) {
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  RangeFetchTestDelegate delegate;
+  delegate.loop_ = loop;
+  fetcher->set_delegate(&delegate);
+  fetcher->SetOffset(offset);
+  fetcher->SetLength(length);
+
+  StartTransferArgs start_xfer_args = {fetcher, url};
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  g_timeout_add(0, StartTransfer, &start_xfer_args);
+  g_main_loop_run(loop);
+  std::chrono::microseconds elapsed =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+  g_main_loop_unref(loop);
+
+  EXPECT_TRUE(delegate.successful_);
+  *data = delegate.data;
+  return elapsed;
+}
+
+// The same for |path| on the default test server.
+std::chrono::microseconds FetchRange(HttpFetcher* fetcher,
+                                     const string& path,
+                                     off_t offset,
+                                     size_t length,
+                                     string* data) {
+  return FetchUrlRange(fetcher, LocalServerUrlForPath(path), offset, length,
+                       data);
+}
+
+// Returns the bytes test_http_server serves at [offset, offset + length).
+string ExpectedPayload(off_t offset, size_t length) {
+  string payload;
+  for (size_t i = 0; i < length; i++)
+    payload += 'a' + (offset + i) % 10;
+  return payload;
+}
+}  // namespace {}
+
+TEST(ParallelHttpFetcherTest, InOrderTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer);
+  ASSERT_TRUE(server->started_);
+
+  std::unique_ptr<ParallelRangeHttpFetcher> fetcher(
+      NewParallelFetcher(kParallelFetchers));
+  fetcher->set_segment_size(1000);
+  fetcher->set_max_buffered_bytes(4000);
+  const off_t kOffset = 3;
+  const size_t kLength = kBigLength - 10;
+  string data;
+  FetchRange(fetcher.get(),
+             StringPrintf("/latency/1/download/%d", kBigLength),
+             kOffset, kLength, &data);
+  ASSERT_EQ(kLength, data.size());
+  EXPECT_TRUE(data == ExpectedPayload(kOffset, kLength));
+  EXPECT_EQ(kHttpResponsePartialContent, fetcher->http_response_code());
+}
+
+// Every response of the flaky server is cut short, so each segment has to be
+// resumed by its own base fetcher.
+TEST(ParallelHttpFetcherTest, ResumeTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer);
+  ASSERT_TRUE(server->started_);
+
+  std::unique_ptr<ParallelRangeHttpFetcher> fetcher(
+      NewParallelFetcher(kParallelFetchers));
+  fetcher->set_segment_size(kBigLength / kParallelFetchers);
+  string data;
+  FetchRange(fetcher.get(),
+             StringPrintf("/flaky/%d/%d/0/0", kBigLength,
+                          kFlakyTruncateLength / 2),
+             0, kBigLength, &data);
+  ASSERT_EQ(kBigLength, data.size());
+  EXPECT_TRUE(data == ExpectedPayload(0, kBigLength));
+}
+
+// On a link where each connection is held back by latency, downloading the
+// segments in parallel is faster than downloading them one after another.
+TEST(ParallelHttpFetcherTest, ThroughputTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer);
+  ASSERT_TRUE(server->started_);
+
+  const int kPayloadLength = 1024 * 1024;
+  const string path = StringPrintf("/latency/5/download/%d", kPayloadLength);
+  std::chrono::microseconds elapsed[2];
+  for (int i = 0; i < 2; i++) {
+    const int num_fetchers = i == 0 ? 1 : kParallelFetchers;
+    std::unique_ptr<ParallelRangeHttpFetcher> fetcher(
+        NewParallelFetcher(num_fetchers));
+    fetcher->set_segment_size(kPayloadLength / 16);
+    string data;
+    elapsed[i] = FetchRange(fetcher.get(), path, 0, kPayloadLength, &data);
+    ASSERT_EQ(kPayloadLength, data.size());
+    EXPECT_TRUE(data == ExpectedPayload(0, kPayloadLength));
+    LOG(INFO) << num_fetchers << " connection(s): "
+              << utils::ToString(elapsed[i]) << ", "
+              << static_cast<double>(kPayloadLength) / elapsed[i].count()
+              << " MB/s";
+  }
+  EXPECT_LT(elapsed[1], elapsed[0]);
+}
+
+// The connections sharing a BandwidthLimiter don't download faster than it
+// allows between them.
+TEST(ParallelHttpFetcherTest, BandwidthLimitTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer);
+  ASSERT_TRUE(server->started_);
+
+  const int kPayloadLength = 512 * 1024;
+  const uint64_t kLimit = 512 * 1024;
+  BandwidthLimiter limiter;
+  limiter.set_limit(kLimit);
+  std::unique_ptr<ParallelRangeHttpFetcher> fetcher(
+      NewParallelFetcher(kParallelFetchers, &limiter));
+  fetcher->set_segment_size(kPayloadLength / 16);
+  string data;
+  std::chrono::microseconds elapsed = FetchRange(
+      fetcher.get(), StringPrintf("/download/%d", kPayloadLength),
+      0, kPayloadLength, &data);
+  ASSERT_EQ(kPayloadLength, data.size());
+  EXPECT_TRUE(data == ExpectedPayload(0, kPayloadLength));
+  LOG(INFO) << "Limited to " << kLimit << " bytes/s: "
+            << utils::ToString(elapsed);
+
+  // Allow for the initial burst and for the last chunk of every connection,
+  // which completes the transfer before its debt is paid off.
+  EXPECT_GE(elapsed, std::chrono::milliseconds(500));
+}
+
+namespace {
+class MirrorProberTestDelegate : public MirrorProberDelegate {
+ public:
+  explicit MirrorProberTestDelegate(GMainLoop* loop) : loop_(loop) {}
+
+  virtual void ProbeComplete(MirrorProber* prober,
+                             const vector<MirrorProbeResult>& results) {
+    results_ = results;
+    g_main_loop_quit(loop_);
+  }
+
+  GMainLoop* loop_;
+  vector<MirrorProbeResult> results_;
+};
+
+gboolean StartProbe(gpointer data) {
+  pair<MirrorProber*, vector<string> >* args =
+      reinterpret_cast<pair<MirrorProber*, vector<string> >*>(data);
+  args->first->Probe(args->second);
+  return FALSE;
+}
+
+MirrorProber* NewMirrorProber(int num_fetchers) {
+  vector<HttpFetcher*> fetchers;
+  for (int i = 0; i < num_fetchers; i++) {
+    LibcurlHttpFetcher* fetcher = new LibcurlHttpFetcher();
+    fetcher->set_retry_seconds(1);
+    fetcher->SetBuildType(false);
+    fetchers.push_back(fetcher);
+  }
+  return new MirrorProber(fetchers);
+}
+
+// The mirrors are served by several test servers, each with its own latency
+// and so throughput.
+const int kSlowMirrorPort = kServerPort + 1;
+const int kFastMirrorPort = kServerPort + 2;
+const int kDeadMirrorPort = kServerPort + 3;  // nothing listens there
+
+string MirrorUrl(int port, int latency_ms, int length) {
+  return LocalServerUrlForPath(
+      StringPrintf("/latency/%d/download/%d", latency_ms, length), port);
+}
+
+MirrorHttpFetcher* NewMirrorFetcher(PrefsInterface* prefs,
+                                    BandwidthLimiter* limiter = NULL) {
+  MirrorHttpFetcher* fetcher =
+      new MirrorHttpFetcher(NewParallelFetcher(kParallelFetchers, limiter),
+                            NewMirrorProber(2),
+                            prefs);
+  fetcher->set_bandwidth_limiter(limiter);
+  return fetcher;
+}
+}  // namespace {}
+
+TEST(MirrorProberTest, SelectFastestTest) {
+  vector<MirrorProbeResult> results(3);
+  EXPECT_EQ(-1, MirrorProber::SelectFastest(results));
+
+  // A mirror that answers sooner but streams slowly loses to one that takes
+  // a little longer to answer but is much faster after that.
+  results[0].ok = true;
+  results[0].time_to_first_byte = std::chrono::milliseconds(10);
+  results[0].bytes_per_second = 100 * 1024;
+  results[1].ok = true;
+  results[1].time_to_first_byte = std::chrono::milliseconds(300);
+  results[1].bytes_per_second = 10 * 1024 * 1024;
+  EXPECT_EQ(1, MirrorProber::SelectFastest(results));
+
+  // A mirror that didn't respond is never picked.
+  results[1].ok = false;
+  EXPECT_EQ(0, MirrorProber::SelectFastest(results));
+}
+
+TEST(MirrorProberTest, ProbeTest) {
+  std::unique_ptr<HttpServer> slow_server(
+      new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(slow_server->started_);
+  std::unique_ptr<HttpServer> fast_server(
+      new PythonHttpServer(kFastMirrorPort));
+  ASSERT_TRUE(fast_server->started_);
+
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  MirrorProberTestDelegate delegate(loop);
+  // Fewer fetchers than mirrors, so that one of them probes two.
+  std::unique_ptr<MirrorProber> prober(NewMirrorProber(2));
+  prober->set_delegate(&delegate);
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 100, kBigLength));
+  urls.push_back(MirrorUrl(kDeadMirrorPort, 1, kBigLength));
+  urls.push_back(MirrorUrl(kFastMirrorPort, 1, kBigLength));
+  pair<MirrorProber*, vector<string> > args(prober.get(), urls);
+  g_timeout_add(0, StartProbe, &args);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_FALSE(prober->probing());
+  ASSERT_EQ(urls.size(), delegate.results_.size());
+  for (size_t i = 0; i < urls.size(); i++)
+    EXPECT_EQ(urls[i], delegate.results_[i].url);
+  EXPECT_TRUE(delegate.results_[0].ok);
+  EXPECT_EQ(MirrorProber::kDefaultProbeLength, delegate.results_[0].bytes);
+  EXPECT_FALSE(delegate.results_[1].ok);
+  EXPECT_TRUE(delegate.results_[2].ok);
+  EXPECT_EQ(MirrorProber::kDefaultProbeLength, delegate.results_[2].bytes);
+  EXPECT_GT(delegate.results_[2].bytes_per_second,
+            delegate.results_[0].bytes_per_second);
+  EXPECT_EQ(2, MirrorProber::SelectFastest(delegate.results_));
+}
+
+// A mirror that stalls is judged on what it sent before the timeout.
+TEST(MirrorProberTest, TimeoutTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(server->started_);
+
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  MirrorProberTestDelegate delegate(loop);
+  std::unique_ptr<MirrorProber> prober(NewMirrorProber(1));
+  prober->set_delegate(&delegate);
+  prober->set_timeout(std::chrono::milliseconds(500));
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 200, kBigLength));
+  pair<MirrorProber*, vector<string> > args(prober.get(), urls);
+  g_timeout_add(0, StartProbe, &args);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  ASSERT_EQ(1U, delegate.results_.size());
+  EXPECT_TRUE(delegate.results_[0].ok);
+  EXPECT_GT(delegate.results_[0].bytes, 0U);
+  EXPECT_LT(delegate.results_[0].bytes, MirrorProber::kDefaultProbeLength);
+}
+
+// The transfer goes to the fastest mirror rather than the one asked for, and
+// the choice is stored.
+TEST(MirrorHttpFetcherTest, PicksFastestTest) {
+  std::unique_ptr<HttpServer> slow_server(
+      new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(slow_server->started_);
+  std::unique_ptr<HttpServer> fast_server(
+      new PythonHttpServer(kFastMirrorPort));
+  ASSERT_TRUE(fast_server->started_);
+  files::ScopedTempDir prefs_dir;
+  ASSERT_TRUE(prefs_dir.CreateUniqueTempDir());
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir.path()));
+
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 100, kBigLength));
+  urls.push_back(MirrorUrl(kFastMirrorPort, 1, kBigLength));
+  MirrorHttpFetcher* mirror_fetcher = NewMirrorFetcher(&prefs);
+  mirror_fetcher->set_mirror_urls(urls);
+  std::unique_ptr<MultiRangeHttpFetcher> fetcher(
+      new MultiRangeHttpFetcher(mirror_fetcher));
+  fetcher->AddRange(0, 1000);
+  fetcher->AddRange(5000, kBigLength - 5000);
+
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  RangeFetchTestDelegate delegate;
+  delegate.loop_ = loop;
+  fetcher->set_delegate(&delegate);
+  StartTransferArgs start_xfer_args = {fetcher.get(), urls[0]};
+  g_timeout_add(0, StartTransfer, &start_xfer_args);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_TRUE(delegate.data == ExpectedPayload(0, 1000) +
+              ExpectedPayload(5000, kBigLength - 5000));
+  EXPECT_EQ(urls[1], mirror_fetcher->current_mirror());
+  string choice;
+  EXPECT_TRUE(prefs.GetString(kPrefsMirrorSelection, &choice));
+  EXPECT_EQ(urls[0] + " " + urls[1], choice);
+}
+
+// A transfer that goes to a slow mirror, as chosen before, moves over to a
+// much faster one part way through.
+TEST(MirrorHttpFetcherTest, SwitchTest) {
+  std::unique_ptr<HttpServer> slow_server(
+      new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(slow_server->started_);
+  std::unique_ptr<HttpServer> fast_server(
+      new PythonHttpServer(kFastMirrorPort));
+  ASSERT_TRUE(fast_server->started_);
+  files::ScopedTempDir prefs_dir;
+  ASSERT_TRUE(prefs_dir.CreateUniqueTempDir());
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir.path()));
+
+  const int kPayloadLength = 1024 * 1024;
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 200, kPayloadLength));
+  urls.push_back(MirrorUrl(kFastMirrorPort, 1, kPayloadLength));
+  ASSERT_TRUE(prefs.SetString(kPrefsMirrorSelection,
+                              urls[0] + " " + urls[0]));
+
+  std::unique_ptr<MirrorHttpFetcher> fetcher(NewMirrorFetcher(&prefs));
+  fetcher->set_mirror_urls(urls);
+  fetcher->set_check_interval(std::chrono::milliseconds(300));
+  string data;
+  FetchUrlRange(fetcher.get(), urls[0], 0, kPayloadLength, &data);
+  ASSERT_EQ(kPayloadLength, data.size());
+  EXPECT_TRUE(data == ExpectedPayload(0, kPayloadLength));
+  EXPECT_EQ(urls[1], fetcher->current_mirror());
+  string choice;
+  EXPECT_TRUE(prefs.GetString(kPrefsMirrorSelection, &choice));
+  EXPECT_EQ(urls[0] + " " + urls[1], choice);
+}
+
+// A transfer held back by the bandwidth limit stays with the mirror it's on,
+// even though another one was probed much faster.
+TEST(MirrorHttpFetcherTest, BandwidthLimitTest) {
+  std::unique_ptr<HttpServer> slow_server(
+      new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(slow_server->started_);
+  std::unique_ptr<HttpServer> fast_server(
+      new PythonHttpServer(kFastMirrorPort));
+  ASSERT_TRUE(fast_server->started_);
+  files::ScopedTempDir prefs_dir;
+  ASSERT_TRUE(prefs_dir.CreateUniqueTempDir());
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir.path()));
+
+  // The slower mirror still does better than the limit, and the probes fit
+  // in its burst.
+  const int kPayloadLength = 1024 * 1024;
+  const uint64_t kLimit = 256 * 1024;
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 20, kPayloadLength));
+  urls.push_back(MirrorUrl(kFastMirrorPort, 1, kPayloadLength));
+  ASSERT_TRUE(prefs.SetString(kPrefsMirrorSelection,
+                              urls[0] + " " + urls[0]));
+
+  BandwidthLimiter limiter;
+  limiter.set_limit(kLimit);
+  std::unique_ptr<MirrorHttpFetcher> fetcher(
+      NewMirrorFetcher(&prefs, &limiter));
+  fetcher->set_mirror_urls(urls);
+  fetcher->set_check_interval(std::chrono::milliseconds(300));
+  string data;
+  FetchUrlRange(fetcher.get(), urls[0], 0, kPayloadLength, &data);
+  ASSERT_EQ(kPayloadLength, data.size());
+  EXPECT_TRUE(data == ExpectedPayload(0, kPayloadLength));
+  EXPECT_EQ(urls[0], fetcher->current_mirror());
+}
+
+// Peers serve payloads with a P2PServer, and the transfer goes to the one
+// that has it rather than to the slower upstream mirror.
+TEST(MirrorHttpFetcherTest, PeerTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(server->started_);
+  files::ScopedTempDir peer_dir;
+  ASSERT_TRUE(peer_dir.CreateUniqueTempDir());
+  const string payload = ExpectedPayload(0, kBigLength);
+  ASSERT_TRUE(utils::WriteFile(
+      peer_dir.path().Append("HASH.payload").value().c_str(),
+      payload.data(), payload.size()));
+  P2PServer peer;
+  ASSERT_TRUE(peer.Start(peer_dir.path().value(), "127.0.0.1", 0));
+
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 100, kBigLength));
+  urls.push_back(LocalServerUrlForPath("/missing.payload", peer.port()));
+  urls.push_back(LocalServerUrlForPath("/HASH.payload", peer.port()));
+  std::unique_ptr<MirrorHttpFetcher> fetcher(NewMirrorFetcher(NULL));
+  fetcher->set_mirror_urls(urls);
+  string data;
+  FetchUrlRange(fetcher.get(), urls[0], 1000, kBigLength - 1000, &data);
+  EXPECT_TRUE(data == ExpectedPayload(1000, kBigLength - 1000));
+  EXPECT_EQ(urls[2], fetcher->current_mirror());
+}
+
+// A peer that fails part way through is fallen back from to the upstream
+// mirror, which picks up where the peer left off.
+TEST(MirrorHttpFetcherTest, PeerFallbackTest) {
+  std::unique_ptr<HttpServer> server(new PythonHttpServer(kSlowMirrorPort));
+  ASSERT_TRUE(server->started_);
+  files::ScopedTempDir peer_dir;
+  ASSERT_TRUE(peer_dir.CreateUniqueTempDir());
+  // Enough of it for probing to succeed, but not the rest.
+  const int kPayloadLength = 1024 * 1024;
+  const string partial =
+      ExpectedPayload(0, 2 * MirrorProber::kDefaultProbeLength);
+  ASSERT_TRUE(utils::WriteFile(
+      peer_dir.path().Append("HASH.payload").value().c_str(),
+      partial.data(), partial.size()));
+  P2PServer peer;
+  ASSERT_TRUE(peer.Start(peer_dir.path().value(), "127.0.0.1", 0));
+
+  vector<string> urls;
+  urls.push_back(MirrorUrl(kSlowMirrorPort, 20, kPayloadLength));
+  urls.push_back(LocalServerUrlForPath("/HASH.payload", peer.port()));
+  std::unique_ptr<MirrorHttpFetcher> fetcher(NewMirrorFetcher(NULL));
+  fetcher->set_mirror_urls(urls);
+  string data;
+  FetchUrlRange(fetcher.get(), urls[0], 0, kPayloadLength, &data);
+  ASSERT_EQ(kPayloadLength, data.size());
+  EXPECT_TRUE(data == ExpectedPayload(0, kPayloadLength));
+  EXPECT_EQ(urls[0], fetcher->current_mirror());
+}
+
 }  // namespace chromeos_update_engine
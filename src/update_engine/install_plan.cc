@@ -24,13 +24,19 @@ InstallPlan::InstallPlan(bool is_resume,
       partition_path(partition_path),
       new_partition_size(0),
       new_kernel_size(0),
-      new_pcr_policy_size(0) {}
+      new_pcr_policy_size(0),
+      io_priority(0),
+      io_rate_limit(0),
+      differential_download(false) {}
 
 InstallPlan::InstallPlan() : is_resume(false),
                              payload_size(0),
                              new_partition_size(0),
                              new_kernel_size(0),
-                             new_pcr_policy_size(0) {}
+                             new_pcr_policy_size(0),
+                             io_priority(0),
+                             io_rate_limit(0),
+                             differential_download(false) {}
 
 
 bool InstallPlan::operator==(const InstallPlan& that) const {
@@ -59,7 +65,10 @@ void InstallPlan::Dump() const {
             << ", kernel_path: " << kernel_path
             << ", pcr_policy_path: " << pcr_policy_path
             << ", old_partition_path: " << old_partition_path
-            << ", old_kernel_path: " << old_kernel_path;
+            << ", old_kernel_path: " << old_kernel_path
+            << ", io_priority: " << io_priority
+            << ", io_rate_limit: " << io_rate_limit
+            << ", differential_download: " << differential_download;
 }
 
 }  // namespace chromeos_update_engine
@@ -32,6 +32,10 @@ struct InstallPlan {
   bool is_resume;
   std::string download_url;  // url to download from
 
+  // The payload URLs from download_url on, which all serve the same payload,
+  // so the download may go to whichever of them is fastest.
+  std::vector<std::string> mirror_urls;
+
   uint64_t payload_size;                 // size of the payload
   std::string payload_hash;              // SHA256 hash of the payload
   std::string partition_path;            // path to main partition device
@@ -67,6 +71,15 @@ struct InstallPlan {
   // "KERNEL=kernel_path" indicates that update_engine installed the kernel
   // so the post install script should not do so.
   std::vector<std::string> postinst_args;
+
+  // The I/O priority (an ioprio(2) value, zero to leave it alone) and the
+  // byte-rate limit (zero if unlimited) of the partition reads and writes.
+  int io_priority;
+  uint64_t io_rate_limit;
+
+  // Whether the data of the full payload operations whose result is found
+  // on the disk is left out of the download.
+  bool differential_download;
 };
 
 }  // namespace chromeos_update_engine
@@ -0,0 +1,162 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/io_scheduler.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::string;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+
+namespace chromeos_update_engine {
+
+namespace {
+// From linux/ioprio.h, which older kernel headers don't export.
+const int kIoprioClassShift = 13;
+const int kIoprioClassBestEffort = 2;
+const int kIoprioClassIdle = 3;
+const int kIoprioWhoProcess = 1;
+const int kIoprioBestEffortLevels = 8;
+
+int IoprioValue(int io_class, int level) {
+  return (io_class << kIoprioClassShift) | level;
+}
+}  // namespace {}
+
+const uint64_t IoScheduler::kSyncIntervalBytes = 8 * 1024 * 1024;
+
+IoScheduler::IoScheduler()
+    : priority_(0),
+      previous_priority_(-1),
+      bytes_read_(0),
+      bytes_written_(0),
+      bytes_written_since_sync_(0),
+      sync_failed_(false) {}
+
+IoScheduler::~IoScheduler() {
+  Stop();
+}
+
+void IoScheduler::Start() {
+  // If another scheduler has already applied the same priority, it's the
+  // one that restores the previous priority.
+  if (priority_ && previous_priority_ < 0) {
+    int previous = GetThreadPriority();
+    if (previous != priority_) {
+      if (!SetProcessPriority(priority_))
+        LOG(WARNING) << "Unable to set the I/O priority.";
+      previous_priority_ = previous;
+    }
+  }
+  start_time_ = steady_clock::now();
+  bytes_read_ = bytes_written_ = bytes_written_since_sync_ = 0;
+}
+
+microseconds IoScheduler::Transferred(int fd,
+                                      size_t bytes_read,
+                                      size_t bytes_written) {
+  bytes_read_ += bytes_read;
+  bytes_written_ += bytes_written;
+
+  if (fd >= 0 && !sync_failed_) {
+    bytes_written_since_sync_ += bytes_written;
+    if (bytes_written_since_sync_ >= kSyncIntervalBytes) {
+      bytes_written_since_sync_ = 0;
+      // Wait for the writeback started last time, which should be long done,
+      // then start it for everything written since. This bounds the dirty
+      // pages to about two intervals' worth without waiting on the disk
+      // most of the time.
+      if (sync_file_range(fd, 0, 0,
+                          SYNC_FILE_RANGE_WAIT_BEFORE |
+                          SYNC_FILE_RANGE_WRITE) != 0) {
+        PLOG(WARNING) << "sync_file_range failed, no longer syncing";
+        sync_failed_ = true;
+      }
+    }
+  }
+
+  if (!limiter_.limit())
+    return microseconds(0);
+  return limiter_.Consume(bytes_read + bytes_written);
+}
+
+void IoScheduler::Stop() {
+  if (previous_priority_ < 0)
+    return;
+  if (!SetProcessPriority(previous_priority_))
+    LOG(WARNING) << "Unable to restore the I/O priority.";
+  previous_priority_ = -1;
+}
+
+void IoScheduler::LogThroughput(const string& what) const {
+  microseconds elapsed =
+      duration_cast<microseconds>(steady_clock::now() - start_time_);
+  double seconds = duration<double>(elapsed).count();
+  double mib = static_cast<double>(bytes_read_ + bytes_written_) /
+      (1024 * 1024);
+  LOG(INFO) << what << ": read " << bytes_read_ << " and wrote "
+            << bytes_written_ << " bytes in " << utils::ToString(elapsed)
+            << " (" << (seconds > 0 ? mib / seconds : 0) << " MiB/s)";
+}
+
+bool IoScheduler::ParsePriority(const string& str, int* priority) {
+  if (str == "idle") {
+    *priority = IoprioValue(kIoprioClassIdle, 0);
+    return true;
+  }
+  const string kBestEffort = "best-effort";
+  if (!utils::StringHasPrefix(str, kBestEffort))
+    return false;
+  int level = kIoprioBestEffortLevels / 2;
+  if (str.size() > kBestEffort.size()) {
+    const string level_str = str.substr(kBestEffort.size());
+    if (level_str.size() != 2 || level_str[0] != ':' ||
+        level_str[1] < '0' ||
+        level_str[1] >= '0' + kIoprioBestEffortLevels)
+      return false;
+    level = level_str[1] - '0';
+  }
+  *priority = IoprioValue(kIoprioClassBestEffort, level);
+  return true;
+}
+
+bool IoScheduler::SetProcessPriority(int priority) {
+  // IOPRIO_WHO_PROCESS only covers a single thread, so go through them all.
+  DIR* dir = opendir("/proc/self/task");
+  TEST_AND_RETURN_FALSE_ERRNO(dir);
+  bool success = true;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    pid_t tid = atoi(entry->d_name);
+    if (syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, priority) != 0 &&
+        errno != ESRCH) {
+      PLOG(ERROR) << "ioprio_set failed for thread " << tid;
+      success = false;
+    }
+  }
+  closedir(dir);
+  return success;
+}
+
+int IoScheduler::GetThreadPriority() {
+  int priority = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+  PLOG_IF(ERROR, priority < 0) << "ioprio_get failed";
+  return priority;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,96 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_SCHEDULER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_SCHEDULER_H__
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+
+#include "macros.h"
+#include "update_engine/bandwidth_limiter.h"
+
+// The IoScheduler class keeps the partition I/O of an update from getting in
+// the way of the workload running on the machine. Whoever reads or writes a
+// partition reports every chunk to it, and it
+//  - applies the configured ioprio(2) priority when the I/O starts, and
+//    restores the previous one when it stops,
+//  - tells the caller how long to wait to stay under a byte-rate limit,
+//  - starts the writeback of the written pages every kSyncIntervalBytes, so
+//    that they don't all pile up to be flushed at the end, and
+//  - keeps track of the throughput for the logs.
+
+namespace chromeos_update_engine {
+
+class IoScheduler {
+ public:
+  // The writeback of the written file is started every this many bytes.
+  static const uint64_t kSyncIntervalBytes;
+
+  IoScheduler();
+  ~IoScheduler();
+
+  // The ioprio(2) value to run the I/O at, as made by ParsePriority(). Zero
+  // leaves the priority alone.
+  void set_priority(int priority) { priority_ = priority; }
+  int priority() const { return priority_; }
+
+  // The limit in bytes read and written per second. Zero means unlimited.
+  void set_rate_limit(uint64_t bytes_per_second) {
+    limiter_.set_limit(bytes_per_second);
+  }
+  uint64_t rate_limit() const { return limiter_.limit(); }
+
+  // Applies the priority and resets the statistics. Call it before the
+  // first read or write.
+  void Start();
+
+  // Restores the I/O priority the process had before Start(), if Start()
+  // changed it. Call it once the I/O is done or cancelled; the destructor
+  // calls it too.
+  void Stop();
+
+  // Accounts for |bytes_read| and |bytes_written| (to |fd|, if not -1) and
+  // returns how long the caller should wait before doing more I/O.
+  std::chrono::microseconds Transferred(int fd,
+                                        size_t bytes_read,
+                                        size_t bytes_written);
+
+  // Logs the amount of I/O done since Start() and its throughput, with
+  // |what| describing it (e.g., the path).
+  void LogThroughput(const std::string& what) const;
+
+  // Parses an I/O priority of the form "idle" or "best-effort[:level]" with
+  // a level from 0 (highest) to 7 into an ioprio(2) value. Returns false if
+  // |str| isn't one.
+  static bool ParsePriority(const std::string& str, int* priority);
+
+  // Sets the I/O priority of every thread of this process to |priority|.
+  // New threads inherit it from the one creating them.
+  static bool SetProcessPriority(int priority);
+
+  // Returns the I/O priority of the calling thread, or -1 on failure.
+  static int GetThreadPriority();
+
+ private:
+  int priority_;
+
+  // The priority to restore in Stop(), or -1 if there's none.
+  int previous_priority_;
+  BandwidthLimiter limiter_;
+
+  std::chrono::steady_clock::time_point start_time_;
+  uint64_t bytes_read_;
+  uint64_t bytes_written_;
+  uint64_t bytes_written_since_sync_;
+  bool sync_failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_IO_SCHEDULER_H__
@@ -0,0 +1,123 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "files/scoped_file.h"
+#include "update_engine/io_scheduler.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class IoSchedulerTest : public ::testing::Test { };
+
+namespace {
+const int kIoprioWhoProcess = 1;
+const int kIdle = 3 << 13;
+const int kBestEffort = 2 << 13;
+}  // namespace {}
+
+TEST(IoSchedulerTest, ParsePriorityTest) {
+  int priority = 0;
+  EXPECT_TRUE(IoScheduler::ParsePriority("idle", &priority));
+  EXPECT_EQ(kIdle, priority);
+  EXPECT_TRUE(IoScheduler::ParsePriority("best-effort", &priority));
+  EXPECT_EQ(kBestEffort | 4, priority);
+  EXPECT_TRUE(IoScheduler::ParsePriority("best-effort:0", &priority));
+  EXPECT_EQ(kBestEffort, priority);
+  EXPECT_TRUE(IoScheduler::ParsePriority("best-effort:7", &priority));
+  EXPECT_EQ(kBestEffort | 7, priority);
+
+  EXPECT_FALSE(IoScheduler::ParsePriority("", &priority));
+  EXPECT_FALSE(IoScheduler::ParsePriority("realtime", &priority));
+  EXPECT_FALSE(IoScheduler::ParsePriority("best-effort:8", &priority));
+  EXPECT_FALSE(IoScheduler::ParsePriority("best-effort:", &priority));
+  EXPECT_FALSE(IoScheduler::ParsePriority("best-effort7", &priority));
+  EXPECT_FALSE(IoScheduler::ParsePriority("idle:7", &priority));
+}
+
+TEST(IoSchedulerTest, SetProcessPriorityTest) {
+  int old_priority = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+  ASSERT_GE(old_priority, 0);
+
+  EXPECT_TRUE(IoScheduler::SetProcessPriority(kBestEffort | 7));
+  EXPECT_EQ(kBestEffort | 7, syscall(SYS_ioprio_get, kIoprioWhoProcess, 0));
+
+  // Raising the priority again may need privileges, so put back what was
+  // there on a best effort basis.
+  IoScheduler::SetProcessPriority(old_priority);
+}
+
+TEST(IoSchedulerTest, RestorePriorityTest) {
+  int old_priority = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+  ASSERT_GE(old_priority, 0);
+  ASSERT_TRUE(IoScheduler::SetProcessPriority(kBestEffort | 7));
+
+  {
+    IoScheduler io;
+    io.set_priority(kIdle);
+    io.Start();
+    EXPECT_EQ(kIdle, IoScheduler::GetThreadPriority());
+
+    // A second scheduler with the same priority leaves the restoring to the
+    // first one.
+    IoScheduler nested;
+    nested.set_priority(kIdle);
+    nested.Start();
+    nested.Stop();
+    EXPECT_EQ(kIdle, IoScheduler::GetThreadPriority());
+
+    io.Stop();
+    EXPECT_EQ(kBestEffort | 7, IoScheduler::GetThreadPriority());
+
+    // Going out of scope restores it too.
+    io.Start();
+    EXPECT_EQ(kIdle, IoScheduler::GetThreadPriority());
+  }
+  EXPECT_EQ(kBestEffort | 7, IoScheduler::GetThreadPriority());
+
+  IoScheduler::SetProcessPriority(old_priority);
+}
+
+TEST(IoSchedulerTest, RateLimitTest) {
+  IoScheduler io;
+  io.set_rate_limit(1000);
+  io.Start();
+
+  // The first quarter second worth of I/O goes through right away; going
+  // over makes the caller wait for it to be paid off.
+  EXPECT_EQ(0, io.Transferred(-1, 200, 50).count());
+  EXPECT_GT(io.Transferred(-1, 0, 100), microseconds(milliseconds(50)));
+}
+
+TEST(IoSchedulerTest, UnlimitedSyncTest) {
+  ScopedTempFile file;
+  int fd = open(file.GetPath().c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  files::ScopedFD fd_closer(fd);
+
+  IoScheduler io;
+  io.Start();
+  const vector<char> chunk(IoScheduler::kSyncIntervalBytes / 4, 'x');
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(utils::WriteAll(fd, chunk.data(), chunk.size()));
+    EXPECT_EQ(0, io.Transferred(fd, 0, chunk.size()).count());
+  }
+  io.LogThroughput(file.GetPath());
+}
+
+}  // namespace chromeos_update_engine
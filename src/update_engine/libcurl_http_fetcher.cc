@@ -11,12 +11,12 @@
 
 #include "strings/string_printf.h"
 #include "update_engine/certificate_checker.h"
-#include "update_engine/dbus_interface.h"
+#include "update_engine/curl_handle_cache.h"
 #include "update_engine/utils.h"
 
-using std::max;
 using std::make_pair;
 using std::string;
+using std::chrono::microseconds;
 using strings::StringPrintf;
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
@@ -37,6 +37,10 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
   LOG_IF(ERROR, transfer_in_progress_)
       << "Destroying the fetcher while a transfer is in progress.";
   CleanUp();
+  if (curl_multi_handle_) {
+    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
+    curl_multi_handle_ = NULL;
+  }
 }
 
 bool LibcurlHttpFetcher::IsOfficialBuild() const {
@@ -47,11 +51,22 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
   LOG(INFO) << "Starting/Resuming transfer";
   CHECK(!transfer_in_progress_);
   url_ = url;
-  curl_multi_handle_ = curl_multi_init();
-  CHECK(curl_multi_handle_);
+  // The multi handle is kept for the lifetime of the fetcher and easy handles
+  // come from the CurlHandleCache, so resuming doesn't start from scratch.
+  if (!curl_multi_handle_) {
+    curl_multi_handle_ = curl_multi_init();
+    CHECK(curl_multi_handle_);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETFUNCTION,
+                               StaticSocketCallback), CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETDATA, this),
+             CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERFUNCTION,
+                               StaticTimerCallback), CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERDATA, this),
+             CURLM_OK);
+  }
 
-  curl_handle_ = curl_easy_init();
-  CHECK(curl_handle_);
+  curl_handle_ = CurlHandleCache::Get().AcquireEasyHandle();
 
   CHECK_EQ(curl_easy_setopt(curl_handle_,
                             CURLOPT_ERRORBUFFER,
@@ -201,6 +216,12 @@ void LibcurlHttpFetcher::SetCurlOptionsForHttps() {
     CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SSL_CTX_FUNCTION,
                               CertificateChecker::ProcessSSLContext),
              CURLE_OK);
+    // Easy handles are pooled across fetchers, and a resumed TLS session
+    // doesn't present the certificate to check, so always do a full
+    // handshake. Connections are still reused within this fetcher, whose
+    // checker already saw their certificate.
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SSL_SESSIONID_CACHE, 0L),
+             CURLE_OK);
   }
   if (!auth_user_.empty()) {
     curl_easy_setopt(curl_handle_, CURLOPT_USERNAME, auth_user_.c_str());
@@ -224,7 +245,7 @@ void LibcurlHttpFetcher::BeginTransfer(const std::string& url) {
   terminate_requested_ = false;
   sent_byte_ = false;
   ResumeTransfer(url_);
-  CurlPerformOnce();
+  CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
 }
 
 void LibcurlHttpFetcher::ForceTransferTermination() {
@@ -243,15 +264,16 @@ void LibcurlHttpFetcher::TerminateTransfer() {
   }
 }
 
-void LibcurlHttpFetcher::CurlPerformOnce() {
+void LibcurlHttpFetcher::CurlSocketAction(curl_socket_t fd, int ev_bitmask) {
   CHECK(transfer_in_progress_);
   int running_handles = 0;
   CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
 
-  // libcurl may request that we immediately call curl_multi_perform after it
-  // returns, so we do. libcurl promises that curl_multi_perform will not block.
+  // Older libcurl versions may request that we immediately call again, so
+  // we do. libcurl promises that curl_multi_socket_action will not block.
   while (CURLM_CALL_MULTI_PERFORM == retcode) {
-    retcode = curl_multi_perform(curl_multi_handle_, &running_handles);
+    retcode = curl_multi_socket_action(curl_multi_handle_, fd, ev_bitmask,
+                                       &running_handles);
     if (terminate_requested_) {
       ForceTransferTermination();
       return;
@@ -324,9 +346,6 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
         delegate_->TransferComplete(this, success);
       }
     }
-  } else {
-    // set up callback
-    SetupMainloopSources();
   }
 }
 
@@ -357,105 +376,91 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
   if (delegate_)
     delegate_->ReceivedBytes(this, reinterpret_cast<char*>(ptr), payload_size);
   in_write_callback_ = false;
+
+  if (bandwidth_limiter_ && !terminate_requested_) {
+    microseconds delay = bandwidth_limiter_->Consume(payload_size);
+    if (delay.count() > 0 && !throttled_) {
+      // Stop reading from the socket until the limiter has caught up; TCP
+      // flow control then slows the server down. Pausing from within the
+      // write callback is allowed and takes effect once we return.
+      CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_RECV), CURLE_OK);
+      throttled_ = true;
+      throttle_timeout_id_ = g_timeout_add(
+          std::max(static_cast<guint>(delay.count() / 1000), 1U),
+          &LibcurlHttpFetcher::StaticThrottleTimeoutCallback,
+          this);
+    }
+  }
   return payload_size;
 }
 
 void LibcurlHttpFetcher::Pause() {
   CHECK(curl_handle_);
   CHECK(transfer_in_progress_);
+  paused_ = true;
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_ALL), CURLE_OK);
 }
 
 void LibcurlHttpFetcher::Unpause() {
   CHECK(curl_handle_);
   CHECK(transfer_in_progress_);
-  CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+  paused_ = false;
+  if (!throttled_)
+    CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
 }
 
-// This method sets up callbacks with the glib main loop.
-void LibcurlHttpFetcher::SetupMainloopSources() {
-  fd_set fd_read;
-  fd_set fd_write;
-  fd_set fd_exc;
-
-  FD_ZERO(&fd_read);
-  FD_ZERO(&fd_write);
-  FD_ZERO(&fd_exc);
-
-  int fd_max = 0;
-
-  // Ask libcurl for the set of file descriptors we should track on its
-  // behalf.
-  CHECK_EQ(curl_multi_fdset(curl_multi_handle_, &fd_read, &fd_write,
-                            &fd_exc, &fd_max), CURLM_OK);
-
-  // We should iterate through all file descriptors up to libcurl's fd_max or
-  // the highest one we're tracking, whichever is larger.
-  for (size_t t = 0; t < arraysize(io_channels_); ++t) {
-    if (!io_channels_[t].empty())
-      fd_max = max(fd_max, io_channels_[t].rbegin()->first);
+int LibcurlHttpFetcher::SocketCallback(curl_socket_t fd, int what) {
+  // Drop the current watch, if any. libcurl only calls us when the events it
+  // is interested in change, so it always needs replacing.
+  IOChannels::iterator it = io_channels_.find(fd);
+  if (it != io_channels_.end()) {
+    g_source_remove(it->second.second);
+    g_io_channel_unref(it->second.first);
+    io_channels_.erase(it);
   }
+  if (what == CURL_POLL_REMOVE)
+    return 0;
 
-  // For each fd, if we're not tracking it, track it. If we are tracking it, but
-  // libcurl doesn't care about it anymore, stop tracking it. After this loop,
-  // there should be exactly as many GIOChannel objects in io_channels_[0|1] as
-  // there are read/write fds that we're tracking.
-  for (int fd = 0; fd <= fd_max; ++fd) {
-    // Note that fd_exc is unused in the current version of libcurl so is_exc
-    // should always be false.
-    bool is_exc = FD_ISSET(fd, &fd_exc) != 0;
-    bool must_track[2] = {
-      is_exc || (FD_ISSET(fd, &fd_read) != 0),  // track 0 -- read
-      is_exc || (FD_ISSET(fd, &fd_write) != 0)  // track 1 -- write
-    };
-
-    for (size_t t = 0; t < arraysize(io_channels_); ++t) {
-      bool tracked = io_channels_[t].find(fd) != io_channels_[t].end();
-
-      if (!must_track[t]) {
-        // If we have an outstanding io_channel, remove it.
-        if (tracked) {
-          g_source_remove(io_channels_[t][fd].second);
-          g_io_channel_unref(io_channels_[t][fd].first);
-          io_channels_[t].erase(io_channels_[t].find(fd));
-        }
-        continue;
-      }
-
-      // If we are already tracking this fd, continue -- nothing to do.
-      if (tracked)
-        continue;
-
-      // Set conditions appropriately -- read for track 0, write for track 1.
-      GIOCondition condition = static_cast<GIOCondition>(
-          ((t == 0) ? (G_IO_IN | G_IO_PRI) : G_IO_OUT) | G_IO_ERR | G_IO_HUP);
-
-      // Track a new fd.
-      GIOChannel* io_channel = g_io_channel_unix_new(fd);
-      guint tag =
-          g_io_add_watch(io_channel, condition, &StaticFDCallback, this);
-
-      io_channels_[t][fd] = make_pair(io_channel, tag);
-      static int io_counter = 0;
-      io_counter++;
-      if (io_counter % 50 == 0) {
-        LOG(INFO) << "io_counter = " << io_counter;
-      }
-    }
-  }
+  int condition = G_IO_ERR | G_IO_HUP;
+  if (what & CURL_POLL_IN)
+    condition |= G_IO_IN | G_IO_PRI;
+  if (what & CURL_POLL_OUT)
+    condition |= G_IO_OUT;
+  GIOChannel* io_channel = g_io_channel_unix_new(fd);
+  guint tag = g_io_add_watch(io_channel,
+                             static_cast<GIOCondition>(condition),
+                             &StaticFDCallback,
+                             this);
+  io_channels_[fd] = make_pair(io_channel, tag);
+  return 0;
+}
 
-  // Set up a timeout callback for libcurl.
-  if (!timeout_source_) {
-    LOG(INFO) << "Setting up timeout source: " << idle_seconds_ << " seconds.";
-    timeout_source_ = g_timeout_source_new_seconds(idle_seconds_);
-    g_source_set_callback(timeout_source_, StaticTimeoutCallback, this, NULL);
-    g_source_attach(timeout_source_, NULL);
+int LibcurlHttpFetcher::TimerCallback(long timeout_ms) {
+  if (timeout_source_) {
+    g_source_destroy(timeout_source_);
+    g_source_unref(timeout_source_);
+    timeout_source_ = NULL;
   }
+  if (timeout_ms < 0)
+    return 0;
+  // libcurl must not be called back from within this callback, so even a
+  // zero timeout goes through the main loop.
+  timeout_source_ = g_timeout_source_new(timeout_ms);
+  g_source_set_callback(timeout_source_, StaticTimeoutCallback, this, NULL);
+  g_source_attach(timeout_source_, NULL);
+  return 0;
 }
 
 bool LibcurlHttpFetcher::FDCallback(GIOChannel *source,
                                     GIOCondition condition) {
-  CurlPerformOnce();
+  int ev_bitmask = 0;
+  if (condition & (G_IO_IN | G_IO_PRI))
+    ev_bitmask |= CURL_CSELECT_IN;
+  if (condition & G_IO_OUT)
+    ev_bitmask |= CURL_CSELECT_OUT;
+  if (condition & (G_IO_ERR | G_IO_HUP))
+    ev_bitmask |= CURL_CSELECT_ERR;
+  CurlSocketAction(g_io_channel_unix_get_fd(source), ev_bitmask);
   // We handle removing of this source elsewhere, so we always return true.
   // The docs say, "the function should return FALSE if the event source
   // should be removed."
@@ -463,37 +468,39 @@ bool LibcurlHttpFetcher::FDCallback(GIOChannel *source,
   return true;
 }
 
+gboolean LibcurlHttpFetcher::ThrottleTimeoutCallback() {
+  throttle_timeout_id_ = 0;
+  throttled_ = false;
+  if (transfer_in_progress_ && !paused_) {
+    // Data libcurl held back while paused may be delivered right away, from
+    // within curl_easy_pause, and the delegate may terminate the transfer
+    // from there.
+    CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+    if (terminate_requested_)
+      ForceTransferTermination();
+  }
+  return FALSE;  // Don't have glib auto call this callback again
+}
+
 gboolean LibcurlHttpFetcher::RetryTimeoutCallback() {
   ResumeTransfer(url_);
-  CurlPerformOnce();
+  CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
   return FALSE;  // Don't have glib auto call this callback again
 }
 
 gboolean LibcurlHttpFetcher::TimeoutCallback() {
-  // We always return true, even if we don't want glib to call us back.
-  // We will remove the event source separately if we don't want to
-  // be called back.
-  if (!transfer_in_progress_)
-    return TRUE;
-  CurlPerformOnce();
-  return TRUE;
-}
-
-void LibcurlHttpFetcher::CleanUp() {
+  // The timer is one-shot: glib drops it when we return FALSE and libcurl
+  // sets a new one through TimerCallback() if it needs one.
   if (timeout_source_) {
-    g_source_destroy(timeout_source_);
+    g_source_unref(timeout_source_);
     timeout_source_ = NULL;
   }
+  if (transfer_in_progress_)
+    CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
+  return FALSE;
+}
 
-  for (size_t t = 0; t < arraysize(io_channels_); ++t) {
-    for (IOChannels::iterator it = io_channels_[t].begin();
-         it != io_channels_[t].end(); ++it) {
-      g_source_remove(it->second.second);
-      g_io_channel_unref(it->second.first);
-    }
-    io_channels_[t].clear();
-  }
-
+void LibcurlHttpFetcher::CleanUp() {
   if (curl_http_headers_) {
     curl_slist_free_all(curl_http_headers_);
     curl_http_headers_ = NULL;
@@ -503,13 +510,25 @@ void LibcurlHttpFetcher::CleanUp() {
       CHECK_EQ(curl_multi_remove_handle(curl_multi_handle_, curl_handle_),
                CURLM_OK);
     }
-    curl_easy_cleanup(curl_handle_);
+    CurlHandleCache::Get().ReleaseEasyHandle(curl_handle_);
     curl_handle_ = NULL;
   }
-  if (curl_multi_handle_) {
-    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
-    curl_multi_handle_ = NULL;
+
+  // libcurl normally releases its sockets and timer through the callbacks
+  // above once the transfer is removed; drop whatever is left.
+  TimerCallback(-1);
+  for (IOChannels::iterator it = io_channels_.begin();
+       it != io_channels_.end(); ++it) {
+    g_source_remove(it->second.second);
+    g_io_channel_unref(it->second.first);
+  }
+  io_channels_.clear();
+  if (throttle_timeout_id_) {
+    g_source_remove(throttle_timeout_id_);
+    throttle_timeout_id_ = 0;
   }
+  throttled_ = false;
+  paused_ = false;
   transfer_in_progress_ = false;
 }
 
@@ -13,6 +13,7 @@
 #include <glog/logging.h>
 
 #include "macros.h"
+#include "update_engine/bandwidth_limiter.h"
 #include "update_engine/certificate_checker.h"
 #include "update_engine/http_fetcher.h"
 
@@ -34,6 +35,7 @@ class LibcurlHttpFetcher : public HttpFetcher {
         curl_handle_(NULL),
         curl_http_headers_(NULL),
         timeout_source_(NULL),
+        throttle_timeout_id_(0),
         transfer_in_progress_(false),
         transfer_size_(0),
         bytes_downloaded_(0),
@@ -44,12 +46,14 @@ class LibcurlHttpFetcher : public HttpFetcher {
         retry_seconds_(20),
         no_network_retry_count_(0),
         no_network_max_retries_(0),
-        idle_seconds_(1),
         force_build_type_(false),
         forced_official_build_(false),
         in_write_callback_(false),
         sent_byte_(false),
         terminate_requested_(false),
+        paused_(false),
+        throttled_(false),
+        bandwidth_limiter_(NULL),
         check_certificate_(CertificateChecker::kNone) {}
 
   // Cleans up all internal state. Does not notify delegate
@@ -70,20 +74,11 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Suspend the transfer by calling curl_easy_pause(CURLPAUSE_ALL).
   virtual void Pause();
 
-  // Resume the transfer by calling curl_easy_pause(CURLPAUSE_CONT).
+  // Resume the transfer by calling curl_easy_pause(CURLPAUSE_CONT), unless
+  // the bandwidth limiter is holding it, in which case it resumes once the
+  // limiter lets it.
   virtual void Unpause();
 
-  // Libcurl sometimes asks to be called back after some time while
-  // leaving that time unspecified. In that case, we pick a reasonable
-  // default of one second, but it can be overridden here. This is
-  // primarily useful for testing.
-  // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
-  //     if libcurl returns a -1 timeout here, it just means that libcurl
-  //     currently has no stored timeout value. You must not wait too long
-  //     (more than a few seconds perhaps) before you call
-  //     curl_multi_perform() again.
-  void set_idle_seconds(int seconds) { idle_seconds_ = seconds; }
-
   // Sets the retry timeout. Useful for testing.
   void set_retry_seconds(int seconds) { retry_seconds_ = seconds; }
 
@@ -101,6 +96,12 @@ class LibcurlHttpFetcher : public HttpFetcher {
     check_certificate_ = check_certificate;
   }
 
+  // Throttles the transfers to the rate |limiter| allows, which may be
+  // shared with other fetchers. Not owned; NULL means no limit.
+  void set_bandwidth_limiter(BandwidthLimiter* limiter) {
+    bandwidth_limiter_ = limiter;
+  }
+
   // Sets HTTP Auth user and password for HTTPS connections.
   // Copies the given credentials.
   void set_auth_credentials(const char* auth_user, const char* auth_password) {
@@ -133,8 +134,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   virtual void ResumeTransfer(const std::string& url);
 
   // These two methods are for glib main loop callbacks. They are called
-  // when either a file descriptor is ready for work or when a timer
-  // has fired. The static versions are shims for libcurl which has a C API.
+  // when either a socket libcurl asked us to watch is ready for work or
+  // when libcurl's timer has fired. The static versions are shims for glib
+  // which has a C API.
   bool FDCallback(GIOChannel *source, GIOCondition condition);
   static gboolean StaticFDCallback(GIOChannel *source,
                                    GIOCondition condition,
@@ -147,23 +149,45 @@ class LibcurlHttpFetcher : public HttpFetcher {
     return reinterpret_cast<LibcurlHttpFetcher*>(data)->TimeoutCallback();
   }
 
+  // Resumes receiving once the bandwidth limiter allows it again.
+  gboolean ThrottleTimeoutCallback();
+  static gboolean StaticThrottleTimeoutCallback(gpointer data) {
+    return reinterpret_cast<LibcurlHttpFetcher*>(data)->
+        ThrottleTimeoutCallback();
+  }
+
   gboolean RetryTimeoutCallback();
   static gboolean StaticRetryTimeoutCallback(void* arg) {
     return static_cast<LibcurlHttpFetcher*>(arg)->RetryTimeoutCallback();
   }
 
-  // Calls into curl_multi_perform to let libcurl do its work. Returns after
-  // curl_multi_perform is finished, which may actually be after more than
-  // one call to curl_multi_perform. This method will set up the glib run
-  // loop with sources for future work that libcurl will do.
-  // This method will not block.
-  // Returns true if we should resume immediately after this call.
-  void CurlPerformOnce();
+  // Calls into curl_multi_socket_action to let libcurl do the work pending
+  // on socket |fd| (CURL_SOCKET_TIMEOUT if libcurl's timer fired) with the
+  // CURL_CSELECT_* events in |ev_bitmask|. libcurl keeps the glib main loop
+  // sources up to date through SocketCallback() and TimerCallback(), and
+  // when the transfer is done this notifies the delegate or schedules a
+  // retry. This method will not block.
+  void CurlSocketAction(curl_socket_t fd, int ev_bitmask);
+
+  // Called by libcurl (CURLMOPT_SOCKETFUNCTION) whenever the CURL_POLL_*
+  // events it wants on socket |fd| change. Adds, updates or removes the
+  // glib watch for |fd| accordingly.
+  int SocketCallback(curl_socket_t fd, int what);
+  static int StaticSocketCallback(CURL* easy, curl_socket_t fd, int what,
+                                  void* userp, void* socketp) {
+    return reinterpret_cast<LibcurlHttpFetcher*>(userp)->SocketCallback(fd,
+                                                                        what);
+  }
 
-  // Sets up glib main loop sources as needed by libcurl. This is generally
-  // the file descriptor of the socket and a timer in case nothing happens
-  // on the fds.
-  void SetupMainloopSources();
+  // Called by libcurl (CURLMOPT_TIMERFUNCTION) to ask to be called back
+  // through CurlSocketAction() in |timeout_ms| milliseconds. A negative
+  // value cancels the timer.
+  int TimerCallback(long timeout_ms);
+  static int StaticTimerCallback(CURLM* multi, long timeout_ms,
+                                 void* userp) {
+    return reinterpret_cast<LibcurlHttpFetcher*>(userp)->TimerCallback(
+        timeout_ms);
+  }
 
   // Callback called by libcurl when new data has arrived on the transfer
   size_t LibcurlWrite(void *ptr, size_t size, size_t nmemb);
@@ -173,8 +197,10 @@ class LibcurlHttpFetcher : public HttpFetcher {
         LibcurlWrite(ptr, size, nmemb);
   }
 
-  // Cleans up the following if they are non-null:
-  // curl(m) handles, io_channels_, timeout_source_.
+  // Cleans up the following if they are non-null: the curl easy handle
+  // (returned to the CurlHandleCache), io_channels_, timeout_source_,
+  // throttle_timeout_id_.
+  // The multi handle is kept for the next transfer.
   void CleanUp();
 
   // Force terminate the transfer. This will invoke the delegate's (if any)
@@ -195,22 +221,26 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Sets the curl options for HTTPS URL.
   void SetCurlOptionsForHttps();
 
-  // Handles for the libcurl library
+  // Handles for the libcurl library. The multi handle lives as long as the
+  // fetcher; the easy handle only for the current transfer.
   CURLM *curl_multi_handle_;
   CURL *curl_handle_;
   struct curl_slist *curl_http_headers_;
 
-  // Lists of all read(0)/write(1) file descriptors that we're waiting on from
-  // the glib main loop. libcurl may open/close descriptors and switch their
-  // directions so maintain two separate lists so that watch conditions can be
-  // set appropriately.
+  // The sockets libcurl asked us to watch, with the glib watch for each.
+  // libcurl tells us through SocketCallback() whenever it opens or closes a
+  // socket or changes the direction it is waiting on.
   typedef std::map<int, std::pair<GIOChannel*, guint> > IOChannels;
-  IOChannels io_channels_[2];
+  IOChannels io_channels_;
 
-  // if non-NULL, a timer we're waiting on. glib main loop will call us back
-  // when it fires.
+  // if non-NULL, libcurl's timer we're waiting on. glib main loop will call
+  // us back when it fires.
   GSource* timeout_source_;
 
+  // If non-zero, the glib timeout that resumes a transfer paused by the
+  // bandwidth limiter.
+  guint throttle_timeout_id_;
+
   bool transfer_in_progress_;
 
   // The transfer size. -1 if not known.
@@ -240,9 +270,6 @@ class LibcurlHttpFetcher : public HttpFetcher {
   int no_network_retry_count_;
   int no_network_max_retries_;
 
-  // Seconds to wait before asking libcurl to "perform".
-  int idle_seconds_;
-
   // If true, assume the build is official or not, according to
   // forced_official_build_. Useful for testing.
   bool force_build_type_;
@@ -259,6 +286,13 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // if we get a terminate request, queue it until we can handle it.
   bool terminate_requested_;
 
+  // True if the transfer was paused through Pause(), or by the bandwidth
+  // limiter, respectively. It only resumes once neither holds it.
+  bool paused_;
+  bool throttled_;
+
+  BandwidthLimiter* bandwidth_limiter_;
+
   // Buffer for curl to dump useful information into
   char curl_error_buffer_[CURL_ERROR_SIZE] ;
 
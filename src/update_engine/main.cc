@@ -8,6 +8,7 @@
 #include <sodium.h>
 
 #include "update_engine/certificate_checker.h"
+#include "update_engine/curl_handle_cache.h"
 #include "update_engine/dbus_constants.h"
 #include "update_engine/dbus_interface.h"
 #include "update_engine/dbus_service.h"
@@ -144,6 +145,7 @@ int main(int argc, char** argv) {
   g_main_loop_unref(loop);
   update_attempter->set_dbus_service(NULL);
   g_object_unref(G_OBJECT(service));
+  chromeos_update_engine::CurlHandleCache::Shutdown();
 
   LOG(INFO) << "Flatcar Update Engine terminating";
   return 0;
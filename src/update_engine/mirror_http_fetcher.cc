@@ -0,0 +1,364 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/mirror_http_fetcher.h"
+
+#include <algorithm>
+
+#include "strings/string_split.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+}  // namespace {}
+
+const std::chrono::milliseconds MirrorHttpFetcher::kDefaultCheckInterval(
+    10000);
+const double MirrorHttpFetcher::kSwitchRatio = 4;
+const int MirrorHttpFetcher::kMaxSwitches = 2;
+
+MirrorHttpFetcher::MirrorHttpFetcher(HttpFetcher* base_fetcher,
+                                     MirrorProber* prober,
+                                     PrefsInterface* prefs)
+    : base_fetcher_(base_fetcher),
+      prober_(prober),
+      prefs_(prefs),
+      bandwidth_limiter_(NULL),
+      current_(-1),
+      switches_(0),
+      offset_(0),
+      length_(0),
+      received_(0),
+      bytes_downloaded_(0),
+      check_interval_(kDefaultCheckInterval),
+      check_timeout_id_(0),
+      window_bytes_(0),
+      transfer_active_(false),
+      waiting_for_probe_(false),
+      switching_(false),
+      next_(-1),
+      terminating_(false),
+      paused_(false) {
+  base_fetcher_->set_delegate(this);
+  prober_->set_delegate(this);
+}
+
+MirrorHttpFetcher::~MirrorHttpFetcher() {
+  LOG_IF(ERROR, transfer_active_) << "Destroying an active fetcher.";
+  StopCheckTimer();
+}
+
+void MirrorHttpFetcher::set_mirror_urls(const vector<string>& urls) {
+  CHECK(!transfer_active_);
+  prober_->Cancel();
+  mirror_urls_ = urls;
+  failed_.assign(urls.size(), false);
+  results_.clear();
+  current_ = -1;
+  switches_ = 0;
+}
+
+string MirrorHttpFetcher::current_mirror() const {
+  return current_ >= 0 ? mirror_urls_[current_] : "";
+}
+
+void MirrorHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_active_) << "BeginTransfer but already active.";
+  if (url != url_ || current_ >= static_cast<int>(mirror_urls_.size()))
+    current_ = -1;
+  url_ = url;
+  http_response_code_ = 0;
+  received_ = 0;
+  transfer_active_ = true;
+  terminating_ = switching_ = false;
+
+  if (mirror_urls_.size() < 2 || MirrorIndex(url) < 0 || current_ >= 0 ||
+      LoadChoice()) {
+    StartBase();
+    return;
+  }
+  // The mirrors are probed once per fetcher; later ranges go to the same
+  // one unless it's switched away from.
+  waiting_for_probe_ = true;
+  if (!prober_->probing())
+    prober_->Probe(mirror_urls_);
+}
+
+void MirrorHttpFetcher::TerminateTransfer() {
+  if (!transfer_active_) {
+    LOG(INFO) << "Called TerminateTransfer but not active.";
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  if (terminating_)
+    return;
+  terminating_ = true;
+  if (waiting_for_probe_) {
+    prober_->Cancel();
+    waiting_for_probe_ = false;
+    EndTransfer(true, false);
+    return;
+  }
+  // If switching, the base fetcher is already stopping.
+  if (!switching_)
+    base_fetcher_->TerminateTransfer();
+}
+
+void MirrorHttpFetcher::Pause() {
+  paused_ = true;
+  if (transfer_active_ && !waiting_for_probe_)
+    base_fetcher_->Pause();
+}
+
+void MirrorHttpFetcher::Unpause() {
+  paused_ = false;
+  if (transfer_active_ && !waiting_for_probe_) {
+    // Time spent paused doesn't count against the mirror.
+    window_start_ = Clock::now();
+    window_bytes_ = 0;
+    base_fetcher_->Unpause();
+  }
+}
+
+void MirrorHttpFetcher::ProbeComplete(MirrorProber* prober,
+                                      const vector<MirrorProbeResult>& results) {
+  results_ = results;
+  if (!waiting_for_probe_)
+    return;
+  waiting_for_probe_ = false;
+  const int fastest = MirrorProber::SelectFastest(results);
+  if (fastest < 0) {
+    // Let the transfer fail on the URL asked for, so that it's counted
+    // against it.
+    LOG(WARNING) << "None of the mirrors responded to probing.";
+    current_ = MirrorIndex(url_);
+  } else {
+    current_ = fastest;
+    LOG(INFO) << "Picked the mirror " << mirror_urls_[current_];
+  }
+  StoreChoice();
+  StartBase();
+}
+
+void MirrorHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                      const char* bytes,
+                                      int length) {
+  // Bytes still arriving from the old mirror while switching are kept, and
+  // the new one picks up after them.
+  if (terminating_)
+    return;
+  http_response_code_ = fetcher->http_response_code();
+  size_t size = length;
+  if (length_)
+    size = std::min(size, length_ - received_);
+  received_ += size;
+  bytes_downloaded_ += size;
+  window_bytes_ += size;
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, size);
+}
+
+void MirrorHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                         bool successful) {
+  http_response_code_ = fetcher->http_response_code();
+  if (!successful && current_ >= 0 && !terminating_) {
+    // Mirrors, peers in particular, may go away; carry on from another one.
+    failed_[current_] = true;
+    const int next = NextMirror();
+    if (next >= 0) {
+      LOG(INFO) << "The transfer from " << mirror_urls_[current_]
+                << " failed, falling back to " << mirror_urls_[next];
+      current_ = next;
+      switching_ = false;
+      StoreChoice();
+      StartBase();
+      return;
+    }
+    // Don't go back to a mirror that failed after a restart.
+    if (prefs_)
+      prefs_->Delete(kPrefsMirrorSelection);
+  }
+  EndTransfer(false, successful);
+}
+
+void MirrorHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  if (fetcher->http_response_code())
+    http_response_code_ = fetcher->http_response_code();
+  if (switching_ && !terminating_) {
+    switching_ = false;
+    current_ = next_;
+    next_ = -1;
+    switches_++;
+    StoreChoice();
+    if (length_ && received_ >= length_) {
+      // All of it came in before the old mirror stopped.
+      EndTransfer(false, true);
+      return;
+    }
+    StartBase();
+    return;
+  }
+  EndTransfer(true, false);
+}
+
+int MirrorHttpFetcher::MirrorIndex(const string& url) const {
+  for (size_t i = 0; i < mirror_urls_.size(); i++) {
+    if (mirror_urls_[i] == url)
+      return i;
+  }
+  return -1;
+}
+
+int MirrorHttpFetcher::NextMirror() const {
+  // The fastest of the mirrors that responded to probing, or without probe
+  // results, the first one in order, which puts the URLs from Omaha first.
+  if (!results_.empty()) {
+    vector<MirrorProbeResult> candidates = results_;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      if (failed_[i])
+        candidates[i].ok = false;
+    }
+    const int fastest = MirrorProber::SelectFastest(candidates);
+    if (fastest >= 0)
+      return fastest;
+    // The URL asked for is worth a try even if it didn't respond in time.
+    const int nominal = MirrorIndex(url_);
+    return nominal < 0 || failed_[nominal] ? -1 : nominal;
+  }
+  for (size_t i = 0; i < failed_.size(); i++) {
+    if (!failed_[i])
+      return i;
+  }
+  return -1;
+}
+
+bool MirrorHttpFetcher::LoadChoice() {
+  // The choice is stored as "<url asked for> <mirror chosen>", and only
+  // applies to the same URL.
+  string value;
+  if (!prefs_ || !prefs_->GetString(kPrefsMirrorSelection, &value))
+    return false;
+  const vector<string> fields = strings::SplitWords(value);
+  if (fields.size() != 2 || fields[0] != url_)
+    return false;
+  const int index = MirrorIndex(fields[1]);
+  if (index < 0)
+    return false;
+  current_ = index;
+  LOG(INFO) << "Using the mirror " << fields[1] << " picked before";
+  return true;
+}
+
+void MirrorHttpFetcher::StoreChoice() {
+  if (prefs_ && current_ >= 0)
+    prefs_->SetString(kPrefsMirrorSelection,
+                      url_ + " " + mirror_urls_[current_]);
+}
+
+void MirrorHttpFetcher::StartBase() {
+  const string url = current_ >= 0 ? mirror_urls_[current_] : url_;
+  LOG_IF(INFO, received_ > 0) << "Resuming the transfer from " << url
+                              << " after " << received_ << " bytes";
+  base_fetcher_->SetOffset(offset_ + received_);
+  if (length_)
+    base_fetcher_->SetLength(length_ - received_);
+  else
+    base_fetcher_->UnsetLength();
+  base_fetcher_->BeginTransfer(url);
+  if (paused_)
+    base_fetcher_->Pause();
+  if (current_ >= 0)
+    StartCheckTimer();
+}
+
+void MirrorHttpFetcher::EndTransfer(bool terminated, bool successful) {
+  StopCheckTimer();
+  transfer_active_ = false;
+  switching_ = false;
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_) {
+    if (terminated)
+      delegate_->TransferTerminated(this);
+    else
+      delegate_->TransferComplete(this, successful);
+  }
+}
+
+void MirrorHttpFetcher::StartCheckTimer() {
+  StopCheckTimer();
+  window_start_ = Clock::now();
+  window_bytes_ = 0;
+  check_timeout_id_ = g_timeout_add(check_interval_.count(),
+                                    StaticCheckCallback, this);
+}
+
+void MirrorHttpFetcher::StopCheckTimer() {
+  if (check_timeout_id_) {
+    g_source_remove(check_timeout_id_);
+    check_timeout_id_ = 0;
+  }
+}
+
+gboolean MirrorHttpFetcher::CheckCallback() {
+  if (paused_ || switching_ || terminating_)
+    return TRUE;
+  const Clock::time_point now = Clock::now();
+  const double seconds =
+      std::chrono::duration<double>(now - window_start_).count();
+  const double rate = seconds > 0 ? window_bytes_ / seconds : 0;
+  window_start_ = now;
+  window_bytes_ = 0;
+
+  if (results_.empty()) {
+    // The mirror was picked before; find out how the others do.
+    if (!prober_->probing())
+      prober_->Probe(mirror_urls_);
+    return TRUE;
+  }
+  if (switches_ >= kMaxSwitches)
+    return TRUE;
+
+  // Note that the base fetcher may use several connections while a probe
+  // uses one, which only makes switching less likely.
+  int best = -1;
+  for (size_t i = 0; i < results_.size(); i++) {
+    if (static_cast<int>(i) == current_ || !results_[i].ok)
+      continue;
+    if (best < 0 ||
+        results_[i].bytes_per_second > results_[best].bytes_per_second)
+      best = i;
+  }
+  if (best < 0)
+    return TRUE;
+  // The probes are short enough to fit in the limiter's burst, so they
+  // aren't held back like the transfer is.
+  double best_rate = results_[best].bytes_per_second;
+  const uint64_t limit =
+      bandwidth_limiter_ ? bandwidth_limiter_->CurrentLimit() : 0;
+  if (limit)
+    best_rate = std::min(best_rate, static_cast<double>(limit));
+  if (rate * kSwitchRatio >= best_rate)
+    return TRUE;
+
+  LOG(INFO) << "Getting " << static_cast<uint64_t>(rate) << " bytes/s from "
+            << mirror_urls_[current_] << " but "
+            << mirror_urls_[best] << " was probed at "
+            << static_cast<uint64_t>(results_[best].bytes_per_second)
+            << " bytes/s, switching to it";
+  // Remember how the mirror did, so it isn't switched back to.
+  results_[current_].bytes_per_second = rate;
+  check_timeout_id_ = 0;
+  switching_ = true;
+  next_ = best;
+  base_fetcher_->TerminateTransfer();
+  return FALSE;  // Restarted along with the transfer.
+}
+
+}  // namespace chromeos_update_engine
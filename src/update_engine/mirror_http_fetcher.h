@@ -0,0 +1,195 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MIRROR_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MIRROR_HTTP_FETCHER_H__
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "update_engine/bandwidth_limiter.h"
+#include "update_engine/http_fetcher.h"
+#include "update_engine/mirror_prober.h"
+#include "update_engine/prefs_interface.h"
+
+// This class downloads from whichever of a set of mirrors of the same
+// payload is fastest, rather than from the one asked for. PayloadState only
+// moves on to another URL once the current one has failed repeatedly, so a
+// slow but working mirror would otherwise be used for the whole download.
+//
+// On the first transfer from a URL that is one of the mirrors, all of them
+// are probed with a MirrorProber and the transfer goes to the fastest. The
+// choice is stored in the prefs, so that a download resumed later (e.g.
+// after a restart) goes back to the same mirror without probing.
+//
+// While downloading, the throughput is measured every check_interval(). If
+// it falls more than kSwitchRatio times below what another mirror was
+// probed at, the transfer is stopped and resumed from that mirror with a
+// Range request, at the same offset. Bytes handed to the delegate are the
+// same as from a single mirror. If the choice came from the prefs, the
+// mirrors are probed in the background the first time the throughput is
+// checked, to have something to compare it with. While a BandwidthLimiter
+// holds the transfer back, a mirror isn't expected to do better than the
+// limit, however fast it was probed.
+//
+// If the transfer from a mirror fails, it carries on from the next fastest
+// one that hasn't failed, so only once they all have does the transfer
+// fail.
+//
+// It is meant to be used as the base fetcher of a MultiRangeHttpFetcher,
+// which supplies the offset and length of every range it fetches.
+
+namespace chromeos_update_engine {
+
+class MirrorHttpFetcher : public HttpFetcher,
+                          public HttpFetcherDelegate,
+                          public MirrorProberDelegate {
+ public:
+  static const std::chrono::milliseconds kDefaultCheckInterval;
+  static const double kSwitchRatio;
+
+  // At most this many switches are made per fetcher, so that mirrors of
+  // similar speed aren't alternated between.
+  static const int kMaxSwitches;
+
+  // Takes ownership of |base_fetcher| and |prober|. |prefs| may be NULL, in
+  // which case choices aren't stored.
+  MirrorHttpFetcher(HttpFetcher* base_fetcher,
+                    MirrorProber* prober,
+                    PrefsInterface* prefs);
+  virtual ~MirrorHttpFetcher();
+
+  // The URLs of the mirrors, which include the one passed to
+  // BeginTransfer(). With fewer than two, transfers go straight to the base
+  // fetcher.
+  void set_mirror_urls(const std::vector<std::string>& urls);
+  const std::vector<std::string>& mirror_urls() const { return mirror_urls_; }
+
+  void set_check_interval(std::chrono::milliseconds interval) {
+    check_interval_ = interval;
+  }
+
+  // The limiter the base fetcher's connections share, if any. Not owned.
+  void set_bandwidth_limiter(const BandwidthLimiter* limiter) {
+    bandwidth_limiter_ = limiter;
+  }
+
+  // The URL transfers go to, which is empty until one is chosen.
+  std::string current_mirror() const;
+
+  virtual void SetOffset(off_t offset) { offset_ = offset; }
+
+  virtual void SetLength(size_t length) { length_ = length; }
+  virtual void UnsetLength() { SetLength(0); }
+
+  // Begins the transfer to the specified URL, or a mirror of it.
+  virtual void BeginTransfer(const std::string& url);
+
+  virtual void TerminateTransfer();
+
+  virtual void Pause();
+  virtual void Unpause();
+
+  // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
+  virtual void set_retry_seconds(int seconds) {
+    base_fetcher_->set_retry_seconds(seconds);
+  }
+  virtual void SetBuildType(bool is_official) {
+    base_fetcher_->SetBuildType(is_official);
+  }
+
+  virtual size_t GetBytesDownloaded() { return bytes_downloaded_; }
+
+  // MirrorProberDelegate method.
+  virtual void ProbeComplete(MirrorProber* prober,
+                             const std::vector<MirrorProbeResult>& results);
+
+ private:
+  // HttpFetcherDelegate methods, called by the base fetcher.
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+  virtual void TransferTerminated(HttpFetcher* fetcher);
+
+  // Returns the index of |url| in mirror_urls_, or -1.
+  int MirrorIndex(const std::string& url) const;
+
+  // Returns the mirror to fall back to once the current one has failed, or
+  // -1 if there's none left.
+  int NextMirror() const;
+
+  // Loads the mirror chosen for url_ from the prefs into current_, or
+  // stores current_ as the choice.
+  bool LoadChoice();
+  void StoreChoice();
+
+  // Starts or resumes the transfer from the current mirror, or from url_ if
+  // there's none.
+  void StartBase();
+
+  // Reports the end of the transfer to the delegate. Note that the delegate
+  // may destroy this object.
+  void EndTransfer(bool terminated, bool successful);
+
+  void StartCheckTimer();
+  void StopCheckTimer();
+
+  // Measures the throughput since the last check and switches mirrors if
+  // another one is expected to be much faster.
+  gboolean CheckCallback();
+  static gboolean StaticCheckCallback(gpointer data) {
+    return reinterpret_cast<MirrorHttpFetcher*>(data)->CheckCallback();
+  }
+
+  std::unique_ptr<HttpFetcher> base_fetcher_;
+  std::unique_ptr<MirrorProber> prober_;
+  PrefsInterface* prefs_;
+  const BandwidthLimiter* bandwidth_limiter_;
+
+  std::vector<std::string> mirror_urls_;
+
+  // The probe results for mirror_urls_, empty if they weren't probed.
+  std::vector<MirrorProbeResult> results_;
+
+  // The mirrors whose transfer failed.
+  std::vector<bool> failed_;
+
+  // The mirror transfers go to, -1 if none is chosen yet.
+  int current_;
+  int switches_;
+
+  off_t offset_;
+  size_t length_;  // zero means up to the end of the resource
+
+  // Bytes handed to the delegate in this transfer and in total.
+  size_t received_;
+  size_t bytes_downloaded_;
+
+  // Throughput measurement since the last check.
+  std::chrono::milliseconds check_interval_;
+  guint check_timeout_id_;
+  std::chrono::steady_clock::time_point window_start_;
+  size_t window_bytes_;
+
+  // True between BeginTransfer and reporting the outcome.
+  bool transfer_active_;
+  // True while waiting for the mirrors to be probed before starting.
+  bool waiting_for_probe_;
+  // True while the base fetcher stops in order to switch to |next_|.
+  bool switching_;
+  int next_;
+  bool terminating_;
+  bool paused_;
+
+  DISALLOW_COPY_AND_ASSIGN(MirrorHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MIRROR_HTTP_FETCHER_H__
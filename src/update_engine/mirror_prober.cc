@@ -0,0 +1,247 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/mirror_prober.h"
+
+#include <algorithm>
+
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+// Shorter spans than this are too coarse to measure throughput over.
+const std::chrono::milliseconds kMinMeasuredDuration(1);
+
+double ToSeconds(Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+}  // namespace {}
+
+const size_t MirrorProber::kDefaultProbeLength = 64 * 1024;
+const uint64_t MirrorProber::kComparisonLength = 16 * 1024 * 1024;
+const std::chrono::milliseconds MirrorProber::kDefaultTimeout(10000);
+
+double MirrorProbeResult::EstimatedSeconds(uint64_t length) const {
+  if (!ok || bytes_per_second <= 0)
+    return -1;
+  return ToSeconds(time_to_first_byte) + length / bytes_per_second;
+}
+
+MirrorProber::MirrorProber(const vector<HttpFetcher*>& fetchers)
+    : next_url_(0),
+      delegate_(NULL),
+      probe_length_(kDefaultProbeLength),
+      timeout_(kDefaultTimeout),
+      timeout_id_(0),
+      probing_(false),
+      stopping_(false) {
+  CHECK(!fetchers.empty());
+  for (vector<HttpFetcher*>::const_iterator it = fetchers.begin();
+       it != fetchers.end(); ++it) {
+    (*it)->set_delegate(this);
+    fetchers_.push_back(std::unique_ptr<HttpFetcher>(*it));
+    ProbeSlot slot;
+    slot.fetcher = *it;
+    slots_.push_back(slot);
+  }
+}
+
+MirrorProber::~MirrorProber() {
+  Cancel();
+}
+
+void MirrorProber::Probe(const vector<string>& urls) {
+  CHECK(!probing_) << "Already probing.";
+  CHECK(!urls.empty());
+  urls_ = urls;
+  results_.assign(urls.size(), MirrorProbeResult());
+  for (size_t i = 0; i < urls.size(); i++)
+    results_[i].url = urls[i];
+  next_url_ = 0;
+  probing_ = true;
+  LOG(INFO) << "Probing " << urls.size() << " mirror(s) with "
+            << probe_length_ << " bytes each";
+
+  // Any results come in from the main loop, so ProbeComplete can't be called
+  // from in here.
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i].index < 0)
+      StartNext(&slots_[i]);
+  }
+  timeout_id_ = g_timeout_add(timeout_.count(), StaticTimeoutCallback, this);
+}
+
+void MirrorProber::Cancel() {
+  if (timeout_id_) {
+    g_source_remove(timeout_id_);
+    timeout_id_ = 0;
+  }
+  if (!probing_)
+    return;
+  probing_ = false;
+  stopping_ = true;
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i].index >= 0)
+      slots_[i].fetcher->TerminateTransfer();
+  }
+  stopping_ = false;
+}
+
+int MirrorProber::SelectFastest(const vector<MirrorProbeResult>& results) {
+  int best = -1;
+  double best_seconds = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    const double seconds = results[i].EstimatedSeconds(kComparisonLength);
+    if (seconds < 0)
+      continue;
+    if (best < 0 || seconds < best_seconds) {
+      best = i;
+      best_seconds = seconds;
+    }
+  }
+  return best;
+}
+
+void MirrorProber::ReceivedBytes(HttpFetcher* fetcher,
+                                 const char* bytes, int length) {
+  ProbeSlot* slot = FindSlot(fetcher);
+  CHECK(slot);
+  if (slot->index < 0)
+    return;
+  MirrorProbeResult& result = results_[slot->index];
+  const Clock::time_point now = Clock::now();
+  if (result.bytes == 0) {
+    slot->first_byte_time = now;
+    slot->first_chunk = length;
+    result.time_to_first_byte =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            now - slot->start_time);
+  }
+  slot->last_byte_time = now;
+  result.bytes += length;
+
+  // A server that ignores the Range header sends the whole payload; enough
+  // has been seen of it.
+  if (result.bytes >= probe_length_ && !stopping_)
+    fetcher->TerminateTransfer();
+}
+
+void MirrorProber::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  ProbeSlot* slot = FindSlot(fetcher);
+  CHECK(slot);
+  if (slot->index < 0)
+    return;
+  LOG_IF(INFO, !successful) << "Probing " << urls_[slot->index] << " failed";
+  FinishProbe(slot);
+  if (probing_)
+    StartNext(slot);
+  MaybeComplete();
+}
+
+void MirrorProber::TransferTerminated(HttpFetcher* fetcher) {
+  ProbeSlot* slot = FindSlot(fetcher);
+  CHECK(slot);
+  if (slot->index < 0)
+    return;
+  FinishProbe(slot);
+  if (probing_ && !stopping_)
+    StartNext(slot);
+  MaybeComplete();
+}
+
+MirrorProber::ProbeSlot* MirrorProber::FindSlot(HttpFetcher* fetcher) {
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i].fetcher == fetcher)
+      return &slots_[i];
+  }
+  return NULL;
+}
+
+void MirrorProber::StartNext(ProbeSlot* slot) {
+  if (next_url_ >= urls_.size())
+    return;
+  slot->index = next_url_++;
+  slot->first_chunk = 0;
+  slot->start_time = Clock::now();
+  slot->fetcher->SetOffset(0);
+  slot->fetcher->SetLength(probe_length_);
+  slot->fetcher->BeginTransfer(urls_[slot->index]);
+}
+
+void MirrorProber::FinishProbe(ProbeSlot* slot) {
+  MirrorProbeResult& result = results_[slot->index];
+  slot->index = -1;
+  result.ok = result.bytes > 0;
+  if (!result.ok)
+    return;
+
+  // The first chunk only tells when the data started flowing; the
+  // throughput is measured over the rest. If it all came in at once, all of
+  // it is spread over the time since the request was made instead, which
+  // understates the throughput but doesn't make it up.
+  const Clock::duration transfer_time =
+      slot->last_byte_time - slot->first_byte_time;
+  if (result.bytes > slot->first_chunk &&
+      transfer_time >= kMinMeasuredDuration) {
+    result.bytes_per_second =
+        (result.bytes - slot->first_chunk) / ToSeconds(transfer_time);
+  } else {
+    result.bytes_per_second =
+        result.bytes / ToSeconds(std::max<Clock::duration>(
+            slot->last_byte_time - slot->start_time, kMinMeasuredDuration));
+  }
+  LOG(INFO) << "Mirror " << result.url << ": first byte after "
+            << utils::ToString(result.time_to_first_byte) << ", "
+            << static_cast<uint64_t>(result.bytes_per_second)
+            << " bytes/s over " << result.bytes << " bytes";
+}
+
+void MirrorProber::MaybeComplete() {
+  if (!probing_ || stopping_)
+    return;
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i].index >= 0)
+      return;
+  }
+  if (next_url_ < urls_.size())
+    return;
+  if (timeout_id_) {
+    g_source_remove(timeout_id_);
+    timeout_id_ = 0;
+  }
+  probing_ = false;
+  vector<MirrorProbeResult> results;
+  results.swap(results_);
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_)
+    delegate_->ProbeComplete(this, results);
+}
+
+gboolean MirrorProber::TimeoutCallback() {
+  timeout_id_ = 0;
+  LOG(INFO) << "Probing timed out, judging the mirrors on what they sent so "
+            << "far";
+  // Mirrors that haven't been probed yet stay unresponsive, and the ones
+  // being probed are measured up to now, so that stalling counts.
+  next_url_ = urls_.size();
+  stopping_ = true;
+  const Clock::time_point now = Clock::now();
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i].index < 0)
+      continue;
+    slots_[i].last_byte_time = now;
+    slots_[i].fetcher->TerminateTransfer();
+  }
+  stopping_ = false;
+  MaybeComplete();
+  return FALSE;  // Don't call this callback again
+}
+
+}  // namespace chromeos_update_engine
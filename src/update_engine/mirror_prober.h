@@ -0,0 +1,142 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MIRROR_PROBER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MIRROR_PROBER_H__
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "update_engine/http_fetcher.h"
+
+// This class measures how fast each of a set of mirrors serves a payload by
+// fetching the same small range of it from all of them concurrently, each
+// base fetcher probing one mirror at a time. For each mirror it reports the
+// time to the first byte and the throughput after it, from which the one
+// expected to deliver the payload soonest can be picked.
+
+namespace chromeos_update_engine {
+
+class MirrorProber;
+
+struct MirrorProbeResult {
+  MirrorProbeResult() : ok(false), bytes(0), bytes_per_second(0) {}
+
+  // Returns the estimated time to download |length| bytes, or a negative
+  // value if the mirror didn't respond.
+  double EstimatedSeconds(uint64_t length) const;
+
+  std::string url;
+  bool ok;  // true if any data was received
+  std::chrono::microseconds time_to_first_byte;
+  uint64_t bytes;
+  double bytes_per_second;
+};
+
+class MirrorProberDelegate {
+ public:
+  // Called once all the mirrors have been probed, with a result for each URL
+  // in the order they were given. It's OK to destroy the |prober| here.
+  virtual void ProbeComplete(MirrorProber* prober,
+                             const std::vector<MirrorProbeResult>& results) = 0;
+};
+
+class MirrorProber : public HttpFetcherDelegate {
+ public:
+  // Bytes fetched from each mirror, and the download size mirrors are
+  // compared on.
+  static const size_t kDefaultProbeLength;
+  static const uint64_t kComparisonLength;
+
+  // How long probing may take; slower mirrors are judged on what they've
+  // sent by then.
+  static const std::chrono::milliseconds kDefaultTimeout;
+
+  // Takes ownership of the passed in fetchers, of which there must be at
+  // least one.
+  explicit MirrorProber(const std::vector<HttpFetcher*>& fetchers);
+  virtual ~MirrorProber();
+
+  void set_delegate(MirrorProberDelegate* delegate) { delegate_ = delegate; }
+
+  void set_probe_length(size_t length) { probe_length_ = length; }
+  void set_timeout(std::chrono::milliseconds timeout) { timeout_ = timeout; }
+
+  // Starts probing |urls|, which must not be empty. ProbeComplete is always
+  // called from the main loop, never from within Probe.
+  void Probe(const std::vector<std::string>& urls);
+
+  // Stops probing without calling ProbeComplete.
+  void Cancel();
+
+  bool probing() const { return probing_; }
+
+  // Returns the index of the fastest mirror in |results|, or -1 if none of
+  // them responded.
+  static int SelectFastest(const std::vector<MirrorProbeResult>& results);
+
+  // HttpFetcherDelegate methods (see http_fetcher.h)
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+  virtual void TransferTerminated(HttpFetcher* fetcher);
+
+ private:
+  struct ProbeSlot {
+    ProbeSlot() : fetcher(NULL), index(-1), first_chunk(0) {}
+
+    HttpFetcher* fetcher;
+    int index;  // of the URL being probed, -1 if idle
+    uint64_t first_chunk;  // bytes that came in with the first byte
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point first_byte_time;
+    std::chrono::steady_clock::time_point last_byte_time;
+  };
+
+  // Returns the slot of |fetcher|.
+  ProbeSlot* FindSlot(HttpFetcher* fetcher);
+
+  // Starts probing the next URL with |slot|'s fetcher, if any are left.
+  void StartNext(ProbeSlot* slot);
+
+  // Records the outcome of the probe in |slot| and makes it idle.
+  void FinishProbe(ProbeSlot* slot);
+
+  // Calls ProbeComplete once all slots are idle. After this returns, this
+  // object may have been destroyed.
+  void MaybeComplete();
+
+  gboolean TimeoutCallback();
+  static gboolean StaticTimeoutCallback(gpointer data) {
+    return reinterpret_cast<MirrorProber*>(data)->TimeoutCallback();
+  }
+
+  std::vector<std::unique_ptr<HttpFetcher> > fetchers_;
+  std::vector<ProbeSlot> slots_;
+
+  std::vector<std::string> urls_;
+  std::vector<MirrorProbeResult> results_;
+  size_t next_url_;
+
+  MirrorProberDelegate* delegate_;
+  size_t probe_length_;
+  std::chrono::milliseconds timeout_;
+  guint timeout_id_;
+
+  bool probing_;
+
+  // Set while the slots are being stopped, during which they don't start
+  // new probes or complete the probing.
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(MirrorProber);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MIRROR_PROBER_H__
@@ -83,10 +83,11 @@ void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                          range.length() - bytes_received_this_range_);
   }
   LOG_IF(WARNING, next_size <= 0) << "Asked to write length <= 0";
+  // Counted first, so that the delegate sees these bytes as passed on.
+  bytes_received_this_range_ += length;
   if (delegate_) {
     delegate_->ReceivedBytes(this, bytes, next_size);
   }
-  bytes_received_this_range_ += length;
   if (range.HasLength() && bytes_received_this_range_ >= range.length()) {
     // Terminates the current fetcher. Waits for its TransferTerminated
     // callback before starting the next range so that we don't end up
@@ -157,6 +158,22 @@ void MultiRangeHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
   TransferEnded(fetcher, false);
 }
 
+void MultiRangeHttpFetcher::GetRemainingRanges(
+    std::vector<std::pair<uint64_t, uint64_t> >* ranges) const {
+  ranges->clear();
+  for (RangesVect::size_type i = current_index_; i < ranges_.size(); i++) {
+    const Range& range = ranges_[i];
+    const uint64_t received =
+        i == current_index_ ? bytes_received_this_range_ : 0;
+    if (!range.HasLength()) {
+      ranges->push_back(std::make_pair(range.offset() + received, 0));
+    } else if (received < range.length()) {
+      ranges->push_back(std::make_pair(range.offset() + received,
+                                       range.length() - received));
+    }
+  }
+}
+
 void MultiRangeHttpFetcher::Reset() {
   base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
   current_index_ = 0;
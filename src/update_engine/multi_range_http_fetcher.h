@@ -53,6 +53,13 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     ranges_.push_back(Range(offset));
   }
 
+  // Returns the ranges, or what's left of them, that haven't been passed on
+  // to the delegate yet in |ranges|, as (offset, length) pairs where a
+  // length of zero means up to the end. Meant to be called while Downloading,
+  // e.g., to carry on later from where the transfer is terminated.
+  void GetRemainingRanges(
+      std::vector<std::pair<uint64_t, uint64_t> >* ranges) const;
+
   virtual void SetOffset(off_t offset) {}  // for now, doesn't support this
 
   virtual void SetLength(size_t length) {}  // unsupported
@@ -71,9 +78,6 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   virtual void Unpause() { base_fetcher_->Unpause(); }
 
   // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
-  virtual void set_idle_seconds(int seconds) {
-    base_fetcher_->set_idle_seconds(seconds);
-  }
   virtual void set_retry_seconds(int seconds) {
     base_fetcher_->set_retry_seconds(seconds);
   }
@@ -84,6 +88,8 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     return base_fetcher_->GetBytesDownloaded();
   }
 
+  HttpFetcher* base_fetcher() const { return base_fetcher_.get(); }
+
  private:
   // A range object defining the offset and length of a download chunk.  Zero
   // length indicates an unspecified end offset (note that it is impossible to
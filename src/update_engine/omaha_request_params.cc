@@ -12,6 +12,10 @@
 #include <string>
 #include <vector>
 
+#include "strings/string_number_conversions.h"
+#include "strings/string_split.h"
+#include "update_engine/bandwidth_limiter.h"
+#include "update_engine/io_scheduler.h"
 #include "update_engine/simple_key_value_store.h"
 #include "update_engine/system_state.h"
 #include "update_engine/prefs_interface.h"
@@ -30,6 +34,7 @@ const char* const OmahaRequestParams::kAppId(
 const char* const OmahaRequestParams::kOsPlatform("CoreOS");
 const char* const OmahaRequestParams::kOsVersion("Chateau");
 const char* const OmahaRequestParams::kDefaultChannel("stable");
+const int OmahaRequestParams::kMaxDownloadConnections = 8;
 const char* const kProductionOmahaUrl(
     "https://public.update.flatcar-linux.net/v1/update/");
 
@@ -56,6 +61,66 @@ bool OmahaRequestParams::Init(bool interactive) {
   pcr_policy_url_ = GetConfValue("PCR_POLICY_SERVER", "");
   download_user_ = GetConfValue("DOWNLOAD_USER", "");
   download_password_ = GetConfValue("DOWNLOAD_PASSWORD", "");
+
+  string rate_limit = GetConfValue("DOWNLOAD_RATE_LIMIT", "");
+  download_rate_limit_ = 0;
+  if (!rate_limit.empty() &&
+      !BandwidthLimiter::ParseRate(rate_limit, &download_rate_limit_)) {
+    LOG(WARNING) << "Ignoring invalid DOWNLOAD_RATE_LIMIT: " << rate_limit;
+  }
+  // More connections load the update server more, so it's opt-in.
+  string connections = GetConfValue("DOWNLOAD_CONNECTIONS", "");
+  download_connections_ = 1;
+  if (!connections.empty() &&
+      (!strings::StringToInt(connections, &download_connections_) ||
+       download_connections_ < 1 ||
+       download_connections_ > kMaxDownloadConnections)) {
+    LOG(WARNING) << "Ignoring invalid DOWNLOAD_CONNECTIONS: " << connections;
+    download_connections_ = 1;
+  }
+  string full_speed_hours = GetConfValue("DOWNLOAD_FULL_SPEED_HOURS", "");
+  full_speed_start_hour_ = full_speed_end_hour_ = 0;
+  if (!full_speed_hours.empty() &&
+      !BandwidthLimiter::ParseHours(full_speed_hours, &full_speed_start_hour_,
+                                    &full_speed_end_hour_)) {
+    LOG(WARNING) << "Ignoring invalid DOWNLOAD_FULL_SPEED_HOURS: "
+                 << full_speed_hours;
+  }
+
+  string io_priority = GetConfValue("IO_PRIORITY", "");
+  io_priority_ = 0;
+  if (!io_priority.empty() &&
+      !IoScheduler::ParsePriority(io_priority, &io_priority_)) {
+    LOG(WARNING) << "Ignoring invalid IO_PRIORITY: " << io_priority;
+  }
+  string io_rate_limit = GetConfValue("IO_RATE_LIMIT", "");
+  io_rate_limit_ = 0;
+  if (!io_rate_limit.empty() &&
+      !BandwidthLimiter::ParseRate(io_rate_limit, &io_rate_limit_)) {
+    LOG(WARNING) << "Ignoring invalid IO_RATE_LIMIT: " << io_rate_limit;
+  }
+  local_payload_dir_ = GetConfValue("LOCAL_PAYLOAD_DIR", "");
+  payload_cache_dir_ = GetConfValue("PAYLOAD_CACHE_DIR", "");
+  string cache_size = GetConfValue("PAYLOAD_CACHE_SIZE", "");
+  payload_cache_size_ = 0;
+  if (!cache_size.empty() &&
+      !utils::ParseSize(cache_size, &payload_cache_size_)) {
+    LOG(WARNING) << "Ignoring invalid PAYLOAD_CACHE_SIZE: " << cache_size;
+  }
+  string p2p_port = GetConfValue("P2P_PORT", "");
+  p2p_port_ = 0;
+  if (!p2p_port.empty() &&
+      (!strings::StringToInt(p2p_port, &p2p_port_) || p2p_port_ < 0 ||
+       p2p_port_ > 65535)) {
+    LOG(WARNING) << "Ignoring invalid P2P_PORT: " << p2p_port;
+    p2p_port_ = 0;
+  }
+  p2p_address_ = GetConfValue("P2P_ADDRESS", "");
+  p2p_peers_ = strings::SplitWords(GetConfValue("P2P_PEERS", ""));
+  mirror_selection_ = GetConfValue("MIRROR_SELECTION", "false") == "true" ||
+      !p2p_peers_.empty();
+  differential_download_ =
+      GetConfValue("DIFFERENTIAL_DOWNLOAD", "false") == "true";
   interactive_ = interactive;
 
   app_channel_ = GetConfValue("GROUP", kDefaultChannel);
@@ -5,6 +5,8 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_REQUEST_PARAMS_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_OMAHA_REQUEST_PARAMS_H__
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -37,7 +39,17 @@ class OmahaRequestParams {
         app_id_(kAppId),
 	app_channel_(kDefaultChannel),
         delta_okay_(true),
-        interactive_(false) {}
+        interactive_(false),
+        download_rate_limit_(0),
+        download_connections_(1),
+        full_speed_start_hour_(0),
+        full_speed_end_hour_(0),
+        io_priority_(0),
+        io_rate_limit_(0),
+        payload_cache_size_(0),
+        p2p_port_(0),
+        mirror_selection_(false),
+        differential_download_(false) {}
 
   OmahaRequestParams(SystemState* system_state,
                      const std::string& in_os_platform,
@@ -66,7 +78,17 @@ class OmahaRequestParams {
         bootid_(in_bootid),
         delta_okay_(in_delta_okay),
         interactive_(in_interactive),
-        update_url_(in_update_url) {}
+        update_url_(in_update_url),
+        download_rate_limit_(0),
+        download_connections_(1),
+        full_speed_start_hour_(0),
+        full_speed_end_hour_(0),
+        io_priority_(0),
+        io_rate_limit_(0),
+        payload_cache_size_(0),
+        p2p_port_(0),
+        mirror_selection_(false),
+        differential_download_(false) {}
 
   // Setters and getters for the various properties.
   inline std::string os_platform() const { return os_platform_; }
@@ -105,12 +127,58 @@ class OmahaRequestParams {
   inline const char* download_user() const { return download_user_.c_str(); }
   inline const char* download_password() const { return download_password_.c_str(); }
 
+  // Payload download rate limit in bytes per second, zero if unlimited, and
+  // the local hours during which it is lifted (equal if never).
+  inline uint64_t download_rate_limit() const { return download_rate_limit_; }
+  inline int full_speed_start_hour() const { return full_speed_start_hour_; }
+  inline int full_speed_end_hour() const { return full_speed_end_hour_; }
+
+  // Number of connections the payload is downloaded over in parallel, one
+  // unless configured otherwise, and at most kMaxDownloadConnections.
+  inline int download_connections() const { return download_connections_; }
+
+  // I/O priority (an ioprio(2) value, zero if unset) and byte-rate limit
+  // (zero if unlimited) for reading and writing the partitions.
+  inline int io_priority() const { return io_priority_; }
+  inline uint64_t io_rate_limit() const { return io_rate_limit_; }
+
+  // Directory searched for a pre-seeded copy of the payload before
+  // downloading it, empty if none.
+  inline std::string local_payload_dir() const { return local_payload_dir_; }
+
+  // Directory keeping downloaded payloads for later attempts, empty if
+  // none, and the bytes it may take up (zero for the default).
+  inline std::string payload_cache_dir() const { return payload_cache_dir_; }
+  inline uint64_t payload_cache_size() const { return payload_cache_size_; }
+
+  // Port the cached payloads are served to peers on, zero if they aren't,
+  // the address they're served on, empty for all of them, and the base URLs
+  // of the peers payloads are looked for on first.
+  inline int p2p_port() const { return p2p_port_; }
+  inline std::string p2p_address() const { return p2p_address_; }
+  inline void set_p2p_peers(const std::vector<std::string>& peers) {
+    p2p_peers_ = peers;
+  }
+  inline const std::vector<std::string>& p2p_peers() const {
+    return p2p_peers_;
+  }
+
+  // Whether the payload mirrors and peers are probed to download from the
+  // fastest one. Peers are only downloaded from this way, so it's on
+  // whenever there are any.
+  inline bool mirror_selection() const { return mirror_selection_; }
+
+  // Whether only the data of the full payload operations whose result isn't
+  // already on the disk is downloaded.
+  inline bool differential_download() const { return differential_download_; }
+
   // Suggested defaults
   static const char* const kAppId;
   static const char* const kOsPlatform;
   static const char* const kOsVersion;
   static const char* const kUpdateUrl;
   static const char* const kDefaultChannel;
+  static const int kMaxDownloadConnections;
 
   // Initializes all the data in the object.
   // Returns true on success, false otherwise.
@@ -170,6 +238,34 @@ class OmahaRequestParams {
   std::string download_user_;
   std::string download_password_;
 
+  // Bandwidth limit for downloading the update payload.
+  uint64_t download_rate_limit_;
+  int download_connections_;
+  int full_speed_start_hour_;
+  int full_speed_end_hour_;
+
+  // I/O scheduling of the partition reads and writes.
+  int io_priority_;
+  uint64_t io_rate_limit_;
+
+  // See local_payload_dir().
+  std::string local_payload_dir_;
+
+  // See payload_cache_dir().
+  std::string payload_cache_dir_;
+  uint64_t payload_cache_size_;
+
+  // See p2p_port().
+  int p2p_port_;
+  std::string p2p_address_;
+  std::vector<std::string> p2p_peers_;
+
+  // See mirror_selection().
+  bool mirror_selection_;
+
+  // See differential_download().
+  bool differential_download_;
+
   // When reading files, prepend root_ to the paths. Useful for testing.
   std::string root_;
 
@@ -9,6 +9,7 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/install_plan.h"
+#include "update_engine/io_scheduler.h"
 #include "update_engine/mock_system_state.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/test_utils.h"
@@ -196,4 +197,99 @@ TEST_F(OmahaRequestParamsTest, ValidChannelTest) {
   EXPECT_EQ("http://www.google.com", out.update_url());
 }
 
+TEST_F(OmahaRequestParamsTest, DownloadRateLimitTest) {
+  ASSERT_TRUE(WriteFileString(
+      kTestDir + "/usr/share/flatcar/release",
+      "FLATCAR_RELEASE_VERSION=0.2.2.3\n"
+      "DOWNLOAD_RATE_LIMIT=512K\n"
+      "DOWNLOAD_FULL_SPEED_HOURS=22-6"));
+  MockSystemState mock_system_state;
+  OmahaRequestParams out(&mock_system_state);
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_EQ(512 * 1024, out.download_rate_limit());
+  EXPECT_EQ(22, out.full_speed_start_hour());
+  EXPECT_EQ(6, out.full_speed_end_hour());
+}
+
+TEST_F(OmahaRequestParamsTest, InvalidDownloadRateLimitTest) {
+  ASSERT_TRUE(WriteFileString(
+      kTestDir + "/usr/share/flatcar/release",
+      "FLATCAR_RELEASE_VERSION=0.2.2.3\n"
+      "DOWNLOAD_RATE_LIMIT=fast\n"
+      "DOWNLOAD_FULL_SPEED_HOURS=night"));
+  MockSystemState mock_system_state;
+  OmahaRequestParams out(&mock_system_state);
+  EXPECT_TRUE(DoTest(&out));
+  EXPECT_EQ(0, out.download_rate_limit());
+  EXPECT_EQ(out.full_speed_start_hour(), out.full_speed_end_hour());
+}
+
+TEST_F(OmahaRequestParamsTest, DownloadConnectionsTest) {
+  MockSystemState mock_system_state;
+  {
+    // A single connection unless configured otherwise.
+    ASSERT_TRUE(WriteFileString(kTestDir + "/usr/share/flatcar/release",
+                                "FLATCAR_RELEASE_VERSION=0.2.2.3\n"));
+    OmahaRequestParams out(&mock_system_state);
+    EXPECT_TRUE(DoTest(&out));
+    EXPECT_EQ(1, out.download_connections());
+  }
+  {
+    ASSERT_TRUE(WriteFileString(kTestDir + "/usr/share/flatcar/release",
+                                "DOWNLOAD_CONNECTIONS=4\n"));
+    OmahaRequestParams out(&mock_system_state);
+    EXPECT_TRUE(DoTest(&out));
+    EXPECT_EQ(4, out.download_connections());
+  }
+  const char* const kInvalid[] = { "0", "many", "100" };
+  for (const char* connections : kInvalid) {
+    ASSERT_TRUE(WriteFileString(kTestDir + "/usr/share/flatcar/release",
+                                string("DOWNLOAD_CONNECTIONS=") + connections));
+    OmahaRequestParams out(&mock_system_state);
+    EXPECT_TRUE(DoTest(&out));
+    EXPECT_EQ(1, out.download_connections()) << connections;
+  }
+}
+
+TEST_F(OmahaRequestParamsTest, MirrorSelectionTest) {
+  MockSystemState mock_system_state;
+  {
+    // The mirrors aren't probed unless configured otherwise.
+    ASSERT_TRUE(WriteFileString(kTestDir + "/usr/share/flatcar/release",
+                                "FLATCAR_RELEASE_VERSION=0.2.2.3\n"));
+    OmahaRequestParams out(&mock_system_state);
+    EXPECT_TRUE(DoTest(&out));
+    EXPECT_FALSE(out.mirror_selection());
+  }
+  {
+    ASSERT_TRUE(WriteFileString(kTestDir + "/usr/share/flatcar/release",
+                                "MIRROR_SELECTION=true\n"));
+    OmahaRequestParams out(&mock_system_state);
+    EXPECT_TRUE(DoTest(&out));
+    EXPECT_TRUE(out.mirror_selection());
+  }
+  {
+    ASSERT_TRUE(WriteFileString(kTestDir + "/usr/share/flatcar/release",
+                                "P2P_PEERS=http://peer:8099\n"));
+    OmahaRequestParams out(&mock_system_state);
+    EXPECT_TRUE(DoTest(&out));
+    EXPECT_TRUE(out.mirror_selection());
+  }
+}
+
+TEST_F(OmahaRequestParamsTest, IoSchedulingTest) {
+  ASSERT_TRUE(WriteFileString(
+      kTestDir + "/usr/share/flatcar/release",
+      "FLATCAR_RELEASE_VERSION=0.2.2.3\n"
+      "IO_PRIORITY=idle\n"
+      "IO_RATE_LIMIT=20M"));
+  MockSystemState mock_system_state;
+  OmahaRequestParams out(&mock_system_state);
+  EXPECT_TRUE(DoTest(&out));
+  int idle = 0;
+  ASSERT_TRUE(IoScheduler::ParsePriority("idle", &idle));
+  EXPECT_EQ(idle, out.io_priority());
+  EXPECT_EQ(20 * 1024 * 1024, out.io_rate_limit());
+}
+
 }  // namespace chromeos_update_engine
@@ -5,16 +5,20 @@
 #include "update_engine/omaha_response_handler_action.h"
 
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 
 #include "files/file_util.h"
+#include "update_engine/omaha_request_params.h"
+#include "update_engine/payload_cache.h"
 #include "update_engine/payload_processor.h"
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/prefs_interface.h"
 #include "update_engine/utils.h"
 
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -22,7 +26,8 @@ OmahaResponseHandlerAction::OmahaResponseHandlerAction(
     SystemState* system_state)
     : system_state_(system_state),
       got_no_update_response_(false),
-      key_path_(PayloadProcessor::kUpdatePayloadPublicKeyPath) {}
+      key_path_(PayloadProcessor::kUpdatePayloadPublicKeyPath),
+      payload_cache_(NULL) {}
 
 void OmahaResponseHandlerAction::PerformAction() {
   CHECK(HasInputObject());
@@ -40,11 +45,45 @@ void OmahaResponseHandlerAction::PerformAction() {
   LOG(INFO) << "Using Url" << url_index << " as the download url this time";
   CHECK(url_index < response.payload_urls.size());
   install_plan_.download_url = response.payload_urls[url_index];
+  // The URLs that have failed too often are skipped as mirrors too. Peers
+  // serve the payload from their cache, by its hash, once they've got it.
+  install_plan_.mirror_urls.assign(response.payload_urls.begin() + url_index,
+                                   response.payload_urls.end());
+  const vector<string>& peers = system_state_->request_params()->p2p_peers();
+  for (vector<string>::const_iterator it = peers.begin();
+       it != peers.end() && !response.hash.empty(); ++it) {
+    string peer = *it;
+    if (!peer.empty() && peer[peer.size() - 1] == '/')
+      peer.resize(peer.size() - 1);
+    install_plan_.mirror_urls.push_back(
+        peer + "/" + PayloadCache::FileNameForHash(response.hash));
+  }
+  string local_payload;
+  if (FindLocalPayload(system_state_->request_params()->local_payload_dir(),
+                       install_plan_.download_url, response.size,
+                       &local_payload)) {
+    LOG(INFO) << "Using the local payload " << local_payload << " instead";
+    install_plan_.download_url = "file://" + local_payload;
+    install_plan_.mirror_urls.clear();
+  } else if (payload_cache_ &&
+             payload_cache_->Lookup(response.hash, response.size,
+                                    &local_payload)) {
+    LOG(INFO) << "Using the cached payload " << local_payload << " instead";
+    install_plan_.download_url = "file://" + local_payload;
+    install_plan_.mirror_urls.clear();
+  }
 
   // Fill up the other properties based on the response.
   install_plan_.display_version = response.display_version;
   install_plan_.payload_size = response.size;
   install_plan_.payload_hash = response.hash;
+  install_plan_.io_priority = system_state_->request_params()->io_priority();
+  install_plan_.io_rate_limit =
+      system_state_->request_params()->io_rate_limit();
+  // A local payload is read as fast as the disk anyway.
+  install_plan_.differential_download =
+      system_state_->request_params()->differential_download() &&
+      !utils::StringHasPrefix(install_plan_.download_url, "file://");
   install_plan_.is_resume =
       PayloadProcessor::CanResumeUpdate(system_state_->prefs(), response.hash);
   if (!install_plan_.is_resume) {
@@ -97,6 +136,35 @@ bool OmahaResponseHandlerAction::GetInstallDev(const std::string& boot_dev,
   return true;
 }
 
+bool OmahaResponseHandlerAction::FindLocalPayload(const string& dir,
+                                                  const string& url,
+                                                  uint64_t size,
+                                                  string* path) {
+  if (dir.empty())
+    return false;
+  string name = url.substr(0, url.find_first_of("?#"));
+  string::size_type slash = name.rfind('/');
+  if (slash != string::npos)
+    name = name.substr(slash + 1);
+  if (name.empty() || name == "." || name == "..")
+    return false;
+
+  files::FilePath candidate_path = files::FilePath(dir).Append(name);
+  if (!files::PathExists(candidate_path))
+    return false;
+  const string& candidate = candidate_path.value();
+  off_t candidate_size = utils::FileSize(candidate);
+  if (candidate_size < 0)
+    return false;
+  if (static_cast<uint64_t>(candidate_size) != size) {
+    LOG(WARNING) << "Ignoring the local payload " << candidate << ": "
+                 << candidate_size << " bytes instead of " << size;
+    return false;
+  }
+  *path = candidate;
+  return true;
+}
+
 bool OmahaResponseHandlerAction::GetKernelPath(const std::string& part_path,
                                                std::string* kernel_path) {
   files::FilePath coreos_kernel_a = files::FilePath("/boot/coreos/vmlinuz-a");
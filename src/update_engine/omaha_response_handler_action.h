@@ -20,6 +20,7 @@
 namespace chromeos_update_engine {
 
 class OmahaResponseHandlerAction;
+class PayloadCache;
 
 template<>
 class ActionTraits<OmahaResponseHandlerAction> {
@@ -54,7 +55,13 @@ class OmahaResponseHandlerAction : public Action<OmahaResponseHandlerAction> {
   std::string Type() const { return StaticType(); }
   void set_key_path(const std::string& path) { key_path_ = path; }
 
+  // Replays payloads found in |payload_cache|, which isn't owned.
+  void set_payload_cache(PayloadCache* payload_cache) {
+    payload_cache_ = payload_cache;
+  }
+
  private:
+  FRIEND_TEST(OmahaResponseHandlerActionTest, FindLocalPayloadTest);
   FRIEND_TEST(UpdateAttempterTest, CreatePendingErrorEventResumedTest);
 
   // Assumes you want to install on the "other" device, where the other
@@ -72,6 +79,14 @@ class OmahaResponseHandlerAction : public Action<OmahaResponseHandlerAction> {
   static bool GetPCRPolicyPath(const std::string& part_path,
                                std::string* policy_path);
 
+  // Looks in |dir| for a file named like the payload at |url| and of
+  // |size| bytes, a copy seeded on the local disk or a mounted volume.
+  // Returns true and its path in |path| if there's one.
+  static bool FindLocalPayload(const std::string& dir,
+                               const std::string& url,
+                               uint64_t size,
+                               std::string* path);
+
   // Global system context.
   SystemState* system_state_;
 
@@ -84,6 +99,9 @@ class OmahaResponseHandlerAction : public Action<OmahaResponseHandlerAction> {
   // Public key path to use for payload verification.
   std::string key_path_;
 
+  // Downloaded payloads kept from earlier attempts, or NULL.
+  PayloadCache* payload_cache_;
+
   DISALLOW_COPY_AND_ASSIGN(OmahaResponseHandlerAction);
 };
 
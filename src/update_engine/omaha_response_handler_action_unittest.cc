@@ -3,15 +3,18 @@
 // found in the LICENSE file.
 
 #include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
+#include "files/scoped_temp_dir.h"
 #include "update_engine/omaha_response_handler_action.h"
 #include "update_engine/mock_system_state.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
 
 using std::string;
+using std::vector;
 using testing::NiceMock;
 using testing::Return;
 
@@ -124,6 +127,53 @@ TEST_F(OmahaResponseHandlerActionTest, SimpleTest) {
   }
 }
 
+TEST_F(OmahaResponseHandlerActionTest, MirrorUrlsTest) {
+  OmahaResponse in;
+  in.update_exists = true;
+  in.display_version = "a.b.c.d";
+  in.payload_urls.push_back("http://foo/the_update_a.b.c.d.tgz");
+  in.payload_urls.push_back("http://bar/the_update_a.b.c.d.tgz");
+  in.payload_urls.push_back("http://baz/the_update_a.b.c.d.tgz");
+  in.hash = "HASHj+";
+  in.size = 12;
+  MockSystemState mock_system_state;
+  EXPECT_CALL(*mock_system_state.mock_payload_state(), GetUrlIndex())
+      .WillRepeatedly(Return(1));
+  InstallPlan install_plan;
+  EXPECT_TRUE(DoTestCommon(&mock_system_state, in, "/dev/sda3",
+                           &install_plan));
+  EXPECT_EQ(in.payload_urls[1], install_plan.download_url);
+  ASSERT_EQ(2U, install_plan.mirror_urls.size());
+  EXPECT_EQ(in.payload_urls[1], install_plan.mirror_urls[0]);
+  EXPECT_EQ(in.payload_urls[2], install_plan.mirror_urls[1]);
+}
+
+TEST_F(OmahaResponseHandlerActionTest, PeerUrlsTest) {
+  OmahaResponse in;
+  in.update_exists = true;
+  in.display_version = "a.b.c.d";
+  in.payload_urls.push_back("http://foo/the_update_a.b.c.d.tgz");
+  in.hash = "HA/SHj+";
+  in.size = 12;
+  MockSystemState mock_system_state;
+  OmahaRequestParams params(&mock_system_state);
+  vector<string> peers;
+  peers.push_back("http://10.0.0.2:8099");
+  peers.push_back("http://10.0.0.3:8099/");
+  params.set_p2p_peers(peers);
+  mock_system_state.set_request_params(&params);
+  InstallPlan install_plan;
+  EXPECT_TRUE(DoTestCommon(&mock_system_state, in, "/dev/sda3",
+                           &install_plan));
+  EXPECT_EQ(in.payload_urls[0], install_plan.download_url);
+  ASSERT_EQ(3U, install_plan.mirror_urls.size());
+  EXPECT_EQ(in.payload_urls[0], install_plan.mirror_urls[0]);
+  EXPECT_EQ("http://10.0.0.2:8099/HA_SHj+.payload",
+            install_plan.mirror_urls[1]);
+  EXPECT_EQ("http://10.0.0.3:8099/HA_SHj+.payload",
+            install_plan.mirror_urls[2]);
+}
+
 TEST_F(OmahaResponseHandlerActionTest, NoUpdatesTest) {
   OmahaResponse in;
   in.update_exists = false;
@@ -134,4 +184,31 @@ TEST_F(OmahaResponseHandlerActionTest, NoUpdatesTest) {
   EXPECT_EQ("", install_plan.partition_path);
 }
 
+TEST_F(OmahaResponseHandlerActionTest, FindLocalPayloadTest) {
+  files::ScopedTempDir dir;
+  ASSERT_TRUE(dir.CreateUniqueTempDir());
+  const string payload = dir.path().Append("update.gz").value();
+  ASSERT_TRUE(utils::WriteFile(payload.c_str(), "0123456789", 10));
+
+  string path;
+  EXPECT_TRUE(OmahaResponseHandlerAction::FindLocalPayload(
+      dir.path().value(), "https://example.com/1.2.3/update.gz", 10, &path));
+  EXPECT_EQ(payload, path);
+  path.clear();
+  EXPECT_TRUE(OmahaResponseHandlerAction::FindLocalPayload(
+      dir.path().value(), "https://example.com/update.gz?arch=amd64", 10,
+      &path));
+  EXPECT_EQ(payload, path);
+
+  // No directory, a different name or a different size.
+  EXPECT_FALSE(OmahaResponseHandlerAction::FindLocalPayload(
+      "", "https://example.com/update.gz", 10, &path));
+  EXPECT_FALSE(OmahaResponseHandlerAction::FindLocalPayload(
+      dir.path().value(), "https://example.com/other.gz", 10, &path));
+  EXPECT_FALSE(OmahaResponseHandlerAction::FindLocalPayload(
+      dir.path().value(), "https://example.com/update.gz", 11, &path));
+  EXPECT_FALSE(OmahaResponseHandlerAction::FindLocalPayload(
+      dir.path().value(), "https://example.com/", 10, &path));
+}
+
 }  // namespace chromeos_update_engine
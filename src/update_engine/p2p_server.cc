@@ -0,0 +1,395 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/p2p_server.h"
+
+#include <errno.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "files/file_path.h"
+#include "strings/string_number_conversions.h"
+#include "strings/string_printf.h"
+#include "strings/string_split.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPayloadSuffix[] = ".payload";
+
+// Requests longer than this are refused; a GET with a Range header is far
+// shorter.
+const size_t kMaxRequestSize = 8 * 1024;
+
+// Bytes of the file sent per write.
+const size_t kSendSize = 64 * 1024;
+
+bool StartsWithNoCase(const string& str, const string& prefix) {
+  return str.size() >= prefix.size() &&
+      strncasecmp(str.c_str(), prefix.c_str(), prefix.size()) == 0;
+}
+}  // namespace {}
+
+const int P2PServer::kMaxConnections = 16;
+const std::chrono::seconds P2PServer::kIdleTimeout(30);
+
+P2PServer::P2PServer()
+    : port_(0),
+      listen_fd_(-1),
+      listen_channel_(NULL),
+      listen_watch_id_(0),
+      idle_timeout_id_(0) {}
+
+P2PServer::~P2PServer() {
+  Stop();
+}
+
+bool P2PServer::Start(const string& dir, const string& address, int port) {
+  Stop();
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (!address.empty() &&
+      inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    LOG(ERROR) << "Invalid P2P server address " << address;
+    return false;
+  }
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create the P2P server socket";
+    return false;
+  }
+  int on = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listen_fd_, kMaxConnections) != 0 ||
+      getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+                  &addr_len) != 0) {
+    PLOG(ERROR) << "Unable to listen on "
+                << (address.empty() ? "all addresses" : address)
+                << ", port " << port;
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  dir_ = dir;
+  address_ = address;
+  port_ = ntohs(addr.sin_port);
+  listen_channel_ = g_io_channel_unix_new(listen_fd_);
+  listen_watch_id_ = g_io_add_watch(listen_channel_, G_IO_IN, StaticOnAccept,
+                                    this);
+  idle_timeout_id_ = g_timeout_add_seconds(kIdleTimeout.count(),
+                                           StaticIdleCallback, this);
+  LOG(INFO) << "Serving the payloads in " << dir_ << " on "
+            << (address_.empty() ? "all addresses" : address_) << ", port "
+            << port_;
+  return true;
+}
+
+void P2PServer::Stop() {
+  while (!connections_.empty())
+    CloseConnection(connections_.begin()->first);
+  if (idle_timeout_id_) {
+    g_source_remove(idle_timeout_id_);
+    idle_timeout_id_ = 0;
+  }
+  if (listen_watch_id_) {
+    g_source_remove(listen_watch_id_);
+    listen_watch_id_ = 0;
+  }
+  if (listen_channel_) {
+    g_io_channel_unref(listen_channel_);
+    listen_channel_ = NULL;
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    LOG(INFO) << "Stopped serving payloads on port " << port_;
+  }
+  address_.clear();
+  port_ = 0;
+}
+
+bool P2PServer::ParsePath(const string& path, string* name) {
+  // Only plain file names in the directory, so nothing can be reached
+  // outside of it, and only the payloads that are complete.
+  if (path.size() < 2 || path[0] != '/')
+    return false;
+  const string file = path.substr(1);
+  if (file[0] == '.' || file.find('/') != string::npos ||
+      !utils::StringHasSuffix(file, kPayloadSuffix)) {
+    return false;
+  }
+  *name = file;
+  return true;
+}
+
+bool P2PServer::ParseRange(const string& value, off_t size,
+                           off_t* begin, off_t* end) {
+  const string kBytesPrefix = "bytes=";
+  if (!StartsWithNoCase(value, kBytesPrefix))
+    return false;
+  const string range = value.substr(kBytesPrefix.size());
+  const size_t dash = range.find('-');
+  if (dash == string::npos || dash == 0 ||
+      range.find(',') != string::npos) {
+    return false;
+  }
+  int64_t first, last = size - 1;
+  if (!strings::StringToInt64(range.substr(0, dash), &first) || first < 0)
+    return false;
+  if (dash + 1 < range.size() &&
+      (!strings::StringToInt64(range.substr(dash + 1), &last) ||
+       last < first)) {
+    return false;
+  }
+  // Clamped first, as the last byte may be as high as INT64_MAX.
+  *begin = first;
+  *end = std::min<int64_t>(last, size - 1) + 1;
+  return true;
+}
+
+gboolean P2PServer::OnAccept(GIOCondition condition) {
+  while (true) {
+    int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      PLOG_IF(WARNING, errno != EAGAIN && errno != EWOULDBLOCK)
+          << "Unable to accept a P2P connection";
+      break;
+    }
+    if (connections_.size() >= static_cast<size_t>(kMaxConnections)) {
+      LOG(INFO) << "Refusing a P2P connection, " << connections_.size()
+                << " already open";
+      close(fd);
+      continue;
+    }
+    Connection& connection = connections_[fd];
+    connection.fd = fd;
+    connection.channel = g_io_channel_unix_new(fd);
+    connection.watch_id = g_io_add_watch(
+        connection.channel,
+        static_cast<GIOCondition>(G_IO_IN | G_IO_ERR | G_IO_HUP),
+        StaticOnConnectionIO, this);
+    connection.last_active = std::chrono::steady_clock::now();
+  }
+  return TRUE;  // Keep listening
+}
+
+gboolean P2PServer::StaticOnConnectionIO(GIOChannel* source,
+                                         GIOCondition condition,
+                                         gpointer data) {
+  return reinterpret_cast<P2PServer*>(data)->OnConnectionIO(
+      g_io_channel_unix_get_fd(source), condition);
+}
+
+gboolean P2PServer::OnConnectionIO(int fd, GIOCondition condition) {
+  std::map<int, Connection>::iterator it = connections_.find(fd);
+  CHECK(it != connections_.end());
+  Connection* connection = &it->second;
+  connection->last_active = std::chrono::steady_clock::now();
+  const guint watch_id = connection->watch_id;
+  bool open;
+  if (condition & G_IO_ERR)
+    open = false;
+  else if (connection->response.empty())
+    open = ReadRequest(connection);
+  else
+    open = WriteResponse(connection);
+  if (!open) {
+    // Returning FALSE removes the watch this is called from.
+    connection->watch_id = 0;
+    CloseConnection(fd);
+    return FALSE;
+  }
+  // Keep the watch unless it was replaced by one for writing.
+  return connection->watch_id == watch_id;
+}
+
+bool P2PServer::ReadRequest(Connection* connection) {
+  char buf[1024];
+  ssize_t rc = read(connection->fd, buf, sizeof(buf));
+  if (rc < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if (rc == 0)
+    return false;  // The peer went away before completing the request.
+  connection->request.append(buf, rc);
+  if (connection->request.find("\r\n\r\n") != string::npos)
+    PrepareResponse(connection);
+  else if (connection->request.size() > kMaxRequestSize)
+    PrepareError(connection, kHttpResponseBadRequest);
+  else
+    return true;
+  StartWriting(connection);
+  return true;
+}
+
+bool P2PServer::WriteResponse(Connection* connection) {
+  // The headers, and then the file, a chunk per call so that one connection
+  // doesn't hold up the others.
+  if (connection->sent < connection->response.size()) {
+    ssize_t rc = send(connection->fd,
+                      connection->response.data() + connection->sent,
+                      connection->response.size() - connection->sent,
+                      MSG_NOSIGNAL);
+    if (rc < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    connection->sent += rc;
+    return true;
+  }
+  if (connection->offset >= connection->end)
+    return false;  // All sent.
+
+  vector<char> buf(std::min<off_t>(kSendSize,
+                                   connection->end - connection->offset));
+  ssize_t read_size = pread(connection->file_fd, buf.data(), buf.size(),
+                            connection->offset);
+  if (read_size <= 0) {
+    PLOG(ERROR) << "Unable to read the payload being served";
+    return false;
+  }
+  ssize_t rc = send(connection->fd, buf.data(), read_size, MSG_NOSIGNAL);
+  if (rc < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  connection->offset += rc;
+  return true;
+}
+
+void P2PServer::PrepareResponse(Connection* connection) {
+  const string& request = connection->request;
+  const vector<string> lines = strings::SplitAndTrim(
+      request.substr(0, request.find("\r\n\r\n")), '\n');
+  const vector<string> request_line =
+      lines.empty() ? vector<string>() : strings::SplitWords(lines[0]);
+  if (request_line.size() != 3) {
+    PrepareError(connection, kHttpResponseBadRequest);
+    return;
+  }
+  if (request_line[0] != "GET") {
+    PrepareError(connection, kHttpResponseNotImplemented);
+    return;
+  }
+  string name;
+  if (!ParsePath(request_line[1], &name)) {
+    LOG(INFO) << "Not serving " << request_line[1];
+    PrepareError(connection, kHttpResponseNotFound);
+    return;
+  }
+  const string path = files::FilePath(dir_).Append(name).value();
+  connection->file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat stbuf;
+  if (connection->file_fd < 0 || fstat(connection->file_fd, &stbuf) != 0 ||
+      !S_ISREG(stbuf.st_mode)) {
+    PrepareError(connection, kHttpResponseNotFound);
+    return;
+  }
+
+  const off_t size = stbuf.st_size;
+  HttpResponseCode code = kHttpResponseOk;
+  connection->offset = 0;
+  connection->end = size;
+  const string kRangeHeader = "Range:";
+  for (size_t i = 1; i < lines.size(); i++) {
+    if (!StartsWithNoCase(lines[i], kRangeHeader))
+      continue;
+    off_t begin, end;
+    if (!ParseRange(strings::SplitAndTrim(lines[i], ':')[1], size, &begin,
+                    &end)) {
+      continue;
+    }
+    if (begin >= size) {
+      PrepareError(connection, kHttpResponseReqRangeNotSat);
+      return;
+    }
+    code = kHttpResponsePartialContent;
+    connection->offset = begin;
+    connection->end = end;
+  }
+
+  LOG(INFO) << "Serving " << name << " [" << connection->offset << ", "
+            << connection->end << ") to a peer";
+  connection->response = StringPrintf(
+      "HTTP/1.1 %d %s\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "Content-Length: %jd\r\n",
+      code, GetHttpResponseDescription(code),
+      static_cast<intmax_t>(connection->end - connection->offset));
+  if (code == kHttpResponsePartialContent) {
+    connection->response += StringPrintf(
+        "Content-Range: bytes %jd-%jd/%jd\r\n",
+        static_cast<intmax_t>(connection->offset),
+        static_cast<intmax_t>(connection->end - 1),
+        static_cast<intmax_t>(size));
+  }
+  connection->response += "Connection: close\r\n\r\n";
+}
+
+void P2PServer::PrepareError(Connection* connection, HttpResponseCode code) {
+  connection->response = StringPrintf(
+      "HTTP/1.1 %d %s\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n",
+      code, GetHttpResponseDescription(code));
+  connection->offset = connection->end = 0;
+}
+
+void P2PServer::StartWriting(Connection* connection) {
+  // The reading watch is removed by its callback, which this is called from.
+  connection->watch_id = g_io_add_watch(
+      connection->channel,
+      static_cast<GIOCondition>(G_IO_OUT | G_IO_ERR | G_IO_HUP),
+      StaticOnConnectionIO, this);
+}
+
+void P2PServer::CloseConnection(int fd) {
+  std::map<int, Connection>::iterator it = connections_.find(fd);
+  if (it == connections_.end())
+    return;
+  Connection& connection = it->second;
+  if (connection.watch_id)
+    g_source_remove(connection.watch_id);
+  g_io_channel_unref(connection.channel);
+  if (connection.file_fd >= 0)
+    close(connection.file_fd);
+  close(connection.fd);
+  connections_.erase(it);
+}
+
+gboolean P2PServer::IdleCallback() {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  vector<int> idle;
+  for (std::map<int, Connection>::const_iterator it = connections_.begin();
+       it != connections_.end(); ++it) {
+    if (now - it->second.last_active >= kIdleTimeout)
+      idle.push_back(it->first);
+  }
+  for (size_t i = 0; i < idle.size(); i++) {
+    LOG(INFO) << "Closing an idle P2P connection";
+    CloseConnection(idle[i]);
+  }
+  return TRUE;  // Keep checking
+}
+
+}  // namespace chromeos_update_engine
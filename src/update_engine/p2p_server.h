@@ -0,0 +1,142 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_P2P_SERVER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_P2P_SERVER_H__
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+
+#include <glib.h>
+
+#include "macros.h"
+#include "update_engine/http_common.h"
+
+// This class serves the payloads in the payload cache to peers on the local
+// network over HTTP, so that they can download them from here instead of
+// the upstream mirror. Only complete payloads that matched their hash (the
+// <key>.payload files named by PayloadCache::FileNameForHash()) are served,
+// read-only, at /<file name>. Single byte ranges are supported so that peers
+// can download over several connections and resume.
+//
+// Connections are handled with non-blocking I/O from the glib main loop.
+// Each one serves a single request and is then closed.
+
+namespace chromeos_update_engine {
+
+class P2PServer {
+ public:
+  // At most this many connections are served at once; more are refused.
+  static const int kMaxConnections;
+
+  // Connections idle for this long are closed.
+  static const std::chrono::seconds kIdleTimeout;
+
+  P2PServer();
+  ~P2PServer();
+
+  // Starts serving the payloads in |dir| on |port|, or a port picked by the
+  // kernel if zero. |address| is the IPv4 address to listen on; if empty,
+  // all of them are, since peers are expected on any of the local networks.
+  // Returns false if |address| isn't valid or it can't listen.
+  bool Start(const std::string& dir, const std::string& address, int port);
+
+  // Stops listening and closes all connections.
+  void Stop();
+
+  bool serving() const { return listen_fd_ >= 0; }
+  const std::string& dir() const { return dir_; }
+  const std::string& address() const { return address_; }
+
+  // The port being listened on, once serving.
+  int port() const { return port_; }
+
+  // Returns true if the request path |path| names a payload that may be
+  // served, in which case its file name is stored in |name|.
+  static bool ParsePath(const std::string& path, std::string* name);
+
+  // Parses the value of a Range header for a resource of |size| bytes into
+  // the first and one past the last byte. Returns false if it isn't a
+  // single byte range, in which case the whole resource is served.
+  static bool ParseRange(const std::string& value, off_t size,
+                         off_t* begin, off_t* end);
+
+ private:
+  struct Connection {
+    Connection()
+        : fd(-1), channel(NULL), watch_id(0), file_fd(-1), offset(0),
+          end(0), sent(0) {}
+
+    int fd;
+    GIOChannel* channel;
+    guint watch_id;
+
+    // The request as read so far.
+    std::string request;
+
+    // What remains to be sent of the response: |response| followed by the
+    // [offset, end) range of |file_fd|.
+    std::string response;
+    int file_fd;
+    off_t offset;
+    off_t end;
+    size_t sent;  // of |response|
+
+    std::chrono::steady_clock::time_point last_active;
+  };
+
+  // Accepts pending connections on the listening socket.
+  gboolean OnAccept(GIOCondition condition);
+  static gboolean StaticOnAccept(GIOChannel* source, GIOCondition condition,
+                                 gpointer data) {
+    return reinterpret_cast<P2PServer*>(data)->OnAccept(condition);
+  }
+
+  // Reads the request of, or writes the response to, the connection on
+  // |fd|. Returns whether to keep the watch it's called from.
+  gboolean OnConnectionIO(int fd, GIOCondition condition);
+  static gboolean StaticOnConnectionIO(GIOChannel* source,
+                                       GIOCondition condition,
+                                       gpointer data);
+
+  // Returns false once the connection is done with.
+  bool ReadRequest(Connection* connection);
+  bool WriteResponse(Connection* connection);
+
+  // Sets up the response to the complete request in |connection|.
+  void PrepareResponse(Connection* connection);
+  void PrepareError(Connection* connection, HttpResponseCode code);
+
+  // Switches the connection from reading the request to writing the
+  // response, with a new watch.
+  void StartWriting(Connection* connection);
+
+  void CloseConnection(int fd);
+
+  // Closes connections that have been idle for too long.
+  gboolean IdleCallback();
+  static gboolean StaticIdleCallback(gpointer data) {
+    return reinterpret_cast<P2PServer*>(data)->IdleCallback();
+  }
+
+  std::string dir_;
+  std::string address_;
+  int port_;
+
+  int listen_fd_;
+  GIOChannel* listen_channel_;
+  guint listen_watch_id_;
+  guint idle_timeout_id_;
+
+  std::map<int, Connection> connections_;
+
+  DISALLOW_COPY_AND_ASSIGN(P2PServer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_P2P_SERVER_H__
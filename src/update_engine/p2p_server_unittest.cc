@@ -0,0 +1,212 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+
+#include <string>
+
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "files/file_util.h"
+#include "files/scoped_temp_dir.h"
+#include "strings/string_printf.h"
+#include "update_engine/http_common.h"
+#include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/p2p_server.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+namespace {
+class P2PFetchDelegate : public HttpFetcherDelegate {
+ public:
+  explicit P2PFetchDelegate(GMainLoop* loop)
+      : loop_(loop), successful_(false) {}
+
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    data_.append(bytes, length);
+  }
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+  virtual void TransferTerminated(HttpFetcher* fetcher) {
+    ADD_FAILURE();
+    g_main_loop_quit(loop_);
+  }
+
+  GMainLoop* loop_;
+  bool successful_;
+  string data_;
+};
+
+struct StartFetchArgs {
+  HttpFetcher* fetcher;
+  string url;
+};
+
+gboolean StartFetch(gpointer data) {
+  StartFetchArgs* args = reinterpret_cast<StartFetchArgs*>(data);
+  args->fetcher->BeginTransfer(args->url);
+  return FALSE;
+}
+}  // namespace {}
+
+class P2PServerTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(dir_.CreateUniqueTempDir());
+    for (int i = 0; i < 300000; i++)
+      payload_ += 'a' + i % 23;
+    name_ = "HA_SH=.payload";
+    ASSERT_TRUE(utils::WriteFile(Path(name_).c_str(), payload_.data(),
+                                 payload_.size()));
+    ASSERT_TRUE(server_.Start(dir_.path().value(), "127.0.0.1", 0));
+  }
+
+  string Path(const string& name) const {
+    return dir_.path().Append(name).value();
+  }
+
+  string Url(const string& path) const {
+    return StringPrintf("http://127.0.0.1:%d%s", server_.port(),
+                        path.c_str());
+  }
+
+  // Fetches |length| bytes at |offset| of |path| from the server, or all of
+  // it if |length| is zero. Returns whether the transfer succeeded.
+  bool Fetch(const string& path, off_t offset, size_t length, string* data,
+             int* response_code) {
+    GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+    P2PFetchDelegate delegate(loop);
+    LibcurlHttpFetcher fetcher;
+    fetcher.set_retry_seconds(1);
+    fetcher.SetBuildType(false);
+    fetcher.set_delegate(&delegate);
+    fetcher.SetOffset(offset);
+    if (length)
+      fetcher.SetLength(length);
+    StartFetchArgs args = {&fetcher, Url(path)};
+    g_timeout_add(0, StartFetch, &args);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    *data = delegate.data_;
+    *response_code = fetcher.http_response_code();
+    return delegate.successful_;
+  }
+
+  files::ScopedTempDir dir_;
+  string payload_;
+  string name_;
+  P2PServer server_;
+};
+
+TEST_F(P2PServerTest, ParsePathTest) {
+  string name;
+  EXPECT_TRUE(P2PServer::ParsePath("/HA_SH=.payload", &name));
+  EXPECT_EQ("HA_SH=.payload", name);
+  EXPECT_FALSE(P2PServer::ParsePath("", &name));
+  EXPECT_FALSE(P2PServer::ParsePath("/", &name));
+  EXPECT_FALSE(P2PServer::ParsePath("HA_SH=.payload", &name));
+  EXPECT_FALSE(P2PServer::ParsePath("/HA_SH=.payload.part", &name));
+  EXPECT_FALSE(P2PServer::ParsePath("/../HA_SH=.payload", &name));
+  EXPECT_FALSE(P2PServer::ParsePath("/dir/HA_SH=.payload", &name));
+  EXPECT_FALSE(P2PServer::ParsePath("/.payload", &name));
+}
+
+TEST_F(P2PServerTest, ParseRangeTest) {
+  off_t begin, end;
+  EXPECT_TRUE(P2PServer::ParseRange("bytes=10-19", 100, &begin, &end));
+  EXPECT_EQ(10, begin);
+  EXPECT_EQ(20, end);
+  EXPECT_TRUE(P2PServer::ParseRange("bytes=10-", 100, &begin, &end));
+  EXPECT_EQ(10, begin);
+  EXPECT_EQ(100, end);
+  EXPECT_TRUE(P2PServer::ParseRange("bytes=90-200", 100, &begin, &end));
+  EXPECT_EQ(90, begin);
+  EXPECT_EQ(100, end);
+  EXPECT_TRUE(P2PServer::ParseRange("bytes=0-9223372036854775807", 100,
+                                    &begin, &end));
+  EXPECT_EQ(0, begin);
+  EXPECT_EQ(100, end);
+  EXPECT_TRUE(P2PServer::ParseRange("bytes=100-", 100, &begin, &end));
+  EXPECT_GE(begin, end);
+  EXPECT_FALSE(P2PServer::ParseRange("bytes=-10", 100, &begin, &end));
+  EXPECT_FALSE(P2PServer::ParseRange("bytes=0-1,5-6", 100, &begin, &end));
+  EXPECT_FALSE(P2PServer::ParseRange("bytes=20-10", 100, &begin, &end));
+  EXPECT_FALSE(P2PServer::ParseRange("lines=0-10", 100, &begin, &end));
+}
+
+TEST_F(P2PServerTest, FullTest) {
+  string data;
+  int code;
+  EXPECT_TRUE(Fetch("/" + name_, 0, 0, &data, &code));
+  EXPECT_EQ(kHttpResponseOk, code);
+  EXPECT_TRUE(data == payload_);
+}
+
+TEST_F(P2PServerTest, RangeTest) {
+  string data;
+  int code;
+  EXPECT_TRUE(Fetch("/" + name_, 1000, 100000, &data, &code));
+  EXPECT_EQ(kHttpResponsePartialContent, code);
+  EXPECT_TRUE(data == payload_.substr(1000, 100000));
+
+  EXPECT_TRUE(Fetch("/" + name_, 250000, 0, &data, &code));
+  EXPECT_EQ(kHttpResponsePartialContent, code);
+  EXPECT_TRUE(data == payload_.substr(250000));
+}
+
+TEST_F(P2PServerTest, NotServedTest) {
+  // Nothing but complete payloads in the directory is served.
+  ASSERT_TRUE(utils::WriteFile(Path(name_ + ".part").c_str(), "part", 4));
+  string data;
+  int code;
+  EXPECT_FALSE(Fetch("/missing.payload", 0, 0, &data, &code));
+  EXPECT_EQ(kHttpResponseNotFound, code);
+  EXPECT_FALSE(Fetch("/" + name_ + ".part", 0, 0, &data, &code));
+  EXPECT_EQ(kHttpResponseNotFound, code);
+  ASSERT_EQ(0, mkdir(Path("dir.payload").c_str(), 0755));
+  EXPECT_FALSE(Fetch("/dir.payload", 0, 0, &data, &code));
+  EXPECT_EQ(kHttpResponseNotFound, code);
+  EXPECT_FALSE(Fetch("/" + name_, payload_.size(), 0, &data, &code));
+  EXPECT_EQ(kHttpResponseReqRangeNotSat, code);
+}
+
+TEST_F(P2PServerTest, StopTest) {
+  const int port = server_.port();
+  EXPECT_GT(port, 0);
+  server_.Stop();
+  EXPECT_FALSE(server_.serving());
+  string data;
+  int code;
+  EXPECT_FALSE(Fetch("/" + name_, 0, 0, &data, &code));
+
+  // The port can be listened on again straight away.
+  EXPECT_TRUE(server_.Start(dir_.path().value(), "127.0.0.1", port));
+  EXPECT_EQ(port, server_.port());
+  EXPECT_TRUE(Fetch("/" + name_, 0, 0, &data, &code));
+  EXPECT_TRUE(data == payload_);
+}
+
+TEST_F(P2PServerTest, AddressTest) {
+  EXPECT_EQ("127.0.0.1", server_.address());
+  EXPECT_FALSE(server_.Start(dir_.path().value(), "localhost", 0));
+  EXPECT_FALSE(server_.serving());
+
+  // No address listens on all of them, the loopback one included.
+  ASSERT_TRUE(server_.Start(dir_.path().value(), "", 0));
+  EXPECT_EQ("", server_.address());
+  string data;
+  int code;
+  EXPECT_TRUE(Fetch("/" + name_, 0, 0, &data, &code));
+  EXPECT_TRUE(data == payload_);
+}
+
+}  // namespace chromeos_update_engine
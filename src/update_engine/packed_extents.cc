@@ -0,0 +1,83 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/packed_extents.h"
+
+#include <cstdint>
+
+#include <glog/logging.h>
+
+#include "update_engine/utils.h"
+
+using google::protobuf::RepeatedField;
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace packed_extents {
+
+namespace {
+// The start blocks are encoded relative to the end of the previous extent
+// with wrapping arithmetic, which also works for kSparseHole.
+uint64_t ZigZagEncode(uint64_t delta) {
+  return (delta << 1) ^
+      static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+}
+
+uint64_t ZigZagDecode(uint64_t value) {
+  return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+void PackExtents(RepeatedPtrField<Extent>* extents,
+                 RepeatedField<uint64_t>* packed) {
+  packed->Clear();
+  packed->Reserve(extents->size() * 2);
+  uint64_t end = 0;
+  for (const Extent& extent : *extents) {
+    packed->Add(ZigZagEncode(extent.start_block() - end));
+    packed->Add(extent.num_blocks());
+    end = extent.start_block() + extent.num_blocks();
+  }
+  extents->Clear();
+}
+
+bool UnpackExtents(RepeatedField<uint64_t>* packed,
+                   RepeatedPtrField<Extent>* extents) {
+  TEST_AND_RETURN_FALSE(packed->size() % 2 == 0);
+  extents->Clear();
+  extents->Reserve(packed->size() / 2);
+  uint64_t end = 0;
+  for (int i = 0; i < packed->size(); i += 2) {
+    Extent* extent = extents->Add();
+    extent->set_start_block(end + ZigZagDecode(packed->Get(i)));
+    extent->set_num_blocks(packed->Get(i + 1));
+    end = extent->start_block() + extent->num_blocks();
+  }
+  packed->Clear();
+  return true;
+}
+}  // namespace {}
+
+bool IsPacked(const InstallOperation& op) {
+  return op.packed_src_extents_size() > 0 || op.packed_dst_extents_size() > 0;
+}
+
+void Pack(InstallOperation* op) {
+  PackExtents(op->mutable_src_extents(), op->mutable_packed_src_extents());
+  PackExtents(op->mutable_dst_extents(), op->mutable_packed_dst_extents());
+}
+
+bool Unpack(InstallOperation* op) {
+  TEST_AND_RETURN_FALSE(op->src_extents_size() == 0 &&
+                        op->dst_extents_size() == 0);
+  TEST_AND_RETURN_FALSE(UnpackExtents(op->mutable_packed_src_extents(),
+                                      op->mutable_src_extents()));
+  TEST_AND_RETURN_FALSE(UnpackExtents(op->mutable_packed_dst_extents(),
+                                      op->mutable_dst_extents()));
+  return true;
+}
+
+}  // namespace packed_extents
+
+}  // namespace chromeos_update_engine
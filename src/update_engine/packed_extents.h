@@ -0,0 +1,34 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PACKED_EXTENTS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PACKED_EXTENTS_H__
+
+#include "update_engine/update_metadata.pb.h"
+
+// The extents of an operation are usually a handful of nested Extent
+// messages, which make up most of a large manifest. The packed_src_extents
+// and packed_dst_extents fields of InstallOperation hold the same extents
+// as delta encoded varints instead, see update_metadata.proto. The client
+// only unpacks the operation it's about to perform.
+
+namespace chromeos_update_engine {
+
+namespace packed_extents {
+
+// Returns true if the extents of |op| are in the packed fields.
+bool IsPacked(const InstallOperation& op);
+
+// Moves the src_extents and dst_extents of |op| into the packed fields.
+void Pack(InstallOperation* op);
+
+// Moves the packed extents of |op| back into src_extents and dst_extents.
+// Returns false if they're malformed or |op| also has unpacked extents.
+bool Unpack(InstallOperation* op);
+
+}  // namespace packed_extents
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PACKED_EXTENTS_H__
@@ -0,0 +1,53 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include "update_engine/extent_ranges.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/packed_extents.h"
+
+namespace chromeos_update_engine {
+
+TEST(PackedExtentsTest, RoundTripTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_MOVE);
+  *(op.add_src_extents()) = ExtentForRange(100, 4);
+  *(op.add_src_extents()) = ExtentForRange(kSparseHole, 2);
+  *(op.add_src_extents()) = ExtentForRange(3, 1);
+  *(op.add_src_extents()) = ExtentForRange(1ULL << 40, 7);
+  *(op.add_dst_extents()) = ExtentForRange(0, 1);
+  *(op.add_dst_extents()) = ExtentForRange(1, 100);
+  const InstallOperation orig = op;
+
+  EXPECT_FALSE(packed_extents::IsPacked(op));
+  packed_extents::Pack(&op);
+  EXPECT_TRUE(packed_extents::IsPacked(op));
+  EXPECT_EQ(0, op.src_extents_size());
+  EXPECT_EQ(0, op.dst_extents_size());
+  ASSERT_EQ(8, op.packed_src_extents_size());
+  // Going backwards is as cheap as going forwards.
+  EXPECT_EQ(200, op.packed_src_extents(0));
+  EXPECT_EQ(4, op.packed_src_extents(1));
+  ASSERT_EQ(4, op.packed_dst_extents_size());
+  EXPECT_EQ(0, op.packed_dst_extents(2));
+  EXPECT_LT(op.ByteSize(), orig.ByteSize());
+
+  EXPECT_TRUE(packed_extents::Unpack(&op));
+  EXPECT_FALSE(packed_extents::IsPacked(op));
+  EXPECT_EQ(orig.SerializeAsString(), op.SerializeAsString());
+}
+
+TEST(PackedExtentsTest, MalformedTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation_Type_REPLACE);
+  op.add_packed_dst_extents(0);
+  EXPECT_FALSE(packed_extents::Unpack(&op));
+
+  op.add_packed_dst_extents(1);
+  *(op.add_dst_extents()) = ExtentForRange(0, 1);
+  EXPECT_FALSE(packed_extents::Unpack(&op));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,335 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/parallel_range_http_fetcher.h"
+
+#include <algorithm>
+
+#include "strings/string_printf.h"
+#include "update_engine/http_common.h"
+
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+const size_t ParallelRangeHttpFetcher::kDefaultSegmentSize = 2 * 1024 * 1024;
+const size_t ParallelRangeHttpFetcher::kDefaultMaxBufferedBytes =
+    16 * 1024 * 1024;
+const int ParallelRangeHttpFetcher::kMaxSegmentRetries = 3;
+
+ParallelRangeHttpFetcher::ParallelRangeHttpFetcher(
+    const vector<HttpFetcher*>& base_fetchers)
+    : offset_(0),
+      length_(0),
+      segment_size_(kDefaultSegmentSize),
+      max_buffered_bytes_(kDefaultMaxBufferedBytes),
+      head_(0),
+      next_segment_(0),
+      buffered_bytes_(0),
+      bytes_received_(0),
+      transfer_active_(false),
+      terminating_(false),
+      failed_(false),
+      paused_(false),
+      pumping_(false),
+      pump_again_(false) {
+  CHECK(!base_fetchers.empty());
+  for (vector<HttpFetcher*>::const_iterator it = base_fetchers.begin();
+       it != base_fetchers.end(); ++it) {
+    (*it)->set_delegate(this);
+    workers_.push_back(std::unique_ptr<Worker>(new Worker(*it)));
+  }
+}
+
+ParallelRangeHttpFetcher::~ParallelRangeHttpFetcher() {
+  LOG_IF(ERROR, transfer_active_) << "Destroying an active fetcher.";
+}
+
+void ParallelRangeHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_active_) << "BeginTransfer but already active.";
+  Reset();
+  url_ = url;
+  http_response_code_ = 0;
+  bytes_received_ = 0;
+  paused_ = false;
+
+  if (length_) {
+    for (size_t done = 0; done < length_; done += segment_size_) {
+      segments_.push_back(Segment(offset_ + done,
+                                  min(segment_size_, length_ - done)));
+    }
+  } else {
+    segments_.push_back(Segment(offset_, 0));
+  }
+  LOG(INFO) << "Fetching " << offset_ << "+"
+            << (length_ ? StringPrintf("%zu", length_) : "?") << " in "
+            << segments_.size() << " segment(s) over up to "
+            << workers_.size() << " connection(s)";
+  transfer_active_ = true;
+  Pump();
+}
+
+void ParallelRangeHttpFetcher::TerminateTransfer() {
+  if (!transfer_active_) {
+    LOG(INFO) << "Called TerminateTransfer but not active.";
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  Pump();
+}
+
+void ParallelRangeHttpFetcher::Pause() {
+  paused_ = true;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker* worker = workers_[i].get();
+    if (worker->segment >= 0 && !worker->stopping && !worker->paused) {
+      worker->paused = true;
+      worker->fetcher->Pause();
+    }
+  }
+}
+
+void ParallelRangeHttpFetcher::Unpause() {
+  paused_ = false;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker* worker = workers_[i].get();
+    if (worker->paused) {
+      worker->paused = false;
+      worker->fetcher->Unpause();
+    }
+  }
+  Pump();
+}
+
+void ParallelRangeHttpFetcher::set_retry_seconds(int seconds) {
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i]->fetcher->set_retry_seconds(seconds);
+}
+
+void ParallelRangeHttpFetcher::SetBuildType(bool is_official) {
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i]->fetcher->SetBuildType(is_official);
+}
+
+void ParallelRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                             const char* bytes,
+                                             int length) {
+  Worker* worker = FindWorker(fetcher);
+  CHECK(worker);
+  CHECK_GE(worker->segment, 0);
+  Segment& segment = segments_[worker->segment];
+
+  // A server that ignores the Range header would send the wrong bytes.
+  if (worker->ranged &&
+      fetcher->http_response_code() != kHttpResponsePartialContent) {
+    LOG(ERROR) << "Expected a partial response for segment "
+               << worker->segment << ", got "
+               << fetcher->http_response_code();
+    failed_ = true;
+    Pump();
+    return;
+  }
+
+  size_t size = length;
+  if (segment.length)
+    size = min(size, segment.length - segment.received);
+  segment.pending.insert(segment.pending.end(), bytes, bytes + size);
+  segment.received += size;
+  buffered_bytes_ += size;
+  bytes_received_ += size;
+
+  // The base fetcher asked for more than the segment (e.g., when resuming
+  // after an interruption); it is complete, so stop it like
+  // MultiRangeHttpFetcher does.
+  if (size < static_cast<size_t>(length) && !worker->stopping) {
+    worker->stopping = true;
+    fetcher->TerminateTransfer();
+  }
+  Pump();
+}
+
+void ParallelRangeHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                                bool successful) {
+  Worker* worker = FindWorker(fetcher);
+  CHECK(worker);
+  http_response_code_ = fetcher->http_response_code();
+  WorkerEnded(worker, successful);
+}
+
+void ParallelRangeHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  Worker* worker = FindWorker(fetcher);
+  CHECK(worker);
+  if (fetcher->http_response_code())
+    http_response_code_ = fetcher->http_response_code();
+  WorkerEnded(worker, false);
+}
+
+void ParallelRangeHttpFetcher::WorkerEnded(Worker* worker, bool successful) {
+  const int index = worker->segment;
+  CHECK_GE(index, 0) << "Transfer ended unexpectedly.";
+  worker->segment = -1;
+  worker->stopping = false;
+  worker->paused = false;
+
+  if (!terminating_ && !failed_) {
+    Segment& segment = segments_[index];
+    if (segment.length ? segment.received >= segment.length : successful) {
+      segment.done = true;
+    } else if (successful && segment.retries < kMaxSegmentRetries) {
+      // The response ended before the segment did; ask for the rest.
+      segment.retries++;
+      LOG(INFO) << "Segment " << index << " ended after " << segment.received
+                << " of " << segment.length << " bytes, resuming (attempt "
+                << segment.retries << ")";
+      resume_queue_.push_back(index);
+    } else {
+      LOG(ERROR) << "Transfer of segment " << index << " failed after "
+                 << segment.received << " bytes.";
+      failed_ = true;
+    }
+  }
+  Pump();
+}
+
+ParallelRangeHttpFetcher::Worker* ParallelRangeHttpFetcher::FindWorker(
+    HttpFetcher* fetcher) {
+  for (size_t i = 0; i < workers_.size(); i++) {
+    if (workers_[i]->fetcher.get() == fetcher)
+      return workers_[i].get();
+  }
+  return NULL;
+}
+
+void ParallelRangeHttpFetcher::StartSegment(Worker* worker, int index) {
+  const Segment& segment = segments_[index];
+  worker->segment = index;
+  worker->ranged = segment.offset + segment.received > 0;
+  worker->stopping = false;
+  worker->paused = false;
+  worker->fetcher->SetOffset(segment.offset + segment.received);
+  if (segment.length)
+    worker->fetcher->SetLength(segment.length - segment.received);
+  else
+    worker->fetcher->UnsetLength();
+  worker->fetcher->BeginTransfer(url_);
+}
+
+void ParallelRangeHttpFetcher::Pump() {
+  if (pumping_) {
+    pump_again_ = true;
+    return;
+  }
+  pumping_ = true;
+  do {
+    pump_again_ = false;
+    if (terminating_ || failed_) {
+      StopWorkers();
+    } else if (!paused_) {
+      DeliverInOrder();
+      StartWorkers();
+    }
+  } while (pump_again_);
+  pumping_ = false;
+
+  if (!transfer_active_ || ActiveWorkers() > 0)
+    return;
+  if (!terminating_ && !failed_ && head_ < segments_.size())
+    return;  // Paused.
+
+  const bool terminated = terminating_;
+  const bool successful = !failed_;
+  LOG(INFO) << "Parallel transfer "
+            << (terminated ? "terminated" :
+                successful ? "completed" : "failed")
+            << " after receiving " << bytes_received_ << " bytes.";
+  Reset();
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_) {
+    if (terminated)
+      delegate_->TransferTerminated(this);
+    else
+      delegate_->TransferComplete(this, successful);
+  }
+}
+
+void ParallelRangeHttpFetcher::DeliverInOrder() {
+  while (head_ < segments_.size()) {
+    Segment& segment = segments_[head_];
+    if (!segment.pending.empty()) {
+      vector<char> data;
+      data.swap(segment.pending);
+      buffered_bytes_ -= data.size();
+      if (delegate_)
+        delegate_->ReceivedBytes(this, data.data(), data.size());
+      if (terminating_ || paused_)
+        return;
+      // More bytes may have come in from inside the callback.
+      continue;
+    }
+    if (!segment.done)
+      return;
+    head_++;
+  }
+}
+
+void ParallelRangeHttpFetcher::StartWorkers() {
+  // Segments this far past the one being delivered wait, so that no more
+  // than about max_buffered_bytes_ pile up in the reorder buffer.
+  const size_t window = max(static_cast<size_t>(1),
+                            max_buffered_bytes_ / segment_size_);
+  for (size_t i = 0; i < workers_.size(); i++) {
+    if (terminating_ || failed_)
+      return;
+    Worker* worker = workers_[i].get();
+    if (worker->segment >= 0)
+      continue;
+    int index;
+    if (!resume_queue_.empty()) {
+      index = resume_queue_.front();
+      resume_queue_.pop_front();
+    } else if (next_segment_ < segments_.size() &&
+               next_segment_ < head_ + window) {
+      index = next_segment_++;
+    } else {
+      return;
+    }
+    StartSegment(worker, index);
+  }
+}
+
+void ParallelRangeHttpFetcher::StopWorkers() {
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker* worker = workers_[i].get();
+    if (worker->segment < 0 || worker->stopping)
+      continue;
+    worker->stopping = true;
+    worker->fetcher->TerminateTransfer();
+  }
+}
+
+int ParallelRangeHttpFetcher::ActiveWorkers() const {
+  int active = 0;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    if (workers_[i]->segment >= 0)
+      active++;
+  }
+  return active;
+}
+
+void ParallelRangeHttpFetcher::Reset() {
+  segments_.clear();
+  resume_queue_.clear();
+  head_ = next_segment_ = 0;
+  buffered_bytes_ = 0;
+  transfer_active_ = terminating_ = failed_ = false;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,179 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PARALLEL_RANGE_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PARALLEL_RANGE_HTTP_FETCHER_H__
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "update_engine/http_fetcher.h"
+
+// This class downloads a single byte range over several HttpFetchers at once.
+// The range set with SetOffset()/SetLength() is split into segments, each of
+// which is requested with its own HTTP Range request by one of the base
+// fetchers. Bytes are handed to the delegate in strict offset order, exactly
+// as a single fetcher would have delivered them, so a delegate that hashes
+// or parses the stream doesn't notice the difference.
+//
+// Segments that arrive ahead of the one being delivered are kept in a reorder
+// buffer. To bound it, a segment is only started while it is less than
+// max_buffered_bytes() ahead of the segment being delivered. A segment whose
+// transfer ends short is resumed from where it stopped; any other failure
+// fails the whole transfer (each base fetcher already retries on its own).
+//
+// If no length is set, the range can't be split and the first base fetcher
+// downloads it on its own.
+//
+// It is meant to be used as the base fetcher of a MultiRangeHttpFetcher,
+// which supplies the offset and length of every range it fetches.
+
+namespace chromeos_update_engine {
+
+class ParallelRangeHttpFetcher : public HttpFetcher,
+                                 public HttpFetcherDelegate {
+ public:
+  static const size_t kDefaultSegmentSize;
+  static const size_t kDefaultMaxBufferedBytes;
+
+  // Takes ownership of the passed in fetchers, of which there must be at
+  // least one.
+  explicit ParallelRangeHttpFetcher(
+      const std::vector<HttpFetcher*>& base_fetchers);
+  virtual ~ParallelRangeHttpFetcher();
+
+  virtual void SetOffset(off_t offset) { offset_ = offset; }
+
+  virtual void SetLength(size_t length) { length_ = length; }
+  virtual void UnsetLength() { SetLength(0); }
+
+  // Begins the transfer to the specified URL.
+  virtual void BeginTransfer(const std::string& url);
+
+  // Terminates all base fetchers; TransferTerminated is sent to the delegate
+  // once the last of them has stopped.
+  virtual void TerminateTransfer();
+
+  virtual void Pause();
+  virtual void Unpause();
+
+  // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
+  virtual void set_retry_seconds(int seconds);
+  virtual void SetBuildType(bool is_official);
+
+  // Bytes received from all base fetchers so far.
+  virtual size_t GetBytesDownloaded() { return bytes_received_; }
+
+  void set_segment_size(size_t size) {
+    CHECK_GT(size, static_cast<size_t>(0));
+    segment_size_ = size;
+  }
+  size_t segment_size() const { return segment_size_; }
+
+  void set_max_buffered_bytes(size_t size) { max_buffered_bytes_ = size; }
+  size_t max_buffered_bytes() const { return max_buffered_bytes_; }
+
+ private:
+  // At most this many times a segment is resumed after a short transfer.
+  static const int kMaxSegmentRetries;
+
+  struct Segment {
+    Segment(off_t offset, size_t length)
+        : offset(offset), length(length), received(0), retries(0),
+          done(false) {}
+
+    off_t offset;
+    size_t length;  // zero means up to the end of the resource
+    size_t received;
+    std::vector<char> pending;  // received but not yet delivered
+    int retries;
+    bool done;
+  };
+
+  struct Worker {
+    explicit Worker(HttpFetcher* fetcher)
+        : fetcher(fetcher), segment(-1), ranged(false), stopping(false),
+          paused(false) {}
+
+    std::unique_ptr<HttpFetcher> fetcher;
+    int segment;  // index into segments_, -1 when idle
+    bool ranged;  // the transfer doesn't start at the beginning of the file
+    bool stopping;  // TerminateTransfer was called on |fetcher|
+    bool paused;
+  };
+
+  // HttpFetcherDelegate methods, called by the base fetchers.
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+  virtual void TransferTerminated(HttpFetcher* fetcher);
+
+  // Called when the transfer of |worker| has ended, one way or another.
+  void WorkerEnded(Worker* worker, bool successful);
+
+  Worker* FindWorker(HttpFetcher* fetcher);
+
+  // Starts downloading the rest of segment |index| with |worker|.
+  void StartSegment(Worker* worker, int index);
+
+  // Moves the transfer along after anything has changed: delivers whatever
+  // is next in order, starts or stops base fetchers and, once all of them
+  // are idle, reports the outcome to the delegate. Calls made while it is
+  // already running (e.g., from inside a delegate callback) are folded into
+  // the running one. Note that the delegate may destroy this object when
+  // the outcome is reported.
+  void Pump();
+
+  // Hands the pending bytes of the segments in order to the delegate,
+  // stopping at the first segment that isn't complete.
+  void DeliverInOrder();
+
+  // Assigns segments to idle workers, as far as the reorder window allows.
+  void StartWorkers();
+
+  // Calls TerminateTransfer on every active worker.
+  void StopWorkers();
+
+  int ActiveWorkers() const;
+
+  void Reset();
+
+  std::vector<std::unique_ptr<Worker> > workers_;
+  std::vector<Segment> segments_;
+
+  // Failed segments waiting to be resumed, before any new ones start.
+  std::deque<int> resume_queue_;
+
+  off_t offset_;
+  size_t length_;
+  size_t segment_size_;
+  size_t max_buffered_bytes_;
+
+  // The segment being delivered and the next one that hasn't been started.
+  size_t head_;
+  size_t next_segment_;
+
+  size_t buffered_bytes_;
+  size_t bytes_received_;
+
+  // True between BeginTransfer and reporting the outcome.
+  bool transfer_active_;
+  // True if we are waiting for the base fetchers to stop because we are
+  // ourselves terminating, or because a segment failed.
+  bool terminating_;
+  bool failed_;
+  bool paused_;
+
+  bool pumping_;
+  bool pump_again_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelRangeHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PARALLEL_RANGE_HTTP_FETCHER_H__
@@ -0,0 +1,292 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/payload_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "files/file_enumerator.h"
+#include "files/file_util.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPayloadSuffix[] = ".payload";
+const char kPartialSuffix[] = ".part";
+// How much of a stored payload is hashed per main loop iteration.
+const size_t kCheckChunkSize = 1024 * 1024;
+
+struct CacheEntry {
+  string path;
+  uint64_t size;
+  time_t last_used;
+
+  bool operator<(const CacheEntry& that) const {
+    return last_used < that.last_used;
+  }
+};
+}  // namespace {}
+
+const uint64_t PayloadCache::kDefaultMaxSize = 1024ULL * 1024 * 1024;
+
+PayloadCache::PayloadCache()
+    : max_size_(kDefaultMaxSize),
+      size_(0),
+      fd_(-1),
+      write_offset_(0),
+      stored_size_(0),
+      carried_over_size_(0),
+      write_failed_(false),
+      check_source_id_(0),
+      check_offset_(0) {}
+
+PayloadCache::~PayloadCache() {
+  CloseWrite(false);
+}
+
+string PayloadCache::FileNameForHash(const string& hash) {
+  string key = hash;
+  std::replace(key.begin(), key.end(), '/', '_');
+  return key + kPayloadSuffix;
+}
+
+string PayloadCache::PathForHash(const string& hash) const {
+  return files::FilePath(dir_).Append(FileNameForHash(hash)).value();
+}
+
+string PayloadCache::PartialPathForHash(const string& hash) const {
+  return PathForHash(hash) + kPartialSuffix;
+}
+
+bool PayloadCache::Lookup(const string& hash, uint64_t size, string* path) {
+  if (!enabled() || hash.empty())
+    return false;
+  const string cached = PathForHash(hash);
+  struct stat stbuf;
+  if (stat(cached.c_str(), &stbuf) != 0)
+    return false;
+  if (static_cast<uint64_t>(stbuf.st_size) != size) {
+    LOG(WARNING) << "Removing " << cached << " of " << stbuf.st_size
+                 << " bytes instead of " << size;
+    Remove(hash);
+    return false;
+  }
+  // Eviction goes by the modification time.
+  LOG_IF(WARNING, utimes(cached.c_str(), NULL) != 0)
+      << "Unable to mark " << cached << " as used";
+  *path = cached;
+  return true;
+}
+
+void PayloadCache::Remove(const string& hash) {
+  if (!enabled() || hash.empty())
+    return;
+  if (writing() && hash == hash_)
+    CloseWrite(false);
+  unlink(PathForHash(hash).c_str());
+  unlink(PartialPathForHash(hash).c_str());
+}
+
+bool PayloadCache::BeginWrite(const string& hash, uint64_t size) {
+  CloseWrite(false);
+  if (!enabled() || hash.empty())
+    return false;
+  if (size > max_size_) {
+    LOG(INFO) << "Not caching the payload, " << size << " bytes is over the "
+              << max_size_ << " bytes allowed";
+    return false;
+  }
+  if (!files::CreateDirectory(files::FilePath(dir_))) {
+    LOG(ERROR) << "Unable to create the payload cache " << dir_;
+    return false;
+  }
+
+  const string partial = PartialPathForHash(hash);
+  TEST_AND_RETURN_FALSE(MakeRoom(size, partial));
+  fd_ = open(partial.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Unable to open " << partial;
+    return false;
+  }
+  struct stat stbuf;
+  if (fstat(fd_, &stbuf) != 0 ||
+      static_cast<uint64_t>(stbuf.st_size) > size) {
+    LOG(WARNING) << "Starting over with " << partial;
+    TEST_AND_RETURN_FALSE_ERRNO(ftruncate(fd_, 0) == 0);
+    stbuf.st_size = 0;
+  }
+  hash_ = hash;
+  size_ = size;
+  write_offset_ = 0;
+  stored_size_ = stbuf.st_size;
+  carried_over_size_ = stored_size_;
+  write_failed_ = false;
+  LOG(INFO) << "Caching the payload in " << partial << ", " << stored_size_
+            << " of " << size_ << " bytes already there";
+  return true;
+}
+
+void PayloadCache::Seek(off_t offset) {
+  write_offset_ = offset;
+}
+
+void PayloadCache::Write(const char* data, size_t length) {
+  if (!writing() || checking() || write_failed_)
+    return;
+  if (static_cast<uint64_t>(write_offset_) > stored_size_ ||
+      write_offset_ + length > size_) {
+    LOG(WARNING) << "Not caching " << length << " bytes at offset "
+                 << write_offset_ << ", " << stored_size_
+                 << " bytes stored so far";
+    write_failed_ = true;
+    return;
+  }
+  // Only the part past what's stored is new; the rest is skipped rather
+  // than written again.
+  uint64_t skip = stored_size_ - write_offset_;
+  if (skip < length &&
+      !utils::PWriteAll(fd_, data + skip, length - skip,
+                        write_offset_ + skip)) {
+    PLOG(ERROR) << "Unable to write to the payload cache";
+    write_failed_ = true;
+    return;
+  }
+  write_offset_ += length;
+  stored_size_ = std::max(stored_size_, static_cast<uint64_t>(write_offset_));
+}
+
+bool PayloadCache::EndWrite(bool verified) {
+  if (!writing() || checking())
+    return false;
+  if (write_failed_ || stored_size_ != size_) {
+    CloseWrite(false);
+    return false;
+  }
+
+  // The data isn't synced to the disk first, that would take as long. A
+  // payload lost in a crash fails when it's replayed, and is removed then.
+  if (verified && carried_over_size_ == 0)
+    return Commit();
+
+  // What's stored may come from several attempts, so check all of it, a
+  // bit at a time so as not to hold up the main loop.
+  LOG(INFO) << "Checking the " << size_ << " bytes of the cached payload";
+  check_hasher_.reset(new OmahaHashCalculator);
+  check_offset_ = 0;
+  check_source_id_ = g_idle_add(&PayloadCache::StaticCheckCallback, this);
+  return false;
+}
+
+gboolean PayloadCache::CheckCallback() {
+  const size_t count = std::min(static_cast<uint64_t>(kCheckChunkSize),
+                                size_ - check_offset_);
+  vector<char> buf(count);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd_, buf.data(), count, check_offset_, &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(count) ||
+      !check_hasher_->Update(buf.data(), count)) {
+    LOG(ERROR) << "Unable to read back the cached payload, discarding it.";
+    check_source_id_ = 0;
+    CloseWrite(true);
+    return FALSE;
+  }
+  check_offset_ += count;
+  if (check_offset_ < size_)
+    return TRUE;
+
+  check_source_id_ = 0;
+  if (!check_hasher_->Finalize() || check_hasher_->hash() != hash_) {
+    LOG(ERROR) << "The cached payload doesn't match its hash, discarding it.";
+    CloseWrite(true);
+    return FALSE;
+  }
+  Commit();
+  return FALSE;
+}
+
+bool PayloadCache::Commit() {
+  const string partial = PartialPathForHash(hash_);
+  const string cached = PathForHash(hash_);
+  if (rename(partial.c_str(), cached.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to move " << partial << " to " << cached;
+    CloseWrite(true);
+    return false;
+  }
+  LOG(INFO) << "Cached the payload in " << cached;
+  CloseWrite(false);
+  return true;
+}
+
+void PayloadCache::CloseWrite(bool discard) {
+  if (!writing())
+    return;
+  if (check_source_id_) {
+    g_source_remove(check_source_id_);
+    check_source_id_ = 0;
+  }
+  check_hasher_.reset();
+  close(fd_);
+  fd_ = -1;
+  if (discard)
+    unlink(PartialPathForHash(hash_).c_str());
+  hash_.clear();
+}
+
+bool PayloadCache::MakeRoom(uint64_t bytes_needed, const string& keep) {
+  vector<CacheEntry> entries;
+  uint64_t total_size = 0;
+  files::FileEnumerator enumerator(files::FilePath(dir_), false,
+                                   files::FileEnumerator::FILES,
+                                   string("*") + kPayloadSuffix + "*");
+  for (files::FilePath name = enumerator.Next(); !name.empty();
+       name = enumerator.Next()) {
+    const string& path = name.value();
+    if (path == keep) {
+      // What's already there of the payload being stored takes no extra
+      // room.
+      bytes_needed -= std::min(
+          bytes_needed,
+          static_cast<uint64_t>(enumerator.GetInfo().GetSize()));
+      continue;
+    }
+    if (utils::StringHasSuffix(path, kPartialSuffix)) {
+      // Only one payload is stored at a time, so any other partial one is
+      // from an update that has been superseded.
+      LOG(INFO) << "Removing the stale partial payload " << path;
+      unlink(path.c_str());
+      continue;
+    }
+    CacheEntry entry;
+    entry.path = path;
+    entry.size = enumerator.GetInfo().GetSize();
+    entry.last_used = enumerator.GetInfo().stat().st_mtime;
+    entries.push_back(entry);
+    total_size += entry.size;
+  }
+
+  std::sort(entries.begin(), entries.end());
+  for (vector<CacheEntry>::const_iterator it = entries.begin();
+       it != entries.end() && total_size + bytes_needed > max_size_; ++it) {
+    LOG(INFO) << "Evicting " << it->path << " from the payload cache";
+    TEST_AND_RETURN_FALSE_ERRNO(unlink(it->path.c_str()) == 0);
+    total_size -= it->size;
+  }
+  return total_size + bytes_needed <= max_size_;
+}
+
+}  // namespace chromeos_update_engine
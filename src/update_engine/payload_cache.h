@@ -0,0 +1,133 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_CACHE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_CACHE_H__
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <glib.h>
+
+#include "macros.h"
+#include "update_engine/omaha_hash_calculator.h"
+
+// A directory of downloaded payloads, named after their Omaha hash, so that
+// applying the same payload again (after a failure past the download, a
+// reboot or an interrupted download) reads it from the disk instead of the
+// network.
+//
+// A payload is stored in <key>.payload.part as it's downloaded, which stays
+// around if the download is interrupted so a resumed download can add to
+// it. Once complete and matching its hash it's renamed to <key>.payload.
+// The least recently used payloads are evicted to stay within the maximum
+// size, and only one payload is being stored at a time.
+
+namespace chromeos_update_engine {
+
+class PayloadCache {
+ public:
+  // The size the cache is allowed to grow to if not configured.
+  static const uint64_t kDefaultMaxSize;
+
+  PayloadCache();
+  ~PayloadCache();
+
+  // An empty directory disables the cache.
+  void set_dir(const std::string& dir) { dir_ = dir; }
+  const std::string& dir() const { return dir_; }
+  void set_max_size(uint64_t max_size) { max_size_ = max_size; }
+  uint64_t max_size() const { return max_size_; }
+
+  bool enabled() const { return !dir_.empty() && max_size_ > 0; }
+
+  // Returns true if the payload with |hash| and |size| is cached, in which
+  // case its path is stored in |path| and it becomes the most recently
+  // used.
+  bool Lookup(const std::string& hash, uint64_t size, std::string* path);
+
+  // Forgets the payload with |hash|, e.g. because it failed to apply.
+  void Remove(const std::string& hash);
+
+  // Starts storing the payload with |hash| and |size|, keeping whatever a
+  // previous attempt stored of it, and makes room for it. Returns false if
+  // it can't be stored, in which case the other calls below are no-ops.
+  bool BeginWrite(const std::string& hash, uint64_t size);
+
+  // The next Write() stores data at |offset| of the payload.
+  void Seek(off_t offset);
+
+  // Stores |length| bytes of the payload. Data past what's stored so far
+  // can't be kept, so a gap stops storing for the rest of the attempt.
+  void Write(const char* data, size_t length);
+
+  // Ends storing the payload. Once it's all there and matches its hash,
+  // it's moved into the cache; otherwise what was stored is kept for the
+  // next attempt unless it's known to be bad. |verified| tells that the
+  // payload was checked against its hash as it was downloaded, and if this
+  // attempt stored all of it, it's moved into the cache straight away and
+  // true is returned. Otherwise the stored file is hashed again in steps
+  // from the main loop, while checking() is true, and false is returned.
+  bool EndWrite(bool verified);
+
+  bool writing() const { return fd_ >= 0; }
+  bool checking() const { return check_source_id_ != 0; }
+
+  // Returns the name of the file the payload with |hash| is stored in once
+  // complete. The hash is base64 encoded, which may contain '/'.
+  static std::string FileNameForHash(const std::string& hash);
+
+ private:
+  // Returns the paths of the files for the payload with |hash|.
+  std::string PathForHash(const std::string& hash) const;
+  std::string PartialPathForHash(const std::string& hash) const;
+
+  // Hashes the next part of the complete partial payload, then moves it
+  // into the cache if it matches its hash.
+  gboolean CheckCallback();
+  static gboolean StaticCheckCallback(gpointer data) {
+    return reinterpret_cast<PayloadCache*>(data)->CheckCallback();
+  }
+
+  // Moves the complete partial payload into the cache.
+  bool Commit();
+
+  // Closes the partial payload, and deletes it if |discard|.
+  void CloseWrite(bool discard);
+
+  // Deletes stale partial payloads and the least recently used payloads
+  // until |bytes_needed| more fit in. |keep| isn't deleted.
+  bool MakeRoom(uint64_t bytes_needed, const std::string& keep);
+
+  std::string dir_;
+  uint64_t max_size_;
+
+  // The payload being stored, and its partial file.
+  std::string hash_;
+  uint64_t size_;
+  int fd_;
+
+  // Where the next Write() goes and how much of the payload is stored, and
+  // how much of it was stored by an earlier attempt.
+  off_t write_offset_;
+  uint64_t stored_size_;
+  uint64_t carried_over_size_;
+
+  // Set once data is missing or couldn't be written.
+  bool write_failed_;
+
+  // The hash of the partial payload as far as it has been checked.
+  guint check_source_id_;
+  std::unique_ptr<OmahaHashCalculator> check_hasher_;
+  uint64_t check_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_CACHE_H__
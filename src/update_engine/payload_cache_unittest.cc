@@ -0,0 +1,194 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "files/file_util.h"
+#include "files/scoped_temp_dir.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/payload_cache.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PayloadCacheTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_TRUE(dir_.CreateUniqueTempDir());
+    cache_.set_dir(dir_.path().value());
+  }
+
+  // Returns a payload of |size| bytes and its hash in |hash|.
+  static string MakePayload(size_t size, char seed, string* hash) {
+    string payload(size, 0);
+    for (size_t i = 0; i < size; i++)
+      payload[i] = seed + i % 37;
+    *hash = OmahaHashCalculator::OmahaHashOfString(payload);
+    return payload;
+  }
+
+  // Stores all of |payload|, which has been verified, in the cache.
+  bool Store(const string& payload, const string& hash) {
+    if (!cache_.BeginWrite(hash, payload.size()))
+      return false;
+    cache_.Write(payload.data(), payload.size());
+    return cache_.EndWrite(true);
+  }
+
+  // Runs the main loop until the cache is done checking a payload.
+  void WaitForCheck() {
+    while (cache_.checking())
+      g_main_context_iteration(NULL, TRUE);
+  }
+
+  files::ScopedTempDir dir_;
+  PayloadCache cache_;
+};
+
+TEST_F(PayloadCacheTest, SimpleTest) {
+  string hash;
+  const string payload = MakePayload(10000, 'a', &hash);
+  string path;
+  EXPECT_FALSE(cache_.Lookup(hash, payload.size(), &path));
+
+  EXPECT_TRUE(Store(payload, hash));
+  EXPECT_FALSE(cache_.writing());
+  ASSERT_TRUE(cache_.Lookup(hash, payload.size(), &path));
+  string stored;
+  EXPECT_TRUE(utils::ReadFile(path, &stored));
+  EXPECT_EQ(payload, stored);
+
+  // An entry of the wrong size is bad and gets removed.
+  EXPECT_FALSE(cache_.Lookup(hash, payload.size() + 1, &path));
+  EXPECT_FALSE(cache_.Lookup(hash, payload.size(), &path));
+}
+
+TEST_F(PayloadCacheTest, DisabledTest) {
+  PayloadCache cache;
+  string hash;
+  const string payload = MakePayload(100, 'a', &hash);
+  EXPECT_FALSE(cache.enabled());
+  EXPECT_FALSE(cache.BeginWrite(hash, payload.size()));
+  cache.Write(payload.data(), payload.size());
+  EXPECT_FALSE(cache.EndWrite(true));
+}
+
+TEST_F(PayloadCacheTest, ResumeTest) {
+  string hash;
+  const string payload = MakePayload(10000, 'a', &hash);
+
+  // The first attempt is interrupted.
+  ASSERT_TRUE(cache_.BeginWrite(hash, payload.size()));
+  cache_.Write(payload.data(), 6000);
+  EXPECT_FALSE(cache_.EndWrite(false));
+
+  // The resumed one fetches the manifest again, then picks up from before
+  // where the first one stopped. What the first one stored is checked
+  // again before the payload is cached.
+  ASSERT_TRUE(cache_.BeginWrite(hash, payload.size()));
+  cache_.Write(payload.data(), 100);
+  cache_.Seek(5000);
+  cache_.Write(payload.data() + 5000, 5000);
+  EXPECT_FALSE(cache_.EndWrite(true));
+  EXPECT_TRUE(cache_.checking());
+  WaitForCheck();
+
+  string path, stored;
+  ASSERT_TRUE(cache_.Lookup(hash, payload.size(), &path));
+  EXPECT_TRUE(utils::ReadFile(path, &stored));
+  EXPECT_EQ(payload, stored);
+}
+
+TEST_F(PayloadCacheTest, GapTest) {
+  string hash;
+  const string payload = MakePayload(10000, 'a', &hash);
+  ASSERT_TRUE(cache_.BeginWrite(hash, payload.size()));
+  cache_.Write(payload.data(), 100);
+  cache_.Seek(5000);
+  cache_.Write(payload.data() + 5000, 5000);
+  EXPECT_FALSE(cache_.EndWrite(true));
+  EXPECT_FALSE(cache_.checking());
+  string path;
+  EXPECT_FALSE(cache_.Lookup(hash, payload.size(), &path));
+}
+
+TEST_F(PayloadCacheTest, BadHashTest) {
+  string hash, other_hash;
+  const string payload = MakePayload(10000, 'a', &hash);
+  MakePayload(10000, 'b', &other_hash);
+  ASSERT_TRUE(cache_.BeginWrite(other_hash, payload.size()));
+  cache_.Write(payload.data(), payload.size());
+  EXPECT_FALSE(cache_.EndWrite(false));
+  WaitForCheck();
+  string path;
+  EXPECT_FALSE(cache_.Lookup(other_hash, payload.size(), &path));
+
+  // Nothing is left over for the next attempt to build on.
+  EXPECT_TRUE(files::IsDirectoryEmpty(dir_.path()));
+}
+
+TEST_F(PayloadCacheTest, CancelCheckTest) {
+  string hash, other_hash;
+  const string payload = MakePayload(10000, 'a', &hash);
+  const string other_payload = MakePayload(100, 'b', &other_hash);
+  ASSERT_TRUE(cache_.BeginWrite(hash, payload.size()));
+  cache_.Write(payload.data(), payload.size());
+  EXPECT_FALSE(cache_.EndWrite(false));
+  EXPECT_TRUE(cache_.checking());
+
+  // Storing another payload stops the check, leaving the first one partial.
+  EXPECT_TRUE(Store(other_payload, other_hash));
+  EXPECT_FALSE(cache_.checking());
+  string path;
+  EXPECT_FALSE(cache_.Lookup(hash, payload.size(), &path));
+  EXPECT_TRUE(cache_.Lookup(other_hash, other_payload.size(), &path));
+}
+
+TEST_F(PayloadCacheTest, EvictionTest) {
+  cache_.set_max_size(25000);
+  string hash_a, hash_b, hash_c;
+  const string payload_a = MakePayload(10000, 'a', &hash_a);
+  const string payload_b = MakePayload(10000, 'b', &hash_b);
+  const string payload_c = MakePayload(10000, 'c', &hash_c);
+  EXPECT_TRUE(Store(payload_a, hash_a));
+  EXPECT_TRUE(Store(payload_b, hash_b));
+
+  // Make b the least recently used one.
+  string path;
+  ASSERT_TRUE(cache_.Lookup(hash_b, payload_b.size(), &path));
+  struct timeval times[2] = {{1000, 0}, {1000, 0}};
+  ASSERT_EQ(0, utimes(path.c_str(), times));
+  ASSERT_TRUE(cache_.Lookup(hash_a, payload_a.size(), &path));
+
+  EXPECT_TRUE(Store(payload_c, hash_c));
+  EXPECT_TRUE(cache_.Lookup(hash_a, payload_a.size(), &path));
+  EXPECT_FALSE(cache_.Lookup(hash_b, payload_b.size(), &path));
+  EXPECT_TRUE(cache_.Lookup(hash_c, payload_c.size(), &path));
+
+  // A payload that can never fit isn't stored at all.
+  string hash_d;
+  const string payload_d = MakePayload(30000, 'd', &hash_d);
+  EXPECT_FALSE(cache_.BeginWrite(hash_d, payload_d.size()));
+  EXPECT_TRUE(cache_.Lookup(hash_a, payload_a.size(), &path));
+}
+
+TEST_F(PayloadCacheTest, RemoveTest) {
+  string hash;
+  const string payload = MakePayload(100, 'a', &hash);
+  EXPECT_TRUE(Store(payload, hash));
+  cache_.Remove(hash);
+  string path;
+  EXPECT_FALSE(cache_.Lookup(hash, payload.size(), &path));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,269 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/payload_compression.h"
+
+#include <algorithm>
+#include <map>
+
+#include "strings/string_number_conversions.h"
+#include "strings/string_split.h"
+#include "update_engine/bzip.h"
+#include "update_engine/utils.h"
+#include "update_engine/xz.h"
+#include "update_engine/zstd.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const uint64_t kNominalDownloadRate = 10 * 1024 * 1024;
+
+namespace {
+vector<InstallOperation_Type> replace_types(1,
+                                            InstallOperation_Type_REPLACE_BZ);
+bool use_zero_operations = false;
+bool use_zstd_diff_operations = false;
+uint64_t target_download_rate = 0;
+
+// The costs a client was measured to apply an operation type at.
+struct ApplyCost {
+  uint64_t decode_rate;
+  double seconds;
+};
+map<InstallOperation_Type, ApplyCost> calibrated_costs;
+
+uint64_t DecodeRate(InstallOperation_Type type) {
+  map<InstallOperation_Type, ApplyCost>::const_iterator it =
+      calibrated_costs.find(type);
+  return it != calibrated_costs.end() ? it->second.decode_rate :
+      NominalDecodeRate(type);
+}
+
+double OperationSeconds(InstallOperation_Type type) {
+  map<InstallOperation_Type, ApplyCost>::const_iterator it =
+      calibrated_costs.find(type);
+  return it != calibrated_costs.end() ? it->second.seconds :
+      NominalOperationSeconds(type);
+}
+}  // namespace {}
+
+uint64_t NominalDecodeRate(InstallOperation_Type type) {
+  switch (type) {
+    case InstallOperation_Type_REPLACE_BZ:
+      return 20 * 1024 * 1024;
+    case InstallOperation_Type_REPLACE_XZ:
+      return 80 * 1024 * 1024;
+    case InstallOperation_Type_REPLACE_ZSTD:
+      return 400 * 1024 * 1024;
+    // bspatch is bound by the bzip2 decoding of its control and diff data.
+    case InstallOperation_Type_BSDIFF:
+    case InstallOperation_Type_SOURCE_BSDIFF:
+      return 20 * 1024 * 1024;
+    // The matches reach far back into the dictionary, missing the caches.
+    case InstallOperation_Type_ZSTD_DIFF:
+    case InstallOperation_Type_SOURCE_ZSTD_DIFF:
+      return 300 * 1024 * 1024;
+    default:
+      return 0;  // nothing to decode
+  }
+}
+
+double NominalOperationSeconds(InstallOperation_Type type) {
+  switch (type) {
+    // The client writes the patch to a temporary file and runs bspatch on
+    // it, which reads the old data back at random.
+    case InstallOperation_Type_BSDIFF:
+    case InstallOperation_Type_SOURCE_BSDIFF:
+      return 0.02;
+    default:
+      return 0;
+  }
+}
+
+bool LoadApplyCostTable(const string& path) {
+  string contents;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(path, &contents));
+  map<InstallOperation_Type, ApplyCost> costs;
+  for (const string& line : strings::SplitAndTrim(contents, '\n')) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    const vector<string> fields = strings::SplitWords(line);
+    InstallOperation_Type type;
+    int64_t decode_rate = -1, microseconds = -1;
+    if (fields.size() != 3 ||
+        !InstallOperation_Type_Parse(fields[0], &type) ||
+        !strings::StringToInt64(fields[1], &decode_rate) ||
+        !strings::StringToInt64(fields[2], &microseconds) ||
+        decode_rate < 0 || microseconds < 0) {
+      LOG(ERROR) << "Malformed line in " << path << ": " << line;
+      return false;
+    }
+    costs[type] = ApplyCost{static_cast<uint64_t>(decode_rate),
+                            microseconds / 1000000.0};
+  }
+  calibrated_costs.swap(costs);
+  return true;
+}
+
+void SetTargetDownloadRate(uint64_t rate) {
+  target_download_rate = rate;
+}
+
+uint64_t TargetDownloadRate() {
+  return target_download_rate;
+}
+
+void SetReplaceTypes(const vector<InstallOperation_Type>& types) {
+  replace_types = types;
+}
+
+const vector<InstallOperation_Type>& GetReplaceTypes() {
+  return replace_types;
+}
+
+void SetUseZeroOperations(bool use) {
+  use_zero_operations = use;
+}
+
+bool UseZeroOperations() {
+  return use_zero_operations;
+}
+
+void SetUseZstdDiffOperations(bool use) {
+  use_zstd_diff_operations = use;
+}
+
+bool UseZstdDiffOperations() {
+  return use_zstd_diff_operations;
+}
+
+bool ParseReplaceTypes(const string& str,
+                       vector<InstallOperation_Type>* types) {
+  types->clear();
+  for (const string& name : strings::SplitAndTrim(str, ',')) {
+    if (name == "bzip2") {
+      types->push_back(InstallOperation_Type_REPLACE_BZ);
+    } else if (name == "xz") {
+      types->push_back(InstallOperation_Type_REPLACE_XZ);
+    } else if (name == "zstd") {
+      types->push_back(InstallOperation_Type_REPLACE_ZSTD);
+    } else if (!name.empty()) {
+      LOG(ERROR) << "Unknown compression: " << name;
+      return false;
+    }
+  }
+  return true;
+}
+
+double EstimateApplySeconds(InstallOperation_Type type,
+                            uint64_t data_length,
+                            uint64_t dst_length) {
+  const uint64_t download_rate =
+      target_download_rate ? target_download_rate : kNominalDownloadRate;
+  double seconds = static_cast<double>(data_length) / download_rate +
+      OperationSeconds(type);
+  const uint64_t decode_rate = DecodeRate(type);
+  if (decode_rate)
+    seconds += static_cast<double>(dst_length) / decode_rate;
+  return seconds;
+}
+
+bool IsCheaperOperation(InstallOperation_Type type,
+                        uint64_t data_length,
+                        InstallOperation_Type best_type,
+                        uint64_t best_length,
+                        uint64_t dst_length) {
+  if (!target_download_rate)
+    return data_length < best_length;
+  return EstimateApplySeconds(type, data_length, dst_length) <
+      EstimateApplySeconds(best_type, best_length, dst_length);
+}
+
+bool IsReplaceType(InstallOperation_Type type) {
+  return type == InstallOperation_Type_REPLACE ||
+      type == InstallOperation_Type_REPLACE_BZ ||
+      type == InstallOperation_Type_REPLACE_ZSTD ||
+      type == InstallOperation_Type_REPLACE_XZ;
+}
+
+bool IsFullOperationType(InstallOperation_Type type) {
+  return IsReplaceType(type) || type == InstallOperation_Type_ZERO;
+}
+
+bool CompressForType(InstallOperation_Type type,
+                     const vector<char>& in,
+                     vector<char>* out) {
+  switch (type) {
+    case InstallOperation_Type_REPLACE:
+      *out = in;
+      return true;
+    case InstallOperation_Type_REPLACE_BZ:
+      return BzipCompress(in, out);
+    case InstallOperation_Type_REPLACE_XZ:
+      return XzCompress(in, out);
+    case InstallOperation_Type_REPLACE_ZSTD:
+      return ZstdCompress(in, out);
+    default:
+      LOG(ERROR) << "Not a REPLACE type: " << type;
+      return false;
+  }
+}
+
+bool CompressReplaceData(const vector<char>& in,
+                         vector<char>* out,
+                         InstallOperation_Type* type) {
+  if (use_zero_operations &&
+      std::find_if(in.begin(), in.end(), [](char c) { return c != 0; }) ==
+      in.end()) {
+    *type = InstallOperation_Type_ZERO;
+    out->clear();
+    return true;
+  }
+  *type = InstallOperation_Type_REPLACE;
+  *out = in;
+  // Payloads for older clients stay the same as they always were.
+  const bool smallest_wins = !target_download_rate &&
+      replace_types.size() == 1 &&
+      replace_types[0] == InstallOperation_Type_REPLACE_BZ;
+  double best_seconds = EstimateApplySeconds(*type, in.size(), in.size());
+  for (InstallOperation_Type candidate : replace_types) {
+    vector<char> compressed;
+    TEST_AND_RETURN_FALSE(CompressForType(candidate, in, &compressed));
+    const double seconds =
+        EstimateApplySeconds(candidate, compressed.size(), in.size());
+    if (smallest_wins ? compressed.size() < out->size() :
+        seconds < best_seconds) {
+      best_seconds = seconds;
+      *type = candidate;
+      out->swap(compressed);
+    }
+  }
+  return true;
+}
+
+bool ChooseZstdDiff(const vector<char>& old_data,
+                    const vector<char>& new_data,
+                    vector<char>* data,
+                    InstallOperation_Type* type) {
+  if (!use_zstd_diff_operations ||
+      old_data.size() + new_data.size() > kZstdDiffMaxSize) {
+    return true;
+  }
+  vector<char> diff;
+  TEST_AND_RETURN_FALSE(ZstdDiff(old_data, new_data, &diff));
+  const double seconds = EstimateApplySeconds(InstallOperation_Type_ZSTD_DIFF,
+                                              diff.size(), new_data.size());
+  const bool faster =
+      seconds < EstimateApplySeconds(*type, data->size(), new_data.size());
+  if (faster || (!target_download_rate && diff.size() < data->size())) {
+    *type = InstallOperation_Type_ZSTD_DIFF;
+    data->swap(diff);
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,123 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_COMPRESSION_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_COMPRESSION_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "update_engine/update_metadata.pb.h"
+
+// The payload generator stores the data of the blocks it sends in full with
+// whichever of REPLACE and the compressed REPLACE types it is allowed to use
+// is expected to make the client done soonest: the time to download the data
+// plus the time to decode it. bzip2 compresses well but decodes at only tens
+// of MB/s, so it can cost more time than the bytes it saves. Likewise a
+// BSDIFF operation that saves a little data over REPLACE_BZ has the client
+// start bspatch and write a temporary file. Given a target download rate,
+// every choice, diffs included, minimizes that estimated time.
+
+namespace chromeos_update_engine {
+
+// The download rate and the rates of each type's decoder, in bytes of
+// output per second, that the costs are estimated with. The decode rates
+// are roughly what ZipTest.DecodeThroughputTest measures on a small
+// instance.
+extern const uint64_t kNominalDownloadRate;
+uint64_t NominalDecodeRate(InstallOperation_Type type);
+
+// The seconds an operation of |type| costs the client besides downloading
+// and decoding its data, such as starting bspatch.
+double NominalOperationSeconds(InstallOperation_Type type);
+
+// Replaces the decode rates and fixed costs of the types listed in the file
+// at |path|, measured on the clients, for the nominal ones. Each line holds
+// a type name, its decode rate in bytes per second and its fixed cost in
+// microseconds, e.g. "BSDIFF 15728640 40000". Blank lines and lines
+// starting with "#" are skipped. Returns false on a malformed file.
+bool LoadApplyCostTable(const std::string& path);
+
+// The download rate, in bytes per second, at which the generator minimizes
+// the estimated time to download and apply the update. 0, the default,
+// keeps choosing between a diff and the REPLACE types by size, as before,
+// and estimates at kNominalDownloadRate.
+void SetTargetDownloadRate(uint64_t rate);
+uint64_t TargetDownloadRate();
+
+// The compressed REPLACE types the generator may choose from. Only
+// REPLACE_BZ by default, as it's all that older clients understand.
+void SetReplaceTypes(const std::vector<InstallOperation_Type>& types);
+const std::vector<InstallOperation_Type>& GetReplaceTypes();
+
+// Whether the generator may send blocks that are all zeros as ZERO
+// operations, which carry no data. Off by default, as older clients don't
+// understand them.
+void SetUseZeroOperations(bool use);
+bool UseZeroOperations();
+
+// Whether the generator may diff changed data with zstd, as ZSTD_DIFF
+// operations, rather than only with bsdiff. Off by default, as older clients
+// don't understand them.
+void SetUseZstdDiffOperations(bool use);
+bool UseZstdDiffOperations();
+
+// Parses a comma separated list of "bzip2", "xz" and "zstd" into |types|.
+bool ParseReplaceTypes(const std::string& str,
+                       std::vector<InstallOperation_Type>* types);
+
+// Returns the estimated seconds it takes a client to download the
+// |data_length| bytes of data of an operation of |type| and decode them into
+// |dst_length| bytes.
+double EstimateApplySeconds(InstallOperation_Type type,
+                            uint64_t data_length,
+                            uint64_t dst_length);
+
+// Returns true if writing |dst_length| bytes with an operation of |type| and
+// |data_length| bytes of data beats doing so with one of |best_type| and
+// |best_length| bytes: it has a lower EstimateApplySeconds() if there's a
+// TargetDownloadRate(), or less data otherwise.
+bool IsCheaperOperation(InstallOperation_Type type,
+                        uint64_t data_length,
+                        InstallOperation_Type best_type,
+                        uint64_t best_length,
+                        uint64_t dst_length);
+
+// Returns true for REPLACE and the compressed REPLACE types, whose data is
+// all of the blocks they write.
+bool IsReplaceType(InstallOperation_Type type);
+
+// Returns true for the types that write their blocks without reading any:
+// the IsReplaceType() ones and ZERO.
+bool IsFullOperationType(InstallOperation_Type type);
+
+// Compresses |in| into |out| the way an operation of |type| (REPLACE or a
+// compressed REPLACE type) stores it.
+bool CompressForType(InstallOperation_Type type,
+                     const std::vector<char>& in,
+                     std::vector<char>* out);
+
+// Stores |in| into |out| with whichever of REPLACE and GetReplaceTypes()
+// has the lowest EstimateApplySeconds(), which is put in |type|. With only
+// REPLACE_BZ allowed and no TargetDownloadRate(), the smaller of it and
+// REPLACE is used, as before.
+// All zeros are sent as ZERO, with no data, if UseZeroOperations().
+bool CompressReplaceData(const std::vector<char>& in,
+                         std::vector<char>* out,
+                         InstallOperation_Type* type);
+
+// If UseZstdDiffOperations(), diffs |new_data| against |old_data| with
+// ZstdDiff() and, if the diff is smaller than the |*type| operation's |data|
+// or has a lower EstimateApplySeconds(), puts it in |data| and ZSTD_DIFF in
+// |type| instead. Given a TargetDownloadRate(), only the time counts. Data
+// too large for a diff is left as it is.
+bool ChooseZstdDiff(const std::vector<char>& old_data,
+                    const std::vector<char>& new_data,
+                    std::vector<char>* data,
+                    InstallOperation_Type* type);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_COMPRESSION_H__
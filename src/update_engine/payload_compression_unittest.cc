@@ -0,0 +1,264 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/bzip.h"
+#include "update_engine/payload_compression.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/xz.h"
+#include "update_engine/zstd.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PayloadCompressionTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    default_types_ = GetReplaceTypes();
+  }
+  virtual void TearDown() {
+    SetReplaceTypes(default_types_);
+    SetUseZeroOperations(false);
+    SetUseZstdDiffOperations(false);
+    SetTargetDownloadRate(0);
+  }
+
+  vector<InstallOperation_Type> default_types_;
+};
+
+TEST_F(PayloadCompressionTest, ParseReplaceTypesTest) {
+  vector<InstallOperation_Type> types;
+  EXPECT_TRUE(ParseReplaceTypes("bzip2, zstd,xz", &types));
+  ASSERT_EQ(3, types.size());
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, types[0]);
+  EXPECT_EQ(InstallOperation_Type_REPLACE_ZSTD, types[1]);
+  EXPECT_EQ(InstallOperation_Type_REPLACE_XZ, types[2]);
+
+  EXPECT_TRUE(ParseReplaceTypes("", &types));
+  EXPECT_TRUE(types.empty());
+  EXPECT_FALSE(ParseReplaceTypes("bzip2,gzip", &types));
+}
+
+TEST_F(PayloadCompressionTest, DefaultTypesTest) {
+  // Older clients only understand bzip2.
+  ASSERT_EQ(1, GetReplaceTypes().size());
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, GetReplaceTypes()[0]);
+}
+
+TEST_F(PayloadCompressionTest, IsReplaceTypeTest) {
+  EXPECT_TRUE(IsReplaceType(InstallOperation_Type_REPLACE));
+  EXPECT_TRUE(IsReplaceType(InstallOperation_Type_REPLACE_BZ));
+  EXPECT_TRUE(IsReplaceType(InstallOperation_Type_REPLACE_ZSTD));
+  EXPECT_TRUE(IsReplaceType(InstallOperation_Type_REPLACE_XZ));
+  EXPECT_FALSE(IsReplaceType(InstallOperation_Type_MOVE));
+  EXPECT_FALSE(IsReplaceType(InstallOperation_Type_BSDIFF));
+  EXPECT_FALSE(IsReplaceType(InstallOperation_Type_ZERO));
+  EXPECT_TRUE(IsFullOperationType(InstallOperation_Type_ZERO));
+  EXPECT_TRUE(IsFullOperationType(InstallOperation_Type_REPLACE_XZ));
+  EXPECT_FALSE(IsFullOperationType(InstallOperation_Type_MOVE));
+}
+
+TEST_F(PayloadCompressionTest, EstimateApplySecondsTest) {
+  EXPECT_DOUBLE_EQ(1.0, EstimateApplySeconds(InstallOperation_Type_REPLACE,
+                                             kNominalDownloadRate,
+                                             kNominalDownloadRate));
+  // The same size of data costs more the slower it is to decode.
+  EXPECT_GT(EstimateApplySeconds(InstallOperation_Type_REPLACE_BZ, 100, 1000),
+            EstimateApplySeconds(InstallOperation_Type_REPLACE_XZ, 100, 1000));
+  EXPECT_GT(EstimateApplySeconds(InstallOperation_Type_REPLACE_XZ, 100, 1000),
+            EstimateApplySeconds(InstallOperation_Type_REPLACE_ZSTD, 100,
+                                 1000));
+}
+
+TEST_F(PayloadCompressionTest, IsCheaperOperationTest) {
+  // A BSDIFF that saves 2% of a megabyte's REPLACE_BZ data.
+  const uint64_t kDstLength = 1024 * 1024;
+  const uint64_t kReplaceLength = 300 * 1000;
+  const uint64_t kBsdiffLength = 294 * 1000;
+
+  // Without a target rate, the smaller data wins, as before.
+  EXPECT_TRUE(IsCheaperOperation(InstallOperation_Type_BSDIFF, kBsdiffLength,
+                                 InstallOperation_Type_REPLACE_BZ,
+                                 kReplaceLength, kDstLength));
+
+  // Starting bspatch costs more than the download it saves on a fast link,
+  // but not on a slow one.
+  SetTargetDownloadRate(100 * 1000 * 1000 / 8);
+  EXPECT_FALSE(IsCheaperOperation(InstallOperation_Type_BSDIFF, kBsdiffLength,
+                                  InstallOperation_Type_REPLACE_BZ,
+                                  kReplaceLength, kDstLength));
+  SetTargetDownloadRate(1000 * 1000 / 8);
+  EXPECT_TRUE(IsCheaperOperation(InstallOperation_Type_BSDIFF, kBsdiffLength,
+                                 InstallOperation_Type_REPLACE_BZ,
+                                 kReplaceLength, kDstLength));
+  EXPECT_DOUBLE_EQ(
+      kReplaceLength / 125000.0 +
+      static_cast<double>(kDstLength) /
+      NominalDecodeRate(InstallOperation_Type_REPLACE_BZ),
+      EstimateApplySeconds(InstallOperation_Type_REPLACE_BZ, kReplaceLength,
+                           kDstLength));
+}
+
+TEST_F(PayloadCompressionTest, LoadApplyCostTableTest) {
+  ScopedTempFile table;
+  ASSERT_TRUE(WriteFileString(table.GetPath(),
+                              "# Measured on a slow board\n"
+                              "\n"
+                              "BSDIFF 1048576 500000\n"
+                              "REPLACE_BZ 2097152 0\n"));
+  EXPECT_TRUE(LoadApplyCostTable(table.GetPath()));
+  EXPECT_DOUBLE_EQ(1.5, EstimateApplySeconds(InstallOperation_Type_BSDIFF,
+                                             0, 1024 * 1024));
+  EXPECT_DOUBLE_EQ(0.5, EstimateApplySeconds(InstallOperation_Type_REPLACE_BZ,
+                                             0, 1024 * 1024));
+  // Types left out keep their nominal costs.
+  EXPECT_DOUBLE_EQ(
+      1024.0 * 1024 / NominalDecodeRate(InstallOperation_Type_REPLACE_XZ),
+      EstimateApplySeconds(InstallOperation_Type_REPLACE_XZ, 0, 1024 * 1024));
+
+  // A malformed table leaves the costs as they were.
+  const char* const kMalformed[] = {
+    "BSDIFF 1048576\n",
+    "GZIP 1048576 0\n",
+    "BSDIFF fast 0\n",
+    "BSDIFF 1048576 -1\n",
+  };
+  for (const char* contents : kMalformed) {
+    ASSERT_TRUE(WriteFileString(table.GetPath(), contents));
+    EXPECT_FALSE(LoadApplyCostTable(table.GetPath())) << contents;
+  }
+  EXPECT_DOUBLE_EQ(1.5, EstimateApplySeconds(InstallOperation_Type_BSDIFF,
+                                             0, 1024 * 1024));
+  EXPECT_FALSE(LoadApplyCostTable("/nonexistent/path"));
+
+  // An empty table restores the nominal costs.
+  ASSERT_TRUE(WriteFileString(table.GetPath(), ""));
+  EXPECT_TRUE(LoadApplyCostTable(table.GetPath()));
+  EXPECT_DOUBLE_EQ(
+      NominalOperationSeconds(InstallOperation_Type_BSDIFF) +
+      1024.0 * 1024 / NominalDecodeRate(InstallOperation_Type_BSDIFF),
+      EstimateApplySeconds(InstallOperation_Type_BSDIFF, 0, 1024 * 1024));
+}
+
+TEST_F(PayloadCompressionTest, CompressForTypeTest) {
+  vector<char> in(64 * 1024);
+  FillWithData(&in);
+  vector<char> out, decompressed;
+  EXPECT_TRUE(CompressForType(InstallOperation_Type_REPLACE, in, &out));
+  EXPECT_TRUE(out == in);
+  EXPECT_TRUE(CompressForType(InstallOperation_Type_REPLACE_BZ, in, &out));
+  EXPECT_TRUE(BzipDecompress(out, &decompressed));
+  EXPECT_TRUE(decompressed == in);
+  EXPECT_TRUE(CompressForType(InstallOperation_Type_REPLACE_ZSTD, in, &out));
+  EXPECT_TRUE(ZstdDecompress(out, &decompressed));
+  EXPECT_TRUE(decompressed == in);
+  EXPECT_TRUE(CompressForType(InstallOperation_Type_REPLACE_XZ, in, &out));
+  EXPECT_TRUE(XzDecompress(out, &decompressed));
+  EXPECT_TRUE(decompressed == in);
+  EXPECT_FALSE(CompressForType(InstallOperation_Type_MOVE, in, &out));
+}
+
+TEST_F(PayloadCompressionTest, CompressReplaceDataTest) {
+  vector<char> in(64 * 1024);
+  FillWithData(&in);
+  vector<char> out;
+  InstallOperation_Type type;
+
+  // By default, bzip2 is used whenever it's smaller.
+  EXPECT_TRUE(CompressReplaceData(in, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, type);
+  string random(reinterpret_cast<const char*>(kRandomString),
+                sizeof(kRandomString));
+  vector<char> incompressible(random.begin(), random.end());
+  EXPECT_TRUE(CompressReplaceData(incompressible, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE, type);
+  EXPECT_TRUE(out == incompressible);
+
+  // zstd compresses this about as well and decodes much faster.
+  vector<InstallOperation_Type> types;
+  ASSERT_TRUE(ParseReplaceTypes("bzip2,xz,zstd", &types));
+  SetReplaceTypes(types);
+  EXPECT_TRUE(CompressReplaceData(in, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE_ZSTD, type);
+  vector<char> decompressed;
+  EXPECT_TRUE(ZstdDecompress(out, &decompressed));
+  EXPECT_TRUE(decompressed == in);
+
+  // Decoding bzip2 takes longer than downloading the data uncompressed on
+  // a fast enough link.
+  SetReplaceTypes(default_types_);
+  SetTargetDownloadRate(1024 * 1024 * 1024);
+  EXPECT_TRUE(CompressReplaceData(in, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE, type);
+  SetTargetDownloadRate(0);
+
+  // Nothing but REPLACE is left.
+  SetReplaceTypes(vector<InstallOperation_Type>());
+  EXPECT_TRUE(CompressReplaceData(in, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE, type);
+  EXPECT_TRUE(out == in);
+}
+
+TEST_F(PayloadCompressionTest, ZeroOperationsTest) {
+  vector<char> zeros(64 * 1024, 0);
+  vector<char> out;
+  InstallOperation_Type type;
+
+  // Older clients don't understand ZERO.
+  EXPECT_FALSE(UseZeroOperations());
+  EXPECT_TRUE(CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, type);
+
+  SetUseZeroOperations(true);
+  EXPECT_TRUE(CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_ZERO, type);
+  EXPECT_TRUE(out.empty());
+
+  zeros.back() = 1;
+  EXPECT_TRUE(CompressReplaceData(zeros, &out, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, type);
+}
+
+TEST_F(PayloadCompressionTest, ChooseZstdDiffTest) {
+  vector<char> old_data(64 * 1024);
+  FillWithData(&old_data);
+  vector<char> new_data = old_data;
+  new_data[100] ^= 1;
+  vector<char> data;
+  InstallOperation_Type type;
+  ASSERT_TRUE(CompressReplaceData(new_data, &data, &type));
+  const vector<char> replace_data = data;
+
+  // Older clients don't understand ZSTD_DIFF.
+  EXPECT_FALSE(UseZstdDiffOperations());
+  EXPECT_TRUE(ChooseZstdDiff(old_data, new_data, &data, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, type);
+  EXPECT_TRUE(data == replace_data);
+
+  SetUseZstdDiffOperations(true);
+  EXPECT_TRUE(ChooseZstdDiff(old_data, new_data, &data, &type));
+  EXPECT_EQ(InstallOperation_Type_ZSTD_DIFF, type);
+  EXPECT_LT(data.size(), replace_data.size());
+  vector<char> patched;
+  EXPECT_TRUE(ZstdPatch(old_data, data, &patched));
+  EXPECT_TRUE(patched == new_data);
+
+  // A diff of unrelated data only wins if it's expected to be done sooner.
+  string random(reinterpret_cast<const char*>(kRandomString),
+                sizeof(kRandomString));
+  vector<char> unrelated(random.begin(), random.end());
+  type = InstallOperation_Type_REPLACE;
+  data = unrelated;
+  EXPECT_TRUE(ChooseZstdDiff(old_data, unrelated, &data, &type));
+  EXPECT_EQ(InstallOperation_Type_REPLACE, type);
+  EXPECT_TRUE(data == unrelated);
+}
+
+}  // namespace chromeos_update_engine
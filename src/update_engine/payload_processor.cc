@@ -6,6 +6,7 @@
 
 #include <endian.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -30,6 +31,9 @@ const char PayloadProcessor::kUpdatePayloadPublicKeyPath[] =
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+// The number of operations whose local blocks are looked at per
+// ContinueWork() call when planning a differential download.
+const size_t kPlanStepOperations = 4;
 
 void LogPartitionInfoHash(const InstallInfo& info, const string& tag) {
   string sha256;
@@ -50,6 +54,19 @@ void LogPartitionInfo(const DeltaArchiveManifest& manifest) {
     LogPartitionInfoHash(manifest.new_partition_info(), "new_partition_info");
 }
 
+// Returns true if the partition operations of |manifest| read the old
+// partition itself, rather than updating a copy of it in place.
+bool ReadsSourcePartition(const DeltaArchiveManifest& manifest) {
+  for (const InstallOperation& op : manifest.partition_operations()) {
+    if (op.type() == InstallOperation_Type_SOURCE_COPY ||
+        op.type() == InstallOperation_Type_SOURCE_BSDIFF ||
+        op.type() == InstallOperation_Type_SOURCE_ZSTD_DIFF) {
+      return true;
+    }
+  }
+  return false;
+}
+
 }  // namespace {}
 
 PayloadProcessor::PayloadProcessor(PrefsInterface* prefs, InstallPlan* install_plan)
@@ -61,9 +78,20 @@ PayloadProcessor::PayloadProcessor(PrefsInterface* prefs, InstallPlan* install_p
     manifest_valid_(false),
     manifest_metadata_size_(0),
     next_operation_num_(0),
+    copy_size_(0),
+    copy_offset_(0),
     buffer_offset_(0),
     last_updated_buffer_offset_(std::numeric_limits<uint64_t>::max()),
-    public_key_path_(kUpdatePayloadPublicKeyPath) {
+    public_key_path_(kUpdatePayloadPublicKeyPath),
+    download_ranges_changed_(false) {
+  partition_performer_.SetIoLimits(install_plan->io_priority,
+                                   install_plan->io_rate_limit);
+  if (install_plan->old_partition_path != install_plan->partition_path)
+    partition_performer_.SetSourcePath(install_plan->old_partition_path);
+  kernel_performer_.SetIoLimits(install_plan->io_priority,
+                                install_plan->io_rate_limit);
+  pcr_policy_performer_.SetIoLimits(install_plan->io_priority,
+                                    install_plan->io_rate_limit);
 }
 
 int PayloadProcessor::Open() {
@@ -139,6 +167,37 @@ bool PayloadProcessor::Write(const void* bytes, size_t count,
       return false;
   }
 
+  // The data is kept in buffer_ until ContinueWork() has caught up.
+  if (HasPendingWork())
+    return true;
+  return PerformOperations(error);
+}
+
+bool PayloadProcessor::HasPendingWork() const {
+  return copy_offset_ < copy_size_ ||
+      (differential_.get() && differential_->planning());
+}
+
+bool PayloadProcessor::ContinueWork(ActionExitCode* error) {
+  *error = kActionCodeSuccess;
+  if (copy_offset_ < copy_size_) {
+    if (!partition_performer_.CopySource(copy_size_, &copy_offset_)) {
+      LOG(ERROR) << "Unable to copy the old partition";
+      *error = kActionCodeFilesystemCopierError;
+      return false;
+    }
+    if (copy_offset_ < copy_size_)
+      return true;
+  }
+  if (differential_.get() && differential_->planning()) {
+    if (!differential_->PlanStep(kPlanStepOperations))
+      return true;
+    FinishDifferentialDownload();
+  }
+  return PerformOperations(error);
+}
+
+bool PayloadProcessor::PerformOperations(ActionExitCode* error) {
   while (next_operation_num_ < operations_.size()) {
     *error = PerformOperation();
     if (*error == kActionCodeDownloadIncomplete) {
@@ -195,6 +254,17 @@ ActionExitCode PayloadProcessor::LoadManifest() {
     operations_.emplace_back(nullptr, &op);
   }
 
+  // The old partition isn't copied ahead of time anymore, as payloads with
+  // SOURCE_COPY and SOURCE_BSDIFF operations don't need it. Deltas without
+  // them update a copy of it in place, which ContinueWork() makes.
+  if (next_operation_num_ == 0 && manifest_.has_old_partition_info() &&
+      !ReadsSourcePartition(manifest_) &&
+      install_plan_->old_partition_path != install_plan_->partition_path &&
+      !install_plan_->old_partition_path.empty()) {
+    copy_size_ = manifest_.old_partition_info().size();
+    copy_offset_ = 0;
+  }
+
   kernel_performer_.SetBlockSize(manifest_.block_size());
   pcr_policy_performer_.SetBlockSize(manifest_.block_size());
   for (const InstallProcedure &proc : manifest_.procedures()) {
@@ -223,6 +293,8 @@ ActionExitCode PayloadProcessor::LoadManifest() {
 
   if (next_operation_num_ > 0)
     LOG(INFO) << "Resuming after " << next_operation_num_ << " operations";
+  if (install_plan_->differential_download)
+    PlanDifferentialDownload();
   LOG(INFO) << "Starting to apply update payload operations";
 
   return kActionCodeSuccess;
@@ -259,15 +331,38 @@ ActionExitCode PayloadProcessor::PerformOperation() {
     return kActionCodeDownloadOperationExecutionError;
   }
 
-  if (op->data_length() > buffer_.size())
+  // The data of a partition operation found on the disk isn't downloaded
+  // but rebuilt from there.
+  const DifferentialDownload::Source source =
+      proc == nullptr && differential_.get() ?
+      differential_->source(next_operation_num_) :
+      DifferentialDownload::kSourceDownload;
+  vector<char> local_data;
+  if (source != DifferentialDownload::kSourceDownload) {
+    if (!differential_->RebuildData(*op, next_operation_num_, &local_data)) {
+      LOG(ERROR) << "Unable to rebuild the data of operation "
+                 << next_operation_num_ << " from the disk";
+      // Download all of it the next time around.
+      prefs_->SetString(kPrefsDifferentialDownloadFailed,
+                        install_plan_->payload_hash);
+      return kActionCodeDownloadOperationHashMismatch;
+    }
+  } else if (op->data_length() > buffer_.size()) {
     return kActionCodeDownloadIncomplete;
+  }
 
   // Makes sure we unblock exit when this operation completes.
   ScopedTerminatorExitUnblocker exit_unblocker =
       ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
 
+  // The result of the operation is already in place on the target.
+  if (source == DifferentialDownload::kSourceTarget)
+    performer = nullptr;
+
   if (performer != nullptr) {
-    ActionExitCode error = performer->PerformOperation(*op, buffer_);
+    ActionExitCode error = performer->PerformOperation(
+        *op, source == DifferentialDownload::kSourceDownload ?
+        buffer_ : local_data);
     if (error != kActionCodeSuccess) {
       LOG(ERROR) << "Aborting install procedure at operation "
                  << next_operation_num_;
@@ -276,10 +371,14 @@ ActionExitCode PayloadProcessor::PerformOperation() {
   }
 
   buffer_offset_ += op->data_length();
-  DiscardBufferHeadBytes(op->data_length());
+  if (source == DifferentialDownload::kSourceDownload)
+    DiscardBufferHeadBytes(op->data_length());
+  else
+    hash_calculator_.Update(local_data.data(), local_data.size());
   next_operation_num_++;
 
-  LOG(INFO) << (performer?"Completed ":"Skipped ")
+  LOG(INFO) << (source != DifferentialDownload::kSourceDownload ? "Reused " :
+                performer ? "Completed " : "Skipped ")
             << next_operation_num_ << "/"
             << operations_.size() << " operations ("
             << (next_operation_num_ * 100 / operations_.size()) << "%)";
@@ -288,6 +387,61 @@ ActionExitCode PayloadProcessor::PerformOperation() {
   return kActionCodeSuccess;
 }
 
+uint64_t PayloadProcessor::DataSize() const {
+  return install_plan_->payload_size -
+      std::min(install_plan_->payload_size, manifest_metadata_size_);
+}
+
+void PayloadProcessor::PlanDifferentialDownload() {
+  if (!DifferentialDownload::CanUse(manifest_) || buffer_offset_ >= DataSize())
+    return;
+  string failed_hash;
+  if (prefs_->GetString(kPrefsDifferentialDownloadFailed, &failed_hash) &&
+      failed_hash == install_plan_->payload_hash) {
+    LOG(INFO) << "Downloading all of the payload, its data couldn't be "
+              << "rebuilt from the disk before";
+    return;
+  }
+
+  // Reading the local blocks may take a while, so it's done in steps from
+  // ContinueWork().
+  differential_.reset(new DifferentialDownload(
+      install_plan_->partition_path, install_plan_->old_partition_path));
+  if (!differential_->BeginPlan(manifest_, next_operation_num_))
+    differential_.reset();
+}
+
+void PayloadProcessor::FinishDifferentialDownload() {
+  if (differential_->reused_operations() == 0) {
+    differential_.reset();
+    return;
+  }
+  differential_->GetDownloadRanges(buffer_offset_, DataSize(),
+                                   &new_download_ranges_);
+  for (size_t i = 0; i < new_download_ranges_.size(); i++)
+    new_download_ranges_[i].first += manifest_metadata_size_;
+  download_ranges_changed_ = true;
+  // The data already written past the manifest is downloaded again if
+  // needed, and isn't part of the hash yet.
+  buffer_.clear();
+}
+
+bool PayloadProcessor::GetNewDownloadRanges(
+    vector<std::pair<uint64_t, uint64_t> >* ranges) {
+  if (!download_ranges_changed_)
+    return false;
+  download_ranges_changed_ = false;
+  ranges->swap(new_download_ranges_);
+  new_download_ranges_.clear();
+  return true;
+}
+
+std::chrono::microseconds PayloadProcessor::TakeIoDelay() {
+  return std::max(partition_performer_.TakeIoDelay(),
+                  std::max(kernel_performer_.TakeIoDelay(),
+                           pcr_policy_performer_.TakeIoDelay()));
+}
+
 bool PayloadProcessor::ExtractSignatureMessage(const vector<char>& data) {
   TEST_AND_RETURN_FALSE(manifest_.has_signatures_offset());
   TEST_AND_RETURN_FALSE(manifest_.has_signatures_size());
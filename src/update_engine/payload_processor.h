@@ -8,9 +8,14 @@
 
 #include <inttypes.h>
 
+#include <chrono>
 #include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "update_engine/delta_performer.h"
+#include "update_engine/differential_download.h"
 #include "update_engine/file_writer.h"
 #include "update_engine/install_plan.h"
 #include "update_engine/omaha_hash_calculator.h"
@@ -48,6 +53,13 @@ class PayloadProcessor : public FileWriter {
   // Wrapper around close. Returns 0 on success or -errno on error.
   int Close();
 
+  // Returns true if there's work to do before the data written so far, and
+  // any more, can be processed. The caller should hold back the download and
+  // call ContinueWork() from the main loop until this returns false.
+  // ContinueWork() returns false and sets |error| on failure.
+  bool HasPendingWork() const;
+  bool ContinueWork(ActionExitCode* error);
+
   // Verifies the downloaded payload against the signed hash included in the
   // payload, against the update check hash and size from the install_plan.
   // Returns kActionCodeSuccess on success, an error code on failure.  This
@@ -72,6 +84,19 @@ class PayloadProcessor : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  // With install_plan->differential_download set, the data of the
+  // operations whose result is found on the disk isn't downloaded. Once
+  // ContinueWork() has looked at it, this returns true, once, with the
+  // (offset, length) ranges of the payload that still need to be written
+  // in |ranges|. They start where the data written so far was consumed, and
+  // any other data written before them is discarded.
+  bool GetNewDownloadRanges(
+      std::vector<std::pair<uint64_t, uint64_t> >* ranges);
+
+  // Returns how long the caller should hold back the download to keep the
+  // partition I/O under install_plan->io_rate_limit, and resets it.
+  std::chrono::microseconds TakeIoDelay();
+
  private:
   // Parses the manifest and finishes any initialization that needs info from
   // the manifest. Result may be kActionCodeDownloadIncomplete.
@@ -80,6 +105,20 @@ class PayloadProcessor : public FileWriter {
   // Execute a single operation. Result may be kActionCodeDownloadIncomplete.
   ActionExitCode PerformOperation();
 
+  // Performs the operations whose data is in buffer_, then extracts the
+  // signatures once all are done. Returns false and sets |error| on failure.
+  bool PerformOperations(ActionExitCode* error);
+
+  // Starts looking for the operations whose data needn't be downloaded, if
+  // install_plan_->differential_download is set. Once ContinueWork() has
+  // looked at all of them, FinishDifferentialDownload() sets
+  // new_download_ranges_.
+  void PlanDifferentialDownload();
+  void FinishDifferentialDownload();
+
+  // The size of the data blobs and signatures, past the manifest.
+  uint64_t DataSize() const;
+
   // Verifies that the expected source hashes (if present) match the hash
   // for the current partition/files. Returns true if there're no expected
   // hash in the payload (e.g., if it's a new-style full update) or if the
@@ -128,6 +167,11 @@ class PayloadProcessor : public FileWriter {
   // Index of the next operation to perform in the manifest.
   size_t next_operation_num_;
 
+  // How much of the old partition ContinueWork() copies over the target
+  // before an in-place delta is applied, and how much it has copied so far.
+  uint64_t copy_size_;
+  uint64_t copy_offset_;
+
   // Flattened list of operations found in the manifest. For partition
   // operations the InstallProcedure is nullptr.
   std::vector<std::pair<const InstallProcedure*,
@@ -157,6 +201,12 @@ class PayloadProcessor : public FileWriter {
   // override with test keys.
   std::string public_key_path_;
 
+  // Where the data of the partition operations comes from, if not all of
+  // it is downloaded.
+  std::unique_ptr<DifferentialDownload> differential_;
+  std::vector<std::pair<uint64_t, uint64_t> > new_download_ranges_;
+  bool download_ranges_changed_;
+
   DISALLOW_COPY_AND_ASSIGN(PayloadProcessor);
 };
 
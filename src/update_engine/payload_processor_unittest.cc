@@ -366,6 +366,9 @@ static void GenerateDeltaFile(DeltaState *state) {
             full_update ? "" : state->a_kernel,
             state->b_kernel,
             "",  // pcr_policy
+            false,  // source_operations
+            false,  // pack_extents
+            4096,  // block_size
             state->delta_path,
             private_key,
             &state->metadata_size));
@@ -86,6 +86,12 @@ bool AddSignatureOpToPayload(const string& payload_path,
   // Updates the protobuf size.
   uint64_t size_be = htobe64(serialized_manifest.size());
   memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
+
+  // The signature may push the end of the data past what the payload's
+  // version can address.
+  uint64_t version_be = htobe64(DeltaMetadata::VersionForDataSize(
+      manifest.signatures_offset() + manifest.signatures_size()));
+  memcpy(&payload[kDeltaVersionOffset], &version_be, sizeof(version_be));
   LOG(INFO) << "Updated payload size: " << payload.size();
   out_payload->swap(payload);
   *out_metadata_size = serialized_manifest.size() + kProtobufOffset;
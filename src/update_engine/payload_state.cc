@@ -127,6 +127,7 @@ void PayloadState::UpdateFailed(ActionExitCode error) {
     case kActionCodeDownloadInvalidMetadataSignature:
     case kActionCodeDownloadOperationHashMissingError:
     case kActionCodeDownloadMetadataSignatureMissingError:
+    case kActionCodeUnsupportedPayloadVersion:
       IncrementUrlIndex();
       break;
 
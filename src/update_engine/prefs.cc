@@ -20,6 +20,8 @@ const char kPrefsCertificateReportToSendDownload[] =
 const char kPrefsCertificateReportToSendUpdate[] =
     "certificate-report-to-send-update";
 const char kPrefsDeltaUpdateFailures[] = "delta-update-failures";
+const char kPrefsDifferentialDownloadFailed[] =
+    "differential-download-failed";
 const char kPrefsManifestMetadataSize[] = "manifest-metadata-size";
 const char kPrefsPreviousVersion[] = "previous-version";
 const char kPrefsResumedUpdateFailures[] = "resumed-update-failures";
@@ -39,6 +41,7 @@ const char kPrefsCurrentUrlFailureCount[] = "current-url-failure-count";
 const char kPrefsBackoffExpiryTime[] = "backoff-expiry-time";
 const char kPrefsAlephVersion[] = "aleph-version";
 const char kPrefsFullResponse[] = "full-response";
+const char kPrefsMirrorSelection[] = "mirror-selection";
 
 bool Prefs::Init(const files::FilePath& prefs_dir) {
   prefs_dir_ = prefs_dir;
@@ -13,6 +13,7 @@ namespace chromeos_update_engine {
 extern const char kPrefsCertificateReportToSendDownload[];
 extern const char kPrefsCertificateReportToSendUpdate[];
 extern const char kPrefsDeltaUpdateFailures[];
+extern const char kPrefsDifferentialDownloadFailed[];
 extern const char kPrefsManifestMetadataSize[];
 extern const char kPrefsPreviousVersion[];
 extern const char kPrefsResumedUpdateFailures[];
@@ -30,6 +31,7 @@ extern const char kPrefsCurrentUrlFailureCount[];
 extern const char kPrefsBackoffExpiryTime[];
 extern const char kPrefsAlephVersion[];
 extern const char kPrefsFullResponse[];
+extern const char kPrefsMirrorSelection[];
 
 // The prefs interface allows access to a persistent preferences
 // store. The two reasons for providing this as an interface are
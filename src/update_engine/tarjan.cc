@@ -22,9 +22,11 @@ void TarjanAlgorithm::Execute(Vertex::Index vertex,
                               vector<Vertex::Index>* out) {
   stack_.clear();
   components_.clear();
+  frames_.clear();
   index_ = 0;
-  for (Graph::iterator it = graph->begin(); it != graph->end(); ++it)
-    it->index = it->lowlink = kInvalidIndex;
+  indexes_.assign(graph->size(), kInvalidIndex);
+  lowlinks_.assign(graph->size(), kInvalidIndex);
+  on_stack_.assign(graph->size(), false);
   required_vertex_ = vertex;
 
   Tarjan(vertex, graph);
@@ -32,39 +34,56 @@ void TarjanAlgorithm::Execute(Vertex::Index vertex,
     out->swap(components_[0]);
 }
 
-void TarjanAlgorithm::Tarjan(Vertex::Index vertex, Graph* graph) {
-  CHECK_EQ((*graph)[vertex].index, kInvalidIndex);
-  (*graph)[vertex].index = index_;
-  (*graph)[vertex].lowlink = index_;
+void TarjanAlgorithm::Visit(Vertex::Index vertex, const Graph& graph) {
+  CHECK_EQ(indexes_[vertex], kInvalidIndex);
+  indexes_[vertex] = index_;
+  lowlinks_[vertex] = index_;
   index_++;
   stack_.push_back(vertex);
-  for (Vertex::EdgeMap::iterator it = (*graph)[vertex].out_edges.begin();
-       it != (*graph)[vertex].out_edges.end(); ++it) {
-    Vertex::Index vertex_next = it->first;
-    if ((*graph)[vertex_next].index == kInvalidIndex) {
-      Tarjan(vertex_next, graph);
-      (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
-                                     (*graph)[vertex_next].lowlink);
-    } else if (utils::VectorContainsValue(stack_, vertex_next)) {
-      (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
-                                     (*graph)[vertex_next].index);
+  on_stack_[vertex] = true;
+  frames_.push_back(Frame(vertex, graph[vertex].out_edges.begin()));
+}
+
+void TarjanAlgorithm::Tarjan(Vertex::Index vertex, Graph* graph) {
+  Visit(vertex, *graph);
+  while (!frames_.empty()) {
+    Frame& frame = frames_.back();
+    const Vertex::Index current = frame.vertex;
+    if (frame.next_edge != (*graph)[current].out_edges.end()) {
+      Vertex::Index vertex_next = frame.next_edge->first;
+      ++frame.next_edge;
+      if (indexes_[vertex_next] == kInvalidIndex) {
+        // Descend; |current|'s lowlink is updated once |vertex_next|'s
+        // frame is popped below.
+        Visit(vertex_next, *graph);
+      } else if (on_stack_[vertex_next]) {
+        lowlinks_[current] = min(lowlinks_[current], indexes_[vertex_next]);
+      }
+      continue;
     }
-  }
-  if ((*graph)[vertex].lowlink == (*graph)[vertex].index) {
-    vector<Vertex::Index> component;
-    Vertex::Index other_vertex;
-    do {
-      other_vertex = stack_.back();
-      stack_.pop_back();
-      component.push_back(other_vertex);
-    } while (other_vertex != vertex && !stack_.empty());
-      
-    if (utils::VectorContainsValue(component, required_vertex_)) {
-      components_.resize(components_.size() + 1);
-      component.swap(components_.back());
+
+    // All out-edges of |current| have been explored.
+    if (lowlinks_[current] == indexes_[current]) {
+      vector<Vertex::Index> component;
+      Vertex::Index other_vertex;
+      do {
+        other_vertex = stack_.back();
+        stack_.pop_back();
+        on_stack_[other_vertex] = false;
+        component.push_back(other_vertex);
+      } while (other_vertex != current && !stack_.empty());
+
+      if (utils::VectorContainsValue(component, required_vertex_)) {
+        components_.resize(components_.size() + 1);
+        component.swap(components_.back());
+      }
+    }
+    frames_.pop_back();
+    if (!frames_.empty()) {
+      Vertex::Index parent = frames_.back().vertex;
+      lowlinks_[parent] = min(lowlinks_[parent], lowlinks_[current]);
     }
   }
 }
 
 }  // namespace chromeos_update_engine
-
@@ -12,6 +12,9 @@
 // in the graph. This implementation will only find the strongly connected
 // component containing the vertex passed in.
 
+// The depth first search is driven by an explicit stack rather than by
+// recursion so that very long dependency chains can't exhaust the call stack.
+
 #include <vector>
 #include "update_engine/graph_types.h"
 
@@ -26,12 +29,28 @@ class TarjanAlgorithm {
                Graph* graph,
                std::vector<Vertex::Index>* out);
  private:
+  // A vertex whose out-edges are being walked, and the next edge to follow.
+  struct Frame {
+    Frame(Vertex::Index vertex, Vertex::EdgeMap::const_iterator next_edge)
+        : vertex(vertex), next_edge(next_edge) {}
+    Vertex::Index vertex;
+    Vertex::EdgeMap::const_iterator next_edge;
+  };
+
   void Tarjan(Vertex::Index vertex, Graph* graph);
+  void Visit(Vertex::Index vertex, const Graph& graph);
 
   Vertex::Index index_;
   Vertex::Index required_vertex_;
   std::vector<Vertex::Index> stack_;
   std::vector<std::vector<Vertex::Index> > components_;
+
+  // Per-vertex state, indexed by vertex. Kept across calls to Execute() so
+  // repeated runs over the same graph don't reallocate.
+  std::vector<Vertex::Index> indexes_;
+  std::vector<Vertex::Index> lowlinks_;
+  std::vector<bool> on_stack_;
+  std::vector<Frame> frames_;
 };
 
 }  // namespace chromeos_update_engine
@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <utility>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
@@ -10,6 +13,7 @@
 #include "update_engine/utils.h"
 
 using std::make_pair;
+using std::min;
 using std::pair;
 using std::set;
 using std::string;
@@ -19,6 +23,77 @@ namespace chromeos_update_engine {
 
 class TarjanAlgorithmTest : public ::testing::Test {};
 
+namespace {
+
+const Vertex::Index kInvalidIndex = -1;
+
+// The original recursive implementation, used as a reference to check that
+// the iterative version finds exactly the same components in the same order.
+class RecursiveTarjan {
+ public:
+  void Execute(Vertex::Index vertex,
+               const Graph& graph,
+               vector<Vertex::Index>* out) {
+    index_ = 0;
+    required_vertex_ = vertex;
+    indexes_.assign(graph.size(), kInvalidIndex);
+    lowlinks_.assign(graph.size(), kInvalidIndex);
+    stack_.clear();
+    components_.clear();
+    Tarjan(vertex, graph);
+    if (!components_.empty())
+      out->swap(components_[0]);
+  }
+
+ private:
+  void Tarjan(Vertex::Index vertex, const Graph& graph) {
+    indexes_[vertex] = lowlinks_[vertex] = index_++;
+    stack_.push_back(vertex);
+    for (Vertex::EdgeMap::const_iterator it = graph[vertex].out_edges.begin();
+         it != graph[vertex].out_edges.end(); ++it) {
+      Vertex::Index next = it->first;
+      if (indexes_[next] == kInvalidIndex) {
+        Tarjan(next, graph);
+        lowlinks_[vertex] = min(lowlinks_[vertex], lowlinks_[next]);
+      } else if (utils::VectorContainsValue(stack_, next)) {
+        lowlinks_[vertex] = min(lowlinks_[vertex], indexes_[next]);
+      }
+    }
+    if (lowlinks_[vertex] == indexes_[vertex]) {
+      vector<Vertex::Index> component;
+      Vertex::Index other;
+      do {
+        other = stack_.back();
+        stack_.pop_back();
+        component.push_back(other);
+      } while (other != vertex && !stack_.empty());
+      if (utils::VectorContainsValue(component, required_vertex_)) {
+        components_.resize(components_.size() + 1);
+        component.swap(components_.back());
+      }
+    }
+  }
+
+  Vertex::Index index_;
+  Vertex::Index required_vertex_;
+  vector<Vertex::Index> indexes_;
+  vector<Vertex::Index> lowlinks_;
+  vector<Vertex::Index> stack_;
+  vector<vector<Vertex::Index> > components_;
+};
+
+// Builds a chain 0 -> 1 -> ... -> n-1, optionally closed into one big cycle.
+void MakeChain(Graph::size_type n, bool cycle, Graph* graph) {
+  graph->clear();
+  graph->resize(n);
+  for (Vertex::Index i = 0; i + 1 < n; i++)
+    (*graph)[i].out_edges.insert(make_pair(i + 1, EdgeProperties()));
+  if (cycle && n > 1)
+    (*graph)[n - 1].out_edges.insert(make_pair(0, EdgeProperties()));
+}
+
+}  // namespace {}
+
 TEST(TarjanAlgorithmTest, SimpleTest) {
   const Vertex::Index n_a = 0;
   const Vertex::Index n_b = 1;
@@ -77,4 +152,69 @@ TEST(TarjanAlgorithmTest, SimpleTest) {
   }
 }
 
+TEST(TarjanAlgorithmTest, MatchesRecursiveOnRandomGraphsTest) {
+  srand(42);
+  TarjanAlgorithm tarjan;
+  RecursiveTarjan reference;
+  for (int round = 0; round < 50; round++) {
+    const Graph::size_type kNodeCount = 1 + rand() % 60;
+    const int kEdgeCount = rand() % (3 * kNodeCount);
+    Graph graph(kNodeCount);
+    for (int e = 0; e < kEdgeCount; e++) {
+      graph[rand() % kNodeCount].out_edges.insert(
+          make_pair(rand() % kNodeCount, EdgeProperties()));
+    }
+    for (Vertex::Index i = 0; i < kNodeCount; i++) {
+      vector<Vertex::Index> expected;
+      vector<Vertex::Index> actual;
+      reference.Execute(i, graph, &expected);
+      tarjan.Execute(i, &graph, &actual);
+      EXPECT_EQ(expected, actual) << "round " << round << " vertex " << i;
+    }
+  }
+}
+
+TEST(TarjanAlgorithmTest, DeepChainTest) {
+  // Deep enough to overflow the stack with one frame per vertex.
+  const Graph::size_type kNodeCount = 1 << 17;
+  Graph graph;
+  TarjanAlgorithm tarjan;
+
+  MakeChain(kNodeCount, false, &graph);
+  {
+    vector<Vertex::Index> vertex_indexes;
+    tarjan.Execute(0, &graph, &vertex_indexes);
+    ASSERT_EQ(1, vertex_indexes.size());
+    EXPECT_EQ(0, vertex_indexes[0]);
+  }
+
+  MakeChain(kNodeCount, true, &graph);
+  {
+    vector<Vertex::Index> vertex_indexes;
+    tarjan.Execute(kNodeCount / 2, &graph, &vertex_indexes);
+    ASSERT_EQ(kNodeCount, vertex_indexes.size());
+    // Components are popped off the stack, so the DFS root comes last.
+    EXPECT_EQ(kNodeCount / 2, vertex_indexes.back());
+    EXPECT_EQ(kNodeCount / 2 - 1, vertex_indexes.front());
+  }
+}
+
+// Not run by default. Run with --gtest_also_run_disabled_tests to get
+// timings for very long synthetic chains.
+TEST(TarjanAlgorithmTest, DISABLED_ChainBenchmark) {
+  const Graph::size_type kNodeCount = 1000000;
+  Graph graph;
+  MakeChain(kNodeCount, true, &graph);
+
+  TarjanAlgorithm tarjan;
+  vector<Vertex::Index> vertex_indexes;
+  auto start = std::chrono::steady_clock::now();
+  tarjan.Execute(0, &graph, &vertex_indexes);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  EXPECT_EQ(kNodeCount, vertex_indexes.size());
+  LOG(INFO) << "Tarjan on " << kNodeCount << " vertex cycle: "
+            << utils::ToString(elapsed);
+}
+
 }  // namespace chromeos_update_engine
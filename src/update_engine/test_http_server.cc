@@ -8,11 +8,19 @@
 // handles very slow data transfers.
 
 // To use this, simply make an HTTP connection to localhost:port and
-// GET a url.
+// GET a url. The port is kServerPort unless given as the only argument, so
+// that several servers can run side by side. Connections are closed after
+// one response unless the url is prefixed with /keep-alive, in which case
+// further requests are served on the same connection until the client goes
+// quiet. A /latency/<ms> prefix sends the response body one window at a
+// time, waiting <ms> before each, like a TCP stream whose throughput is
+// bounded by its window and round trip time. Each connection is served by
+// its own thread.
 
 #include <errno.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +33,7 @@
 #include <string>
 #include <vector>
 
+#include <glib.h>
 #include <glog/logging.h>
 
 #include "strings/string_printf.h"
@@ -36,6 +45,12 @@
 // HTTP end-of-line delimiter; sorry, this needs to be a macro.
 #define EOL "\r\n"
 
+// How long a kept-alive connection may sit idle before it is closed.
+#define KEEP_ALIVE_TIMEOUT_MS 1000
+
+// Bytes sent per round trip for /latency/ requests.
+#define LATENCY_WINDOW_SIZE (16 * 1024)
+
 using std::min;
 using std::string;
 using std::vector;
@@ -62,14 +77,18 @@ bool EndsWith(const string& str, const string& search) {
 
 struct HttpRequest {
   HttpRequest()
-      : start_offset(0), end_offset(0), return_code(kHttpResponseOk) {}
+      : start_offset(0), end_offset(0), return_code(kHttpResponseOk),
+        latency_ms(0) {}
   string host;
   string url;
   off_t start_offset;
   off_t end_offset;  // non-inclusive, zero indicates unspecified.
   HttpResponseCode return_code;
+  int latency_ms;  // delay before each window of the payload, if non-zero.
 };
 
+// Reads and decodes one request. Returns false if the client closed the
+// connection before sending a complete request.
 bool ParseRequest(int fd, HttpRequest* request) {
   string headers;
   do {
@@ -79,6 +98,10 @@ bool ParseRequest(int fd, HttpRequest* request) {
       perror("read");
       exit(1);
     }
+    if (r == 0) {
+      LOG(INFO) << "connection closed by client";
+      return false;
+    }
     headers.append(buf, r);
   } while (!EndsWith(headers, EOL EOL));
 
@@ -339,6 +362,18 @@ ssize_t HandleGet(int fd, const HttpRequest& request, const size_t total_length,
       return -1;
     LOG(INFO) << ret << " payload bytes written (second chunk)";
     written += ret;
+  } else if (request.latency_ms > 0) {
+    for (off_t offset = start_offset; offset < static_cast<off_t>(end_offset);
+         offset += LATENCY_WINDOW_SIZE) {
+      usleep(request.latency_ms * 1000);
+      const off_t window_end = min(offset + LATENCY_WINDOW_SIZE,
+                                   static_cast<off_t>(end_offset));
+      if ((ret = WritePayload(fd, offset, window_end)) < 0)
+        return -1;
+      written += ret;
+    }
+    LOG(INFO) << (end_offset - start_offset) << " payload bytes written with "
+              << request.latency_ms << "ms latency";
   } else {
     if ((ret = WritePayload(fd, start_offset, end_offset)) < 0)
       return -1;
@@ -450,7 +485,7 @@ void HandleDefault(int fd, const HttpRequest& request) {
 // Break a URL into terms delimited by slashes.
 class UrlTerms {
  public:
-  UrlTerms(string &url, size_t num_terms) {
+  UrlTerms(const string &url, size_t num_terms) {
     // URL must be non-empty and start with a slash.
     CHECK_GT(url.size(), static_cast<size_t>(0));
     CHECK_EQ(url[0], '/');
@@ -479,11 +514,8 @@ class UrlTerms {
   std::vector<string> terms;
 };
 
-void HandleConnection(int fd) {
-  HttpRequest request;
-  ParseRequest(fd, &request);
-
-  string &url = request.url;
+void HandleRequest(int fd, const HttpRequest& request) {
+  const string& url = request.url;
   LOG(INFO) << "pid(" << getpid() <<  "): handling url " << url;
   if (url == "/quitquitquit") {
     HandleQuit(fd);
@@ -504,10 +536,43 @@ void HandleConnection(int fd) {
   } else {
     HandleDefault(fd, request);
   }
+}
+
+void HandleConnection(int fd) {
+  const string kKeepAlivePrefix = "/keep-alive";
+  const string kLatencyPrefix = "/latency/";
+  while (true) {
+    HttpRequest request;
+    if (!ParseRequest(fd, &request))
+      break;
+
+    bool keep_alive = StartsWith(request.url, kKeepAlivePrefix);
+    if (keep_alive)
+      request.url.erase(0, kKeepAlivePrefix.length());
+    if (StartsWith(request.url, kLatencyPrefix)) {
+      size_t end = request.url.find('/', kLatencyPrefix.length());
+      CHECK_NE(end, string::npos);
+      request.latency_ms = atoi(request.url.c_str() + kLatencyPrefix.length());
+      request.url.erase(0, end);
+    }
+    HandleRequest(fd, request);
+    if (!keep_alive)
+      break;
+
+    // Wait for the client to send another request on this connection.
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, KEEP_ALIVE_TIMEOUT_MS) <= 0)
+      break;
+  }
 
   close(fd);
 }
 
+gpointer HandleConnectionThread(gpointer data) {
+  HandleConnection(GPOINTER_TO_INT(data));
+  return NULL;
+}
+
 }  // namespace chromeos_update_engine
 
 using namespace chromeos_update_engine;
@@ -532,7 +597,13 @@ int main(int argc, char** argv) {
 
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(kServerPort);
+  int port = kServerPort;
+  if (argc > 1) {
+    port = atoi(argv[1]);
+    if (port <= 0 || port > 65535)
+      LOG(FATAL) << "invalid port " << argv[1];
+  }
+  server_addr.sin_port = htons(port);
 
   {
     // Get rid of "Address in use" error
@@ -559,7 +630,11 @@ int main(int argc, char** argv) {
     LOG(INFO) << "got past accept";
     if (client_fd < 0)
       LOG(FATAL) << "ERROR on accept";
-    HandleConnection(client_fd);
+    GThread* thread = g_thread_try_new("connection", HandleConnectionThread,
+                                       GINT_TO_POINTER(client_fd), NULL);
+    if (!thread)
+      LOG(FATAL) << "ERROR creating connection thread";
+    g_thread_unref(thread);
   }
   return 0;
 }
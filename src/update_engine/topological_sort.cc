@@ -3,39 +3,57 @@
 // found in the LICENSE file.
 
 #include "update_engine/topological_sort.h"
-#include <set>
+#include <utility>
 #include <vector>
 #include <glog/logging.h>
 
-using std::set;
+using std::make_pair;
+using std::pair;
 using std::vector;
 
 namespace chromeos_update_engine {
 
 namespace {
+typedef pair<Vertex::Index, Vertex::EdgeMap::const_iterator> VisitFrame;
+
+// Depth first post-order walk from |root| using an explicit stack, so very
+// deep graphs don't overflow the call stack.
 void TopologicalSortVisit(const Graph& graph,
-                          set<Vertex::Index>* visited_nodes,
+                          vector<bool>* visited_nodes,
+                          vector<VisitFrame>* frames,
                           vector<Vertex::Index>* nodes,
-                          Vertex::Index node) {
-  if (visited_nodes->find(node) != visited_nodes->end())
+                          Vertex::Index root) {
+  if ((*visited_nodes)[root])
     return;
 
-  visited_nodes->insert(node);
-  // Visit all children.
-  for (Vertex::EdgeMap::const_iterator it = graph[node].out_edges.begin();
-       it != graph[node].out_edges.end(); ++it) {
-    TopologicalSortVisit(graph, visited_nodes, nodes, it->first);
+  (*visited_nodes)[root] = true;
+  frames->push_back(make_pair(root, graph[root].out_edges.begin()));
+  while (!frames->empty()) {
+    VisitFrame& frame = frames->back();
+    if (frame.second != graph[frame.first].out_edges.end()) {
+      // Visit the next child.
+      Vertex::Index child = frame.second->first;
+      ++frame.second;
+      if (!(*visited_nodes)[child]) {
+        (*visited_nodes)[child] = true;
+        frames->push_back(make_pair(child, graph[child].out_edges.begin()));
+      }
+      continue;
+    }
+    // All children visited; visit this node.
+    nodes->push_back(frame.first);
+    frames->pop_back();
   }
-  // Visit this node.
-  nodes->push_back(node);
 }
 }  // namespace {}
 
 void TopologicalSort(const Graph& graph, vector<Vertex::Index>* out) {
-  set<Vertex::Index> visited_nodes;
+  vector<bool> visited_nodes(graph.size(), false);
+  vector<VisitFrame> frames;
+  out->reserve(out->size() + graph.size());
 
   for (Vertex::Index i = 0; i < graph.size(); i++) {
-    TopologicalSortVisit(graph, &visited_nodes, out, i);
+    TopologicalSortVisit(graph, &visited_nodes, &frames, out, i);
   }
 }
 
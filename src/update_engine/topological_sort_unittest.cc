@@ -2,13 +2,19 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <chrono>
+#include <cstdlib>
+#include <set>
 #include <utility>
 #include <vector>
+#include <glog/logging.h>
 #include <gtest/gtest.h>
 #include "update_engine/graph_types.h"
 #include "update_engine/topological_sort.h"
+#include "update_engine/utils.h"
 
 using std::make_pair;
+using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -32,6 +38,37 @@ bool IndexOf(const vector<T>& vect,
   }
   return false;
 }
+
+// The original recursive implementation, used as a reference to check that
+// the iterative version produces exactly the same order.
+void RecursiveVisit(const Graph& graph,
+                    set<Vertex::Index>* visited_nodes,
+                    vector<Vertex::Index>* nodes,
+                    Vertex::Index node) {
+  if (visited_nodes->find(node) != visited_nodes->end())
+    return;
+  visited_nodes->insert(node);
+  for (Vertex::EdgeMap::const_iterator it = graph[node].out_edges.begin();
+       it != graph[node].out_edges.end(); ++it) {
+    RecursiveVisit(graph, visited_nodes, nodes, it->first);
+  }
+  nodes->push_back(node);
+}
+
+void RecursiveTopologicalSort(const Graph& graph, vector<Vertex::Index>* out) {
+  set<Vertex::Index> visited_nodes;
+  for (Vertex::Index i = 0; i < graph.size(); i++)
+    RecursiveVisit(graph, &visited_nodes, out, i);
+}
+
+// Builds the chain n-1 -> n-2 -> ... -> 0, so the walk from vertex n-1 has
+// to descend through every other vertex.
+void MakeReverseChain(Graph::size_type n, Graph* graph) {
+  graph->clear();
+  graph->resize(n);
+  for (Vertex::Index i = 1; i < n; i++)
+    (*graph)[i].out_edges.insert(make_pair(i - 1, EdgeProperties()));
+}
 }  // namespace {}
 
 TEST(TopologicalSortTest, SimpleTest) {
@@ -77,4 +114,60 @@ TEST(TopologicalSortTest, SimpleTest) {
   }
 }
 
+TEST(TopologicalSortTest, MatchesRecursiveOnRandomGraphsTest) {
+  srand(7);
+  for (int round = 0; round < 50; round++) {
+    const Graph::size_type kNodeCount = 1 + rand() % 80;
+    const int kEdgeCount = rand() % (3 * kNodeCount);
+    Graph graph(kNodeCount);
+    // Only add edges from higher to lower vertices to keep the graph acyclic.
+    for (int e = 0; e < kEdgeCount; e++) {
+      Vertex::Index a = rand() % kNodeCount;
+      Vertex::Index b = rand() % kNodeCount;
+      if (a == b)
+        continue;
+      graph[std::max(a, b)].out_edges.insert(
+          make_pair(std::min(a, b), EdgeProperties()));
+    }
+    vector<Vertex::Index> expected;
+    vector<Vertex::Index> actual;
+    RecursiveTopologicalSort(graph, &expected);
+    TopologicalSort(graph, &actual);
+    EXPECT_EQ(expected, actual) << "round " << round;
+  }
+}
+
+TEST(TopologicalSortTest, DeepChainTest) {
+  // Deep enough to overflow the stack with one frame per vertex.
+  const Graph::size_type kNodeCount = 1 << 17;
+  Graph graph;
+  MakeReverseChain(kNodeCount, &graph);
+  // Vertex 0 is walked first; route it through the whole chain down to 1.
+  graph[0].out_edges.insert(make_pair(kNodeCount - 1, EdgeProperties()));
+  graph[1].out_edges.clear();
+
+  vector<Vertex::Index> sorted;
+  TopologicalSort(graph, &sorted);
+  ASSERT_EQ(kNodeCount, sorted.size());
+  EXPECT_EQ(1, sorted.front());
+  EXPECT_EQ(0, sorted.back());
+}
+
+// Not run by default. Run with --gtest_also_run_disabled_tests to get
+// timings for very long synthetic chains.
+TEST(TopologicalSortTest, DISABLED_ChainBenchmark) {
+  const Graph::size_type kNodeCount = 1000000;
+  Graph graph;
+  MakeReverseChain(kNodeCount, &graph);
+
+  vector<Vertex::Index> sorted;
+  auto start = std::chrono::steady_clock::now();
+  TopologicalSort(graph, &sorted);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  EXPECT_EQ(kNodeCount, sorted.size());
+  LOG(INFO) << "TopologicalSort on " << kNodeCount << " vertex chain: "
+            << utils::ToString(elapsed);
+}
+
 }  // namespace chromeos_update_engine
@@ -20,14 +20,18 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/dbus_service.h"
 #include "update_engine/download_action.h"
+#include "update_engine/file_http_fetcher.h"
 #include "update_engine/filesystem_copier_action.h"
 #include "update_engine/kernel_copier_action.h"
 #include "update_engine/kernel_verifier_action.h"
 #include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/mirror_http_fetcher.h"
 #include "update_engine/multi_range_http_fetcher.h"
 #include "update_engine/omaha_request_action.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
+#include "update_engine/p2p_server.h"
+#include "update_engine/parallel_range_http_fetcher.h"
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/pcr_policy_post_action.h"
 #include "update_engine/postinstall_runner_action.h"
@@ -47,6 +51,7 @@ using std::vector;
 namespace chromeos_update_engine {
 
 const int UpdateAttempter::kMaxDeltaUpdateFailures = 3;
+const int UpdateAttempter::kProbeConnections = 3;
 
 const char* kUpdateCompletedMarker =
     "/var/run/update_engine_autoupdate_completed";
@@ -112,6 +117,7 @@ UpdateAttempter::UpdateAttempter(SystemState* system_state,
       last_checked_time_(0),
       new_version_(kVersionZero),
       new_payload_size_(0),
+      download_rate_limit_overridden_(false),
       updated_boot_flags_(false),
       update_boot_flags_running_(false),
       start_action_processor_(false) {
@@ -170,6 +176,38 @@ bool UpdateAttempter::CalculateUpdateParams(bool interactive) {
     return false;
   }
 
+  if (!download_rate_limit_overridden_)
+    download_limiter_.set_limit(omaha_request_params_->download_rate_limit());
+  download_limiter_.set_full_speed_hours(
+      omaha_request_params_->full_speed_start_hour(),
+      omaha_request_params_->full_speed_end_hour());
+  if (download_limiter_.limit()) {
+    LOG(INFO) << "Limiting the download to " << download_limiter_.limit()
+              << " bytes/s";
+  }
+
+  payload_cache_.set_dir(omaha_request_params_->payload_cache_dir());
+  payload_cache_.set_max_size(
+      omaha_request_params_->payload_cache_size() ?
+      omaha_request_params_->payload_cache_size() :
+      PayloadCache::kDefaultMaxSize);
+
+  // Peers download the cached payloads from here.
+  const int p2p_port = omaha_request_params_->p2p_port();
+  const string p2p_address = omaha_request_params_->p2p_address();
+  if (p2p_port > 0 && payload_cache_.enabled()) {
+    if (!p2p_server_.serving() || p2p_server_.dir() != payload_cache_.dir() ||
+        p2p_server_.address() != p2p_address ||
+        p2p_server_.port() != p2p_port) {
+      p2p_server_.Stop();
+      LOG_IF(WARNING, !p2p_server_.Start(payload_cache_.dir(), p2p_address,
+                                         p2p_port))
+          << "Unable to serve payloads to peers on port " << p2p_port;
+    }
+  } else {
+    p2p_server_.Stop();
+  }
+
   DisableDeltaUpdateIfNeeded();
   return true;
 }
@@ -194,6 +232,7 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
       new OmahaResponseHandlerAction(system_state_));
   shared_ptr<FilesystemCopierAction> filesystem_copier_action(
       new FilesystemCopierAction(false));
+  filesystem_copier_action->set_hash_only(true);
   shared_ptr<KernelCopierAction> kernel_copier_action(new KernelCopierAction);
   shared_ptr<OmahaRequestAction> download_started_action(
       new OmahaRequestAction(system_state_,
@@ -202,11 +241,36 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                              new LibcurlHttpFetcher(),
                              false,
                              false));
-  LibcurlHttpFetcher* download_fetcher = new LibcurlHttpFetcher();
-  download_fetcher->set_check_certificate(CertificateChecker::kDownload);
-  download_fetcher->set_auth_credentials(
-      omaha_request_params_->download_user(),
-      omaha_request_params_->download_password());
+  vector<HttpFetcher*> download_fetchers;
+  for (int i = 0; i < omaha_request_params_->download_connections(); i++) {
+    LibcurlHttpFetcher* download_fetcher = new LibcurlHttpFetcher();
+    download_fetcher->set_check_certificate(CertificateChecker::kDownload);
+    download_fetcher->set_auth_credentials(
+        omaha_request_params_->download_user(),
+        omaha_request_params_->download_password());
+    download_fetcher->set_bandwidth_limiter(&download_limiter_);
+    download_fetchers.push_back(download_fetcher);
+  }
+  HttpFetcher* download_fetcher = download_fetchers.size() == 1 ?
+      download_fetchers[0] : new ParallelRangeHttpFetcher(download_fetchers);
+  if (omaha_request_params_->mirror_selection()) {
+    vector<HttpFetcher*> probe_fetchers;
+    for (int i = 0; i < kProbeConnections; i++) {
+      LibcurlHttpFetcher* probe_fetcher = new LibcurlHttpFetcher();
+      probe_fetcher->set_check_certificate(CertificateChecker::kDownload);
+      probe_fetcher->set_auth_credentials(
+          omaha_request_params_->download_user(),
+          omaha_request_params_->download_password());
+      probe_fetcher->set_bandwidth_limiter(&download_limiter_);
+      probe_fetchers.push_back(probe_fetcher);
+    }
+    MirrorHttpFetcher* mirror_fetcher =
+        new MirrorHttpFetcher(download_fetcher,
+                              new MirrorProber(probe_fetchers),
+                              prefs_);
+    mirror_fetcher->set_bandwidth_limiter(&download_limiter_);
+    download_fetcher = mirror_fetcher;
+  }
   shared_ptr<DownloadAction> download_action(
       new DownloadAction(prefs_,
                          new MultiRangeHttpFetcher(
@@ -233,6 +297,8 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                              false,
                              false));
 
+  response_handler_action->set_payload_cache(&payload_cache_);
+  download_action->set_payload_cache(&payload_cache_);
   download_action->set_delegate(this);
   response_handler_action_ = response_handler_action;
   download_action_ = download_action;
@@ -490,6 +556,13 @@ bool UpdateAttempter::GetStatus(int64_t* last_checked_time,
   return true;
 }
 
+void UpdateAttempter::SetDownloadRateLimit(uint64_t bytes_per_second) {
+  LOG(INFO) << "Setting the download rate limit to " << bytes_per_second
+            << " bytes/s";
+  download_limiter_.set_limit(bytes_per_second);
+  download_rate_limit_overridden_ = true;
+}
+
 void UpdateAttempter::UpdateBootFlags() {
   if (update_boot_flags_running_) {
     LOG(INFO) << "Update boot flags running, nothing to do.";
@@ -667,9 +740,25 @@ void UpdateAttempter::MarkDeltaUpdateFailure() {
 }
 
 void UpdateAttempter::SetupDownload() {
+  // A payload found on the local disk is read straight from there, with the
+  // same ranges as it would be downloaded.
+  if (FileHttpFetcher::IsFileUrl(
+          response_handler_action_->install_plan().download_url, NULL)) {
+    download_action_->set_http_fetcher(
+        new MultiRangeHttpFetcher(new FileHttpFetcher()));
+  }
   MultiRangeHttpFetcher* fetcher =
       dynamic_cast<MultiRangeHttpFetcher*>(download_action_->http_fetcher());
   fetcher->ClearRanges();
+  MirrorHttpFetcher* mirror_fetcher =
+      dynamic_cast<MirrorHttpFetcher*>(fetcher->base_fetcher());
+  if (mirror_fetcher) {
+    mirror_fetcher->set_mirror_urls(
+        response_handler_action_->install_plan().mirror_urls);
+  }
+  // Ranges with a known length can be downloaded over several connections.
+  const uint64_t payload_size =
+      response_handler_action_->install_plan().payload_size;
   if (response_handler_action_->install_plan().is_resume) {
     // Resuming an update so fetch the update manifest metadata first.
     int64_t manifest_metadata_size = 0;
@@ -681,9 +770,11 @@ void UpdateAttempter::SetupDownload() {
     int64_t next_data_offset = 0;
     prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
     uint64_t resume_offset = manifest_metadata_size + next_data_offset;
-    if (resume_offset < response_handler_action_->install_plan().payload_size) {
-      fetcher->AddRange(resume_offset);
+    if (resume_offset < payload_size) {
+      fetcher->AddRange(resume_offset, payload_size - resume_offset);
     }
+  } else if (payload_size > 0) {
+    fetcher->AddRange(0, payload_size);
   } else {
     fetcher->AddRange(0);
   }
@@ -17,10 +17,13 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/action_processor.h"
+#include "update_engine/bandwidth_limiter.h"
 #include "update_engine/dbus_interface.h"
 #include "update_engine/download_action.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
+#include "update_engine/p2p_server.h"
+#include "update_engine/payload_cache.h"
 #include "update_engine/system_state.h"
 
 struct UpdateEngineService;
@@ -55,6 +58,9 @@ class UpdateAttempter : public ActionProcessorDelegate,
  public:
   static const int kMaxDeltaUpdateFailures;
 
+  // Number of connections the payload mirrors are probed over in parallel.
+  static const int kProbeConnections;
+
   UpdateAttempter(SystemState* system_state,
                   DbusGlibInterface* dbus_iface);
   virtual ~UpdateAttempter() = default;
@@ -84,6 +90,11 @@ class UpdateAttempter : public ActionProcessorDelegate,
                  std::string* new_version,
                  int64_t* new_size);
 
+  // Limits the payload download to |bytes_per_second|, zero meaning no
+  // limit, overriding DOWNLOAD_RATE_LIMIT from update.conf until the daemon
+  // restarts. Takes effect immediately, even on a download in progress.
+  void SetDownloadRateLimit(uint64_t bytes_per_second);
+
   // Runs coreos-setgootroot, whose responsibility it is to mark the
   // currently booted partition has high priority/permanent/etc. The execution
   // is asynchronous. On completion, the action processor may be started
@@ -252,6 +263,19 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Common parameters for all Omaha requests.
   OmahaRequestParams* omaha_request_params_;
 
+  // Shared by all the payload download connections.
+  BandwidthLimiter download_limiter_;
+
+  // True once the download rate limit has been set over D-Bus, in which case
+  // the one from update.conf is ignored.
+  bool download_rate_limit_overridden_;
+
+  // Downloaded payloads, kept so later attempts can read them from the disk.
+  PayloadCache payload_cache_;
+
+  // Serves the cached payloads to peers, if P2P_PORT is set.
+  P2PServer p2p_server_;
+
   // Originally, both of these flags are false. Once UpdateBootFlags is called,
   // |update_boot_flags_running_| is set to true. As soon as UpdateBootFlags
   // completes its asynchronous run, |update_boot_flags_running_| is reset to
@@ -10,6 +10,7 @@
 #include <glog/logging.h>
 
 #include "update_engine/marshal.glibmarshal.h"
+#include "update_engine/bandwidth_limiter.h"
 #include "update_engine/dbus_constants.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/utils.h"
@@ -18,6 +19,7 @@ extern "C" {
 #include "update_engine/update_engine.dbusclient.h"
 }
 
+using chromeos_update_engine::BandwidthLimiter;
 using chromeos_update_engine::kUpdateEngineServiceName;
 using chromeos_update_engine::kUpdateEngineServicePath;
 using chromeos_update_engine::kUpdateEngineServiceInterface;
@@ -31,6 +33,9 @@ DEFINE_bool(update, false, "Forces an update and waits for its completion. "
             "Exit status is 0 if the update succeeded, and 1 otherwise.");
 DEFINE_bool(watch_for_updates, false,
             "Listen for status updates and print them to the screen.");
+DEFINE_string(download_rate_limit, "",
+              "Limits the update download to this many bytes per second, "
+              "optionally suffixed with K, M or G; 0 lifts the limit.");
 
 namespace {
 
@@ -96,6 +101,20 @@ bool ResetStatus() {
   return rc;
 }
 
+bool SetDownloadRateLimit(uint64_t bytes_per_second) {
+  DBusGProxy* proxy;
+  GError* error = NULL;
+
+  CHECK(GetProxy(&proxy));
+
+  gboolean rc = com_coreos_update1_Manager_set_download_rate_limit(
+      proxy, bytes_per_second, &error);
+  if (rc == FALSE) {
+    LOG(ERROR) << "Error setting the download rate limit: "
+               << GetAndFreeGError(&error);
+  }
+  return rc;
+}
 
 // If |op| is non-NULL, sets it to the current operation string or an
 // empty string if unable to obtain the current status.
@@ -237,6 +256,23 @@ int main(int argc, char** argv) {
   }
 
 
+  if (!FLAGS_download_rate_limit.empty()) {
+    uint64_t bytes_per_second = 0;
+    if (!BandwidthLimiter::ParseRate(FLAGS_download_rate_limit,
+                                     &bytes_per_second)) {
+      LOG(ERROR) << "Invalid download rate limit: "
+                 << FLAGS_download_rate_limit;
+      return 1;
+    }
+    if (!SetDownloadRateLimit(bytes_per_second)) {
+      LOG(ERROR) << "SetDownloadRateLimit failed.";
+      return 1;
+    }
+    LOG(INFO) << "Download rate limit set to " << bytes_per_second
+              << " bytes/s.";
+    return 0;
+  }
+
   if (FLAGS_status) {
     LOG(INFO) << "Querying Update Engine status...";
     if (!GetStatus(NULL)) {
@@ -4,11 +4,14 @@
 
 #include "update_engine/utils.h"
 
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -20,6 +23,7 @@
 
 #include <algorithm>
 #include <chrono>
+#include <limits>
 #include <ratio>
 #include <sstream>
 
@@ -137,6 +141,37 @@ bool PWriteAll(int fd, const void* buf, size_t count, off_t offset) {
   return true;
 }
 
+bool ZeroRange(int fd, off_t offset, off_t length) {
+  struct stat stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+  if (S_ISBLK(stbuf.st_mode)) {
+    uint64_t range[2] = { static_cast<uint64_t>(offset),
+                          static_cast<uint64_t>(length) };
+    if (HANDLE_EINTR(ioctl(fd, BLKZEROOUT, range)) == 0)
+      return true;
+    PLOG(WARNING) << "BLKZEROOUT failed, writing zeros instead";
+  } else if (S_ISREG(stbuf.st_mode)) {
+    // Extending the file leaves a hole, which reads as zeros.
+    if (offset + length > stbuf.st_size)
+      TEST_AND_RETURN_FALSE_ERRNO(ftruncate(fd, offset + length) == 0);
+    const off_t end = min(offset + length, stbuf.st_size);
+    if (offset >= end ||
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  end - offset) == 0) {
+      return true;
+    }
+    PLOG(WARNING) << "Unable to punch a hole, writing zeros instead";
+  }
+
+  static const vector<char> zeros(1024 * 1024);
+  for (off_t done = 0; done < length; ) {
+    const size_t count = min(static_cast<off_t>(zeros.size()), length - done);
+    TEST_AND_RETURN_FALSE(PWriteAll(fd, zeros.data(), count, offset + done));
+    done += count;
+  }
+  return true;
+}
+
 bool PReadAll(int fd, void* buf, size_t count, off_t offset,
               ssize_t* out_bytes_read) {
   char* c_buf = static_cast<char*>(buf);
@@ -533,6 +568,43 @@ string FormatSecs(unsigned secs) {
   return ToString(std::chrono::seconds(secs));
 }
 
+bool ParseSize(const string& str, uint64_t* size) {
+  if (str.empty() || !isdigit(str[0]))
+    return false;
+  errno = 0;
+  char* end = NULL;
+  uint64_t value = strtoull(str.c_str(), &end, 10);
+  if (errno == ERANGE)
+    return false;
+  int shift = 0;
+  switch (toupper(*end)) {
+    case 'T':
+      shift = 40;
+      break;
+    case 'G':
+      shift = 30;
+      break;
+    case 'M':
+      shift = 20;
+      break;
+    case 'K':
+      shift = 10;
+      break;
+    default:
+      break;
+  }
+  if (shift) {
+    if (value > (std::numeric_limits<uint64_t>::max() >> shift))
+      return false;
+    value <<= shift;
+    end++;
+  }
+  if (*end != '\0')
+    return false;
+  *size = value;
+  return true;
+}
+
 string ToString(std::chrono::microseconds delta) {
   using std::chrono::duration_cast;
 
@@ -700,6 +772,8 @@ string CodeToString(ActionExitCode code) {
       return "kActionCodeNewPCRPolicyHTTPError";
     case kActionCodeRollbackError:
       return "kActionCodeRollbackError";
+    case kActionCodeUnsupportedPayloadVersion:
+      return "kActionCodeUnsupportedPayloadVersion";
     case kActionCodeDownloadIncomplete:
       return "kActionCodeDownloadIncomplete";
     case kActionCodeOmahaRequestHTTPResponseBase:
@@ -53,6 +53,12 @@ bool WriteFile(const char* path, const char* data, int data_len);
 bool WriteAll(int fd, const void* buf, size_t count);
 bool PWriteAll(int fd, const void* buf, size_t count, off_t offset);
 
+// Zeroes |length| bytes of |fd| at |offset| without writing them out where
+// the kernel can, with BLKZEROOUT on block devices, which thin-provisioned
+// ones may unmap, and by punching a hole in regular files. Falls back to
+// writing zeros. Returns true on success.
+bool ZeroRange(int fd, off_t offset, off_t length);
+
 // Calls pread() repeatedly until count bytes are read, or EOF is reached.
 // Returns number of bytes read in *bytes_read. Returns true on success.
 bool PReadAll(int fd, void* buf, size_t count, off_t offset,
@@ -222,6 +228,11 @@ std::string FormatSecs(unsigned secs);
 // when applicable.
 std::string ToString(std::chrono::microseconds delta);
 
+// Parses a size in bytes with an optional K, M, G or T (binary) suffix,
+// e.g., "512M", into |size|. Returns false if |str| isn't one or the size
+// doesn't fit in 64 bits.
+bool ParseSize(const std::string& str, uint64_t* size);
+
 // This method transforms the given error code to be suitable for
 // error classification purposes by removing the higher order bits and
 // aggregating error codes beyond the enum range, etc. This method is
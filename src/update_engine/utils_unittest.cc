@@ -220,4 +220,28 @@ TEST(UtilsTest, DurationToStringTest) {
   EXPECT_EQ("23h59m59s", utils::ToString(seconds(86399)));
 }
 
+TEST(UtilsTest, ParseSizeTest) {
+  uint64_t size = 0;
+  EXPECT_TRUE(utils::ParseSize("0", &size));
+  EXPECT_EQ(0, size);
+  EXPECT_TRUE(utils::ParseSize("4096", &size));
+  EXPECT_EQ(4096, size);
+  EXPECT_TRUE(utils::ParseSize("512k", &size));
+  EXPECT_EQ(512 * 1024, size);
+  EXPECT_TRUE(utils::ParseSize("2G", &size));
+  EXPECT_EQ(2ULL * 1024 * 1024 * 1024, size);
+  EXPECT_TRUE(utils::ParseSize("16777215T", &size));
+  EXPECT_EQ(16777215ULL << 40, size);
+  EXPECT_TRUE(utils::ParseSize("18446744073709551615", &size));
+  EXPECT_EQ(18446744073709551615ULL, size);
+
+  EXPECT_FALSE(utils::ParseSize("", &size));
+  EXPECT_FALSE(utils::ParseSize("-1", &size));
+  EXPECT_FALSE(utils::ParseSize("M", &size));
+  EXPECT_FALSE(utils::ParseSize("10MB", &size));
+  EXPECT_FALSE(utils::ParseSize("16777216T", &size));
+  EXPECT_FALSE(utils::ParseSize("18446744073709551616", &size));
+  EXPECT_FALSE(utils::ParseSize("99999999999999999999K", &size));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,100 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/xz.h"
+
+#include <algorithm>
+
+#include <lzma.h>
+
+#include "update_engine/utils.h"
+
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The decoder allocates a dictionary as large as the encoder used, so it's
+// kept no larger than the data.
+const uint32_t kPreset = 9 | LZMA_PRESET_EXTREME;
+const uint32_t kMinDictSize = 4096;
+
+bool XzDecompressData(const char* in, size_t in_size, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+
+  lzma_stream stream = LZMA_STREAM_INIT;
+  TEST_AND_RETURN_FALSE(lzma_stream_decoder(&stream, UINT64_MAX, 0) ==
+                        LZMA_OK);
+  stream.next_in = reinterpret_cast<const uint8_t*>(in);
+  stream.avail_in = in_size;
+  vector<char> buffer(1024 * 1024);
+  lzma_ret rc = LZMA_OK;
+  while (rc == LZMA_OK) {
+    stream.next_out = reinterpret_cast<uint8_t*>(buffer.data());
+    stream.avail_out = buffer.size();
+    rc = lzma_code(&stream, LZMA_FINISH);
+    out->insert(out->end(), buffer.data(),
+                buffer.data() + buffer.size() - stream.avail_out);
+  }
+  lzma_end(&stream);
+  if (rc != LZMA_STREAM_END) {
+    LOG(ERROR) << "xz decompression failed: " << rc;
+    return false;
+  }
+  return true;
+}
+
+bool XzCompressData(const char* in, size_t in_size, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+
+  lzma_options_lzma options;
+  TEST_AND_RETURN_FALSE(!lzma_lzma_preset(&options, kPreset));
+  options.dict_size = min(options.dict_size,
+                          max(kMinDictSize, static_cast<uint32_t>(in_size)));
+  lzma_filter filters[] = {
+    { LZMA_FILTER_LZMA2, &options },
+    { LZMA_VLI_UNKNOWN, NULL },
+  };
+  out->resize(lzma_stream_buffer_bound(in_size));
+  size_t out_pos = 0;
+  // The payload has its own hashes, so the stream doesn't need a check.
+  lzma_ret rc = lzma_stream_buffer_encode(
+      filters, LZMA_CHECK_NONE, NULL, reinterpret_cast<const uint8_t*>(in),
+      in_size, reinterpret_cast<uint8_t*>(out->data()), &out_pos,
+      out->size());
+  if (rc != LZMA_OK) {
+    LOG(ERROR) << "xz compression failed: " << rc;
+    return false;
+  }
+  out->resize(out_pos);
+  return true;
+}
+}  // namespace {}
+
+bool XzDecompress(const vector<char>& in, vector<char>* out) {
+  return XzDecompressData(in.data(), in.size(), out);
+}
+
+bool XzCompress(const vector<char>& in, vector<char>* out) {
+  return XzCompressData(in.data(), in.size(), out);
+}
+
+bool XzCompressString(const string& str, vector<char>* out) {
+  return XzCompressData(str.data(), str.size(), out);
+}
+
+bool XzDecompressString(const string& str, vector<char>* out) {
+  return XzDecompressData(str.data(), str.size(), out);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,21 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_H__
+
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// XZ (LZMA2) compresses or decompresses str/in to out.
+bool XzDecompress(const std::vector<char>& in, std::vector<char>* out);
+bool XzCompress(const std::vector<char>& in, std::vector<char>* out);
+bool XzCompressString(const std::string& str, std::vector<char>* out);
+bool XzDecompressString(const std::string& str, std::vector<char>* out);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_H__
@@ -0,0 +1,56 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/xz_extent_writer.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const vector<char>::size_type kOutputBufferLength = 1024 * 1024;
+}
+
+XzExtentWriter::~XzExtentWriter() {
+  lzma_end(&stream_);
+}
+
+bool XzExtentWriter::Init(int fd,
+                          const vector<Extent>& extents,
+                          uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(lzma_stream_decoder(&stream_, UINT64_MAX, 0) ==
+                        LZMA_OK);
+  output_buffer_.resize(kOutputBufferLength);
+  return next_->Init(fd, extents, block_size);
+}
+
+bool XzExtentWriter::Write(const void* bytes, size_t count) {
+  stream_.next_in = reinterpret_cast<const uint8_t*>(bytes);
+  stream_.avail_in = count;
+  while (!stream_end_) {
+    stream_.next_out = reinterpret_cast<uint8_t*>(&output_buffer_[0]);
+    stream_.avail_out = output_buffer_.size();
+    lzma_ret rc = lzma_code(&stream_, LZMA_RUN);
+    if (rc != LZMA_OK && rc != LZMA_STREAM_END) {
+      LOG(ERROR) << "xz decompression failed: " << rc;
+      return false;
+    }
+    stream_end_ = rc == LZMA_STREAM_END;
+    const size_t length = output_buffer_.size() - stream_.avail_out;
+    if (length)
+      TEST_AND_RETURN_FALSE(next_->Write(&output_buffer_[0], length));
+    if (stream_.avail_in == 0 && stream_.avail_out != 0)
+      break;  // no more input to process
+  }
+  // Nothing may follow the end of the stream.
+  TEST_AND_RETURN_FALSE(stream_.avail_in == 0);
+  return true;
+}
+
+bool XzExtentWriter::EndImpl() {
+  TEST_AND_RETURN_FALSE(stream_end_);
+  return next_->End();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,38 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_EXTENT_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_EXTENT_WRITER_H__
+
+#include <vector>
+#include <lzma.h>
+#include "update_engine/extent_writer.h"
+#include "update_engine/utils.h"
+
+// XzExtentWriter is a concrete ExtentWriter subclass that xz-decompresses
+// what it's given in Write. It passes the decompressed data to an underlying
+// ExtentWriter.
+
+namespace chromeos_update_engine {
+
+class XzExtentWriter : public ExtentWriter {
+ public:
+  XzExtentWriter(ExtentWriter* next)
+      : next_(next), stream_(), stream_end_(false) {}
+  ~XzExtentWriter();
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size);
+  bool Write(const void* bytes, size_t count);
+  bool EndImpl();
+
+ private:
+  ExtentWriter* const next_;  // The underlying ExtentWriter.
+  lzma_stream stream_;  // the liblzma stream, zeroed like LZMA_STREAM_INIT
+  std::vector<char> output_buffer_;
+  bool stream_end_;  // whether all of the stream was decoded
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_XZ_EXTENT_WRITER_H__
@@ -2,17 +2,25 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <gtest/gtest.h>
 
 #include "update_engine/bzip.h"
+#include "update_engine/bzip_extent_writer.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
+#include "update_engine/xz.h"
+#include "update_engine/xz_extent_writer.h"
+#include "update_engine/zstd.h"
+#include "update_engine/zstd_extent_writer.h"
 
 using std::string;
 using std::vector;
@@ -30,6 +38,7 @@ class ZipTest : public ::testing::Test {
                          std::vector<char>* out) const = 0;
   bool ZipDecompressString(const std::string& str,
                            std::vector<char>* out) const = 0;
+  ExtentWriter* NewExtentWriter(ExtentWriter* next) const = 0;
 };
 
 class BzipTest {};
@@ -53,9 +62,64 @@ class ZipTest<BzipTest> : public ::testing::Test {
                            std::vector<char>* out) const {
     return BzipDecompressString(str, out);
   }
+  ExtentWriter* NewExtentWriter(ExtentWriter* next) const {
+    return new BzipExtentWriter(next);
+  }
 };
 
-typedef ::testing::Types<BzipTest> ZipTestTypes;
+class ZstdTest {};
+
+template <>
+class ZipTest<ZstdTest> : public ::testing::Test {
+ public:
+  bool ZipDecompress(const std::vector<char>& in,
+                     std::vector<char>* out) const {
+    return ZstdDecompress(in, out);
+  }
+  bool ZipCompress(const std::vector<char>& in,
+                   std::vector<char>* out) const {
+    return ZstdCompress(in, out);
+  }
+  bool ZipCompressString(const std::string& str,
+                         std::vector<char>* out) const {
+    return ZstdCompressString(str, out);
+  }
+  bool ZipDecompressString(const std::string& str,
+                           std::vector<char>* out) const {
+    return ZstdDecompressString(str, out);
+  }
+  ExtentWriter* NewExtentWriter(ExtentWriter* next) const {
+    return new ZstdExtentWriter(next);
+  }
+};
+
+class XzTest {};
+
+template <>
+class ZipTest<XzTest> : public ::testing::Test {
+ public:
+  bool ZipDecompress(const std::vector<char>& in,
+                     std::vector<char>* out) const {
+    return XzDecompress(in, out);
+  }
+  bool ZipCompress(const std::vector<char>& in,
+                   std::vector<char>* out) const {
+    return XzCompress(in, out);
+  }
+  bool ZipCompressString(const std::string& str,
+                         std::vector<char>* out) const {
+    return XzCompressString(str, out);
+  }
+  bool ZipDecompressString(const std::string& str,
+                           std::vector<char>* out) const {
+    return XzDecompressString(str, out);
+  }
+  ExtentWriter* NewExtentWriter(ExtentWriter* next) const {
+    return new XzExtentWriter(next);
+  }
+};
+
+typedef ::testing::Types<BzipTest, ZstdTest, XzTest> ZipTestTypes;
 TYPED_TEST_CASE(ZipTest, ZipTestTypes);
 
 
@@ -107,4 +171,63 @@ TYPED_TEST(ZipTest, EmptyInputsTest) {
   EXPECT_EQ(0, out.size());
 }
 
+TYPED_TEST(ZipTest, TruncatedTest) {
+  vector<char> in(64 * 1024);
+  FillWithData(&in);
+  vector<char> out;
+  EXPECT_TRUE(this->ZipCompress(in, &out));
+  out.resize(out.size() / 2);
+  vector<char> decompressed;
+  EXPECT_FALSE(this->ZipDecompress(out, &decompressed));
+}
+
+// Logs how fast each compressor's ExtentWriter decodes data that compresses
+// about as well as a filesystem image, which is what the payload generator
+// weighs against the size of the data (see NominalDecodeRate() and
+// LoadApplyCostTable()).
+TYPED_TEST(ZipTest, DecodeThroughputTest) {
+  // The lengths are given, as some of the words hold NULs.
+  const string kWords[] = {
+    "update", "engine", "payload", "\n", string("\0\0\0\0", 4),
+    "/usr/lib64/", "\x7f" "ELF", "flatcar", "operation", "\xff\xfe",
+    "kernel", " ",
+  };
+  const size_t kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+  const size_t kSize = 4 * 1024 * 1024;
+  string in;
+  uint32_t seed = 1;
+  while (in.size() < kSize) {
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 4 == 0)
+      in += static_cast<char>(seed >> 24);  // some noise
+    else
+      in += kWords[(seed >> 16) % kNumWords];
+  }
+  // Whole blocks, to fill the extent written to exactly.
+  in.resize(kSize);
+  vector<char> compressed;
+  EXPECT_TRUE(this->ZipCompressString(in, &compressed));
+
+  // Only the decoding is timed.
+  int fd = open("/dev/null", O_WRONLY);
+  ASSERT_GE(fd, 0);
+  vector<Extent> extents(1);
+  extents[0].set_start_block(0);
+  extents[0].set_num_blocks(kSize / 4096);
+  DirectExtentWriter direct_writer;
+  std::unique_ptr<ExtentWriter> writer(
+      this->NewExtentWriter(&direct_writer));
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  EXPECT_TRUE(writer->Init(fd, extents, 4096));
+  EXPECT_TRUE(writer->Write(compressed.data(), compressed.size()));
+  EXPECT_TRUE(writer->End());
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  close(fd);
+  LOG(INFO) << "Decoded " << compressed.size() << " bytes into "
+            << in.size() << " at " << in.size() / 1048576.0 / seconds
+            << " MiB/s";
+}
+
 }  // namespace chromeos_update_engine
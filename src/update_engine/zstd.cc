@@ -0,0 +1,143 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/zstd.h"
+
+#include <zstd.h>
+
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The decoder only needs a window as large as the data, which the encoder
+// picks by itself as it knows the size up front.
+const int kCompressionLevel = 19;
+
+// Frames are decoded with |prefix| as their dictionary if it's not NULL.
+bool ZstdDecompressData(const char* in, size_t in_size,
+                        const vector<char>* prefix, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+
+  ZSTD_DStream* stream = ZSTD_createDStream();
+  TEST_AND_RETURN_FALSE(stream);
+  ZSTD_inBuffer input = { in, in_size, 0 };
+  vector<char> buffer(ZSTD_DStreamOutSize());
+  size_t rc = 0;
+  if (prefix) {
+    rc = ZSTD_DCtx_setParameter(stream, ZSTD_d_windowLogMax,
+                                kZstdDiffWindowLogMax);
+    if (!ZSTD_isError(rc))
+      rc = ZSTD_DCtx_refPrefix(stream, prefix->data(), prefix->size());
+    if (ZSTD_isError(rc)) {
+      LOG(ERROR) << "Unable to set up the zstd dictionary: "
+                 << ZSTD_getErrorName(rc);
+      ZSTD_freeDStream(stream);
+      return false;
+    }
+  }
+  // The decoder may still hold output back once the input is consumed, until
+  // it reports the end of the frame.
+  bool output_full = false;
+  while (input.pos < input.size || (output_full && rc != 0)) {
+    ZSTD_outBuffer output = { buffer.data(), buffer.size(), 0 };
+    rc = ZSTD_decompressStream(stream, &output, &input);
+    if (ZSTD_isError(rc))
+      break;
+    out->insert(out->end(), buffer.data(), buffer.data() + output.pos);
+    output_full = output.pos == output.size;
+  }
+  ZSTD_freeDStream(stream);
+  if (ZSTD_isError(rc)) {
+    LOG(ERROR) << "zstd decompression failed: " << ZSTD_getErrorName(rc);
+    return false;
+  }
+  // A non-zero hint means the frame was cut short.
+  TEST_AND_RETURN_FALSE(rc == 0);
+  return true;
+}
+
+bool ZstdCompressData(const char* in, size_t in_size, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in_size == 0)
+    return true;
+  out->resize(ZSTD_compressBound(in_size));
+  size_t rc = ZSTD_compress(out->data(), out->size(), in, in_size,
+                            kCompressionLevel);
+  if (ZSTD_isError(rc)) {
+    LOG(ERROR) << "zstd compression failed: " << ZSTD_getErrorName(rc);
+    return false;
+  }
+  out->resize(rc);
+  return true;
+}
+}  // namespace {}
+
+bool ZstdDecompress(const vector<char>& in, vector<char>* out) {
+  return ZstdDecompressData(in.data(), in.size(), NULL, out);
+}
+
+bool ZstdCompress(const vector<char>& in, vector<char>* out) {
+  return ZstdCompressData(in.data(), in.size(), out);
+}
+
+bool ZstdCompressString(const string& str, vector<char>* out) {
+  return ZstdCompressData(str.data(), str.size(), out);
+}
+
+bool ZstdDecompressString(const string& str, vector<char>* out) {
+  return ZstdDecompressData(str.data(), str.size(), NULL, out);
+}
+
+bool ZstdDiff(const vector<char>& old_data,
+              const vector<char>& new_data,
+              vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  TEST_AND_RETURN_FALSE(old_data.size() + new_data.size() <= kZstdDiffMaxSize);
+  int window_log = 10;  // the smallest zstd allows
+  while ((1ULL << window_log) < old_data.size() + new_data.size())
+    window_log++;
+
+  ZSTD_CCtx* ctx = ZSTD_createCCtx();
+  TEST_AND_RETURN_FALSE(ctx);
+  out->resize(ZSTD_compressBound(new_data.size()));
+  size_t rc = ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel,
+                                     kCompressionLevel);
+  if (!ZSTD_isError(rc))
+    rc = ZSTD_CCtx_setParameter(ctx, ZSTD_c_enableLongDistanceMatching, 1);
+  if (!ZSTD_isError(rc))
+    rc = ZSTD_CCtx_setParameter(ctx, ZSTD_c_windowLog, window_log);
+  // Patching other old data than the diff was made from doesn't fail by
+  // itself, it has to be caught by the checksum.
+  if (!ZSTD_isError(rc))
+    rc = ZSTD_CCtx_setParameter(ctx, ZSTD_c_checksumFlag, 1);
+  if (!ZSTD_isError(rc))
+    rc = ZSTD_CCtx_refPrefix(ctx, old_data.data(), old_data.size());
+  if (!ZSTD_isError(rc)) {
+    rc = ZSTD_compress2(ctx, out->data(), out->size(), new_data.data(),
+                        new_data.size());
+  }
+  ZSTD_freeCCtx(ctx);
+  if (ZSTD_isError(rc)) {
+    LOG(ERROR) << "zstd diff failed: " << ZSTD_getErrorName(rc);
+    return false;
+  }
+  out->resize(rc);
+  return true;
+}
+
+bool ZstdPatch(const vector<char>& old_data,
+               const vector<char>& diff,
+               vector<char>* out) {
+  return ZstdDecompressData(diff.data(), diff.size(), &old_data, out);
+}
+
+}  // namespace chromeos_update_engine
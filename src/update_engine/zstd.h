@@ -0,0 +1,40 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ZSTD_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ZSTD_H__
+
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// Zstandard compresses or decompresses str/in to out.
+bool ZstdDecompress(const std::vector<char>& in, std::vector<char>* out);
+bool ZstdCompress(const std::vector<char>& in, std::vector<char>* out);
+bool ZstdCompressString(const std::string& str, std::vector<char>* out);
+bool ZstdDecompressString(const std::string& str, std::vector<char>* out);
+
+// A diff can refer back to any of the old data from anywhere in the new
+// data, so its window has to cover both. Clients accept windows of up to
+// 1 << kZstdDiffWindowLogMax bytes, and diffs are only made of data that
+// fits.
+const int kZstdDiffWindowLogMax = 28;
+const size_t kZstdDiffMaxSize = 1 << kZstdDiffWindowLogMax;
+
+// Compresses |new_data| into |out| using |old_data| as a prefix dictionary,
+// with long distance matching, like zstd --patch-from. The old and new
+// data together must be at most kZstdDiffMaxSize bytes.
+bool ZstdDiff(const std::vector<char>& old_data,
+              const std::vector<char>& new_data,
+              std::vector<char>* out);
+
+// Decompresses a ZstdDiff() |diff| of |old_data| into |out|.
+bool ZstdPatch(const std::vector<char>& old_data,
+               const std::vector<char>& diff,
+               std::vector<char>* out);
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ZSTD_H__
@@ -0,0 +1,59 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/zstd_extent_writer.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+ZstdExtentWriter::~ZstdExtentWriter() {
+  if (stream_)
+    ZSTD_freeDStream(stream_);
+}
+
+bool ZstdExtentWriter::Init(int fd,
+                            const vector<Extent>& extents,
+                            uint32_t block_size) {
+  stream_ = ZSTD_createDStream();
+  TEST_AND_RETURN_FALSE(stream_ != NULL);
+  TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_initDStream(stream_)));
+  if (prefix_) {
+    TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_DCtx_setParameter(
+        stream_, ZSTD_d_windowLogMax, kZstdDiffWindowLogMax)));
+    TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_DCtx_refPrefix(
+        stream_, prefix_->data(), prefix_->size())));
+  }
+  output_buffer_.resize(ZSTD_DStreamOutSize());
+  return next_->Init(fd, extents, block_size);
+}
+
+bool ZstdExtentWriter::Write(const void* bytes, size_t count) {
+  ZSTD_inBuffer input = { bytes, count, 0 };
+  // The decoder keeps what it can't output yet, so loop until it has
+  // consumed all the input and either doesn't fill the output buffer or
+  // reports the end of the frame.
+  while (count) {
+    ZSTD_outBuffer output = { &output_buffer_[0], output_buffer_.size(), 0 };
+    size_t rc = ZSTD_decompressStream(stream_, &output, &input);
+    if (ZSTD_isError(rc)) {
+      LOG(ERROR) << "zstd decompression failed: " << ZSTD_getErrorName(rc);
+      return false;
+    }
+    frame_complete_ = rc == 0;
+    if (output.pos)
+      TEST_AND_RETURN_FALSE(next_->Write(&output_buffer_[0], output.pos));
+    if (input.pos == input.size &&
+        (output.pos < output.size || frame_complete_))
+      break;
+  }
+  return true;
+}
+
+bool ZstdExtentWriter::EndImpl() {
+  TEST_AND_RETURN_FALSE(frame_complete_);
+  return next_->End();
+}
+
+}  // namespace chromeos_update_engine
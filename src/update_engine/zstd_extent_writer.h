@@ -0,0 +1,45 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ZSTD_EXTENT_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ZSTD_EXTENT_WRITER_H__
+
+#include <vector>
+#include <zstd.h>
+#include "update_engine/extent_writer.h"
+#include "update_engine/utils.h"
+#include "update_engine/zstd.h"
+
+// ZstdExtentWriter is a concrete ExtentWriter subclass that
+// zstd-decompresses what it's given in Write. It passes the decompressed
+// data to an underlying ExtentWriter. Given a prefix, it decodes a
+// ZstdDiff() of it instead, which is how the ZSTD_DIFF operations are
+// applied.
+
+namespace chromeos_update_engine {
+
+class ZstdExtentWriter : public ExtentWriter {
+ public:
+  ZstdExtentWriter(ExtentWriter* next)
+      : next_(next), prefix_(NULL), stream_(NULL), frame_complete_(false) {}
+  // |prefix| has to outlive the writer.
+  ZstdExtentWriter(ExtentWriter* next, const std::vector<char>* prefix)
+      : next_(next), prefix_(prefix), stream_(NULL), frame_complete_(false) {}
+  ~ZstdExtentWriter();
+
+  bool Init(int fd, const std::vector<Extent>& extents, uint32_t block_size);
+  bool Write(const void* bytes, size_t count);
+  bool EndImpl();
+
+ private:
+  ExtentWriter* const next_;  // The underlying ExtentWriter.
+  const std::vector<char>* const prefix_;  // the dictionary, if any
+  ZSTD_DStream* stream_;  // the libzstd stream
+  std::vector<char> output_buffer_;
+  bool frame_complete_;  // whether all of the frame was decoded
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ZSTD_EXTENT_WRITER_H__
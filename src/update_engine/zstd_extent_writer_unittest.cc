@@ -0,0 +1,139 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+#include "update_engine/zstd.h"
+#include "update_engine/zstd_extent_writer.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPathTemplate[] = "./ZstdExtentWriterTest-file.XXXXXX";
+const uint32_t kBlockSize = 4096;
+}
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    memcpy(path_, kPathTemplate, sizeof(kPathTemplate));
+    fd_ = mkstemp(path_);
+    ASSERT_GE(fd_, 0);
+  }
+  virtual void TearDown() {
+    close(fd_);
+    unlink(path_);
+  }
+  int fd() { return fd_; }
+ private:
+  int fd_;
+  char path_[sizeof(kPathTemplate)];
+};
+
+TEST_F(ZstdExtentWriterTest, ChunkedTest) {
+  const vector<char>::size_type kDecompressedLength = 2048 * 1024;  // 2 MiB
+  const size_t kChunkSize = 3;
+
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(kDecompressedLength / kBlockSize + 1);
+  extents.push_back(extent);
+
+  vector<char> decompressed_data(kDecompressedLength);
+  FillWithData(&decompressed_data);
+  vector<char> compressed_data;
+  EXPECT_TRUE(ZstdCompress(decompressed_data, &compressed_data));
+
+  DirectExtentWriter direct_writer;
+  ZstdExtentWriter zstd_writer(&direct_writer);
+  EXPECT_TRUE(zstd_writer.Init(fd(), extents, kBlockSize));
+
+  for (vector<char>::size_type i = 0; i < compressed_data.size();
+       i += kChunkSize) {
+    size_t this_chunk_size = min(kChunkSize, compressed_data.size() - i);
+    EXPECT_TRUE(zstd_writer.Write(&compressed_data[i], this_chunk_size));
+  }
+  EXPECT_TRUE(zstd_writer.End());
+
+  vector<char> output(kDecompressedLength + 1);
+  ssize_t bytes_read = pread(fd(), &output[0], output.size(), 0);
+  EXPECT_EQ(kDecompressedLength, bytes_read);
+  output.resize(kDecompressedLength);
+  ExpectVectorsEq(decompressed_data, output);
+}
+
+TEST_F(ZstdExtentWriterTest, TruncatedTest) {
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(16);
+  extents.push_back(extent);
+
+  vector<char> decompressed_data(16 * kBlockSize);
+  FillWithData(&decompressed_data);
+  vector<char> compressed_data;
+  EXPECT_TRUE(ZstdCompress(decompressed_data, &compressed_data));
+
+  // The data must be complete by the time the writer is ended.
+  DirectExtentWriter direct_writer;
+  ZstdExtentWriter zstd_writer(&direct_writer);
+  EXPECT_TRUE(zstd_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_TRUE(zstd_writer.Write(&compressed_data[0],
+                                compressed_data.size() - 1));
+  EXPECT_FALSE(zstd_writer.End());
+}
+
+TEST_F(ZstdExtentWriterTest, PrefixTest) {
+  vector<Extent> extents;
+  Extent extent;
+  extent.set_start_block(0);
+  extent.set_num_blocks(16);
+  extents.push_back(extent);
+
+  // Data that only compresses well given the old data.
+  vector<char> old_data(16 * kBlockSize);
+  uint32_t seed = 1;
+  for (char& c : old_data) {
+    seed = seed * 1103515245 + 12345;
+    c = seed >> 24;
+  }
+  vector<char> new_data(old_data.begin() + old_data.size() / 2,
+                        old_data.end());
+  new_data.insert(new_data.end(), old_data.begin(),
+                  old_data.begin() + old_data.size() / 2);
+  vector<char> diff;
+  EXPECT_TRUE(ZstdDiff(old_data, new_data, &diff));
+  EXPECT_LT(diff.size(), new_data.size() / 2);
+
+  DirectExtentWriter direct_writer;
+  ZstdExtentWriter zstd_writer(&direct_writer, &old_data);
+  EXPECT_TRUE(zstd_writer.Init(fd(), extents, kBlockSize));
+  for (size_t i = 0; i < diff.size(); i += 3)
+    EXPECT_TRUE(zstd_writer.Write(&diff[i], min<size_t>(3, diff.size() - i)));
+  EXPECT_TRUE(zstd_writer.End());
+
+  vector<char> output(new_data.size());
+  EXPECT_EQ(new_data.size(), pread(fd(), &output[0], output.size(), 0));
+  ExpectVectorsEq(new_data, output);
+
+  // The diff can't be decoded without its dictionary.
+  DirectExtentWriter plain_direct_writer;
+  ZstdExtentWriter plain_writer(&plain_direct_writer);
+  EXPECT_TRUE(plain_writer.Init(fd(), extents, kBlockSize));
+  EXPECT_FALSE(plain_writer.Write(&diff[0], diff.size()) &&
+               plain_writer.End());
+}
+
+}  // namespace chromeos_update_engine